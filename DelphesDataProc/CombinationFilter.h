@@ -0,0 +1,171 @@
+#ifndef _COMBINATIONFILTER_H_
+#define _COMBINATIONFILTER_H_
+
+#include <iostream>
+#include <string>
+#include <assert.h>
+#include <functional>
+#include <vector>
+
+#include "TString.h"
+#include "TObjArray.h"
+#include "TObjString.h"
+
+#include "Report.h"
+#include "Particle.h"
+
+
+class
+CombinationFilter
+{
+
+  //
+  // Cheap cuts on a jet assignment (lepTopJet, hadTopJet, hadWJet1, hadWJet2) that are
+  // applied before any features are calculated for it, so that hopeless combinations never
+  // reach the output. The cuts are configured from a string like
+  //
+  //    "mW:50:110,mTop:100:250,bTop:1,bW:1,dRW:3.0"
+  //
+  // with
+  //    mW:min:max    mass window for the hadronic W (hadWJet1+hadWJet2) [GeV]
+  //    mTop:min:max  mass window for the hadronic top (hadTopJet+hadWJet1+hadWJet2) [GeV]
+  //    bTop:n        at least n of lepTopJet and hadTopJet b-tagged
+  //    bW:n          at most n of hadWJet1 and hadWJet2 b-tagged
+  //    dRW:max       maximum dR between hadWJet1 and hadWJet2
+  //
+  // or "none". Other cuts can be added with addCut(). For every cut the Stats count how many
+  // combinations, and how many truth-matched (signal) ones, it fails on its own, which is the
+  // price of the cut in signal efficiency.
+  //
+
+public:
+
+  struct Combination {
+    RecoParticle *lepTopJet , *hadTopJet , *hadWJet1 , *hadWJet2 , *lep;
+    Bool_t isSignal() const { return hadTopJet->fromCommonWofSameTop( hadWJet1 , hadWJet2 ) && lepTopJet->fromCommonTop( lep ); }
+  };
+
+  typedef std::function< Bool_t( const Combination& ) > CutFunction;
+
+  // Counters, kept per input file by the callers and added up in the end
+  struct Stats {
+    Long64_t nTotal , nSignal , nPassed , nPassedSignal;
+    std::vector<Long64_t> v_nFailed , v_nFailedSignal;
+    Stats() : nTotal( 0 ) , nSignal( 0 ) , nPassed( 0 ) , nPassedSignal( 0 ) {}
+    void add( const Stats &other ) {
+      nTotal	    += other.nTotal;
+      nSignal	    += other.nSignal;
+      nPassed	    += other.nPassed;
+      nPassedSignal += other.nPassedSignal;
+      if( v_nFailed.size() < other.v_nFailed.size() ) {
+	v_nFailed.resize( other.v_nFailed.size() , 0 );
+	v_nFailedSignal.resize( other.v_nFailedSignal.size() , 0 );
+      }
+      for( std::size_t i = 0 ; i < other.v_nFailed.size() ; i++ ) {
+	v_nFailed[i]	   += other.v_nFailed[i];
+	v_nFailedSignal[i] += other.v_nFailedSignal[i];
+      }
+    }
+  };
+
+private:
+
+  std::vector<TString> v_names;
+  std::vector<CutFunction> v_cuts;
+
+  static Int_t nTagged( RecoParticle *a , RecoParticle *b ) { return ( a->getTagLevel() > 0 ? 1 : 0 ) + ( b->getTagLevel() > 0 ? 1 : 0 ); }
+
+  static void badSpec( const TString &spec ) {
+    report::error( "CombinationFilter : can't understand the cut %s" , spec.Data() );
+    assert( false );
+  }
+
+public:
+
+  CombinationFilter() {}
+  ~CombinationFilter() {}
+
+  std::size_t size() const { return v_cuts.size(); }
+
+  void addCut( const TString &name , const CutFunction &cut ) {
+    v_names.push_back( name );
+    v_cuts.push_back( cut );
+  }
+
+  void configure( const TString &spec ) {
+    if( spec==TString("none") || spec.Length()==0 ) return;
+    TObjArray *cuts = spec.Tokenize( "," );
+    for( Int_t i = 0 ; i < cuts->GetEntries() ; i++ ) {
+      const TString cut = ((TObjString*)cuts->At(i))->GetString();
+      TObjArray *args = cut.Tokenize( ":" );
+      const Int_t nargs = args->GetEntries() - 1;
+      const TString name = ((TObjString*)args->At(0))->GetString();
+      std::vector<Double_t> x;
+      for( Int_t j = 1 ; j <= nargs ; j++ ) x.push_back( ((TObjString*)args->At(j))->GetString().Atof() );
+      delete args;
+      if( name==TString("mW") && nargs==2 ) {
+	const Double_t lo = x[0] , hi = x[1];
+	addCut( cut , [lo,hi]( const Combination &c ) {
+	    const Double_t m = ( c.hadWJet1->getP4() + c.hadWJet2->getP4() ).m;
+	    return m >= lo && m <= hi; } );
+      } else if( name==TString("mTop") && nargs==2 ) {
+	const Double_t lo = x[0] , hi = x[1];
+	addCut( cut , [lo,hi]( const Combination &c ) {
+	    const Double_t m = ( c.hadTopJet->getP4() + c.hadWJet1->getP4() + c.hadWJet2->getP4() ).m;
+	    return m >= lo && m <= hi; } );
+      } else if( name==TString("bTop") && nargs==1 ) {
+	const Int_t n = Int_t( x[0] );
+	addCut( cut , [n]( const Combination &c ) { return nTagged( c.lepTopJet , c.hadTopJet ) >= n; } );
+      } else if( name==TString("bW") && nargs==1 ) {
+	const Int_t n = Int_t( x[0] );
+	addCut( cut , [n]( const Combination &c ) { return nTagged( c.hadWJet1 , c.hadWJet2 ) <= n; } );
+      } else if( name==TString("dRW") && nargs==1 ) {
+	const Double_t dr = x[0];
+	addCut( cut , [dr]( const Combination &c ) { return c.hadWJet1->deltaR( c.hadWJet2 ) <= dr; } );
+      } else {
+	badSpec( cut );
+      }
+    }
+    delete cuts;
+  }
+
+  // Every cut is evaluated, so that each one's losses are counted on their own
+  Bool_t pass( const Combination &c , const Bool_t &signal , Stats &stats ) const {
+    if( stats.v_nFailed.size() < v_cuts.size() ) {
+      stats.v_nFailed.resize( v_cuts.size() , 0 );
+      stats.v_nFailedSignal.resize( v_cuts.size() , 0 );
+    }
+    Bool_t res = kTRUE;
+    for( std::size_t i = 0 ; i < v_cuts.size() ; i++ ) {
+      if( v_cuts[i]( c ) ) continue;
+      res = kFALSE;
+      stats.v_nFailed[i]++;
+      if( signal ) stats.v_nFailedSignal[i]++;
+    }
+    stats.nTotal++;
+    if( signal ) stats.nSignal++;
+    if( res ) {
+      stats.nPassed++;
+      if( signal ) stats.nPassedSignal++;
+    }
+    return res;
+  }
+
+  void print( const Stats &stats ) const {
+    if( v_cuts.empty() ) return;
+    auto frac = []( const Long64_t &n , const Long64_t &d ) { return d > 0 ? Double_t(n)/Double_t(d) : 0.0; };
+    report::info( "Combination filter : %lld of %lld combinations kept (%0.4f), %lld of %lld signal combinations kept (%0.4f)" ,
+		  stats.nPassed , stats.nTotal , frac(stats.nPassed,stats.nTotal) ,
+		  stats.nPassedSignal , stats.nSignal , frac(stats.nPassedSignal,stats.nSignal) );
+    report::blank( "%-25s %15s %15s" , "Cut" , "Fails (all)" , "Fails (signal)" );
+    for( std::size_t i = 0 ; i < v_cuts.size() ; i++ ) {
+      const Long64_t nf  = i < stats.v_nFailed.size() ? stats.v_nFailed[i] : 0;
+      const Long64_t nfs = i < stats.v_nFailedSignal.size() ? stats.v_nFailedSignal[i] : 0;
+      report::blank( "%-25s %15.4f %15.4f" , v_names[i].Data() , frac(nf,stats.nTotal) , frac(nfs,stats.nSignal) );
+    }
+  }
+
+};
+
+
+#endif
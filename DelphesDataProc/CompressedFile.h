@@ -0,0 +1,190 @@
+#ifndef _COMPRESSEDFILE_H_
+#define _COMPRESSEDFILE_H_
+
+#include <iostream>
+#include <cstdio>
+#include <assert.h>
+#include <vector>
+
+#include "TString.h"
+
+#include "Report.h"
+
+#include <bzlib.h>
+#include <zstd.h>
+
+
+class
+CompressedFile
+{
+
+  //
+  // Output file that compresses whatever is written to it on the fly (bzip2 or zstd), so
+  // there's never an uncompressed copy on disk. Both formats allow several compressed streams
+  // ("frames") to be concatenated in one file, which is how already compressed files written
+  // with the same codec are appended with appendRaw() without decompressing them.
+  //
+
+public:
+
+  enum Codec { NONE , BZIP2 , ZSTD };
+
+  static Codec getCodec( const TString &name ) {
+    if( name==TString("none") ) return NONE;
+    if( name==TString("bzip2") || name==TString("bz2") ) return BZIP2;
+    if( name==TString("zstd") || name==TString("zst") ) return ZSTD;
+    report::error( "CompressedFile : unknown compression %s (expected none, bzip2 or zstd)" , name.Data() );
+    assert( false );
+    return NONE;
+  }
+
+  static TString getExtension( const Codec &c ) {
+    if( c==BZIP2 ) return ".bz2";
+    if( c==ZSTD ) return ".zst";
+    return "";
+  }
+
+private:
+
+  std::FILE *fp;
+  TString path;
+  Codec codec;
+  Int_t level;
+  Int_t nthreads;
+  Bool_t inFrame; // data has gone into the current compressed stream since it was started
+
+  BZFILE *bz;
+  ZSTD_CCtx *zc;
+  std::vector<char> zbuf;
+
+  void fail( const char *what ) {
+    report::error( "CompressedFile : %s failed for %s" , what , path.Data() );
+    assert( false );
+  }
+
+  void writeFile( const void *data , const std::size_t &n ) {
+    if( n && std::fwrite( data , 1 , n , fp ) != n ) fail( "write" );
+  }
+
+  void startFrame() {
+    if( codec==BZIP2 ) {
+      Int_t err = BZ_OK;
+      bz = BZ2_bzWriteOpen( &err , fp , level , 0 , 0 );
+      if( err != BZ_OK ) fail( "BZ2_bzWriteOpen" );
+    }
+    inFrame = kTRUE;
+  }
+
+  // Runs the zstd stream until the input is used up (and, at the end of a frame, until
+  // everything has been written out)
+  void zstdStream( const char *data , const std::size_t &n , const ZSTD_EndDirective &mode ) {
+    ZSTD_inBuffer in = { data , n , 0 };
+    while( kTRUE ) {
+      ZSTD_outBuffer out = { &zbuf[0] , zbuf.size() , 0 };
+      const std::size_t remaining = ZSTD_compressStream2( zc , &out , &in , mode );
+      if( ZSTD_isError(remaining) ) {
+	report::error( "CompressedFile : zstd error %s for %s" , ZSTD_getErrorName(remaining) , path.Data() );
+	assert( false );
+      }
+      writeFile( out.dst , out.pos );
+      if( mode==ZSTD_e_continue ? in.pos == in.size : remaining == 0 ) break;
+    }
+  }
+
+public:
+
+  CompressedFile()
+    : fp( 0 )
+    , codec( NONE )
+    , level( 0 )
+    , nthreads( 1 )
+    , inFrame( kFALSE )
+    , bz( 0 )
+    , zc( 0 )
+  {}
+
+  ~CompressedFile() { close(); }
+
+  // A level of 0 means the codec's default (9 for bzip2, 3 for zstd). nthreads is only used by
+  // zstd, which then compresses blocks in parallel on that many threads.
+  void open( const TString &fname , const Codec &_codec = NONE , const Int_t &_level = 0 , const Int_t &_nthreads = 1 ) {
+    close();
+    path     = fname;
+    codec    = _codec;
+    level    = _level;
+    nthreads = _nthreads;
+    fp = std::fopen( fname.Data() , "wb" );
+    if( ! fp ) {
+      report::error( "CompressedFile : could not open %s" , fname.Data() );
+      assert( false );
+    }
+    if( codec==BZIP2 && level==0 ) level = 9;
+    if( codec==ZSTD ) {
+      zc = ZSTD_createCCtx();
+      ZSTD_CCtx_setParameter( zc , ZSTD_c_compressionLevel , level ? level : ZSTD_CLEVEL_DEFAULT );
+      if( nthreads > 1 && ZSTD_isError( ZSTD_CCtx_setParameter( zc , ZSTD_c_nbWorkers , nthreads ) ) ) {
+	report::warn( "CompressedFile : this zstd library can't compress on several threads, using one" );
+      }
+      zbuf.resize( ZSTD_CStreamOutSize() );
+    }
+  }
+
+  Bool_t isOpen() const { return fp != 0; }
+  const TString& getPath() const { return path; }
+  const Codec& getCodec() const { return codec; }
+
+  void write( const char *data , const std::size_t &n ) {
+    if( n == 0 ) return;
+    if( codec==NONE ) { writeFile( data , n ); return; }
+    if( ! inFrame ) startFrame();
+    if( codec==BZIP2 ) {
+      Int_t err = BZ_OK;
+      BZ2_bzWrite( &err , bz , (void*)data , Int_t(n) );
+      if( err != BZ_OK ) fail( "BZ2_bzWrite" );
+    } else {
+      zstdStream( data , n , ZSTD_e_continue );
+    }
+  }
+
+  // Finishes the current compressed stream. The next write() starts a new one.
+  void endFrame() {
+    if( ! inFrame ) return;
+    if( codec==BZIP2 ) {
+      Int_t err = BZ_OK;
+      BZ2_bzWriteClose( &err , bz , 0 , 0 , 0 );
+      if( err != BZ_OK ) fail( "BZ2_bzWriteClose" );
+      bz = 0;
+    } else if( codec==ZSTD ) {
+      zstdStream( 0 , 0 , ZSTD_e_end );
+    }
+    inFrame = kFALSE;
+  }
+
+  // Copies another file as it is to the end of this one. For the result to be readable it has
+  // to have been written with the same codec (e.g. a part file from another CompressedFile).
+  void appendRaw( const TString &fname ) {
+    endFrame();
+    std::FILE *in = std::fopen( fname.Data() , "rb" );
+    if( ! in ) {
+      report::error( "CompressedFile : could not open %s" , fname.Data() );
+      assert( false );
+    }
+    std::vector<char> block( 1 << 20 );
+    std::size_t n;
+    while( (n = std::fread( &block[0] , 1 , block.size() , in )) > 0 ) writeFile( &block[0] , n );
+    std::fclose( in );
+  }
+
+  void close() {
+    if( ! fp ) return;
+    endFrame();
+    if( zc ) ZSTD_freeCCtx( zc );
+    zc = 0;
+    if( std::fclose( fp ) != 0 ) fail( "close" );
+    fp = 0;
+  }
+
+};
+
+
+#endif
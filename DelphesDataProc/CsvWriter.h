@@ -0,0 +1,303 @@
+#ifndef _CSVWRITER_H_
+#define _CSVWRITER_H_
+
+#include <iostream>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <assert.h>
+#include <deque>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "TString.h"
+
+#include "Report.h"
+#include "CompressedFile.h"
+
+
+class
+CsvWriter
+{
+
+  //
+  // Buffered CSV output. Rows are formatted straight into a large in-memory buffer that is
+  // written out in big blocks (optionally by a background thread), rather than going through
+  // an ostream and being flushed at the end of every row. Without a file the writer just
+  // collects the text, which is how the per-file output chunks of the threaded loops work.
+  //
+  // The file can be compressed as it is written (see CompressedFile), which is then done by the
+  // background thread as well.
+  //
+  // Numbers are written with as few significant digits as it takes to read back the same
+  // value (at float or double precision), but never fewer than 6. Anything that was already
+  // exact in the old "ostream << double" output (precision 6, %g style) comes out identical.
+  //
+
+private:
+
+  CompressedFile file;
+  std::string buffer; // only the first "used" characters are output, the rest is head room
+  std::size_t used;
+  std::size_t blockSize;
+
+  // Background writer
+  Bool_t useThread;
+  std::thread writerThread;
+  std::mutex mtx;
+  std::condition_variable cv;
+  // Blocks of text for the file, each optionally followed by a file to append as it is (and
+  // then delete, if it's a part file only the writer still needs)
+  struct Block {
+    std::string text;
+    TString append;
+    Bool_t removeAppended;
+    Block() : removeAppended( kFALSE ) {}
+  };
+  std::deque<Block> queue;
+  Bool_t finished;
+
+  static const Double_t* pow10() {
+    static const Double_t p[23] = { 1e0 , 1e1 , 1e2 , 1e3 , 1e4 , 1e5 , 1e6 , 1e7 , 1e8 , 1e9 , 1e10 , 1e11 ,
+				    1e12 , 1e13 , 1e14 , 1e15 , 1e16 , 1e17 , 1e18 , 1e19 , 1e20 , 1e21 , 1e22 };
+    return p;
+  }
+
+  // Decimal exponent of a, for 1e-4 <= a < 1e6
+  static Int_t getExponent( const Double_t &a ) {
+    static const Double_t bounds[10] = { 1e-3 , 1e-2 , 1e-1 , 1e0 , 1e1 , 1e2 , 1e3 , 1e4 , 1e5 , 1e6 };
+    Int_t X = -4;
+    while( X < 5 && a >= bounds[X+4] ) X++;
+    return X;
+  }
+
+  static char* putUnsigned( char *p , unsigned long long v ) {
+    char tmp[24];
+    Int_t n = 0;
+    do { tmp[n++] = char('0' + v % 10); v /= 10; } while( v );
+    while( n ) *p++ = tmp[--n];
+    return p;
+  }
+
+  static Bool_t roundTrips( const Double_t &r , const Double_t &v , const Bool_t &single ) {
+    return single ? Float_t(r)==Float_t(v) : r==v;
+  }
+
+  // Digits of a rounded to P significant figures (m, with D of them after the decimal point)
+  // for the range where %g uses fixed notation. Returns false when the answer isn't clear-cut
+  // (rounding ties, carries into the next power of ten, too many digits for exact integer
+  // arithmetic) and printf should decide.
+  static Bool_t fixedDigits( const Double_t &a , const Int_t &X , const Int_t &P , unsigned long long &m , Int_t &D ) {
+    D = P - 1 - X;
+    if( P > 15 || D < 0 || D > 22 ) return kFALSE;
+    const Double_t scaled = a * pow10()[D];
+    const unsigned long long fl = (unsigned long long)( scaled );
+    const Double_t frac = scaled - Double_t(fl);
+    if( std::fabs( frac - 0.5 ) < 1e-6 ) return kFALSE;
+    m = frac > 0.5 ? fl + 1 : fl;
+    return Double_t(m) < pow10()[P];
+  }
+
+  // Writes m/10^D in fixed notation without trailing zeros, like %g does
+  static char* putFixed( char *p , unsigned long long m , Int_t D ) {
+    while( D > 0 && m % 10 == 0 ) { m /= 10; D--; }
+    char tmp[48];
+    Int_t n = 0;
+    for( Int_t i = 0 ; i < D ; i++ ) { tmp[n++] = char('0' + m % 10); m /= 10; }
+    if( D > 0 ) tmp[n++] = '.';
+    do { tmp[n++] = char('0' + m % 10); m /= 10; } while( m );
+    while( n ) *p++ = tmp[--n];
+    return p;
+  }
+
+  // Same as above, done by printf and starting from P significant digits
+  static char* printfDigits( char *p , const Double_t &v , const Bool_t &single , const Int_t &minP = 6 ) {
+    const Int_t maxP = single ? 9 : 17;
+    char tmp[40];
+    Int_t n = 0;
+    for( Int_t P = minP ; P <= maxP ; P++ ) {
+      n = std::snprintf( tmp , sizeof(tmp) , "%.*g" , P , v );
+      if( v != v || roundTrips( std::strtod(tmp,0) , v , single ) ) break;
+    }
+    std::memcpy( p , tmp , n );
+    return p + n;
+  }
+
+  void writeOut( const char *data , const std::size_t &n , const TString &append , const Bool_t &removeAppended ) {
+    file.write( data , n );
+    if( ! append.Length() ) return;
+    file.appendRaw( append );
+    if( removeAppended ) std::remove( append.Data() );
+  }
+
+  void writerLoop() {
+    Block block;
+    while( kTRUE ) {
+      {
+	std::unique_lock<std::mutex> lock( mtx );
+	cv.wait( lock , [this]{ return finished || !queue.empty(); } );
+	if( queue.empty() ) return;
+	block.text.swap( queue.front().text );
+	block.append = queue.front().append;
+	block.removeAppended = queue.front().removeAppended;
+	queue.pop_front();
+      }
+      cv.notify_all();
+      writeOut( block.text.data() , block.text.size() , block.append , block.removeAppended );
+    }
+  }
+
+  void flushBlock( const TString &append = "" , const Bool_t &removeAppended = kFALSE ) {
+    if( ! file.isOpen() ) return;
+    if( ! useThread ) {
+      writeOut( buffer.data() , used , append , removeAppended );
+      used = 0;
+      return;
+    }
+    std::unique_lock<std::mutex> lock( mtx );
+    // Don't let the formatting run too far ahead of the disk
+    cv.wait( lock , [this]{ return queue.size() < 4; } );
+    buffer.resize( used );
+    queue.push_back( Block() );
+    queue.back().text.swap( buffer );
+    queue.back().append = append;
+    queue.back().removeAppended = removeAppended;
+    lock.unlock();
+    cv.notify_all();
+    used = 0;
+  }
+
+  // Room for n more characters at the end of the output
+  char* tail( const std::size_t &n ) {
+    if( used + n > buffer.size() ) buffer.resize( std::max( std::max( 2*buffer.size() , used + n ) , blockSize + 4096 ) );
+    return &buffer[used];
+  }
+
+public:
+
+  CsvWriter( const std::size_t &_blockSize = 1 << 22 )
+    : used( 0 )
+    , blockSize( _blockSize )
+    , useThread( kFALSE )
+    , finished( kFALSE )
+  {}
+
+  ~CsvWriter() { close(); }
+
+  // Output file, or none to only collect the text in memory. The compression settings are
+  // passed on to CompressedFile::open().
+  void open( const TString &fname , const Bool_t &_useThread = kFALSE ,
+	     const CompressedFile::Codec &codec = CompressedFile::NONE , const Int_t &level = 0 , const Int_t &nthreads = 1 ) {
+    close();
+    file.open( fname , codec , level , nthreads );
+    useThread = _useThread;
+    finished  = kFALSE;
+    if( useThread ) writerThread = std::thread( &CsvWriter::writerLoop , this );
+  }
+
+  void close() {
+    if( ! file.isOpen() ) return;
+    flushBlock();
+    if( useThread ) {
+      {
+	std::lock_guard<std::mutex> lock( mtx );
+	finished = kTRUE;
+      }
+      cv.notify_all();
+      writerThread.join();
+      useThread = kFALSE;
+    }
+    file.close();
+  }
+
+  Bool_t isOpen() const { return file.isOpen(); }
+  const TString& getPath() const { return file.getPath(); }
+
+  // Text collected so far (for writers without a file), leaving the writer empty
+  void take( std::string &out ) { out.assign( buffer.data() , used ); used = 0; }
+
+  //
+  // Formatting
+  //
+
+  void putRaw( const char *s , const std::size_t &n ) { std::memcpy( tail(n) , s , n ); used += n; }
+  void putRaw( const std::string &s ) { putRaw( s.data() , s.size() ); }
+  void putString( const TString &s ) { putRaw( s.Data() , s.Length() ); }
+  void putSeparator() { *tail(1) = ','; used++; }
+
+  void putInt( const Long64_t &v ) {
+    char *p = tail( 24 );
+    char *q = p;
+    if( v < 0 ) { *q++ = '-'; q = putUnsigned( q , 0ULL - (unsigned long long)(v) ); }
+    else q = putUnsigned( q , (unsigned long long)(v) );
+    used += q - p;
+  }
+
+  void putFloat( const Double_t &v ) { putNumber( v , kTRUE ); }
+  void putDouble( const Double_t &v ) { putNumber( v , kFALSE ); }
+
+  // Shortest representation that reads back as v, stored as a float (single) or a double.
+  // In single precision it is the float nearest to v that gets written out.
+  void putNumber( const Double_t &v , Bool_t single ) {
+    char *tmp = tail( 48 );
+    char *p = tmp;
+    // values outside of the float range are written at double precision
+    if( single && ( std::fabs(v) > 3.4e38 || ( v != 0 && Float_t(v) == 0 ) ) ) single = kFALSE;
+    const Double_t x = single ? Double_t( Float_t(v) ) : v;
+    if( x != x || x - x != 0 ) {
+      p = printfDigits( p , x , single );
+    } else if( x == 0 ) {
+      if( std::signbit(x) ) *p++ = '-';
+      *p++ = '0';
+    } else {
+      const Double_t a = std::fabs( x );
+      if( x < 0 ) *p++ = '-';
+      if( a < 1e6 && a == std::floor(a) ) {
+	// whole numbers that %g prints without an exponent
+	p = putUnsigned( p , (unsigned long long)(a) );
+      } else if( a >= 1e-4 && a < 1e6 ) {
+	const Int_t X = getExponent( a );
+	const Int_t maxP = single ? 9 : 17;
+	unsigned long long m = 0;
+	Int_t P = 6 , D = 0;
+	Bool_t ok = kFALSE;
+	for( ; P <= maxP ; P++ ) {
+	  if( ! fixedDigits( a , X , P , m , D ) ) break;
+	  // m and 10^D are both exact, so this is the correctly rounded value of the decimal string
+	  if( (ok = roundTrips( Double_t(m) / pow10()[D] , a , single )) ) break;
+	}
+	p = ok ? putFixed( p , m , D ) : printfDigits( tmp , x , single , P );
+      } else {
+	p = printfDigits( tmp , x , single );
+      }
+    }
+    used += p - tmp;
+  }
+
+  // End of a row: hands the buffer to the file once it's big enough
+  void endRow() {
+    *tail(1) = '\n';
+    used++;
+    if( used >= blockSize ) flushBlock();
+  }
+
+  // Copies another file (e.g. a part file written by another CsvWriter with the same
+  // compression settings) to the output after everything written so far. With a background
+  // writer the copy happens later, so a file that is no longer needed afterwards has to be
+  // deleted by the writer ("remove") rather than by the caller.
+  void appendFile( const TString &fname , const Bool_t &remove = kFALSE ) {
+    if( ! file.isOpen() ) {
+      report::error( "CsvWriter : can't append %s without an output file" , fname.Data() );
+      assert( false );
+    }
+    flushBlock( fname , remove );
+  }
+
+};
+
+
+#endif
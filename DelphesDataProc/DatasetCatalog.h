@@ -0,0 +1,239 @@
+#ifndef _DATASETCATALOG_H_
+#define _DATASETCATALOG_H_
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <assert.h>
+#include <vector>
+
+#include "TFile.h"
+#include "TTree.h"
+#include "TString.h"
+#include "TRegexp.h"
+#include "TSystem.h"
+#include "TMD5.h"
+
+#include "Report.h"
+
+
+class
+DatasetCatalog
+{
+
+  //
+  // The input files of each sample in a data directory, with their entry counts, sizes,
+  // UUIDs (and optionally MD5 sums), and the cross-section and generated event count of the
+  // sample. BuildDatasetCatalog makes it once per data directory, and jobs read it instead
+  // of listing the directory and matching names on every run. It is a text file:
+  //
+  //   sample <name> <tree> <xsec> <nevents> <cost>
+  //   file <sample> <entries> <bytes> <uuid> <md5> <path>
+  //
+  // with '#' starting a comment. An unknown cross-section or event count is -1, and an MD5
+  // sum that wasn't computed is '-'. The cost is the time an entry of the sample takes to
+  // process relative to the other samples (1 if left out), which JobSplitter balances.
+  //
+
+public:
+
+  struct File {
+    TString path;
+    Long64_t entries;
+    Long64_t bytes;
+    TString uuid;
+    TString md5;
+    File() : entries( 0 ) , bytes( 0 ) , uuid( "-" ) , md5( "-" ) {}
+  };
+
+  struct Sample {
+    TString name;
+    TString tree;
+    Double_t xsec;
+    Double_t nevents;
+    Double_t cost;
+    std::vector<File> files;
+    Long64_t getEntries() const {
+      Long64_t n = 0;
+      for( const File &f : files ) n += f.entries;
+      return n;
+    }
+  };
+
+private:
+
+  std::vector<Sample> v_samples;
+
+  Sample* find( const TString &name ) {
+    for( Sample &s : v_samples ) if( s.name == name ) return &s;
+    return 0;
+  }
+
+public:
+
+  DatasetCatalog() {}
+  ~DatasetCatalog() {}
+
+  // Where BuildDatasetCatalog puts the catalog of a data directory by default
+  static TString getDefaultPath( const TString &datadir ) { return datadir + "/dataset_catalog.txt"; }
+
+  static Bool_t exists( const TString &path ) { return ! gSystem->AccessPathName( path ); }
+
+  // Opens "path" and describes it for the catalog. The MD5 sum reads the whole file.
+  static File describe( const TString &path , const TString &treename , const Bool_t &md5 = kFALSE ) {
+    File f;
+    f.path = path;
+    TFile *tf = TFile::Open( path );
+    TTree *t = ( tf && ! tf->IsZombie() ) ? (TTree*) tf->Get( treename ) : 0;
+    if( ! t ) {
+      report::error( "DatasetCatalog : no %s tree in %s" , treename.Data() , path.Data() );
+      assert( false );
+    }
+    f.entries = t->GetEntries();
+    f.bytes   = tf->GetSize();
+    f.uuid    = tf->GetUUID().AsString();
+    delete tf;
+    if( md5 ) {
+      TMD5 *sum = TMD5::FileChecksum( path );
+      if( sum ) f.md5 = sum->AsString();
+      delete sum;
+    }
+    return f;
+  }
+
+  void addSample( const TString &name , const TString &tree , const Double_t &xsec = -1 , const Double_t &nevents = -1 , const Double_t &cost = 1 ) {
+    if( find( name ) ) {
+      report::error( "DatasetCatalog : sample %s added twice" , name.Data() );
+      assert( false );
+    }
+    Sample s;
+    s.name    = name;
+    s.tree    = tree;
+    s.xsec    = xsec;
+    s.nevents = nevents;
+    s.cost    = cost;
+    v_samples.push_back( s );
+  }
+
+  void addFile( const TString &sample , const File &f ) {
+    Sample *s = find( sample );
+    if( ! s ) {
+      report::error( "DatasetCatalog : file %s of unknown sample %s" , f.path.Data() , sample.Data() );
+      assert( false );
+    }
+    s->files.push_back( f );
+  }
+
+  void load( const TString &fname ) {
+    std::ifstream in( fname.Data() );
+    if( ! in ) {
+      report::error( "DatasetCatalog : could not open %s" , fname.Data() );
+      assert( false );
+    }
+    v_samples.clear();
+    std::string line;
+    Int_t nfiles = 0;
+    for( Int_t iline = 1 ; std::getline( in , line ) ; iline++ ) {
+      if( line.find('#') != std::string::npos ) line.erase( line.find('#') );
+      std::istringstream ss( line );
+      std::string kind;
+      if( ! (ss >> kind) ) continue;
+      Bool_t ok = kFALSE;
+      if( kind == "sample" ) {
+	std::string name , tree;
+	Double_t xsec , nevents , cost;
+	if( (ok = bool(ss >> name >> tree >> xsec >> nevents)) ) {
+	  if( ! (ss >> cost) ) cost = 1;
+	  addSample( name.c_str() , tree.c_str() , xsec , nevents , cost );
+	}
+      } else if( kind == "file" ) {
+	std::string sample , uuid , md5 , path;
+	File f;
+	if( (ok = bool(ss >> sample >> f.entries >> f.bytes >> uuid >> md5 >> path)) ) {
+	  f.uuid = uuid.c_str();
+	  f.md5  = md5.c_str();
+	  f.path = path.c_str();
+	  addFile( sample.c_str() , f );
+	  nfiles++;
+	}
+      }
+      if( ! ok ) {
+	report::error( "DatasetCatalog : can't read line %i of %s" , iline , fname.Data() );
+	assert( false );
+      }
+    }
+    report::info( "Read %i samples with %i files from %s" , Int_t(v_samples.size()) , nfiles , fname.Data() );
+  }
+
+  void save( const TString &fname , const TString &comment = "" ) const {
+    std::ofstream out( fname.Data() );
+    if( ! out ) {
+      report::error( "DatasetCatalog : could not create %s" , fname.Data() );
+      assert( false );
+    }
+    if( comment.Length() ) out << "# " << comment << "\n";
+    for( const Sample &s : v_samples ) {
+      out << TString::Format( "sample %s %s %.12g %.12g %.6g" , s.name.Data() , s.tree.Data() , s.xsec , s.nevents , s.cost ) << "\n";
+      for( const File &f : s.files ) {
+	out << TString::Format( "file %s %lld %lld %s %s %s" , s.name.Data() , f.entries , f.bytes , f.uuid.Data() , f.md5.Data() , f.path.Data() ) << "\n";
+      }
+    }
+  }
+
+  std::size_t numSamples() const { return v_samples.size(); }
+  const Sample& getSample( const std::size_t &i ) const { return v_samples[i]; }
+
+  Bool_t hasSample( const TString &name ) const {
+    for( const Sample &s : v_samples ) if( s.name == name ) return kTRUE;
+    return kFALSE;
+  }
+
+  const Sample& getSample( const TString &name ) const {
+    for( const Sample &s : v_samples ) if( s.name == name ) return s;
+    report::error( "DatasetCatalog : no sample %s" , name.Data() );
+    assert( false );
+    return v_samples.front();
+  }
+
+  // The samples whose names match "pattern" ('*' wildcards), in catalog order
+  std::vector<TString> getSampleNames( const TString &pattern = "*" ) const {
+    TRegexp re( pattern , kTRUE );
+    std::vector<TString> names;
+    for( const Sample &s : v_samples ) if( s.name.Index( re ) == 0 ) names.push_back( s.name );
+    return names;
+  }
+
+  // The file paths of a sample, none if the catalog doesn't have it
+  std::vector<TString> getPaths( const TString &name ) const {
+    std::vector<TString> paths;
+    for( const Sample &s : v_samples ) {
+      if( s.name != name ) continue;
+      for( const File &f : s.files ) paths.push_back( f.path );
+    }
+    return paths;
+  }
+
+  // The entry counts of the files of a sample, in the order of getPaths()
+  std::vector<Long64_t> getEntries( const TString &name ) const {
+    std::vector<Long64_t> entries;
+    for( const Sample &s : v_samples ) {
+      if( s.name != name ) continue;
+      for( const File &f : s.files ) entries.push_back( f.entries );
+    }
+    return entries;
+  }
+
+  // The names of the directories holding the files, e.g. for PhysicsProcess::matchTag
+  std::vector<TString> getDirectoryNames() const {
+    std::vector<TString> names;
+    for( const Sample &s : v_samples ) {
+      for( const File &f : s.files ) names.push_back( gSystem->BaseName( gSystem->DirName( f.path ) ) );
+    }
+    return names;
+  }
+
+};
+
+
+#endif
@@ -6,141 +6,222 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <assert.h>
-#include <map>
+#include <algorithm>
 #include <vector>
 
 #include "TString.h"
-#include "TTree.h"
-#include "TDataType.h"
 #include "TMath.h"
-#include "TLeaf.h"
-#include "TClonesArray.h"
-#include "TF1.h"
-#include "TRandom3.h"
 
 #include "Report.h"
+#include "Philox.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 class
 DelphesBtagger
 {
 
+  //
+  // Emulated b-tagging with five nested working points, from the loosest (1) to the tightest
+  // (5). The efficiencies are functions of the jet pt for b, c and light jets. A jet passes
+  // working point k with probability eff[k-1](pt) given that it passed k-1, so the chance to
+  // reach at least level k is the product of the (capped) ratios, P(>=k). These cumulative
+  // probabilities are tabulated once, in the constructor, every PTSTEP GeV up to PTMAX and
+  // interpolated linearly in between (within ~1e-5 of the curves), and jets beyond the table
+  // get the curves evaluated directly. A tag is then a table lookup and a single uniform
+  // number u, and the level is the number of working points with u < P(>=k).
+  //
+  // The uniform numbers are counter-based (see Philox.h), keyed by the seed and the sample,
+  // and counted by the input file, the entry in the file, the jet's index in the entry and
+  // the purpose of the number. The tag of a jet therefore doesn't depend on what else the
+  // job processed, or in which order, or on how many threads or splits it was run with.
+  // Files are identified by their name together with the name of the directory they are in
+  // (see getFileId()), since the files of a sample usually all have the same name, one per
+  // job directory.
+  //
+  // The jets of an entry are best tagged together, by collecting them in a Batch and calling
+  // tag(). With -mavx2 (see SIMDFLAGS in the Makefile) four jets at a time then go through
+  // the random numbers, table lookups and comparisons in vector registers, with the same
+  // results as getTagLevel().
+  //
+
+public:
+
+  enum Flavor { B = 0 , C , L , NFLAVORS };
+  enum { NWP = 5 };
+
+  // Jets of one entry, as columns
+  struct Batch {
+    std::vector<float> pt;
+    std::vector<int> flavor;
+    std::vector<Int_t> index; // in the entry's jet collection
+    std::vector<Int_t> level; // filled by tag()
+    void clear() {
+      pt.clear();
+      flavor.clear();
+      index.clear();
+      level.clear();
+    }
+    void add( const float &_pt , const int &_flavor , const Int_t &_index ) {
+      pt.push_back( _pt );
+      flavor.push_back( _flavor );
+      index.push_back( _index );
+    }
+    std::size_t size() const { return pt.size(); }
+  };
+
 private:
 
-  TRandom3 r;
+  static constexpr Double_t PTMAX  = 500;
+  static constexpr Double_t PTSTEP = 0.25;
 
-  TF1 *func0B;
-  TF1 *func1B;
-  TF1 *func2B;
-  TF1 *func3B;
-  TF1 *func4B;
+  // What the random numbers are used for, so that different uses never share one
+  enum Purpose { TAGLEVEL = 1 };
 
-  TF1 *func0C;
-  TF1 *func1C;
-  TF1 *func2C;
-  TF1 *func3C;
-  TF1 *func4C;
+  UInt_t key[2]; // seed, sample
+  UInt_t ctr[3]; // file, entry (low and high words)
 
-  TF1 *func0L;
-  TF1 *func1L;
-  TF1 *func2L;
-  TF1 *func3L;
-  TF1 *func4L;
+  Int_t nbins;
+  // P(>=k) for every flavor at pt = i*PTSTEP, the NWP working points of every point one
+  // after the other
+  std::vector<Double_t> v_table;
 
-public:
+  Int_t getRow( const Int_t &flavor , const Int_t &i ) const { return ( flavor*(nbins+1) + i )*NWP; }
 
-  DelphesBtagger( Int_t rseed = 8675309 )
-    : r(8675309)
-    , func0B( new TF1("func0B","0.85*TMath::TanH(0.0026*x[0])*(30.0/(1+0.063*x[0]))",0,500) )
-    , func1B( new TF1("func1B","0.84*TMath::TanH(0.0025*x[0])*(28.0/(1+0.068*x[0]))",0,500) )
-    , func2B( new TF1("func2B","0.82*TMath::TanH(0.0024*x[0])*(27.0/(1+0.07*x[0]))",0,500) )
-    , func3B( new TF1("func3B","0.75*TMath::TanH(0.0023*x[0])*(25.0/(1+0.072*x[0]))",0,500) )
-    , func4B( new TF1("func4B","0.7*TMath::TanH(0.0022*x[0])*(25.0/(1+0.077*x[0]))",0,500) )
-    , func0C( new TF1("func0C","0.25*TMath::TanH(0.018*x[0])*(1/(1+0.0013*x[0]))",0,500) )
-    , func1C( new TF1("func1C","0.24*TMath::TanH(0.016*x[0])*(1/(1+0.0012*x[0]))",0,500) )
-    , func2C( new TF1("func2C","0.23*TMath::TanH(0.014*x[0])*(1/(1+0.0011*x[0]))",0,500) )
-    , func3C( new TF1("func3C","0.22*TMath::TanH(0.011*x[0])*(1/(1+0.0010*x[0]))",0,500) )
-    , func4C( new TF1("func4C","0.20*TMath::TanH(0.008*x[0])*(1/(1+0.0009*x[0]))",0,500) )
-    , func0L( new TF1("func0L","0.01*0.00038*x[0]",0,500) )
-    , func1L( new TF1("func1L","0.008*0.00036*x[0]",0,500) )
-    , func2L( new TF1("func2L","0.006*0.0003*x[0]",0,500) )
-    , func3L( new TF1("func3L","0.003*0.00025*x[0]",0,500) )
-    , func4L( new TF1("func4L","0.001*0.0001*x[0]",0,500) )
-  {}
-
-  ~DelphesBtagger() {
-    delete func0B;
-    delete func1B;
-    delete func2B;
-    delete func3B;
-    delete func4B;
-    delete func0C;
-    delete func1C;
-    delete func2C;
-    delete func3C;
-    delete func4C;
-    delete func0L;
-    delete func1L;
-    delete func2L;
-    delete func3L;
-    delete func4L;
+  static Int_t getFlavor( const int &pdgFlavor ) {
+    if( pdgFlavor == 5 ) return B;
+    if( pdgFlavor == 4 ) return C;
+    return L;
   }
 
-  Int_t getTagLevel( const float &pt , const int &flavor ) {
+  static UInt_t getCounter( const Int_t &ijet ) { return ( UInt_t(TAGLEVEL) << 24 ) | UInt_t( ijet ); }
 
-    Int_t tagLevel = 0;
-    float efficiency[5];
-    //P(tight | loose) = P(loose | tight) * P(tight)/ P (loose) = P(tight)/ P (loose)
-
-    if (flavor == 5) {
-      efficiency[0] = func0B->Eval(pt);//loosest
-      efficiency[1] = func1B->Eval(pt);
-      efficiency[2] = func2B->Eval(pt);
-      efficiency[3] = func3B->Eval(pt);
-      efficiency[4] = func4B->Eval(pt);//tightest
-    }
-    else if (flavor == 4) {
-      efficiency[0] = func0C->Eval(pt);//loosest
-      efficiency[1] = func1C->Eval(pt);
-      efficiency[2] = func2C->Eval(pt);
-      efficiency[3] = func3C->Eval(pt);
-      efficiency[4] = func4C->Eval(pt);//tightest
+  static void cumulative( const Int_t &flavor , const Double_t &pt , Double_t *res ) {
+    Double_t eff[NWP];
+    for( Int_t k = 0 ; k < NWP ; k++ ) eff[k] = efficiency( flavor , k , pt );
+    res[0] = eff[0];
+    for( Int_t k = 1 ; k < NWP ; k++ ) res[k] = eff[k-1] > 0 ? res[k-1] * std::min( std::max( eff[k]/eff[k-1] , 0.0 ) , 1.0 ) : 0.0;
+  }
+
+#if defined(__AVX2__)
+  // Same as getTagLevel() for four jets. Jets beyond the table are redone one by one.
+  void tag4( const float *pt , const int *flavor , const Int_t *ijet , Int_t *levels ) const {
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d one  = _mm256_set1_pd( 1.0 );
+    const __m256d x = _mm256_div_pd( _mm256_cvtps_pd( _mm_loadu_ps( pt ) ) , _mm256_set1_pd( PTSTEP ) );
+    const __m256d inTable = _mm256_and_pd( _mm256_cmp_pd( x , zero , _CMP_GE_OQ ) , _mm256_cmp_pd( x , _mm256_set1_pd( nbins ) , _CMP_LT_OQ ) );
+    const __m256d xin = _mm256_and_pd( inTable , x );
+    const __m128i i = _mm256_cvttpd_epi32( xin );
+    const __m256d w = _mm256_sub_pd( xin , _mm256_cvtepi32_pd( i ) );
+    const __m128i f = _mm_setr_epi32( getFlavor(flavor[0]) , getFlavor(flavor[1]) , getFlavor(flavor[2]) , getFlavor(flavor[3]) );
+    const __m128i row = _mm_mullo_epi32( _mm_add_epi32( _mm_mullo_epi32( f , _mm_set1_epi32( nbins+1 ) ) , i ) , _mm_set1_epi32( NWP ) );
+    const UInt_t last[4] = { getCounter( ijet[0] ) , getCounter( ijet[1] ) , getCounter( ijet[2] ) , getCounter( ijet[3] ) };
+    const __m256d uniform = Philox::uniform4( ctr , last , key );
+    __m256d n = zero;
+    for( Int_t k = 0 ; k < NWP ; k++ ) {
+      const __m256d lo = _mm256_i32gather_pd( &v_table[k] , row , 8 );
+      const __m256d hi = _mm256_i32gather_pd( &v_table[NWP+k] , row , 8 );
+      const __m256d p  = _mm256_add_pd( lo , _mm256_mul_pd( w , _mm256_sub_pd( hi , lo ) ) );
+      n = _mm256_add_pd( n , _mm256_and_pd( _mm256_cmp_pd( uniform , p , _CMP_LT_OQ ) , one ) );
     }
-    else {
-      efficiency[0] = func0L->Eval(pt);//loosest
-      efficiency[1] = func1L->Eval(pt);
-      efficiency[2] = func2L->Eval(pt);
-      efficiency[3] = func3L->Eval(pt);
-      efficiency[4] = func4L->Eval(pt);//tightest
+    _mm_storeu_si128( (__m128i*)levels , _mm256_cvttpd_epi32( n ) );
+    const Int_t mask = _mm256_movemask_pd( inTable );
+    for( Int_t l = 0 ; l < 4 ; l++ ) if( !( mask & (1<<l) ) ) levels[l] = getTagLevel( pt[l] , flavor[l] , ijet[l] );
+  }
+#endif
+
+public:
+
+  DelphesBtagger( UInt_t seed = 8675309 )
+    : nbins( Int_t( PTMAX/PTSTEP + 0.5 ) )
+  {
+    key[0] = seed;
+    key[1] = Philox::hash( "" );
+    ctr[0] = ctr[1] = ctr[2] = 0;
+    v_table.resize( NFLAVORS*(nbins+1)*NWP );
+    for( Int_t f = 0 ; f < NFLAVORS ; f++ ) {
+      for( Int_t i = 0 ; i <= nbins ; i++ ) cumulative( f , i*PTSTEP , &v_table[getRow(f,i)] );
     }
-    float uniform = r.Uniform(1.0);
-
-    if( uniform < efficiency[0] ) {
-      tagLevel = 1;
-      float looseGivenTight = efficiency[1] / efficiency[0];
-      uniform = r.Uniform(1.0);
-      if( uniform < looseGivenTight ) {
-        tagLevel = 2;
-        looseGivenTight = efficiency[2] / efficiency[1];
-        uniform = r.Uniform(1.0);
-        if( uniform < looseGivenTight ) {
-          tagLevel = 3;
-          looseGivenTight = efficiency[3] / efficiency[2];
-          uniform = r.Uniform(1.0);
-          if( uniform < looseGivenTight ) {
-            tagLevel = 4;
-            looseGivenTight = efficiency[4] / efficiency[3];
-            uniform = r.Uniform(1.0);
-            if( uniform < looseGivenTight ) {
-              tagLevel = 5;
-            }
-          }
-        }
-      }
+  }
+
+  ~DelphesBtagger() {}
+
+  // Efficiency of working point wp (0 = loosest) for jets of the given flavor
+  static Double_t efficiency( const Int_t &flavor , const Int_t &wp , const Double_t &pt ) {
+    static const Double_t b[NWP][4] = { { 0.85 , 0.0026 , 30.0 , 0.063 } ,
+					{ 0.84 , 0.0025 , 28.0 , 0.068 } ,
+					{ 0.82 , 0.0024 , 27.0 , 0.07  } ,
+					{ 0.75 , 0.0023 , 25.0 , 0.072 } ,
+					{ 0.7  , 0.0022 , 25.0 , 0.077 } };
+    static const Double_t c[NWP][3] = { { 0.25 , 0.018 , 0.0013 } ,
+					{ 0.24 , 0.016 , 0.0012 } ,
+					{ 0.23 , 0.014 , 0.0011 } ,
+					{ 0.22 , 0.011 , 0.0010 } ,
+					{ 0.20 , 0.008 , 0.0009 } };
+    static const Double_t l[NWP] = { 0.01*0.00038 , 0.008*0.00036 , 0.006*0.0003 , 0.003*0.00025 , 0.001*0.0001 };
+    if( flavor == B ) return b[wp][0] * TMath::TanH( b[wp][1]*pt ) * ( b[wp][2]/( 1 + b[wp][3]*pt ) );
+    if( flavor == C ) return c[wp][0] * TMath::TanH( c[wp][1]*pt ) * ( 1/( 1 + c[wp][2]*pt ) );
+    return l[wp]*pt;
+  }
+
+  void setSample( const TString &name ) { key[1] = Philox::hash( name.Data() ); }
+
+  // Identifies the random numbers, e.g. for checking that stored tags are still valid. The
+  // leading number is that of the way files are counted, see getFileId().
+  TString getKeyString() const { return TString::Format( "2-%08x%08x" , key[0] , key[1] ); }
+
+  // The last two components of path, e.g. "<job>/delphes_output.root", so that the tags of a
+  // file don't depend on where the data directory is
+  static TString getFileId( const TString &path ) {
+    const char *s = path.Data();
+    const char *id = s;
+    Int_t nslash = 0;
+    for( const char *p = s + path.Length() ; p > s ; p-- ) {
+      if( p[-1] == '/' && ++nslash == 2 ) { id = p; break; }
     }
+    return id;
+  }
 
+  void beginInputFile( const TString &path ) { ctr[0] = Philox::hash( getFileId( path ).Data() ); }
+
+  void beginEvent( const Long64_t &ientry ) {
+    ctr[1] = UInt_t( ULong64_t( ientry ) );
+    ctr[2] = UInt_t( ULong64_t( ientry ) >> 32 );
+  }
+
+  // ijet is the index of the jet in the entry's jet collection
+  Int_t getTagLevel( const float &pt , const int &flavor , const Int_t &ijet ) const {
+    const Int_t f = getFlavor( flavor );
+    Double_t p[NWP];
+    const Double_t x = pt/PTSTEP;
+    if( x >= 0 && x < nbins ) {
+      const Int_t i = Int_t( x );
+      const Double_t w = x - i;
+      const Double_t *lo = &v_table[getRow(f,i)] , *hi = lo + NWP;
+      for( Int_t k = 0 ; k < NWP ; k++ ) p[k] = lo[k] + w*( hi[k] - lo[k] );
+    } else {
+      cumulative( f , pt , p );
+    }
+    const UInt_t c[4] = { ctr[0] , ctr[1] , ctr[2] , getCounter( ijet ) };
+    const Double_t uniform = Philox::uniform( c , key );
+    Int_t tagLevel = 0;
+    for( Int_t k = 0 ; k < NWP ; k++ ) if( uniform < p[k] ) tagLevel++;
     return tagLevel;
   }
 
+  // Fills b.level, the same as getTagLevel() for every jet
+  void tag( Batch &b ) const {
+    const Int_t n = b.size();
+    b.level.resize( n );
+    Int_t i = 0;
+#if defined(__AVX2__)
+    for( ; i+4 <= n ; i += 4 ) tag4( &b.pt[i] , &b.flavor[i] , &b.index[i] , &b.level[i] );
+#endif
+    for( ; i < n ; i++ ) b.level[i] = getTagLevel( b.pt[i] , b.flavor[i] , b.index[i] );
+  }
+
 };
 
 
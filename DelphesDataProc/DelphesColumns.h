@@ -0,0 +1,247 @@
+#ifndef _DELPHESCOLUMNS_H_
+#define _DELPHESCOLUMNS_H_
+
+#include <iostream>
+#include <assert.h>
+#include <vector>
+
+#include "TTree.h"
+#include "TBranchElement.h"
+#include "TClonesArray.h"
+#include "TString.h"
+#include "TMath.h"
+
+#include "Report.h"
+#include "DelphesLeaves.h"
+
+// Delphes includes
+#include "classes/DelphesClasses.h"
+#include "external/ExRootAnalysis/ExRootTreeReader.h"
+
+
+class
+DelphesColumns
+{
+
+  //
+  // The members of the Delphes collections that a job reads, as one array per member for the
+  // current entry, e.g. jet.pt[i] rather than ((Jet*)br_jet->At(i))->PT. This is what the
+  // selectors work on. In DIRECT mode the split branches are read straight into the arrays,
+  // the way TTreeReaderArray does it (the tree is put in MakeClass mode), so the Delphes
+  // objects are never made and streamed. OBJECTS mode reads the collections the usual way
+  // with ExRootTreeReader and copies the members over, for comparisons. Either way only the
+  // members in the given DelphesLeaves are read and the other arrays keep their values.
+  //
+
+public:
+
+  enum Mode { DIRECT , OBJECTS };
+
+  struct Jets {
+    Int_t n;
+    std::vector<Float_t> pt , eta , phi , mass;
+    std::vector<UInt_t> flavor;
+  };
+  struct Leptons {
+    Int_t n;
+    std::vector<Float_t> pt , eta , phi;
+  };
+  struct MissingEt {
+    Int_t n;
+    std::vector<Float_t> met , eta , phi;
+  };
+  struct Particles {
+    Int_t n;
+    std::vector<Int_t> pid , status , m1 , m2;
+    std::vector<Float_t> px , py , eta , phi;
+  };
+
+  Jets jet;
+  Leptons el , mu;
+  MissingEt met;
+  Particles part;
+
+private:
+
+  TTree *tree;
+  Mode mode;
+  DelphesLeaves leaves;
+  ExRootTreeReader *ex;
+  TClonesArray *br_jet , *br_el , *br_mu , *br_met , *br_part;
+
+  // Sets up a collection, returning the room needed for its largest entry in the file (0 if
+  // the collection isn't read)
+  Int_t useCollection( const char *name , Int_t &n , TClonesArray* &br ) {
+    n  = 0;
+    br = 0;
+    if( ! leaves.usesCollection( name ) ) return 0;
+    TBranchElement *b = dynamic_cast<TBranchElement*>( tree->GetBranch( name ) );
+    if( ! b ) {
+      report::error( "DelphesColumns : no %s collection in the Delphes tree" , name );
+      assert( false );
+    }
+    if( mode == DIRECT ) check( name , tree->SetBranchAddress( name , &n ) );
+    else br = ex->UseBranch( name );
+    return TMath::Max( b->GetMaximum() , 1 );
+  }
+
+  template< typename T >
+  void bind( const TString &leaf , std::vector<T> &v , const Int_t &capacity ) {
+    v.assign( capacity , T() );
+    if( mode == DIRECT && capacity > 0 && leaves.contains( leaf ) ) check( leaf , tree->SetBranchAddress( leaf , v.data() ) );
+  }
+
+  static void check( const TString &name , const Int_t &status ) {
+    if( status >= 0 ) return;
+    report::error( "DelphesColumns : could not read %s into an array (error %i)" , name.Data() , status );
+    assert( false );
+  }
+
+  static void checkSize( const char *name , const Int_t &n , const std::size_t &capacity ) {
+    if( std::size_t(n) <= capacity ) return;
+    report::error( "DelphesColumns : %i entries in %s, more than the %i in the branch info" , n , name , Int_t(capacity) );
+    assert( false );
+  }
+
+  // OBJECTS mode: copy the members over from the collections just read
+  void copyObjects() {
+    if( br_jet ) {
+      jet.n = br_jet->GetEntriesFast();
+      checkSize( "Jet" , jet.n , jet.pt.size() );
+      for( Int_t i = 0 ; i < jet.n ; i++ ) {
+	Jet *o = (Jet*) br_jet->At(i);
+	jet.pt[i]     = o->PT;
+	jet.eta[i]    = o->Eta;
+	jet.phi[i]    = o->Phi;
+	jet.mass[i]   = o->Mass;
+	jet.flavor[i] = o->Flavor;
+      }
+    }
+    if( br_el ) {
+      el.n = br_el->GetEntriesFast();
+      checkSize( "Electron" , el.n , el.pt.size() );
+      for( Int_t i = 0 ; i < el.n ; i++ ) {
+	Electron *o = (Electron*) br_el->At(i);
+	el.pt[i]  = o->PT;
+	el.eta[i] = o->Eta;
+	el.phi[i] = o->Phi;
+      }
+    }
+    if( br_mu ) {
+      mu.n = br_mu->GetEntriesFast();
+      checkSize( "Muon" , mu.n , mu.pt.size() );
+      for( Int_t i = 0 ; i < mu.n ; i++ ) {
+	Muon *o = (Muon*) br_mu->At(i);
+	mu.pt[i]  = o->PT;
+	mu.eta[i] = o->Eta;
+	mu.phi[i] = o->Phi;
+      }
+    }
+    if( br_met ) {
+      met.n = br_met->GetEntriesFast();
+      checkSize( "MissingET" , met.n , met.met.size() );
+      for( Int_t i = 0 ; i < met.n ; i++ ) {
+	MissingET *o = (MissingET*) br_met->At(i);
+	met.met[i] = o->MET;
+	met.eta[i] = o->Eta;
+	met.phi[i] = o->Phi;
+      }
+    }
+    if( br_part ) {
+      part.n = br_part->GetEntriesFast();
+      checkSize( "Particle" , part.n , part.pid.size() );
+      for( Int_t i = 0 ; i < part.n ; i++ ) {
+	GenParticle *o = (GenParticle*) br_part->At(i);
+	part.pid[i]    = o->PID;
+	part.status[i] = o->Status;
+	part.m1[i]     = o->M1;
+	part.m2[i]     = o->M2;
+	part.px[i]     = o->Px;
+	part.py[i]     = o->Py;
+	part.eta[i]    = o->Eta;
+	part.phi[i]    = o->Phi;
+      }
+    }
+  }
+
+  DelphesColumns( const DelphesColumns& );
+  DelphesColumns& operator=( const DelphesColumns& );
+
+public:
+
+  // Reads the members in "_leaves" of t, and nothing else. The tree has to stay open while
+  // this is in use.
+  DelphesColumns( TTree *t , const DelphesLeaves &_leaves , const Mode &_mode = DIRECT )
+    : tree( t )
+    , mode( _mode )
+    , leaves( _leaves )
+    , ex( 0 )
+  {
+    leaves.activate( tree );
+    if( mode == DIRECT ) tree->SetMakeClass( 1 );
+    else ex = new ExRootTreeReader( tree );
+
+    Int_t capacity = useCollection( "Jet" , jet.n , br_jet );
+    bind( "Jet.PT"     , jet.pt     , capacity );
+    bind( "Jet.Eta"    , jet.eta    , capacity );
+    bind( "Jet.Phi"    , jet.phi    , capacity );
+    bind( "Jet.Mass"   , jet.mass   , capacity );
+    bind( "Jet.Flavor" , jet.flavor , capacity );
+
+    capacity = useCollection( "Electron" , el.n , br_el );
+    bind( "Electron.PT"  , el.pt  , capacity );
+    bind( "Electron.Eta" , el.eta , capacity );
+    bind( "Electron.Phi" , el.phi , capacity );
+
+    capacity = useCollection( "Muon" , mu.n , br_mu );
+    bind( "Muon.PT"  , mu.pt  , capacity );
+    bind( "Muon.Eta" , mu.eta , capacity );
+    bind( "Muon.Phi" , mu.phi , capacity );
+
+    capacity = useCollection( "MissingET" , met.n , br_met );
+    bind( "MissingET.MET" , met.met , capacity );
+    bind( "MissingET.Eta" , met.eta , capacity );
+    bind( "MissingET.Phi" , met.phi , capacity );
+
+    capacity = useCollection( "Particle" , part.n , br_part );
+    bind( "Particle.PID"    , part.pid    , capacity );
+    bind( "Particle.Status" , part.status , capacity );
+    bind( "Particle.M1"     , part.m1     , capacity );
+    bind( "Particle.M2"     , part.m2     , capacity );
+    bind( "Particle.Px"     , part.px     , capacity );
+    bind( "Particle.Py"     , part.py     , capacity );
+    bind( "Particle.Eta"    , part.eta    , capacity );
+    bind( "Particle.Phi"    , part.phi    , capacity );
+  }
+
+  ~DelphesColumns() {
+    if( mode == DIRECT ) {
+      tree->ResetBranchAddresses();
+      tree->SetMakeClass( 0 );
+    }
+    delete ex;
+  }
+
+  static Mode getMode( const TString &name ) {
+    if( name == TString("direct") ) return DIRECT;
+    if( name == TString("objects") ) return OBJECTS;
+    report::error( "DelphesColumns : unknown read mode %s (direct or objects)" , name.Data() );
+    assert( false );
+    return DIRECT;
+  }
+
+  Mode getMode() const { return mode; }
+
+  void readEntry( const Long64_t &ientry ) {
+    if( mode == DIRECT ) {
+      tree->GetEntry( ientry );
+      return;
+    }
+    ex->ReadEntry( ientry );
+    copyObjects();
+  }
+
+};
+
+
+#endif
@@ -0,0 +1,132 @@
+#ifndef _DELPHESEVENTINDEX_H_
+#define _DELPHESEVENTINDEX_H_
+
+#include <iostream>
+#include <assert.h>
+#include <mutex>
+#include <vector>
+
+#include "TFile.h"
+#include "TTree.h"
+#include "TNamed.h"
+#include "TString.h"
+#include "TSystem.h"
+
+#include "Report.h"
+#include "ParallelTools.h"
+#include "DelphesBtagger.h"
+#include "SideFiles.h"
+
+
+class
+DelphesEventIndex
+{
+
+  //
+  // A few numbers for every entry of a Delphes file (how many jets and leptons pass the
+  // object cuts, their leading pTs and the b-tag counts), stored next to the file so that
+  // later jobs can tell which entries can't pass their jet, b-tag and lepton channel cuts
+  // without reading the entries. Nothing in it depends on those cuts, so one index serves
+  // any selection. The b-tag counts do depend on the tagger's key, which the index remembers
+  // along with the file it was made from (UUID and number of entries) and the VERSION. Bump
+  // VERSION when the object cuts change. Indices are written as side files (see SideFiles.h),
+  // so jobs can make and read them concurrently.
+  //
+
+public:
+
+  static const Int_t VERSION = 1;
+
+  struct Summary {
+    Int_t nJet , nEl , nMu; // passing the object cuts
+    Float_t leadJetPt , leadLepPt; // GeV, -1 if there is none
+    Int_t nBtag[DelphesBtagger::NWP]; // jets tagged at working point k+1 or tighter
+  };
+
+private:
+
+  std::vector<Summary> v_summary;
+
+  // Points the tree at s, making the branches if the tree is being written
+  static void setBranches( TTree *t , Summary &s , const Bool_t &write ) {
+    auto bind = [&]( const char *name , void *address , const char *leaflist ) {
+      if( write ) t->Branch( name , address , leaflist );
+      else t->SetBranchAddress( name , address );
+    };
+    bind( "nJet"      , &s.nJet	     , "nJet/I" );
+    bind( "nEl"	      , &s.nEl	     , "nEl/I" );
+    bind( "nMu"	      , &s.nMu	     , "nMu/I" );
+    bind( "leadJetPt" , &s.leadJetPt , "leadJetPt/F" );
+    bind( "leadLepPt" , &s.leadLepPt , "leadLepPt/F" );
+    bind( "nBtag"     , s.nBtag	     , TString::Format( "nBtag[%i]/I" , Int_t(DelphesBtagger::NWP) ) );
+  }
+
+public:
+
+  DelphesEventIndex() {}
+  ~DelphesEventIndex() {}
+
+  void clear() { v_summary.clear(); }
+  void add( const Summary &s ) { v_summary.push_back( s ); }
+  Long64_t size() const { return v_summary.size(); }
+  const Summary& operator[]( const Long64_t &i ) const { return v_summary[i]; }
+
+  // What an index of "source" (holding "entries" entries) made with "bt" has to remember
+  static TString getInfo( TFile *source , const Long64_t &entries , const DelphesBtagger &bt ) {
+    return TString::Format( "version=%i;uuid=%s;entries=%lld;btag=%s" , VERSION , source->GetUUID().AsString() ,
+			    entries , bt.getKeyString().Data() );
+  }
+
+  // Where the index of a Delphes file goes in directory "dir"
+  static TString getIndexPath( const TString &dir , const TString &sourcePath ) { return sidefile::getPath( dir , sourcePath , "index" ); }
+
+  // Loads the index at "path" if it exists and was made with "info", and returns whether it did
+  Bool_t read( const TString &path , const TString &info ) {
+    clear();
+    std::lock_guard<std::mutex> lock( ptools::rootMutex() );
+    if( gSystem->AccessPathName( path ) ) return kFALSE;
+    TFile *f = TFile::Open( path );
+    TNamed *stored = ( f && ! f->IsZombie() ) ? (TNamed*) f->Get( "IndexInfo" ) : 0;
+    TTree *t = stored && info == TString( stored->GetTitle() ) ? (TTree*) f->Get( "index" ) : 0;
+    if( t ) {
+      Summary s;
+      setBranches( t , s , kFALSE );
+      v_summary.reserve( t->GetEntries() );
+      for( Long64_t i = 0 ; i < t->GetEntries() ; i++ ) {
+	t->GetEntry( i );
+	v_summary.push_back( s );
+      }
+    }
+    delete f;
+    return t != 0;
+  }
+
+  // Writes a temporary file that only replaces "path" once complete
+  void write( const TString &path , const TString &info ) {
+    const TString tmpPath = sidefile::getTempPath( path );
+    std::lock_guard<std::mutex> lock( ptools::rootMutex() );
+    TFile *f = new TFile( tmpPath , "recreate" );
+    if( f->IsZombie() ) {
+      report::error( "DelphesEventIndex : could not create %s" , tmpPath.Data() );
+      assert( false );
+    }
+    TTree *t = new TTree( "index" , "index" );
+    t->SetDirectory( f );
+    Summary s;
+    setBranches( t , s , kTRUE );
+    for( std::size_t i = 0 ; i < v_summary.size() ; i++ ) {
+      s = v_summary[i];
+      t->Fill();
+    }
+    t->Write( "" , TObject::kOverwrite );
+    TNamed stored( "IndexInfo" , info );
+    stored.Write( "" , TObject::kOverwrite );
+    f->Close();
+    delete f;
+    sidefile::commit( tmpPath , path );
+  }
+
+};
+
+
+#endif
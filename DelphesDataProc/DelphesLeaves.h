@@ -0,0 +1,86 @@
+#ifndef _DELPHESLEAVES_H_
+#define _DELPHESLEAVES_H_
+
+#include <iostream>
+#include <initializer_list>
+#include <set>
+#include <vector>
+
+#include "TTree.h"
+#include "TBranch.h"
+#include "TLeaf.h"
+#include "TString.h"
+
+
+class
+DelphesLeaves
+{
+
+  //
+  // The members of the Delphes collections that a job actually reads, e.g. Jet.PT. The
+  // readers add the ones they use, and activate() then switches off every other branch of
+  // the tree, so that reading an entry doesn't decompress the members nobody looks at (the
+  // constituent and particle references of the jets in particular). Members that aren't
+  // read keep whatever values they had, so a reader has to list everything it uses.
+  //
+
+private:
+
+  std::vector<TString> v_branches; // whole collections, for their counters
+  std::vector<TString> v_leaves;
+
+  static void addOnce( std::vector<TString> &v , const TString &name ) {
+    for( std::size_t i = 0 ; i < v.size() ; i++ ) if( v[i] == name ) return;
+    v.push_back( name );
+  }
+
+public:
+
+  DelphesLeaves() {}
+  ~DelphesLeaves() {}
+
+  void add( const TString &collection , std::initializer_list<const char*> members ) {
+    addOnce( v_branches , collection );
+    for( const char *m : members ) addOnce( v_leaves , collection + "." + m );
+  }
+
+  Bool_t usesCollection( const TString &collection ) const {
+    for( const TString &b : v_branches ) if( b == collection ) return kTRUE;
+    return kFALSE;
+  }
+
+  Bool_t contains( const TString &leaf ) const {
+    for( const TString &l : v_leaves ) if( l == leaf ) return kTRUE;
+    return kFALSE;
+  }
+
+  void activate( TTree *t ) const {
+    t->SetBranchStatus( "*" , 0 );
+    for( const TString &b : v_branches ) {
+      t->SetBranchStatus( b , 1 );
+      if( t->GetBranch( b+"_size" ) ) t->SetBranchStatus( b+"_size" , 1 );
+    }
+    for( const TString &l : v_leaves ) t->SetBranchStatus( l , 1 );
+  }
+
+  // Uncompressed bytes per entry in the active branches of t, and in all of them
+  static void getBytesPerEntry( TTree *t , Double_t &active , Double_t &all ) {
+    active = all = 0;
+    if( t->GetEntries() == 0 ) return;
+    std::set<TBranch*> seen;
+    TIter next = t->GetListOfLeaves();
+    TLeaf *leaf = 0;
+    while( (leaf = (TLeaf*)next()) ) {
+      TBranch *b = leaf->GetBranch();
+      if( ! seen.insert( b ).second ) continue;
+      all += b->GetTotBytes();
+      if( t->GetBranchStatus( b->GetName() ) ) active += b->GetTotBytes();
+    }
+    active /= t->GetEntries();
+    all /= t->GetEntries();
+  }
+
+};
+
+
+#endif
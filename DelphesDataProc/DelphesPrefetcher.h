@@ -0,0 +1,213 @@
+#ifndef _DELPHESPREFETCHER_H_
+#define _DELPHESPREFETCHER_H_
+
+#include <iostream>
+#include <assert.h>
+#include <vector>
+#include <set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "TFile.h"
+#include "TTree.h"
+#include "TBranch.h"
+#include "TLeaf.h"
+#include "TTreeCache.h"
+#include "TString.h"
+#include "TMath.h"
+
+#include "Report.h"
+#include "ParallelTools.h"
+#include "DelphesLeaves.h"
+
+
+class
+DelphesPrefetcher
+{
+
+  //
+  // Opens the Delphes files of a job ahead of the event loop on a background thread. Each
+  // file gets a TTreeCache holding just the active branches, limited to the range of entries
+  // the job reads from it, and the baskets of the first cluster of the range are read into
+  // the cache, so the reader starts on a file whose open, metadata reads and first vectored
+  // read have already happened. At most "depth" files are kept ready and not yet taken (one
+  // per worker is enough). A file the thread hasn't got to when it's asked for is opened by
+  // the caller instead, and with a depth of 0 there is no thread and take() always does that.
+  //
+
+private:
+
+  enum State { WAITING , OPENING , READY , TAKEN };
+
+  struct Slot {
+    State state;
+    TFile *file;
+    TTree *tree;
+    Slot() : state( WAITING ) , file( 0 ) , tree( 0 ) {}
+  };
+
+  std::vector<TString> paths;
+  std::vector<Long64_t> firstEntries , lastEntries; // of each path, lastEntries -1 = to the end
+  std::size_t first , last;
+  DelphesLeaves leaves;
+  Long64_t cacheBytes;
+  std::size_t depth;
+
+  std::vector<Slot> slots;
+  std::size_t nReady;
+  Bool_t stopping;
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::thread thread;
+
+  // Opens file i with the leaves active and the cache set up for its entry range, then fills
+  // the cache with the first cluster of the range if "warm"
+  TFile* open( const std::size_t &i , TTree* &t , const Bool_t &warm ) const {
+    const TString &path = paths[i];
+    TFile *f = 0;
+    {
+      std::lock_guard<std::mutex> lock( ptools::rootMutex() );
+      f = TFile::Open( path );
+      t = ( f && ! f->IsZombie() ) ? (TTree*) f->Get( "Delphes" ) : 0;
+      if( ! t ) {
+	report::error( "DelphesPrefetcher : no Delphes tree in %s" , path.Data() );
+	assert( false );
+      }
+      leaves.activate( t );
+      configureCache( t , cacheBytes );
+    }
+    const Long64_t entries = t->GetEntries();
+    const Long64_t firstEntry = firstEntries.empty() ? 0 : TMath::Min( firstEntries[i] , entries );
+    const Long64_t lastEntry = lastEntries.empty() || lastEntries[i] < 0 ? entries : TMath::Min( lastEntries[i] , entries );
+    TTreeCache *tc = dynamic_cast<TTreeCache*>( f->GetCacheRead( t ) );
+    if( tc && lastEntry > firstEntry ) tc->SetEntryRange( firstEntry , lastEntry );
+    if( warm && tc && lastEntry > firstEntry ) {
+      t->LoadTree( firstEntry );
+      tc->FillBuffer();
+    }
+    return f;
+  }
+
+  void prefetchLoop() {
+    for( std::size_t i = first ; i < last ; i++ ) {
+      {
+	std::unique_lock<std::mutex> lock( mtx );
+	cv.wait( lock , [&]{ return stopping || nReady < depth; } );
+	if( stopping ) return;
+	if( slots[i].state != WAITING ) continue; // the reader got there first
+	slots[i].state = OPENING;
+      }
+      TTree *t = 0;
+      TFile *f = open( i , t , kTRUE );
+      {
+	std::lock_guard<std::mutex> lock( mtx );
+	slots[i].file  = f;
+	slots[i].tree  = t;
+	slots[i].state = READY;
+	nReady++;
+	cv.notify_all();
+      }
+    }
+  }
+
+  DelphesPrefetcher( const DelphesPrefetcher& );
+  DelphesPrefetcher& operator=( const DelphesPrefetcher& );
+
+public:
+
+  // Prefetches paths[_first] to paths[_last-1], in that order. Of path i only the entries
+  // [_firstEntries[i],_lastEntries[i]) are read (lastEntries -1 = to the end); no ranges means
+  // whole files.
+  DelphesPrefetcher( const std::vector<TString> &_paths , const std::size_t &_first , const std::size_t &_last ,
+		     const DelphesLeaves &_leaves , const Long64_t &_cacheBytes , const std::size_t &_depth ,
+		     const std::vector<Long64_t> &_firstEntries = std::vector<Long64_t>() ,
+		     const std::vector<Long64_t> &_lastEntries = std::vector<Long64_t>() )
+    : paths( _paths )
+    , firstEntries( _firstEntries )
+    , lastEntries( _lastEntries )
+    , first( _first )
+    , last( TMath::Min( _last , _paths.size() ) )
+    , leaves( _leaves )
+    , cacheBytes( _cacheBytes )
+    , depth( _depth )
+    , slots( _paths.size() )
+    , nReady( 0 )
+    , stopping( kFALSE )
+  {
+    if( depth == 0 ) return;
+    ptools::initThreads();
+    thread = std::thread( &DelphesPrefetcher::prefetchLoop , this );
+  }
+
+  ~DelphesPrefetcher() {
+    {
+      std::lock_guard<std::mutex> lock( mtx );
+      stopping = kTRUE;
+      cv.notify_all();
+    }
+    if( thread.joinable() ) thread.join();
+    std::lock_guard<std::mutex> lock( ptools::rootMutex() );
+    for( Slot &s : slots ) if( s.state == READY ) delete s.file;
+  }
+
+  Long64_t getCacheBytes() const { return cacheBytes; }
+
+  // The file and Delphes tree of paths[i], with the leaves active and the cache set up.
+  // Can only be taken once, and the caller owns (and closes) the file.
+  TFile* take( const std::size_t &i , TTree* &t ) {
+    assert( i >= first && i < last );
+    std::unique_lock<std::mutex> lock( mtx );
+    assert( slots[i].state != TAKEN );
+    if( slots[i].state == WAITING ) {
+      slots[i].state = TAKEN;
+      lock.unlock();
+      return open( i , t , kFALSE );
+    }
+    cv.wait( lock , [&]{ return slots[i].state == READY; } );
+    slots[i].state = TAKEN;
+    nReady--;
+    cv.notify_all();
+    t = slots[i].tree;
+    return slots[i].file;
+  }
+
+  //
+  // Gives t a TTreeCache of the branches that are active (see DelphesLeaves::activate), big
+  // enough for two clusters of them but no more than maxBytes, and ends the learning phase
+  // so the first read already fetches all of them. A maxBytes of 0 leaves t without a cache.
+  // Replaces any cache t had. Returns the cache size.
+  //
+  static Long64_t configureCache( TTree *t , const Long64_t &maxBytes ) {
+    t->SetCacheSize( 0 );
+    if( maxBytes <= 0 || t->GetEntries() == 0 ) return 0;
+
+    std::vector<TBranch*> active;
+    std::set<TBranch*> seen;
+    Double_t zipBytes = 0;
+    TIter next = t->GetListOfLeaves();
+    TLeaf *leaf = 0;
+    while( (leaf = (TLeaf*)next()) ) {
+      TBranch *b = leaf->GetBranch();
+      if( ! seen.insert( b ).second ) continue;
+      if( ! t->GetBranchStatus( b->GetName() ) ) continue;
+      active.push_back( b );
+      zipBytes += b->GetZipBytes();
+    }
+    if( active.empty() ) return 0;
+
+    TTree::TClusterIterator ci = t->GetClusterIterator( 0 );
+    ci.Next();
+    const Long64_t clusterEntries = TMath::Max( ci.GetNextEntry() , Long64_t(1) );
+    const Long64_t size = TMath::Min( maxBytes , TMath::Max( Long64_t( 2.0 * zipBytes / t->GetEntries() * clusterEntries ) , Long64_t(1<<20) ) );
+
+    t->SetCacheSize( size );
+    for( TBranch *b : active ) t->AddBranchToCache( b , kFALSE );
+    t->StopCacheLearningPhase();
+    return size;
+  }
+
+};
+
+
+#endif
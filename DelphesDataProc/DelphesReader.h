@@ -8,6 +8,7 @@
 #include <assert.h>
 #include <map>
 #include <vector>
+#include <mutex>
 
 #include "TString.h"
 #include "TTree.h"
@@ -15,19 +16,24 @@
 #include "TMath.h"
 #include "TLeaf.h"
 #include "TClonesArray.h"
-#include "TF1.h"
-#include "TRandom3.h"
+#include "TFile.h"
 
 #include "Report.h"
+#include "ParallelTools.h"
 #include "tth.h"
+#include "FeatureWriter.h"
+#include "CsvWriter.h"
+#include "FeatureSelection.h"
+#include "DelphesBtagger.h"
+#include "DelphesEventIndex.h"
+#include "DelphesLeaves.h"
+#include "DelphesColumns.h"
+#include "DelphesPrefetcher.h"
 
 #include "TTHbbLeptonic/MVAVariables.h"
 #include "TTHbbLeptonic/PairedSystem.h"
 #include "TopEvent/Event.h"
 
-// Delphes Includes
-#include "classes/DelphesClasses.h"
-#include "external/ExRootAnalysis/ExRootTreeReader.h"
 
 using namespace std;
 using namespace tth;
@@ -41,12 +47,9 @@ private:
   const Double_t MeV = 1000.0;
   const Double_t GeV = 1.0;
   
-  ExRootTreeReader *ex;
-  TClonesArray *br_el;
-  TClonesArray *br_mu;
-  TClonesArray *br_jet;
-  TClonesArray *br_met;
-  TClonesArray *br_part;
+  DelphesColumns *cols;
+  DelphesColumns::Mode readMode;
+  Long64_t cacheBytes;
 
   std::vector<TLorentzVector> good_jets;
   std::vector<TLorentzVector> good_el;
@@ -54,337 +57,687 @@ private:
   std::vector<std::size_t> good_jets_ids;
   std::vector<std::size_t> good_el_id;
   std::vector<std::size_t> good_mu_id;
-  
+
   TString selectionTag;
   UInt_t minNjets;
   UInt_t minNbtags;
   UInt_t totalSplits;
   UInt_t splitId;
 
-  TF1 *func0B;
-  TF1 *func1B;
-  TF1 *func2B;
-  TF1 *func3B;
-  TF1 *func4B;
+  DelphesBtagger bt;
+  DelphesBtagger::Batch jetBatch;
+  TString inputFileName;
+
+  // Directory of the per-file event indices ("none" = don't use them), and for the current
+  // file which entries can pass the cuts according to its index (empty without an index)
+  TString indexDir;
+  DelphesEventIndex index;
+  std::vector<char> v_mayPass;
+
+  // The object cuts, the same for jets and leptons
+  static Bool_t passesObjectCuts( const Double_t &pt , const Double_t &eta ) { return pt >= 20 && TMath::Abs(eta) <= 2.5; }
+
+  // The members of the Delphes branches that getEntry() reads. There's no truth selection,
+  // so the Particle branch isn't read at all.
+  static DelphesLeaves getLeaves() {
+    DelphesLeaves l;
+    l.add( "Jet" , { "PT" , "Eta" , "Phi" , "Mass" , "Flavor" } );
+    l.add( "Electron" , { "PT" , "Eta" , "Phi" } );
+    l.add( "Muon" , { "PT" , "Eta" , "Phi" } );
+    l.add( "MissingET" , { "MET" , "Eta" , "Phi" } );
+    return l;
+  }
 
-  TF1 *func0C;
-  TF1 *func1C;
-  TF1 *func2C;
-  TF1 *func3C;
-  TF1 *func4C;
+  void useBranches() {
+    delete cols;
+    cols = new DelphesColumns( tree , getLeaves() , readMode );
+    DelphesPrefetcher::configureCache( tree , cacheBytes );
+  }
 
-  TF1 *func0L;
-  TF1 *func1L;
-  TF1 *func2L;
-  TF1 *func3L;
-  TF1 *func4L;
+  // Sets the lepton channel flags, and the combined selections from them and the jet counts
+  void setChannels( const std::size_t &nel , const std::size_t &nmu , const std::size_t &njet , const UInt_t &nbtags ) {
+    map_char[h_noSel]	    = 1;
+    map_char[h_ee]	    = nel==2 && nmu==0 ? 1 : 0;
+    map_char[h_uu]	    = nel==0 && nmu==2 ? 1 : 0;
+    map_char[h_eu]	    = nel==1 && nmu==1 ? 1 : 0;
+    map_char[h_ll]	    = (nel+nmu)==2 ? 1 : 0;
+    map_char[h_e]	    = nel==1 && nmu==0 ? 1 : 0;
+    map_char[h_u]	    = nel==0 && nmu==1 ? 1 : 0;
+    map_char[h_l]	    = (nel+nmu)==1 ? 1 : 0;
+    map_char[h_anyl]        = (nel+nmu)>0 ? 1 : 0;
+    map_char[h_dil]         = map_char[h_ll] && njet >= 4 && nbtags >= 3;
+    map_char[h_ljet]        = map_char[h_l] && njet >= 6 && nbtags >= 3;
+    map_char[h_combinedSel] = map_char[h_dil] || map_char[h_ljet];
+  }
 
-  TRandom3 r;
+  // Whether an entry with this summary can pass the cuts of getEntry()
+  Bool_t mayPass( const DelphesEventIndex::Summary &s ) {
+    if( UInt_t(s.nJet) < minNjets ) return kFALSE;
+    if( UInt_t(s.nBtag[0]) < minNbtags ) return kFALSE;
+    setChannels( s.nEl , s.nMu , s.nJet , s.nBtag[0] );
+    return map_char[h_selection];
+  }
 
-  bool isTagged[5];
-  
-  Int_t getTagLevel( const float &pt , const int &flavor ) {
-
-    Int_t tagLevel = 0;
-    float efficiency[5];
-    //P(tight | loose) = P(loose | tight) * P(tight)/ P (loose) = P(tight)/ P (loose)
-
-    if (flavor == 5) {
-      efficiency[0] = func0B->Eval(pt);//loosest
-      efficiency[1] = func1B->Eval(pt);
-      efficiency[2] = func2B->Eval(pt);
-      efficiency[3] = func3B->Eval(pt);
-      efficiency[4] = func4B->Eval(pt);//tightest
-    }
-    else if (flavor == 4) {
-      efficiency[0] = func0C->Eval(pt);//loosest
-      efficiency[1] = func1C->Eval(pt);
-      efficiency[2] = func2C->Eval(pt);
-      efficiency[3] = func3C->Eval(pt);
-      efficiency[4] = func4C->Eval(pt);//tightest
-    }
-    else {
-      efficiency[0] = func0L->Eval(pt);//loosest
-      efficiency[1] = func1L->Eval(pt);
-      efficiency[2] = func2L->Eval(pt);
-      efficiency[3] = func3L->Eval(pt);
-      efficiency[4] = func4L->Eval(pt);//tightest
-    }
-    float uniform = r.Uniform(1.0);
-
-    if( uniform < efficiency[0] ) {
-      tagLevel = 1;
-      float looseGivenTight = efficiency[1] / efficiency[0];
-      uniform = r.Uniform(1.0);
-      if( uniform < looseGivenTight ) {
-	tagLevel = 2;
-        looseGivenTight = efficiency[2] / efficiency[1];
-        uniform = r.Uniform(1.0);
-        if( uniform < looseGivenTight ) {
-	  tagLevel = 3;
-          looseGivenTight = efficiency[3] / efficiency[2];
-          uniform = r.Uniform(1.0);
-          if( uniform < looseGivenTight ) {
-	    tagLevel = 4;
-            looseGivenTight = efficiency[4] / efficiency[3];
-            uniform = r.Uniform(1.0);
-            if( uniform < looseGivenTight ) {
-	      tagLevel = 5;
-            }
-	  }
-	}
+  // Summary of the entry last read, with the b-tagger set up for it
+  void summariseEntry( DelphesEventIndex::Summary &s ) {
+    s.nJet = s.nEl = s.nMu = 0;
+    s.leadJetPt = s.leadLepPt = -1;
+    for( Int_t k = 0 ; k < DelphesBtagger::NWP ; k++ ) s.nBtag[k] = 0;
+    const DelphesColumns::Jets &jet = cols->jet;
+    jetBatch.clear();
+    for( Int_t i = 0 ; i < jet.n ; ++i ) {
+      if( ! passesObjectCuts( jet.pt[i] * GeV , jet.eta[i] ) ) continue;
+      jetBatch.add( jet.pt[i]*GeV , jet.flavor[i] , i );
+      s.leadJetPt = TMath::Max( s.leadJetPt , Float_t(jet.pt[i] * GeV) );
+    }
+    bt.tag( jetBatch );
+    s.nJet = jetBatch.size();
+    for( std::size_t k = 0 ; k < jetBatch.size() ; k++ ) {
+      for( Int_t itag = 0 ; itag < jetBatch.level[k] && itag < DelphesBtagger::NWP ; itag++ ) s.nBtag[itag]++;
+    }
+    const DelphesColumns::Leptons *leptons[2] = { &cols->el , &cols->mu };
+    for( Int_t il = 0 ; il < 2 ; il++ ) {
+      const DelphesColumns::Leptons &lep = *leptons[il];
+      for( Int_t i = 0 ; i < lep.n ; ++i ) {
+	if( ! passesObjectCuts( lep.pt[i] * GeV , lep.eta[i] ) ) continue;
+	( il == 0 ? s.nEl : s.nMu )++;
+	s.leadLepPt = TMath::Max( s.leadLepPt , Float_t(lep.pt[i] * GeV) );
       }
     }
+  }
+
+  // Makes the index of the current file, reading only the jet and lepton branches
+  void buildIndex() {
+    {
+      std::lock_guard<std::mutex> lock( ptools::rootMutex() );
+      delete cols;
+      DelphesLeaves l;
+      l.add( "Jet" , { "PT" , "Eta" , "Flavor" } );
+      l.add( "Electron" , { "PT" , "Eta" } );
+      l.add( "Muon" , { "PT" , "Eta" } );
+      cols = new DelphesColumns( tree , l , readMode );
+      DelphesPrefetcher::configureCache( tree , cacheBytes );
+    }
+    index.clear();
+    DelphesEventIndex::Summary s;
+    const Long64_t nev = tree->GetEntries();
+    for( Long64_t iev = 0 ; iev < nev ; iev++ ) {
+      cols->readEntry( iev );
+      bt.beginEvent( iev );
+      summariseEntry( s );
+      index.add( s );
+    }
+    std::lock_guard<std::mutex> lock( ptools::rootMutex() );
+    useBranches();
+  }
+
+  // Works out which entries of the current file can pass, from its index (made if needed)
+  void loadIndex() {
+    v_mayPass.clear();
+    if( indexDir == TString("none") ) return;
+    TFile *source = tree->GetCurrentFile();
+    const TString path = DelphesEventIndex::getIndexPath( indexDir , inputFileName );
+    const TString info = DelphesEventIndex::getInfo( source , tree->GetEntries() , bt );
+    if( ! index.read( path , info ) ) {
+      buildIndex();
+      index.write( path , info );
+      report::info( "Indexed %lld entries of %s into %s" , index.size() , inputFileName.Data() , path.Data() );
+    }
+    v_mayPass.resize( index.size() );
+    for( Long64_t i = 0 ; i < index.size() ; i++ ) v_mayPass[i] = mayPass( index[i] );
+  }
+
+
+  //
+  // Handles for everything that getEntry() calculates. They are registered once, in the
+  // constructor, so the event loop reads and writes the values by slot rather than by name.
+  //
+  struct KinematicHandles {
+    Handle<Float_t> pt , eta , phi , m;
+    Handle<Int_t> tag; // b-tag level for jets, flavor for leptons
+  };
+  // The groups of MVAVariables outputs below are only calculated when "active", i.e. when at
+  // least one of their branches is in the feature selection
+  struct PairHandles {
+    variable v;
+    pairing p;
+    TString tag;
+    Bool_t active;
+    Handle<Float_t> m , pt , ptsum , dr , dphi , deta;
+  };
+  struct TripletHandles {
+    variable v;
+    TString tag;
+    Bool_t active;
+    Handle<Float_t> m , pt;
+  };
+  struct CollectionHandles {
+    collection c;
+    TString tag;
+    Bool_t active;
+    Handle<Float_t> aplanarity , aplanority , sphericity , spherocity , sphericityT;
+    Handle<Float_t> planarity , variableC , variableD , circularity , planarFlow;
+  };
+
+  Handle<UInt_t> h_nbtags[5];
+  Handle< std::vector<float>* > h_good_jet_pt , h_good_jet_eta , h_good_jet_phi , h_good_jet_mass;
+  Handle< std::vector<int>* > h_good_jet_btag , h_good_jet_flavor;
+  Handle< std::vector<float>* > h_good_el_pt , h_good_el_eta , h_good_el_phi;
+  Handle< std::vector<float>* > h_good_mu_pt , h_good_mu_eta , h_good_mu_phi;
+  Handle<Int_t> h_nJets , h_nLeptons , h_nBTags , h_nJetsAbovePt[4];
+  Handle<Float_t> h_HT_all , h_HT_had , h_Centrality , h_MHiggs , h_NHiggs_30;
+  Handle<Float_t> h_H_all[5] , h_Htransverse_all[5];
+  Handle<Float_t> h_Thrust_all , h_ThrustAxis_all[3];
+  Handle<Float_t> h_pT_met , h_eta_met , h_phi_met;
+  KinematicHandles h_jet[10] , h_bjet[5] , h_lepton[2];
+  std::vector<PairHandles> h_pairs;
+  std::vector<TripletHandles> h_triplets;
+  Handle<Float_t> h_DileptonMass , h_DileptonPt , h_DileptonSumPt , h_DileptondR , h_DileptondPhi , h_DileptondEta;
+  std::vector<CollectionHandles> h_collections;
+  Handle<Float_t> h_dRlepbb_MindR;
+  Handle<Char_t> h_noSel , h_ee , h_uu , h_eu , h_ll , h_e , h_u , h_l , h_anyl , h_dil , h_ljet , h_combinedSel;
+  Handle<Char_t> h_selection; // whichever of the above selectionTag names
+
+  KinematicHandles setKinematicBranches( const TString &itag , const TString &tagname ) {
+    KinematicHandles k;
+    k.pt  = setBranch_float( "pT_"+itag , kFALSE );
+    k.eta = setBranch_float( "eta_"+itag , kFALSE );
+    k.phi = setBranch_float( "phi_"+itag , kFALSE );
+    k.m   = setBranch_float( "M_"+itag , kFALSE );
+    if( tagname.Length() ) k.tag = setBranch_int( tagname+"_"+itag , kFALSE );
+    return k;
+  }
+
+  void registerBranches() {
+
+    // Observables for objects passing the object selection criteria
+    for( Int_t i = 0 ; i < 5 ; i++ ) h_nbtags[i] = setBranch_uint( TString::Format("good_nbtags_%i",i+1) , kFALSE );
+    h_good_jet_pt     = setBranch_vector_float( "good_jet_pt" , kFALSE );
+    h_good_jet_eta    = setBranch_vector_float( "good_jet_eta" , kFALSE );
+    h_good_jet_phi    = setBranch_vector_float( "good_jet_phi" , kFALSE );
+    h_good_jet_mass   = setBranch_vector_float( "good_jet_mass" , kFALSE );
+    h_good_jet_btag   = setBranch_vector_int( "good_jet_btag" , kFALSE );
+    h_good_jet_flavor = setBranch_vector_int( "good_jet_flavor" , kFALSE );
+    h_good_el_pt      = setBranch_vector_float( "good_el_pt" , kFALSE );
+    h_good_el_eta     = setBranch_vector_float( "good_el_eta" , kFALSE );
+    h_good_el_phi     = setBranch_vector_float( "good_el_phi" , kFALSE );
+    h_good_mu_pt      = setBranch_vector_float( "good_mu_pt" , kFALSE );
+    h_good_mu_eta     = setBranch_vector_float( "good_mu_eta" , kFALSE );
+    h_good_mu_phi     = setBranch_vector_float( "good_mu_phi" , kFALSE );
+
+    // Variables from MVAVariables tool
+    // Common
+    h_nJets    = setBranch_int( "nJets" , kFALSE );
+    h_nLeptons = setBranch_int( "nLeptons" , kFALSE );
+    h_nJetsAbovePt[0] = setBranch_int( "nJetsAbovePt25" , kFALSE );
+    h_nJetsAbovePt[1] = setBranch_int( "nJetsAbovePt30" , kFALSE );
+    h_nJetsAbovePt[2] = setBranch_int( "nJetsAbovePt35" , kFALSE );
+    h_nJetsAbovePt[3] = setBranch_int( "nJetsAbovePt40" , kFALSE );
+    h_nBTags = map_int.add( "nBTags" ); // calculated, but never registered as a branch
+    h_HT_all     = setBranch_float( "HT_all" , kFALSE );
+    h_HT_had     = setBranch_float( "HT_had" , kFALSE );
+    h_Centrality = setBranch_float( "Centrality" , kFALSE );
+    h_MHiggs     = setBranch_float( "MHiggs" , kFALSE );
+    h_NHiggs_30  = setBranch_float( "NHiggs_30" , kFALSE );
+
+    // fox wolfram moments
+    for( Int_t i = 0 ; i < 5 ; i++ ) h_H_all[i] = setBranch_float( TString::Format("H%i_all",i+1) , kFALSE );
+    for( Int_t i = 0 ; i < 5 ; i++ ) h_Htransverse_all[i] = setBranch_float( TString::Format("H%itransverse_all",i+1) , kFALSE );
+
+    // Thrust
+    h_Thrust_all        = setBranch_float( "Thrust_all" , kFALSE );
+    h_ThrustAxis_all[0] = setBranch_float( "ThrustAxisX_all" , kFALSE );
+    h_ThrustAxis_all[1] = setBranch_float( "ThrustAxisY_all" , kFALSE );
+    h_ThrustAxis_all[2] = setBranch_float( "ThrustAxisZ_all" , kFALSE );
+
+    // MET
+    h_pT_met  = setBranch_float( "pT_met" , kFALSE );
+    h_eta_met = setBranch_float( "eta_met" , kFALSE );
+    h_phi_met = setBranch_float( "phi_met" , kFALSE );
+    
+    // Jet kinematics
+    for( Int_t ij = 0 ; ij < 10 ; ij++ ) h_jet[ij] = setKinematicBranches( TString::Format("jet%i",ij) , "bTagLevel" );
+    for( Int_t ij = 0 ; ij < 5 ; ij++ ) h_bjet[ij] = setKinematicBranches( TString::Format("bjet%i",ij) , "" );
+    
+    // Lepton kinematics
+    for( Int_t il = 0 ; il < 2 ; il++ ) h_lepton[il] = setKinematicBranches( TString::Format("lepton%i",il) , "flavor" );
+
+    // Two-object systems
+    for( variableIter iv = mva_variable_names.begin() , fv = mva_variable_names.end() ; iv != fv ; ++iv ) {
+      for( pairingIter ip = mva_pairing_names.begin() , fp = mva_pairing_names.end() ; ip != fp ; ++ip ) {
+	TString itag = ip->second + "_" + iv->second;
+	PairHandles ph;
+	ph.v     = iv->first;
+	ph.p     = ip->first;
+	ph.tag   = itag;
+	ph.active = kTRUE;
+	ph.m     = setBranch_float( "M"+itag , kFALSE );
+	ph.pt    = setBranch_float( "Pt"+itag , kFALSE );
+	ph.ptsum = setBranch_float( "PtSum"+itag , kFALSE );
+	ph.dr    = setBranch_float( "dR"+itag , kFALSE );
+	ph.dphi  = setBranch_float( "dPhi"+itag , kFALSE );
+	ph.deta  = setBranch_float( "dEta"+itag , kFALSE );
+	h_pairs.push_back( ph );
+      }
+      TripletHandles th;
+      th.v  = iv->first;
+      th.tag = iv->second;
+      th.active = kTRUE;
+      th.m  = setBranch_float( "Mjjj_"+iv->second , kFALSE );
+      th.pt = setBranch_float( "Ptjjj_"+iv->second , kFALSE );
+      h_triplets.push_back( th );
+    }
+
+    // DIL
+    h_DileptonMass  = setBranch_float( "DileptonMass" , kFALSE );
+    h_DileptonPt    = setBranch_float( "DileptonPt" , kFALSE );
+    h_DileptonSumPt = setBranch_float( "DileptonSumPt" , kFALSE );
+    h_DileptondR    = setBranch_float( "DileptondR" , kFALSE );
+    h_DileptondPhi  = setBranch_float( "DileptondPhi" , kFALSE );
+    h_DileptondEta  = setBranch_float( "DileptondEta" , kFALSE );
+
+    // Collection features
+    for( collectionIter ic = mva_collection_names.begin() , fc = mva_collection_names.end() ; ic != fc ; ++ic ) {
+      CollectionHandles ch;
+      ch.c           = ic->first;
+      ch.tag         = ic->second;
+      ch.active      = kTRUE;
+      ch.aplanarity  = setBranch_float( "Aplanarity_"+ic->second , kFALSE );
+      ch.aplanority  = setBranch_float( "Aplanority_"+ic->second , kFALSE );
+      ch.sphericity  = setBranch_float( "Sphericity_"+ic->second , kFALSE );
+      ch.spherocity  = setBranch_float( "Spherocity_"+ic->second , kFALSE );
+      ch.sphericityT = setBranch_float( "SphericityT_"+ic->second , kFALSE );
+      ch.planarity   = setBranch_float( "Planarity_"+ic->second , kFALSE );
+      ch.variableC   = setBranch_float( "Variable_C_"+ic->second , kFALSE );
+      ch.variableD   = setBranch_float( "Variable_D_"+ic->second , kFALSE );
+      ch.circularity = setBranch_float( "Circularity_"+ic->second , kFALSE );
+      ch.planarFlow  = setBranch_float( "PlanarFlow_"+ic->second , kFALSE );
+      h_collections.push_back( ch );
+    }
+
+    // L+jets
+    h_dRlepbb_MindR = setBranch_float( "dRlepbb_MindR" , kFALSE );
+
+    // Lepton channels
+    h_noSel       = setBranch_char( "noSel" , kFALSE );
+    h_ee          = setBranch_char( "ee" , kFALSE );
+    h_uu          = setBranch_char( "uu" , kFALSE );
+    h_eu          = setBranch_char( "eu" , kFALSE );
+    h_ll          = setBranch_char( "ll" , kFALSE );
+    h_e           = setBranch_char( "e" , kFALSE );
+    h_u           = setBranch_char( "u" , kFALSE );
+    h_l           = setBranch_char( "l" , kFALSE );
+    h_combinedSel = setBranch_char( "combinedSel" , kFALSE );
+    // only used for the selection, never registered as branches
+    h_anyl        = map_char.add( "anyl" );
+    h_dil         = map_char.add( "dil" );
+    h_ljet        = map_char.add( "ljet" );
 
-    return tagLevel;
   }
 
-  std::ofstream *outputCsv;
+  CsvWriter *outputCsv;
+  CsvWriter *csvOut; // either outputCsv or the csv buffer of the current output chunk
+  // Scalar leaves of the tree being written to csv, and how to print them
+  enum CsvKind { CSV_DOUBLE , CSV_FLOAT , CSV_INT };
+  TTree *csvTree;
+  std::vector< std::pair<TLeaf*,CsvKind> > v_csvLeaves;
+
+  const std::vector< std::pair<TLeaf*,CsvKind> >& getCsvLeaves( TTree *tree ) {
+    if( tree == csvTree ) return v_csvLeaves;
+    csvTree = tree;
+    v_csvLeaves.clear();
+    TIter next = tree->GetListOfLeaves();
+    TLeaf *leaf = 0;
+    while( (leaf = (TLeaf*)next()) ) {
+      TString leaftype = leaf->GetTypeName();
+      if( leaftype.BeginsWith("vector") ) continue;
+      CsvKind kind = leaftype==TString("Double_t") ? CSV_DOUBLE : leaftype==TString("Float_t") ? CSV_FLOAT : CSV_INT;
+      v_csvLeaves.push_back( std::make_pair( leaf , kind ) );
+    }
+    return v_csvLeaves;
+  }
   Double_t weight;
-  
+  Long64_t eventNumber;
 
-public:
+  // With the COLUMNAR format the output trees (plus an Event branch) are the only output,
+  // and the CSV copy of them isn't written
+  FeatureWriter::Format outputFormat;
 
-  DelphesReader()
-    : TreeReader()
-    , selectionTag( "None" )
-    , minNjets( 0 )
-    , minNbtags( 0 )
-    , totalSplits( 0 )
-    , splitId( 0 )
-    , r(8675309)
-    , func0B( new TF1("func0B","0.85*TMath::TanH(0.0026*x[0])*(30.0/(1+0.063*x[0]))",0,500) )
-    , func1B( new TF1("func1B","0.84*TMath::TanH(0.0025*x[0])*(28.0/(1+0.068*x[0]))",0,500) )
-    , func2B( new TF1("func2B","0.82*TMath::TanH(0.0024*x[0])*(27.0/(1+0.07*x[0]))",0,500) )
-    , func3B( new TF1("func3B","0.75*TMath::TanH(0.0023*x[0])*(25.0/(1+0.072*x[0]))",0,500) )
-    , func4B( new TF1("func4B","0.7*TMath::TanH(0.0022*x[0])*(25.0/(1+0.077*x[0]))",0,500) )
-    , func0C( new TF1("func0C","0.25*TMath::TanH(0.018*x[0])*(1/(1+0.0013*x[0]))",0,500) )
-    , func1C( new TF1("func1C","0.24*TMath::TanH(0.016*x[0])*(1/(1+0.0012*x[0]))",0,500) )
-    , func2C( new TF1("func2C","0.23*TMath::TanH(0.014*x[0])*(1/(1+0.0011*x[0]))",0,500) )
-    , func3C( new TF1("func3C","0.22*TMath::TanH(0.011*x[0])*(1/(1+0.0010*x[0]))",0,500) )
-    , func4C( new TF1("func4C","0.20*TMath::TanH(0.008*x[0])*(1/(1+0.0009*x[0]))",0,500) )
-    , func0L( new TF1("func0L","0.01*0.00038*x[0]",0,500) )
-    , func1L( new TF1("func1L","0.008*0.00036*x[0]",0,500) )
-    , func2L( new TF1("func2L","0.006*0.0003*x[0]",0,500) )
-    , func3L( new TF1("func3L","0.003*0.00025*x[0]",0,500) )
-    , func4L( new TF1("func4L","0.001*0.0001*x[0]",0,500) )
-    , outputCsv( 0 )
-  {}
+  // Branches of the output trees to write (all of them if it's empty), and which of the
+  // expensive groups of variables getEntry() has to calculate for them
+  FeatureSelection selection;
+  Bool_t do_foxWolfram , do_thrust , do_dilepton , do_lepbb;
 
-  ~DelphesReader() {
-    delete ex;
-    //delete br_el;
-    //delete br_mu;
-    //delete br_jet;
-    //delete br_met;
-    delete func0B;
-    delete func1B;
-    delete func2B;
-    delete func3B;
-    delete func4B;
-    delete func0C;
-    delete func1C;
-    delete func2C;
-    delete func3C;
-    delete func4C;
-    delete func0L;
-    delete func1L;
-    delete func2L;
-    delete func3L;
-    delete func4L;
+  Bool_t anySelected( std::initializer_list<TString> names ) const {
+    for( const TString &n : names ) if( selection.selects(n) ) return kTRUE;
+    return kFALSE;
   }
 
-  void setSelectionTag( TString v ) { selectionTag = v; }
-  void setMinNjets( UInt_t v ) { minNjets = v; }
-  void setMinNbtags( UInt_t v ) { minNbtags = v; }
-  void setTotalSplits( UInt_t v ) { totalSplits = v; }
-  void setSplitId( UInt_t v ) { splitId = v; }
+  void planCalculations() {
+    do_foxWolfram = kFALSE;
+    for( Int_t i = 1 ; i <= 5 ; i++ ) {
+      if( anySelected( { TString::Format("H%i_all",i) , TString::Format("H%itransverse_all",i) } ) ) do_foxWolfram = kTRUE;
+    }
+    do_thrust   = anySelected( { "Thrust_all" , "ThrustAxisX_all" , "ThrustAxisY_all" , "ThrustAxisZ_all" } );
+    do_dilepton = anySelected( { "DileptonMass" , "DileptonPt" , "DileptonSumPt" , "DileptondR" , "DileptondPhi" , "DileptondEta" } );
+    do_lepbb    = anySelected( { "dRlepbb_MindR" } );
+    for( PairHandles &ph : h_pairs ) {
+      ph.active = anySelected( { "M"+ph.tag , "Pt"+ph.tag , "PtSum"+ph.tag , "dR"+ph.tag , "dPhi"+ph.tag , "dEta"+ph.tag } );
+    }
+    for( TripletHandles &th : h_triplets ) th.active = anySelected( { "Mjjj_"+th.tag , "Ptjjj_"+th.tag } );
+    for( CollectionHandles &ch : h_collections ) {
+      ch.active = anySelected( { "Aplanarity_"+ch.tag , "Aplanority_"+ch.tag , "Sphericity_"+ch.tag , "Spherocity_"+ch.tag ,
+				 "SphericityT_"+ch.tag , "Planarity_"+ch.tag , "Variable_C_"+ch.tag , "Variable_D_"+ch.tag ,
+				 "Circularity_"+ch.tag , "PlanarFlow_"+ch.tag } );
+    }
+  }
 
-  void setupOutputTree( const TString &tname ) {
+  template< typename T >
+  void bookBranch( TTree *t , const TString &name , T *address ) {
+    if( selection.selects(name) ) t->Branch( name , address );
+  }
+
+  // Book an in-memory output tree with all of the (selected) branches we save
+  TTree* bookOutputTree( const TString &tname ) {
 
-    // Initilialize output TTree
     TTree *tmp_tree = new TTree( tname , tname );
     tmp_tree->SetDirectory( 0 );
     tmp_tree->Branch( "weight" , &weight );
-    tmp_tree->Branch( "ee" , &map_char["ee"] );
-    tmp_tree->Branch( "uu" , &map_char["uu"] );
-    tmp_tree->Branch( "eu" , &map_char["eu"] );
-    tmp_tree->Branch( "e" , &map_char["e"] );
-    tmp_tree->Branch( "u" , &map_char["u"] );
-
-    tmp_tree->Branch( "nJets" , &map_int["nJets"] );
-    tmp_tree->Branch( "good_nbtags_1" , &map_uint["good_nbtags_1"] );
-    tmp_tree->Branch( "good_nbtags_2" , &map_uint["good_nbtags_2"] );
-    tmp_tree->Branch( "good_nbtags_3" , &map_uint["good_nbtags_3"] );
-    tmp_tree->Branch( "good_nbtags_4" , &map_uint["good_nbtags_4"] );
-    tmp_tree->Branch( "good_nbtags_5" , &map_uint["good_nbtags_5"] );
-
-    tmp_tree->Branch( "pT_met" , &map_float["pT_met"] );
-    tmp_tree->Branch( "eta_met" , &map_float["eta_met"] );
-    tmp_tree->Branch( "phi_met" , &map_float["phi_met"] );
-
-    tmp_tree->Branch( "pT_lepton0" , &map_float["pT_lepton0"] );
-    tmp_tree->Branch( "eta_lepton0" , &map_float["eta_lepton0"] );
-    tmp_tree->Branch( "phi_lepton0" , &map_float["phi_lepton0"] );
-    tmp_tree->Branch( "flavor_lepton0" , &map_int["flavor_lepton0"] );
-    tmp_tree->Branch( "pT_lepton1" , &map_float["pT_lepton1"] );
-    tmp_tree->Branch( "eta_lepton1" , &map_float["eta_lepton1"] );
-    tmp_tree->Branch( "phi_lepton1" , &map_float["phi_lepton1"] );
-    tmp_tree->Branch( "flavor_lepton1" , &map_int["flavor_lepton1"] );
+    if( outputFormat==FeatureWriter::COLUMNAR ) tmp_tree->Branch( "Event" , &eventNumber );
+    bookBranch( tmp_tree , "ee" , &map_char["ee"] );
+    bookBranch( tmp_tree , "uu" , &map_char["uu"] );
+    bookBranch( tmp_tree , "eu" , &map_char["eu"] );
+    bookBranch( tmp_tree , "e" , &map_char["e"] );
+    bookBranch( tmp_tree , "u" , &map_char["u"] );
+
+    bookBranch( tmp_tree , "nJets" , &map_int["nJets"] );
+    bookBranch( tmp_tree , "good_nbtags_1" , &map_uint["good_nbtags_1"] );
+    bookBranch( tmp_tree , "good_nbtags_2" , &map_uint["good_nbtags_2"] );
+    bookBranch( tmp_tree , "good_nbtags_3" , &map_uint["good_nbtags_3"] );
+    bookBranch( tmp_tree , "good_nbtags_4" , &map_uint["good_nbtags_4"] );
+    bookBranch( tmp_tree , "good_nbtags_5" , &map_uint["good_nbtags_5"] );
+
+    bookBranch( tmp_tree , "pT_met" , &map_float["pT_met"] );
+    bookBranch( tmp_tree , "eta_met" , &map_float["eta_met"] );
+    bookBranch( tmp_tree , "phi_met" , &map_float["phi_met"] );
+
+    bookBranch( tmp_tree , "pT_lepton0" , &map_float["pT_lepton0"] );
+    bookBranch( tmp_tree , "eta_lepton0" , &map_float["eta_lepton0"] );
+    bookBranch( tmp_tree , "phi_lepton0" , &map_float["phi_lepton0"] );
+    bookBranch( tmp_tree , "flavor_lepton0" , &map_int["flavor_lepton0"] );
+    bookBranch( tmp_tree , "pT_lepton1" , &map_float["pT_lepton1"] );
+    bookBranch( tmp_tree , "eta_lepton1" , &map_float["eta_lepton1"] );
+    bookBranch( tmp_tree , "phi_lepton1" , &map_float["phi_lepton1"] );
+    bookBranch( tmp_tree , "flavor_lepton1" , &map_int["flavor_lepton1"] );
     
     for( Int_t ij = 0 ; ij < 10 ; ij++ ) {
       TString itag = TString::Format( "jet%i" , ij );
-      tmp_tree->Branch( "pT_"+itag , &map_float["pT_"+itag] );
-      tmp_tree->Branch( "eta_"+itag , &map_float["eta_"+itag] );
-      tmp_tree->Branch( "phi_"+itag , &map_float["phi_"+itag] );
-      tmp_tree->Branch( "M_"+itag , &map_float["M_"+itag] );
-      tmp_tree->Branch( "bTagLevel_"+itag , &map_int["bTagLevel_"+itag] );
+      bookBranch( tmp_tree , "pT_"+itag , &map_float["pT_"+itag] );
+      bookBranch( tmp_tree , "eta_"+itag , &map_float["eta_"+itag] );
+      bookBranch( tmp_tree , "phi_"+itag , &map_float["phi_"+itag] );
+      bookBranch( tmp_tree , "M_"+itag , &map_float["M_"+itag] );
+      bookBranch( tmp_tree , "bTagLevel_"+itag , &map_int["bTagLevel_"+itag] );
     }
 
     // Begin high-level observables
     
-    tmp_tree->Branch( "nJetsAbovePt25" , &map_int["nJetsAbovePt25"] );
-    tmp_tree->Branch( "nJetsAbovePt30" , &map_int["nJetsAbovePt30"] );
-    tmp_tree->Branch( "nJetsAbovePt35" , &map_int["nJetsAbovePt35"] );
-    tmp_tree->Branch( "nJetsAbovePt40" , &map_int["nJetsAbovePt40"] );
+    bookBranch( tmp_tree , "nJetsAbovePt25" , &map_int["nJetsAbovePt25"] );
+    bookBranch( tmp_tree , "nJetsAbovePt30" , &map_int["nJetsAbovePt30"] );
+    bookBranch( tmp_tree , "nJetsAbovePt35" , &map_int["nJetsAbovePt35"] );
+    bookBranch( tmp_tree , "nJetsAbovePt40" , &map_int["nJetsAbovePt40"] );
 
     for( Int_t ij = 0 ; ij < 5 ; ij++ ) {
       TString itag = TString::Format( "jet%i" , ij );
-      tmp_tree->Branch( "pT_b"+itag , &map_float["pT_b"+itag] );
-      tmp_tree->Branch( "eta_b"+itag , &map_float["eta_b"+itag] );
-      tmp_tree->Branch( "phi_b"+itag , &map_float["phi_b"+itag] );
-      tmp_tree->Branch( "M_b"+itag , &map_float["M_b"+itag] );
-    }
-
-    tmp_tree->Branch( "HT_all" , &map_float["HT_all"] );
-    tmp_tree->Branch( "HT_had" , &map_float["HT_had"] );
-    tmp_tree->Branch( "Centrality" , &map_float["Centrality"] );
-    tmp_tree->Branch( "NHiggs_30" , &map_float["NHiggs_30"] );
-    tmp_tree->Branch( "MHiggs" , &map_float["MHiggs"] );
-
-    tmp_tree->Branch( "H1_all" , &map_float["H1_all"] );
-    tmp_tree->Branch( "H2_all" , &map_float["H2_all"] );
-    tmp_tree->Branch( "H3_all" , &map_float["H3_all"] );
-    tmp_tree->Branch( "H4_all" , &map_float["H4_all"] );
-    tmp_tree->Branch( "H5_all" , &map_float["H5_all"] );
-    tmp_tree->Branch( "H1transverse_all" , &map_float["H1transverse_all"] );
-    tmp_tree->Branch( "H2transverse_all" , &map_float["H2transverse_all"] );
-    tmp_tree->Branch( "H3transverse_all" , &map_float["H3transverse_all"] );
-    tmp_tree->Branch( "H4transverse_all" , &map_float["H4transverse_all"] );
-    tmp_tree->Branch( "H5transverse_all" , &map_float["H5transverse_all"] );
-
-    tmp_tree->Branch( "Thrust_all" , &map_float["Thrust_all"] );
-    tmp_tree->Branch( "ThrustAxisX_all" , &map_float["ThrustAxisX_all"] );
-    tmp_tree->Branch( "ThrustAxisY_all" , &map_float["ThrustAxisY_all"] );
-    tmp_tree->Branch( "ThrustAxisZ_all" , &map_float["ThrustAxisZ_all"] );
+      bookBranch( tmp_tree , "pT_b"+itag , &map_float["pT_b"+itag] );
+      bookBranch( tmp_tree , "eta_b"+itag , &map_float["eta_b"+itag] );
+      bookBranch( tmp_tree , "phi_b"+itag , &map_float["phi_b"+itag] );
+      bookBranch( tmp_tree , "M_b"+itag , &map_float["M_b"+itag] );
+    }
+
+    bookBranch( tmp_tree , "HT_all" , &map_float["HT_all"] );
+    bookBranch( tmp_tree , "HT_had" , &map_float["HT_had"] );
+    bookBranch( tmp_tree , "Centrality" , &map_float["Centrality"] );
+    bookBranch( tmp_tree , "NHiggs_30" , &map_float["NHiggs_30"] );
+    bookBranch( tmp_tree , "MHiggs" , &map_float["MHiggs"] );
+
+    bookBranch( tmp_tree , "H1_all" , &map_float["H1_all"] );
+    bookBranch( tmp_tree , "H2_all" , &map_float["H2_all"] );
+    bookBranch( tmp_tree , "H3_all" , &map_float["H3_all"] );
+    bookBranch( tmp_tree , "H4_all" , &map_float["H4_all"] );
+    bookBranch( tmp_tree , "H5_all" , &map_float["H5_all"] );
+    bookBranch( tmp_tree , "H1transverse_all" , &map_float["H1transverse_all"] );
+    bookBranch( tmp_tree , "H2transverse_all" , &map_float["H2transverse_all"] );
+    bookBranch( tmp_tree , "H3transverse_all" , &map_float["H3transverse_all"] );
+    bookBranch( tmp_tree , "H4transverse_all" , &map_float["H4transverse_all"] );
+    bookBranch( tmp_tree , "H5transverse_all" , &map_float["H5transverse_all"] );
+
+    bookBranch( tmp_tree , "Thrust_all" , &map_float["Thrust_all"] );
+    bookBranch( tmp_tree , "ThrustAxisX_all" , &map_float["ThrustAxisX_all"] );
+    bookBranch( tmp_tree , "ThrustAxisY_all" , &map_float["ThrustAxisY_all"] );
+    bookBranch( tmp_tree , "ThrustAxisZ_all" , &map_float["ThrustAxisZ_all"] );
     
     for( variableIter iv = mva_variable_names.begin() , fv = mva_variable_names.end() ; iv != fv ; ++iv ) {
       for( pairingIter ip = mva_pairing_names.begin() , fp = mva_pairing_names.end() ; ip != fp ; ++ip ) {
 	TString itag = ip->second + "_" + iv->second;
-	tmp_tree->Branch( "M"+itag , &map_float["M"+itag] );
-	tmp_tree->Branch( "Pt"+itag , &map_float["Pt"+itag] );
-	tmp_tree->Branch( "PtSum"+itag , &map_float["PtSum"+itag] );
-	tmp_tree->Branch( "dR"+itag , &map_float["dR"+itag] );
-	tmp_tree->Branch( "dPhi"+itag , &map_float["dPhi"+itag] );
-	tmp_tree->Branch( "dEta"+itag , &map_float["dEta"+itag] );
+	bookBranch( tmp_tree , "M"+itag , &map_float["M"+itag] );
+	bookBranch( tmp_tree , "Pt"+itag , &map_float["Pt"+itag] );
+	bookBranch( tmp_tree , "PtSum"+itag , &map_float["PtSum"+itag] );
+	bookBranch( tmp_tree , "dR"+itag , &map_float["dR"+itag] );
+	bookBranch( tmp_tree , "dPhi"+itag , &map_float["dPhi"+itag] );
+	bookBranch( tmp_tree , "dEta"+itag , &map_float["dEta"+itag] );
       }
-      tmp_tree->Branch( "Mjjj_"+iv->second , &map_float["Mjjj_"+iv->second] );
-      tmp_tree->Branch( "Ptjjj_"+iv->second , &map_float["Ptjjj_"+iv->second] );
+      bookBranch( tmp_tree , "Mjjj_"+iv->second , &map_float["Mjjj_"+iv->second] );
+      bookBranch( tmp_tree , "Ptjjj_"+iv->second , &map_float["Ptjjj_"+iv->second] );
     }
     
-    tmp_tree->Branch( "DileptonMass" , &map_float["DileptonMass"] );
-    tmp_tree->Branch( "DileptonPt" , &map_float["DileptonPt"] );
-    tmp_tree->Branch( "DileptonSumPt" , &map_float["DileptonSumPt"] );
-    tmp_tree->Branch( "DileptondR" , &map_float["DileptondR"] );
-    tmp_tree->Branch( "DileptondPhi" , &map_float["DileptondPhi"] );
-    tmp_tree->Branch( "DileptondEta" , &map_float["DileptondEta"] );
+    bookBranch( tmp_tree , "DileptonMass" , &map_float["DileptonMass"] );
+    bookBranch( tmp_tree , "DileptonPt" , &map_float["DileptonPt"] );
+    bookBranch( tmp_tree , "DileptonSumPt" , &map_float["DileptonSumPt"] );
+    bookBranch( tmp_tree , "DileptondR" , &map_float["DileptondR"] );
+    bookBranch( tmp_tree , "DileptondPhi" , &map_float["DileptondPhi"] );
+    bookBranch( tmp_tree , "DileptondEta" , &map_float["DileptondEta"] );
     
     for( collectionIter ic = mva_collection_names.begin() , fc = mva_collection_names.end() ; ic != fc ; ++ic ) {
-      tmp_tree->Branch( "Aplanarity_"+ic->second , &map_float["Aplanarity_"+ic->second] );
-      tmp_tree->Branch( "Aplanority_"+ic->second , &map_float["Aplanority_"+ic->second] );
-      tmp_tree->Branch( "Sphericity_"+ic->second , &map_float["Sphericity_"+ic->second] );
-      tmp_tree->Branch( "Spherocity_"+ic->second , &map_float["Spherocity_"+ic->second] );
-      tmp_tree->Branch( "SphericityT_"+ic->second , &map_float["SphericityT_"+ic->second] );
-      tmp_tree->Branch( "Planarity_"+ic->second , &map_float["Planarity_"+ic->second] );
-      tmp_tree->Branch( "Variable_C_"+ic->second , &map_float["Variable_C_"+ic->second] );
-      tmp_tree->Branch( "Variable_D_"+ic->second , &map_float["Variable_D_"+ic->second] );
-      tmp_tree->Branch( "Circularity_"+ic->second , &map_float["Circularity_"+ic->second] );
-      tmp_tree->Branch( "PlanarFlow_"+ic->second , &map_float["PlanarFlow_"+ic->second] );
+      bookBranch( tmp_tree , "Aplanarity_"+ic->second , &map_float["Aplanarity_"+ic->second] );
+      bookBranch( tmp_tree , "Aplanority_"+ic->second , &map_float["Aplanority_"+ic->second] );
+      bookBranch( tmp_tree , "Sphericity_"+ic->second , &map_float["Sphericity_"+ic->second] );
+      bookBranch( tmp_tree , "Spherocity_"+ic->second , &map_float["Spherocity_"+ic->second] );
+      bookBranch( tmp_tree , "SphericityT_"+ic->second , &map_float["SphericityT_"+ic->second] );
+      bookBranch( tmp_tree , "Planarity_"+ic->second , &map_float["Planarity_"+ic->second] );
+      bookBranch( tmp_tree , "Variable_C_"+ic->second , &map_float["Variable_C_"+ic->second] );
+      bookBranch( tmp_tree , "Variable_D_"+ic->second , &map_float["Variable_D_"+ic->second] );
+      bookBranch( tmp_tree , "Circularity_"+ic->second , &map_float["Circularity_"+ic->second] );
+      bookBranch( tmp_tree , "PlanarFlow_"+ic->second , &map_float["PlanarFlow_"+ic->second] );
     }
     
-    tmp_tree->Branch( "dRlepbb_MindR" , &map_float["dRlepbb_MindR"] );
-    
-    // Close existing csv file and initialize a new one to contain same output as tree
-    if( outputCsv ) outputCsv->close();
-    outputCsv = new std::ofstream( TString::Format("output/DelphesReader_%s_%u_%u_%u_%u_%s.csv",selectionTag.Data(),minNjets,minNbtags,totalSplits,splitId,tname.Data()).Data() );
-    (*outputCsv) << "Event";
-    TIter next = tmp_tree->GetListOfLeaves();
+    bookBranch( tmp_tree , "dRlepbb_MindR" , &map_float["dRlepbb_MindR"] );
+
+    return tmp_tree;
+  }
+
+
+public:
+
+  DelphesReader()
+    : TreeReader()
+    , cols( 0 )
+    , readMode( DelphesColumns::DIRECT )
+    , cacheBytes( 0 )
+    , selectionTag( "None" )
+    , minNjets( 0 )
+    , minNbtags( 0 )
+    , totalSplits( 0 )
+    , splitId( 0 )
+    , bt( 8675309 )
+    , indexDir( "none" )
+    , outputCsv( 0 )
+    , csvOut( 0 )
+    , csvTree( 0 )
+    , outputFormat( FeatureWriter::CSV )
+  {
+    registerBranches();
+    planCalculations();
+    h_selection = map_char.add( selectionTag );
+  }
+
+  ~DelphesReader() {
+    delete cols;
+    delete outputCsv;
+  }
+
+  void setSelectionTag( TString v ) { selectionTag = v; h_selection = map_char.add( v ); }
+  void setMinNjets( UInt_t v ) { minNjets = v; }
+  void setMinNbtags( UInt_t v ) { minNbtags = v; }
+  void setTotalSplits( UInt_t v ) { totalSplits = v; }
+  void setSplitId( UInt_t v ) { splitId = v; }
+  void setOutputFormat( FeatureWriter::Format v ) { outputFormat = v; }
+  void setIndexDir( TString v ) { indexDir = v; }
+  void setReadMode( DelphesColumns::Mode v ) { readMode = v; }
+  void setCacheBytes( Long64_t v ) { cacheBytes = v; }
+
+  // Only write (and as far as possible only calculate) the selected branches of the output trees
+  void selectFeatures( FeatureSelection &sel ) {
+    // Everything we know how to write, for the bookkeeping of which names were used
+    selection = FeatureSelection();
+    TTree *all = bookOutputTree( "all" );
+    TIter next = all->GetListOfLeaves();
     TLeaf *leaf = 0;
-    while( (leaf = (TLeaf*)next()) ) {
-      TString leaftype = leaf->GetTypeName();
-      if( leaftype.BeginsWith("vector") ) continue;
-      //TString leafname ( leaf->GetName() );
-      (*outputCsv) << "," << leaf->GetName();
-    }
-    (*outputCsv) << std::endl;
-    
+    while( (leaf = (TLeaf*)next()) ) sel.use( leaf->GetName() );
+    delete all;
+    selection = sel;
+    planCalculations();
+  }
+
+  TreeReader* clone() const {
+    DelphesReader *c = new DelphesReader();
+    c->setSelectionTag( selectionTag );
+    c->setMinNjets( minNjets );
+    c->setMinNbtags( minNbtags );
+    c->setTotalSplits( totalSplits );
+    c->setSplitId( splitId );
+    c->setSignalMode( signalMode );
+    c->setOutputFormat( outputFormat );
+    c->setIndexDir( indexDir );
+    c->setReadMode( readMode );
+    c->setCacheBytes( cacheBytes );
+    c->selection = selection;
+    c->planCalculations();
+    return c;
+  }
+
+  // The b-tagging random numbers are counted by the file's name and directory rather than its
+  // index, which depends on how the job was split
+  void beginInputFile( const std::size_t & ) {
+    bt.beginInputFile( inputFileName );
+    loadIndex();
+  }
+
+  // The columns reset the branch addresses of the tree when they go, which has to happen
+  // before the tree is deleted
+  void endInputFile() {
+    std::lock_guard<std::mutex> lock( ptools::rootMutex() );
+    delete cols;
+    cols = 0;
+  }
+
+  void setupOutputTree( const TString &tname ) {
+
+    // Initilialize output TTree
+    TTree *tmp_tree = bookOutputTree( tname );
     outputTrees.push_back( tmp_tree );
+    bt.setSample( tname );
+    csvTree = 0;
+    if( outputFormat!=FeatureWriter::CSV ) return;
+
+    // Close existing csv file and initialize a new one to contain same output as tree
+    if( ! outputCsv ) outputCsv = new CsvWriter();
+    outputCsv->open( TString::Format("output/DelphesReader_%s_%u_%u_%u_%u_%s.csv",selectionTag.Data(),minNjets,minNbtags,totalSplits,splitId,tname.Data()) , kTRUE );
+    csvOut = outputCsv;
+    outputCsv->putString( "Event" );
+    const std::vector< std::pair<TLeaf*,CsvKind> > &leaves = getCsvLeaves( tmp_tree );
+    for( std::size_t i = 0 ; i < leaves.size() ; i++ ) {
+      outputCsv->putSeparator();
+      outputCsv->putString( leaves[i].first->GetName() );
+    }
+    outputCsv->endRow();
   }
 
   void fillOutputTree( const std::size_t &ifile , const Long64_t &ievent , const Double_t &w ) {
 
     weight = w;
+    eventNumber = (Long64_t(ifile) * Long64_t(27000)) + ievent;
     outputTrees.back()->Fill();
-
-    (*outputCsv) << (Long64_t(ifile) * Long64_t(27000)) + ievent;
-    TIter next = outputTrees.back()->GetListOfLeaves();
-    TLeaf *leaf = 0;
-    while( (leaf = (TLeaf*)next()) ) {
-      TString leaftype = leaf->GetTypeName();
-      if( leaftype.BeginsWith("vector") ) continue;
-      //std::cout << leaf->GetName() << " = " << leaf->GetValue() << std::endl;
-      (*outputCsv) << "," << leaf->GetValue();
+    if( ! csvOut ) return;
+
+    csvOut->putInt( eventNumber );
+    const std::vector< std::pair<TLeaf*,CsvKind> > &leaves = getCsvLeaves( outputTrees.back() );
+    for( std::size_t i = 0 ; i < leaves.size() ; i++ ) {
+      csvOut->putSeparator();
+      const Double_t v = leaves[i].first->GetValue();
+      switch( leaves[i].second ) {
+      case CSV_DOUBLE : csvOut->putDouble( v ); break;
+      case CSV_FLOAT  : csvOut->putFloat( v ); break;
+      case CSV_INT    : csvOut->putInt( Long64_t(v) ); break;
+      }
     }
-    (*outputCsv) << std::endl;
+    csvOut->endRow();
 
     // FIXME
     //doTruthMatching();
     
   }
 
+  //
+  // Output chunks for the multi-threaded event loop. While a chunk is open, fillOutputTree
+  // writes into a private tree and csv buffer instead of the real output.
+  //
+  void beginOutputChunk( const TString &tname ) {
+    outputTrees.push_back( bookOutputTree(tname) );
+    bt.setSample( tname );
+    csvTree = 0;
+    csvOut = outputFormat==FeatureWriter::CSV ? new CsvWriter() : 0;
+  }
+
+  OutputChunk* endOutputChunk() {
+    OutputChunk *chunk = new OutputChunk();
+    chunk->tree = outputTrees.back();
+    if( csvOut ) csvOut->take( chunk->csv );
+    outputTrees.pop_back();
+    csvTree = 0;
+    delete csvOut;
+    csvOut = outputCsv;
+    return chunk;
+  }
+
+  void appendOutputChunk( OutputChunk *chunk ) {
+    // Read the chunk back through our own branch buffers and refill our tree from them
+    outputTrees.back()->CopyAddresses( chunk->tree );
+    for( Long64_t ientry = 0 ; ientry < chunk->tree->GetEntries() ; ++ientry ) {
+      chunk->tree->GetEntry( ientry );
+      outputTrees.back()->Fill();
+    }
+    if( outputCsv ) outputCsv->putRaw( chunk->csv );
+    delete chunk->tree;
+    delete chunk;
+  }
+
+  // Needs the Particle members in getLeaves(), which has none as there's no truth selection.
+  // Matching through the jets' particle references (Jet.Particles) would need the Delphes
+  // objects, which DelphesColumns doesn't make.
   void doTruthMatching() {
 
-    std::map<UInt_t,GenParticle*> mp;
+    const DelphesColumns::Particles &part = cols->part;
 
-    report::debug( "nParticles = %i" , br_part->GetEntriesFast() );
+    report::debug( "nParticles = %i" , part.n );
     
-    for( std::size_t ipart = 0 ; ipart < br_part->GetEntriesFast() ; ++ipart ) {
-      GenParticle *p = (GenParticle*) br_part->At(ipart);
-      report::debug( "Particle%-3i UniqueID = %-3i , Status = %-3i , PID = %-3i , M1 = %-3i , M2 = %-3i" , int(ipart) , int(p->GetUniqueID()) , p->Status , p->PID , p->M1 , p->M2 );
-      mp[ipart] = p;
+    for( Int_t ipart = 0 ; ipart < part.n ; ++ipart ) {
+      report::debug( "Particle%-3i Status = %-3i , PID = %-3i , M1 = %-3i , M2 = %-3i" , int(ipart) , part.status[ipart] , part.pid[ipart] , part.m1[ipart] , part.m2[ipart] );
     }
     
 
     assert( false );
     return;
     
-    for( std::size_t ijet = 0 ; ijet < good_jets_ids.size() ; ijet++ ) {
-
-      Jet *jet = (Jet*) br_jet->At(good_jets_ids[ijet]);
-      report::debug( "Jet[%i] NParticles=%i NConstituents=%i" , int(ijet) , jet->Particles.GetSize() , jet->Constituents.GetSize() );
-
-      /*
-      for( Int_t ipart = 0 ; ipart < jet->Particles.GetSize() ; ipart++ ) {
-	GenParticle *p = (GenParticle*) jet->Particles.At(ipart);
-	std::cout << "  Particle = " << p << std::endl;
-	// FAILS because not all particles are saved...
-	report::blank( "   GenParticle[%i] Status=%i PID=%i" , ipart , p->Status , p->PID );
-      }
-      */
-      
-    }
-
-    
   }
   
   void saveOutputTrees( const TString &fname ) {
@@ -400,7 +753,7 @@ public:
       delete fout;
     }
 
-    outputCsv->close();
+    if( outputCsv ) outputCsv->close();
     
     /* Old code to produce a single file with a different tree name for each process
     TFile *fout = new TFile( fname , "recreate" );
@@ -417,13 +770,7 @@ public:
   
   void setTree( TTree *_tree ) {
 
-    UInt_t fUniqueID[50];
-    _tree->SetBranchStatus( "Particle.fUniqueID" , 1 );
-    _tree->SetBranchAddress( "Particle.fUniqueID" , &fUniqueID );
-
-    _tree->GetEntry( 0 );
-    //std::cout << "fUniqueID[0]  = " << fUniqueID[0] << std::endl;
-    //std::cout << "fUniqueID[10] = " << fUniqueID[10] << std::endl;
+    inputFileName = _tree->GetCurrentFile() ? _tree->GetCurrentFile()->GetName() : _tree->GetName();
 
     /*
     TIter next = _tree->GetListOfLeaves();
@@ -438,148 +785,16 @@ public:
     */
     
 
-    ex = new ExRootTreeReader( _tree );
-
-    br_el   = ex->UseBranch( "Electron" );
-    br_mu   = ex->UseBranch( "Muon" );
-    br_jet  = ex->UseBranch( "Jet" );
-    br_met  = ex->UseBranch( "MissingET" );
-    br_part = ex->UseBranch( "Particle" );
-
-    // Observables for objects passing the object selection criteria
-    setBranch_uint( "good_nbtags_1" , kFALSE );
-    setBranch_uint( "good_nbtags_2" , kFALSE );
-    setBranch_uint( "good_nbtags_3" , kFALSE );
-    setBranch_uint( "good_nbtags_4" , kFALSE );
-    setBranch_uint( "good_nbtags_5" , kFALSE );
-    setBranch_vector_float( "good_jet_pt" , kFALSE );
-    setBranch_vector_float( "good_jet_eta" , kFALSE );
-    setBranch_vector_float( "good_jet_phi" , kFALSE );
-    setBranch_vector_float( "good_jet_mass" , kFALSE );
-    setBranch_vector_int( "good_jet_btag" , kFALSE );
-    setBranch_vector_int( "good_jet_flavor" , kFALSE );
-    setBranch_vector_float( "good_el_pt" , kFALSE );
-    setBranch_vector_float( "good_el_eta" , kFALSE );
-    setBranch_vector_float( "good_el_phi" , kFALSE );
-    setBranch_vector_float( "good_mu_pt" , kFALSE );
-    setBranch_vector_float( "good_mu_eta" , kFALSE );
-    setBranch_vector_float( "good_mu_phi" , kFALSE );
-
-    // Variables from MVAVariables tool
-    // Common
-    setBranch_int( "nJets" , kFALSE );
-    setBranch_int( "nLeptons" , kFALSE );
-    setBranch_int( "nJetsAbovePt25" , kFALSE );
-    setBranch_int( "nJetsAbovePt30" , kFALSE );
-    setBranch_int( "nJetsAbovePt35" , kFALSE );
-    setBranch_int( "nJetsAbovePt40" , kFALSE );
-    setBranch_float( "HT_all" , kFALSE );
-    setBranch_float( "HT_had" , kFALSE );
-    setBranch_float( "Centrality" , kFALSE );
-    setBranch_float( "MHiggs" , kFALSE );
-    setBranch_float( "NHiggs_30" , kFALSE );
-
-    // fox wolfram moments
-    setBranch_float( "H1_all" , kFALSE );
-    setBranch_float( "H2_all" , kFALSE );
-    setBranch_float( "H3_all" , kFALSE );
-    setBranch_float( "H4_all" , kFALSE );
-    setBranch_float( "H5_all" , kFALSE );
-    setBranch_float( "H1transverse_all" , kFALSE );
-    setBranch_float( "H2transverse_all" , kFALSE );
-    setBranch_float( "H3transverse_all" , kFALSE );
-    setBranch_float( "H4transverse_all" , kFALSE );
-    setBranch_float( "H5transverse_all" , kFALSE );
-
-    // Thrust
-    setBranch_float( "Thrust_all" , kFALSE );
-    setBranch_float( "ThrustAxisX_all" , kFALSE );
-    setBranch_float( "ThrustAxisY_all" , kFALSE );
-    setBranch_float( "ThrustAxisZ_all" , kFALSE );
-
-    // MET
-    setBranch_float( "pT_met" , kFALSE );
-    setBranch_float( "eta_met" , kFALSE );
-    setBranch_float( "phi_met" , kFALSE );
-    
-    // Jet kinematics
-    for( Int_t ij = 0 ; ij < 10 ; ij++ ) {
-      TString itag = TString::Format( "jet%i" , ij );
-      setBranch_float( "pT_"+itag , kFALSE );
-      setBranch_float( "eta_"+itag , kFALSE );
-      setBranch_float( "phi_"+itag , kFALSE );
-      setBranch_float( "M_"+itag , kFALSE );
-      setBranch_int( "bTagLevel_"+itag , kFALSE );
-    }
-
-    for( Int_t ij = 0 ; ij < 5 ; ij++ ) {
-      TString itag = TString::Format( "jet%i" , ij );
-      setBranch_float( "pT_b"+itag , kFALSE );
-      setBranch_float( "eta_b"+itag , kFALSE );
-      setBranch_float( "phi_b"+itag , kFALSE );
-      setBranch_float( "M_b"+itag , kFALSE );
-    }
-    
-    // Lepton kinematics
-    setBranch_float( "pT_lepton0" , kFALSE );
-    setBranch_float( "eta_lepton0" , kFALSE );
-    setBranch_float( "phi_lepton0" , kFALSE );
-    setBranch_int( "flavor_lepton0" , kFALSE );
-    setBranch_float( "pT_lepton1" , kFALSE );
-    setBranch_float( "eta_lepton1" , kFALSE );
-    setBranch_float( "phi_lepton1" , kFALSE );
-    setBranch_int( "flavor_lepton1" , kFALSE );
+    tree = _tree;
+    useBranches();
+    v_mayPass.clear();
 
-    // Two-object systems
-    for( variableIter iv = mva_variable_names.begin() , fv = mva_variable_names.end() ; iv != fv ; ++iv ) {
-      for( pairingIter ip = mva_pairing_names.begin() , fp = mva_pairing_names.end() ; ip != fp ; ++ip ) {
-	TString itag = ip->second + "_" + iv->second;
-	setBranch_float( "M"+itag , kFALSE );
-	setBranch_float( "Pt"+itag , kFALSE );
-	setBranch_float( "PtSum"+itag , kFALSE );
-	setBranch_float( "dR"+itag , kFALSE );
-	setBranch_float( "dPhi"+itag , kFALSE );
-	setBranch_float( "dEta"+itag , kFALSE );
-      }
-      setBranch_float( "Mjjj_"+iv->second , kFALSE );
-      setBranch_float( "Ptjjj_"+iv->second , kFALSE );
-    }
-
-    // DIL
-    setBranch_float( "DileptonMass" , kFALSE );
-    setBranch_float( "DileptonPt" , kFALSE );
-    setBranch_float( "DileptonSumPt" , kFALSE );
-    setBranch_float( "DileptondR" , kFALSE );
-    setBranch_float( "DileptondPhi" , kFALSE );
-    setBranch_float( "DileptondEta" , kFALSE );
-
-    // Collection features
-    for( collectionIter ic = mva_collection_names.begin() , fc = mva_collection_names.end() ; ic != fc ; ++ic ) {
-      setBranch_float( "Aplanarity_"+ic->second , kFALSE );
-      setBranch_float( "Aplanority_"+ic->second , kFALSE );
-      setBranch_float( "Sphericity_"+ic->second , kFALSE );
-      setBranch_float( "Spherocity_"+ic->second , kFALSE );
-      setBranch_float( "SphericityT_"+ic->second , kFALSE );
-      setBranch_float( "Planarity_"+ic->second , kFALSE );
-      setBranch_float( "Variable_C_"+ic->second , kFALSE );
-      setBranch_float( "Variable_D_"+ic->second , kFALSE );
-      setBranch_float( "Circularity_"+ic->second , kFALSE );
-      setBranch_float( "PlanarFlow_"+ic->second , kFALSE );
-    }
-
-    // L+jets
-    setBranch_float( "dRlepbb_MindR" , kFALSE );
-
-    // Lepton channels
-    setBranch_char( "noSel" , kFALSE );
-    setBranch_char( "ee" , kFALSE );
-    setBranch_char( "uu" , kFALSE );
-    setBranch_char( "eu" , kFALSE );
-    setBranch_char( "ll" , kFALSE );
-    setBranch_char( "e" , kFALSE );
-    setBranch_char( "u" , kFALSE );
-    setBranch_char( "l" , kFALSE );
-    setBranch_char( "combinedSel" , kFALSE );
+    static std::once_flag reported;
+    std::call_once( reported , [this]() {
+	Double_t active , all;
+	DelphesLeaves::getBytesPerEntry( tree , active , all );
+	report::info( "Reading %.1f of the %.1f kB per entry (uncompressed) of the Delphes branches" , active/1024 , all/1024 );
+      } );
 
   }
 
@@ -587,17 +802,30 @@ public:
   
   Bool_t getEntry( const Long64_t &ientry ) {
 
-    ex->ReadEntry( ientry );
+    // Entries that the index rules out aren't read at all
+    if( ! v_mayPass.empty() && ! v_mayPass[ientry] ) return kFALSE;
+
+    cols->readEntry( ientry );
+    bt.beginEvent( ientry );
 
     //report::debug( "ientry = %i" , ientry );
     //if( ientry > 100 ) assert( false );
     //return kFALSE;
 
-    map_uint["good_nbtags_1"] = 0;
-    map_uint["good_nbtags_2"] = 0;
-    map_uint["good_nbtags_3"] = 0;
-    map_uint["good_nbtags_4"] = 0;
-    map_uint["good_nbtags_5"] = 0;
+    for( Int_t i = 0 ; i < 5 ; i++ ) map_uint[h_nbtags[i]] = 0;
+
+    std::vector<float> *good_jet_pt     = map_vector_float[h_good_jet_pt];
+    std::vector<float> *good_jet_eta    = map_vector_float[h_good_jet_eta];
+    std::vector<float> *good_jet_phi    = map_vector_float[h_good_jet_phi];
+    std::vector<float> *good_jet_mass   = map_vector_float[h_good_jet_mass];
+    std::vector<int>   *good_jet_flavor = map_vector_int[h_good_jet_flavor];
+    std::vector<int>   *good_jet_btag   = map_vector_int[h_good_jet_btag];
+    std::vector<float> *good_el_pt      = map_vector_float[h_good_el_pt];
+    std::vector<float> *good_el_eta     = map_vector_float[h_good_el_eta];
+    std::vector<float> *good_el_phi     = map_vector_float[h_good_el_phi];
+    std::vector<float> *good_mu_pt      = map_vector_float[h_good_mu_pt];
+    std::vector<float> *good_mu_eta     = map_vector_float[h_good_mu_eta];
+    std::vector<float> *good_mu_phi     = map_vector_float[h_good_mu_phi];
 
     m_event.clear();
     good_jets.clear();
@@ -606,301 +834,288 @@ public:
     good_mu.clear();
     good_el_id.clear();
     good_mu_id.clear();
-    map_vector_float["good_jet_pt"]->clear();
-    map_vector_float["good_jet_eta"]->clear();
-    map_vector_float["good_jet_phi"]->clear();
-    map_vector_float["good_jet_mass"]->clear();
-    map_vector_int["good_jet_flavor"]->clear();
-    map_vector_int["good_jet_btag"]->clear();
-    map_vector_float["good_el_pt"]->clear();
-    map_vector_float["good_el_eta"]->clear();
-    map_vector_float["good_el_phi"]->clear();
-    map_vector_float["good_mu_pt"]->clear();
-    map_vector_float["good_mu_eta"]->clear();
-    map_vector_float["good_mu_phi"]->clear();
+    good_jet_pt->clear();
+    good_jet_eta->clear();
+    good_jet_phi->clear();
+    good_jet_mass->clear();
+    good_jet_flavor->clear();
+    good_jet_btag->clear();
+    good_el_pt->clear();
+    good_el_eta->clear();
+    good_el_phi->clear();
+    good_mu_pt->clear();
+    good_mu_eta->clear();
+    good_mu_phi->clear();
 
 
     //
-    // Jet selection
+    // Jet selection, b-tagging the selected jets all together
     //
-    for( std::size_t i = 0 ; i < br_jet->GetEntriesFast() ; ++i ) {
+    const DelphesColumns::Jets &jet = cols->jet;
+    jetBatch.clear();
+    for( Int_t i = 0 ; i < jet.n ; ++i ) {
+
+      if( ! passesObjectCuts( jet.pt[i] * GeV , jet.eta[i] ) ) continue;
 
-      Jet *jet = (Jet*) br_jet->At(i);
+      jetBatch.add( jet.pt[i]*GeV , jet.flavor[i] , i );
 
-      if( (jet->PT * GeV) < 20 ) continue;
-      if( TMath::Abs(jet->Eta) > 2.5 ) continue;
+    }
+    bt.tag( jetBatch );
+    for( std::size_t k = 0 ; k < jetBatch.size() ; k++ ) {
+
+      const Int_t i = jetBatch.index[k];
 
       TLorentzVector vjet;
-      vjet.SetPtEtaPhiM( jet->PT * MeV , jet->Eta , jet->Phi , jet->Mass * MeV );
-
-      map_vector_float["good_jet_pt"]->push_back( jet->PT * MeV );
-      map_vector_float["good_jet_eta"]->push_back( jet->Eta );
-      map_vector_float["good_jet_phi"]->push_back( jet->Phi );
-      map_vector_float["good_jet_mass"]->push_back( jet->Mass * MeV );
-      map_vector_int["good_jet_flavor"]->push_back( jet->Flavor );
-
-      Int_t tagLevel = getTagLevel( jet->PT*GeV , jet->Flavor );
-      map_vector_int["good_jet_btag"]->push_back( tagLevel );
-
-      if( tagLevel > 0 ) {
-	map_uint["good_nbtags_1"]++;
-	if( tagLevel > 1 ) {
-	  map_uint["good_nbtags_2"]++;
-	  if( tagLevel > 2 ) {
-	    map_uint["good_nbtags_3"]++;
-	    if( tagLevel > 3 ) {
-	      map_uint["good_nbtags_4"]++;
-	      if( tagLevel > 4 ) {
-		map_uint["good_nbtags_5"]++;
-	      }
-	    }
-	  }
-	}
-      }
+      vjet.SetPtEtaPhiM( jet.pt[i] * MeV , jet.eta[i] , jet.phi[i] , jet.mass[i] * MeV );
+
+      good_jet_pt->push_back( jet.pt[i] * MeV );
+      good_jet_eta->push_back( jet.eta[i] );
+      good_jet_phi->push_back( jet.phi[i] );
+      good_jet_mass->push_back( jet.mass[i] * MeV );
+      good_jet_flavor->push_back( jet.flavor[i] );
+
+      Int_t tagLevel = jetBatch.level[k];
+      good_jet_btag->push_back( tagLevel );
+
+      // good_nbtags_N counts the jets tagged at level N or tighter
+      for( Int_t itag = 0 ; itag < tagLevel && itag < 5 ; itag++ ) map_uint[h_nbtags[itag]]++;
       
       good_jets.push_back( vjet );
       good_jets_ids.push_back( i );
 
       /*jet->BTag*/
-      m_event.m_jets.push_back( new xAOD::Jet(vjet,tagLevel>0?10:-10,tagLevel) );
+      m_event.addJet( vjet , tagLevel>0?10:-10 , tagLevel );
 
     }
 
     if( good_jets.size() < minNjets ) return kFALSE;
-    if( map_uint["good_nbtags_1"] < minNbtags ) return kFALSE;
+    if( map_uint[h_nbtags[0]] < minNbtags ) return kFALSE;
 
     //
     // Electron selection
     //
-    for( std::size_t i = 0 ; i < br_el->GetEntriesFast() ; ++i ) {
-
-      Electron *el = (Electron*) br_el->At(i);
+    const DelphesColumns::Leptons &el = cols->el;
+    for( Int_t i = 0 ; i < el.n ; ++i ) {
 
-      if( (el->PT * GeV) < 20 ) continue;
-      if( TMath::Abs(el->Eta) > 2.5 ) continue;
+      if( ! passesObjectCuts( el.pt[i] * GeV , el.eta[i] ) ) continue;
 
       TLorentzVector vel;
-      vel.SetPtEtaPhiM( el->PT * MeV , el->Eta , el->Phi , 0.0 );
+      vel.SetPtEtaPhiM( el.pt[i] * MeV , el.eta[i] , el.phi[i] , 0.0 );
 
-      map_vector_float["good_el_pt"]->push_back( el->PT * MeV );
-      map_vector_float["good_el_eta"]->push_back( el->Eta );
-      map_vector_float["good_el_phi"]->push_back( el->Phi );
+      good_el_pt->push_back( el.pt[i] * MeV );
+      good_el_eta->push_back( el.eta[i] );
+      good_el_phi->push_back( el.phi[i] );
       good_el.push_back( vel );
       good_el_id.push_back( i );
 
-      m_event.m_electrons.push_back( new xAOD::Electron(vel) );
+      m_event.addElectron( vel );
 
     }
 
     //
     // Muon selection
     //
-    for( std::size_t i = 0 ; i < br_mu->GetEntriesFast() ; ++i ) {
+    const DelphesColumns::Leptons &mu = cols->mu;
+    for( Int_t i = 0 ; i < mu.n ; ++i ) {
 
-      Muon *mu = (Muon*) br_mu->At(i);
-
-      if( (mu->PT * GeV) < 20 ) continue;
-      if( TMath::Abs(mu->Eta) > 2.5 ) continue;
+      if( ! passesObjectCuts( mu.pt[i] * GeV , mu.eta[i] ) ) continue;
 
       TLorentzVector vmu;
-      vmu.SetPtEtaPhiM( mu->PT * MeV , mu->Eta , mu->Phi , 0.0 );
+      vmu.SetPtEtaPhiM( mu.pt[i] * MeV , mu.eta[i] , mu.phi[i] , 0.0 );
 
-      map_vector_float["good_mu_pt"]->push_back( mu->PT * MeV );
-      map_vector_float["good_mu_eta"]->push_back( mu->Eta );
-      map_vector_float["good_mu_phi"]->push_back( mu->Phi );
+      good_mu_pt->push_back( mu.pt[i] * MeV );
+      good_mu_eta->push_back( mu.eta[i] );
+      good_mu_phi->push_back( mu.phi[i] );
       good_mu.push_back( vmu );
       good_mu_id.push_back( i );
 
-      m_event.m_muons.push_back( new xAOD::Muon(vmu) );
+      m_event.addMuon( vmu );
 
     }
 
     // Channels
-    map_char["noSel"]	    = 1;
-    map_char["ee"]	    = good_el.size()==2 && good_mu.size()==0 ? 1 : 0;
-    map_char["uu"]	    = good_el.size()==0 && good_mu.size()==2 ? 1 : 0;
-    map_char["eu"]	    = good_el.size()==1 && good_mu.size()==1 ? 1 : 0;
-    map_char["ll"]	    = (good_el.size()+good_mu.size())==2 ? 1 : 0;
-    map_char["e"]	    = good_el.size()==1 && good_mu.size()==0 ? 1 : 0;
-    map_char["u"]	    = good_el.size()==0 && good_mu.size()==1 ? 1 : 0;
-    map_char["l"]	    = (good_el.size()+good_mu.size())==1 ? 1 : 0;
-    map_char["anyl"]        = (good_el.size()+good_mu.size())>0 ? 1 : 0;
-    map_char["dil"]         = map_char["ll"] && good_jets.size() >= 4 && map_uint["good_nbtags_1"] >= 3;
-    map_char["ljet"]        = map_char["l"] && good_jets.size() >= 6 && map_uint["good_nbtags_1"] >= 3;
-    map_char["combinedSel"] = map_char["dil"] || map_char["ljet"];
-    if( !map_char[selectionTag] ) return kFALSE;
+    setChannels( good_el.size() , good_mu.size() , good_jets.size() , map_uint[h_nbtags[0]] );
+    if( !map_char[h_selection] ) return kFALSE;
     
-    MissingET *met = (MissingET*) br_met->At(0);
-    m_event.m_met->setP4( met->MET * MeV , met->Eta , met->Phi , 0 );
-    map_float["pT_met"]	 = met->MET * MeV;
-    map_float["eta_met"] = met->Eta;
-    map_float["phi_met"] = met->Phi;
+    const DelphesColumns::MissingEt &met = cols->met;
+    m_event.m_met->setP4( met.met[0] * MeV , met.eta[0] , met.phi[0] , 0 );
+    map_float[h_pT_met]	 = met.met[0] * MeV;
+    map_float[h_eta_met] = met.eta[0];
+    map_float[h_phi_met] = met.phi[0];
 
     std::size_t nlep = good_el.size() + good_mu.size();
     std::size_t njet = good_jets.size();
 
-    map_int["nLeptons"] = nlep;
+    map_int[h_nLeptons] = nlep;
     
     //
     // Use MVAVariables to generate more training observables
     //
     
-    MVAVariables *m_mva = new MVAVariables();
-    m_mva->initialise( m_event );
+    // Made for every entry (on the stack, so without a heap allocation): initialise() isn't
+    // known to reset everything a previous entry left behind, so the instance isn't reused
+    MVAVariables mva;
+    mva.initialise( m_event );
 
     TLorentzVector vleadingLep;
-    const xAOD::IParticle *leadingLep = m_mva->getLeadingPtLepton();
+    const xAOD::IParticle *leadingLep = mva.getLeadingPtLepton();
     vleadingLep.SetPtEtaPhiE( leadingLep->pt() , leadingLep->eta() , leadingLep->phi() , leadingLep->e() );
-    PairedSystem *ps_lepbb_MindR = new PairedSystem( m_mva->getEntry(pairing::bb,variable::MindR) , vleadingLep );
     
     // Common
-    map_int["nJets"]	      = m_mva->nJets();
-
-    map_int["nJetsAbovePt25"] = m_mva->nJetsAbovePt(25);
-    map_int["nJetsAbovePt30"] = m_mva->nJetsAbovePt(30);
-    map_int["nJetsAbovePt35"] = m_mva->nJetsAbovePt(35);
-    map_int["nJetsAbovePt40"] = m_mva->nJetsAbovePt(40);
-    map_int["nBTags"]	      = m_mva->nbTag();
-    map_float["HT_all"]	      = m_mva->HT(collection::all);
-    map_float["HT_had"]	      = m_mva->HT(collection::jets);
-    map_float["Centrality"]   = m_mva->Centrality(collection::all);
-    map_float["MHiggs"]	      = m_mva->higgsCandidateMass();
-    map_float["NHiggs_30"]    = m_mva->nHiggsCandidatesMassWindow(pairing::bb,30);
+    map_int[h_nJets]	       = mva.nJets();
+
+    map_int[h_nJetsAbovePt[0]] = mva.nJetsAbovePt(25);
+    map_int[h_nJetsAbovePt[1]] = mva.nJetsAbovePt(30);
+    map_int[h_nJetsAbovePt[2]] = mva.nJetsAbovePt(35);
+    map_int[h_nJetsAbovePt[3]] = mva.nJetsAbovePt(40);
+    map_int[h_nBTags]	       = mva.nbTag();
+    map_float[h_HT_all]	       = mva.HT(collection::all);
+    map_float[h_HT_had]	       = mva.HT(collection::jets);
+    map_float[h_Centrality]    = mva.Centrality(collection::all);
+    map_float[h_MHiggs]	       = mva.higgsCandidateMass();
+    map_float[h_NHiggs_30]     = mva.nHiggsCandidatesMassWindow(pairing::bb,30);
     
 
     // Fox Wolfram Moments
-    map_float["H1_all"] = m_mva->FirstFoxWolframMoment(collection::all);
-    map_float["H2_all"] = m_mva->SecondFoxWolframMoment(collection::all);
-    map_float["H3_all"] = m_mva->ThirdFoxWolframMoment(collection::all);
-    map_float["H4_all"] = m_mva->FourthFoxWolframMoment(collection::all);
-    map_float["H5_all"] = m_mva->FifthFoxWolframMoment(collection::all);
-    map_float["H1transverse_all"] = m_mva->FirstFoxWolframTransverseMoment(collection::all);
-    map_float["H2transverse_all"] = m_mva->SecondFoxWolframTransverseMoment(collection::all);
-    map_float["H3transverse_all"] = m_mva->ThirdFoxWolframTransverseMoment(collection::all);
-    map_float["H4transverse_all"] = m_mva->FourthFoxWolframTransverseMoment(collection::all);
-    map_float["H5transverse_all"] = m_mva->FifthFoxWolframTransverseMoment(collection::all);
+    if( do_foxWolfram ) {
+      map_float[h_H_all[0]] = mva.FirstFoxWolframMoment(collection::all);
+      map_float[h_H_all[1]] = mva.SecondFoxWolframMoment(collection::all);
+      map_float[h_H_all[2]] = mva.ThirdFoxWolframMoment(collection::all);
+      map_float[h_H_all[3]] = mva.FourthFoxWolframMoment(collection::all);
+      map_float[h_H_all[4]] = mva.FifthFoxWolframMoment(collection::all);
+      map_float[h_Htransverse_all[0]] = mva.FirstFoxWolframTransverseMoment(collection::all);
+      map_float[h_Htransverse_all[1]] = mva.SecondFoxWolframTransverseMoment(collection::all);
+      map_float[h_Htransverse_all[2]] = mva.ThirdFoxWolframTransverseMoment(collection::all);
+      map_float[h_Htransverse_all[3]] = mva.FourthFoxWolframTransverseMoment(collection::all);
+      map_float[h_Htransverse_all[4]] = mva.FifthFoxWolframTransverseMoment(collection::all);
+    }
 
     // Thrust
-    map_float["Thrust_all"]	 = njet + nlep > 0 ? m_mva->getThrust(collection::all) : 0;
-    map_float["ThrustAxisX_all"] = njet + nlep > 0 ? m_mva->getThrustAxis(collection::all).X() : 0;
-    map_float["ThrustAxisY_all"] = njet + nlep > 0 ? m_mva->getThrustAxis(collection::all).Y() : 0;
-    map_float["ThrustAxisZ_all"] = njet + nlep > 0 ? m_mva->getThrustAxis(collection::all).Z() : 0;
+    if( do_thrust ) {
+      map_float[h_Thrust_all]	     = njet + nlep > 0 ? mva.getThrust(collection::all) : 0;
+      map_float[h_ThrustAxis_all[0]] = njet + nlep > 0 ? mva.getThrustAxis(collection::all).X() : 0;
+      map_float[h_ThrustAxis_all[1]] = njet + nlep > 0 ? mva.getThrustAxis(collection::all).Y() : 0;
+      map_float[h_ThrustAxis_all[2]] = njet + nlep > 0 ? mva.getThrustAxis(collection::all).Z() : 0;
+    }
 
     // Jet kinematics
     for( Int_t ij = 0 ; ij < 10 ; ij++ ) {
-      TString itag = TString::Format( "jet%i" , ij );
+      KinematicHandles &k = h_jet[ij];
       if( njet > ij ) {
-	map_float["pT_"+itag]	   = m_mva->getPtOrderedJet(ij)->pt();
-	map_float["eta_"+itag]	   = m_mva->getPtOrderedJet(ij)->eta();
-	map_float["phi_"+itag]	   = m_mva->getPtOrderedJet(ij)->phi();
-	map_float["M_"+itag]	   = m_mva->getPtOrderedJet(ij)->m();
-	map_int["bTagLevel_"+itag] = m_mva->getPtOrderedJet(ij)->getBTagLevel();
+	map_float[k.pt]	 = mva.getPtOrderedJet(ij)->pt();
+	map_float[k.eta] = mva.getPtOrderedJet(ij)->eta();
+	map_float[k.phi] = mva.getPtOrderedJet(ij)->phi();
+	map_float[k.m]	 = mva.getPtOrderedJet(ij)->m();
+	map_int[k.tag]	 = mva.getPtOrderedJet(ij)->getBTagLevel();
       } else {
-	map_float["pT_"+itag]	   = -1;
-	map_float["eta_"+itag]	   = -10;
-	map_float["phi_"+itag]	   = -5;
-	map_float["M_"+itag]	   = -1;
-	map_int["bTagLevel_"+itag] = -1;
+	map_float[k.pt]	 = -1;
+	map_float[k.eta] = -10;
+	map_float[k.phi] = -5;
+	map_float[k.m]	 = -1;
+	map_int[k.tag]	 = -1;
       }
     }
 
     for( Int_t ij = 0 ; ij < 5 ; ij++ ) {
-      TString itag = TString::Format( "jet%i" , ij );
-      if( map_uint["good_nbtags_1"] > ij ) {
-	map_float["pT_b"+itag]  = m_mva->getPtOrdered_bJet(ij)->pt();
-	map_float["eta_b"+itag] = m_mva->getPtOrdered_bJet(ij)->eta();
-	map_float["phi_b"+itag] = m_mva->getPtOrdered_bJet(ij)->phi();
-	map_float["M_b"+itag]   = m_mva->getPtOrdered_bJet(ij)->m();
+      KinematicHandles &k = h_bjet[ij];
+      if( map_uint[h_nbtags[0]] > ij ) {
+	map_float[k.pt]  = mva.getPtOrdered_bJet(ij)->pt();
+	map_float[k.eta] = mva.getPtOrdered_bJet(ij)->eta();
+	map_float[k.phi] = mva.getPtOrdered_bJet(ij)->phi();
+	map_float[k.m]   = mva.getPtOrdered_bJet(ij)->m();
       } else {
-	map_float["pT_b"+itag]  = -1;
-	map_float["eta_b"+itag] = -10;
-	map_float["phi_b"+itag] = -5;
-	map_float["M_b"+itag]   = -1;
+	map_float[k.pt]  = -1;
+	map_float[k.eta] = -10;
+	map_float[k.phi] = -5;
+	map_float[k.m]   = -1;
       }
     }
 
     // Lepton kinematics
     if( nlep > 0 ) {
-      map_float["pT_lepton0"]   = m_mva->getLeadingPtLepton()->pt();
-      map_float["eta_lepton0"]  = m_mva->getLeadingPtLepton()->eta();
-      map_float["phi_lepton0"]  = m_mva->getLeadingPtLepton()->phi();
-      map_int["flavor_lepton0"] = m_mva->getLeadingPtLepton()->flavor();
+      map_float[h_lepton[0].pt]  = mva.getLeadingPtLepton()->pt();
+      map_float[h_lepton[0].eta] = mva.getLeadingPtLepton()->eta();
+      map_float[h_lepton[0].phi] = mva.getLeadingPtLepton()->phi();
+      map_int[h_lepton[0].tag]   = mva.getLeadingPtLepton()->flavor();
     } else {
-      map_float["pT_lepton0"]   = -1;
-      map_float["eta_lepton0"]  = -10;
-      map_float["phi_lepton0"]  = -5;
-      map_int["flavor_lepton0"] = -1;
+      map_float[h_lepton[0].pt]  = -1;
+      map_float[h_lepton[0].eta] = -10;
+      map_float[h_lepton[0].phi] = -5;
+      map_int[h_lepton[0].tag]   = -1;
     }
 
     if( nlep > 1 ) {
-      map_float["pT_lepton1"]   = m_mva->getSubleadingPtLepton()->pt();
-      map_float["eta_lepton1"]  = m_mva->getSubleadingPtLepton()->eta();
-      map_float["phi_lepton1"]  = m_mva->getSubleadingPtLepton()->phi();
-      map_int["flavor_lepton1"] = m_mva->getSubleadingPtLepton()->flavor();
+      map_float[h_lepton[1].pt]  = mva.getSubleadingPtLepton()->pt();
+      map_float[h_lepton[1].eta] = mva.getSubleadingPtLepton()->eta();
+      map_float[h_lepton[1].phi] = mva.getSubleadingPtLepton()->phi();
+      map_int[h_lepton[1].tag]   = mva.getSubleadingPtLepton()->flavor();
     } else {
-      map_float["pT_lepton1"]   = -1;
-      map_float["eta_lepton1"]  = -10;
-      map_float["phi_lepton1"]  = -5;
-      map_int["flavor_lepton1"] = -1;
+      map_float[h_lepton[1].pt]  = -1;
+      map_float[h_lepton[1].eta] = -10;
+      map_float[h_lepton[1].phi] = -5;
+      map_int[h_lepton[1].tag]   = -1;
     }
     
     // Composite objects
-    for( variableIter iv = mva_variable_names.begin() , fv = mva_variable_names.end() ; iv != fv ; ++iv ) {
-      for( pairingIter ip = mva_pairing_names.begin() , fp = mva_pairing_names.end() ; ip != fp ; ++ip ) {
-	TString itag = ip->second + "_" + iv->second;
-	map_float["M"+itag] = m_mva->MassofPair( ip->first , iv->first );
-	map_float["Pt"+itag] = m_mva->PtofPair( ip->first , iv->first );
-	map_float["PtSum"+itag] = m_mva->PtSumofPair( ip->first , iv->first );
-	map_float["dR"+itag] = m_mva->deltaRofPair( ip->first , iv->first );
-	map_float["dPhi"+itag] = m_mva->deltaPhiofPair( ip->first , iv->first );
-	map_float["dEta"+itag] = m_mva->deltaEtaofPair( ip->first , iv->first );
-      }
-      map_float["Mjjj_"+iv->second] = m_mva->MassofJetTriplet( iv->first );
-      map_float["Ptjjj_"+iv->second] = m_mva->PtofJetTriplet( iv->first );
+    for( const PairHandles &ph : h_pairs ) {
+      if( ! ph.active ) continue;
+      map_float[ph.m]     = mva.MassofPair( ph.p , ph.v );
+      map_float[ph.pt]    = mva.PtofPair( ph.p , ph.v );
+      map_float[ph.ptsum] = mva.PtSumofPair( ph.p , ph.v );
+      map_float[ph.dr]    = mva.deltaRofPair( ph.p , ph.v );
+      map_float[ph.dphi]  = mva.deltaPhiofPair( ph.p , ph.v );
+      map_float[ph.deta]  = mva.deltaEtaofPair( ph.p , ph.v );
+    }
+    for( const TripletHandles &th : h_triplets ) {
+      if( ! th.active ) continue;
+      map_float[th.m]  = mva.MassofJetTriplet( th.v );
+      map_float[th.pt] = mva.PtofJetTriplet( th.v );
     }
 
     // DIL
-    if( nlep > 1 ) {
-      map_float["DileptonMass"]	 = m_mva->DileptonMass();
-      map_float["DileptonPt"]	 = m_mva->DileptonPt();
-      map_float["DileptonSumPt"] = m_mva->DileptonSumPt();
-      map_float["DileptondR"]	 = m_mva->DileptondR();
-      map_float["DileptondPhi"]	 = m_mva->DileptondPhi();
-      map_float["DileptondEta"]	 = m_mva->DileptondEta();
+    if( do_dilepton && nlep > 1 ) {
+      map_float[h_DileptonMass]	 = mva.DileptonMass();
+      map_float[h_DileptonPt]	 = mva.DileptonPt();
+      map_float[h_DileptonSumPt] = mva.DileptonSumPt();
+      map_float[h_DileptondR]	 = mva.DileptondR();
+      map_float[h_DileptondPhi]	 = mva.DileptondPhi();
+      map_float[h_DileptondEta]	 = mva.DileptondEta();
     } else {
-      map_float["DileptonMass"]	 = -1;
-      map_float["DileptonPt"]	 = -1;
-      map_float["DileptonSumPt"] = -1;
-      map_float["DileptondR"]	 = -1;
-      map_float["DileptondPhi"]	 = -5;
-      map_float["DileptondEta"]	 = -10;
+      map_float[h_DileptonMass]	 = -1;
+      map_float[h_DileptonPt]	 = -1;
+      map_float[h_DileptonSumPt] = -1;
+      map_float[h_DileptondR]	 = -1;
+      map_float[h_DileptondPhi]	 = -5;
+      map_float[h_DileptondEta]	 = -10;
     }
     
     // Collection features
-    for( collectionIter ic = mva_collection_names.begin() , fc = mva_collection_names.end() ; ic != fc ; ++ic ) {
-      map_float["Aplanarity_"+ic->second] = m_mva->Aplanarity( ic->first );
-      map_float["Aplanority_"+ic->second] = m_mva->Aplanority( ic->first );
-      map_float["Sphericity_"+ic->second] = m_mva->Sphericity( ic->first );
-      map_float["Spherocity_"+ic->second] = m_mva->Spherocity( ic->first );
-      map_float["SphericityT_"+ic->second] = m_mva->SphericityT( ic->first );
-      map_float["Planarity_"+ic->second] = m_mva->Planarity( ic->first );
-      map_float["Variable_C_"+ic->second] = m_mva->Variable_C( ic->first );
-      map_float["Variable_D_"+ic->second] = m_mva->Variable_D( ic->first );
-      map_float["Circularity_"+ic->second] = m_mva->Circularity( ic->first );
-      map_float["PlanarFlow_"+ic->second] = m_mva->PlanarFlow( ic->first );
+    for( const CollectionHandles &ch : h_collections ) {
+      if( ! ch.active ) continue;
+      map_float[ch.aplanarity]  = mva.Aplanarity( ch.c );
+      map_float[ch.aplanority]  = mva.Aplanority( ch.c );
+      map_float[ch.sphericity]  = mva.Sphericity( ch.c );
+      map_float[ch.spherocity]  = mva.Spherocity( ch.c );
+      map_float[ch.sphericityT] = mva.SphericityT( ch.c );
+      map_float[ch.planarity]   = mva.Planarity( ch.c );
+      map_float[ch.variableC]   = mva.Variable_C( ch.c );
+      map_float[ch.variableD]   = mva.Variable_D( ch.c );
+      map_float[ch.circularity] = mva.Circularity( ch.c );
+      map_float[ch.planarFlow]  = mva.PlanarFlow( ch.c );
     }
 
     // L+jets
-    map_float["dRlepbb_MindR"] = ps_lepbb_MindR->DeltaR();
+    if( do_lepbb ) {
+      PairedSystem ps_lepbb_MindR( mva.getEntry(pairing::bb,variable::MindR) , vleadingLep );
+      map_float[h_dRlepbb_MindR] = ps_lepbb_MindR.DeltaR();
+    }
     
-    delete ps_lepbb_MindR;
-    delete m_mva;
 
     return kTRUE;
   }
 
 
-  Bool_t passesSelection() { return map_char[selectionTag]; }
+  Bool_t passesSelection() { return map_char[h_selection]; }
 
 
   TString getSelectionTitle() {
@@ -5,6 +5,7 @@
 #include <string>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <assert.h>
 #include <vector>
 
 #include <TTree.h>
@@ -14,12 +15,12 @@
 
 #include "Report.h"
 #include "Particle.h"
+#include "TopEvent/ParticleArena.h"
 #include "TopDecay.h"
 #include "DelphesBtagger.h"
-
-// Delphes includes
-#include "classes/DelphesClasses.h"
-#include "external/ExRootAnalysis/ExRootTreeReader.h"
+#include "SkimEvent.h"
+#include "DelphesLeaves.h"
+#include "DelphesColumns.h"
 
 class DelphesRecoSelector
 {
@@ -31,6 +32,9 @@ private:
   Int_t minJets;
   Int_t maxJets;
   
+  // Owns all of the particles of the current event
+  ParticleArena<RecoParticle> arena;
+
   // vectors for keeping track of classified truth particles
   std::vector<RecoParticle*> v_all;
   std::vector<RecoParticle*> v_jets;
@@ -46,20 +50,20 @@ private:
   // neutrino z-momentum solution in the particular event
   Bool_t nuMomentumSolved;
   
-  // Readers for Delphes trees
-  ExRootTreeReader *ex;
-  TClonesArray *br_el;
-  TClonesArray *br_mu;
-  TClonesArray *br_jet;
-  TClonesArray *br_met;
+  // The Delphes collections of the current entry
+  const DelphesColumns *cols;
   DelphesBtagger *bt;
+  DelphesBtagger::Batch jetBatch;
+
+  // The selected objects of the current Delphes entry
+  SkimEvent record;
 
 private:
   // functions
 
   void cleanup() {
     // Remove all truth particle currently in the record
-    for( std::size_t i = 0 ; i < v_all.size() ; i++ ) delete v_all[i];
+    arena.reset();
     v_all.clear();
     v_jets.clear();
     v_ljets.clear();
@@ -72,23 +76,33 @@ private:
     nuMomentumSolved = kTRUE;
   }
 
+  static void checkSize( const char *what , const std::size_t &n , const Int_t &max ) {
+    if( n <= std::size_t(max) ) return;
+    report::error( "DelphesRecoSelector : more than %i selected %s in an event" , max , what );
+    assert( false );
+  }
+
 public:
 
-  DelphesRecoSelector( ExRootTreeReader* _ex , DelphesBtagger *_bt , Int_t _minJets = -1 , Int_t _maxJets = -1 )
-    : ex( _ex )
+  // The columns have to hold the members of requireLeaves(). Without them, the events can
+  // only come from processRecoRecord( const SkimEvent& ).
+  DelphesRecoSelector( const DelphesColumns* _cols , DelphesBtagger *_bt , Int_t _minJets = -1 , Int_t _maxJets = -1 )
+    : cols( _cols )
     , bt( _bt )
     , minJets( _minJets )
     , maxJets( _maxJets )
-  {
-    // Set up the Delphes reader branches
-    br_el  = ex->UseBranch( "Electron" );
-    br_mu  = ex->UseBranch( "Muon" );
-    br_jet = ex->UseBranch( "Jet" );
-    br_met = ex->UseBranch( "MissingET" );
-  }
+  {}
 
   ~DelphesRecoSelector() { cleanup(); }
 
+  // The members of the Delphes branches that processRecoRecord() reads
+  static void requireLeaves( DelphesLeaves &l ) {
+    l.add( "Jet" , { "PT" , "Eta" , "Phi" , "Mass" , "Flavor" } );
+    l.add( "Electron" , { "PT" , "Eta" , "Phi" } );
+    l.add( "Muon" , { "PT" , "Eta" , "Phi" } );
+    l.add( "MissingET" , { "MET" , "Phi" } );
+  }
+
 
   //
   // Basic return functions
@@ -118,14 +132,17 @@ public:
   }
 
   Bool_t getNuMomentumSolved() { return nuMomentumSolved; }
+
+  // The selected objects of the last entry read by processRecoRecord(), e.g. for a skim
+  const SkimEvent& getRecord() const { return record; }
   
-  std::vector<RecoParticle*> getAll() { return v_all; }
-  std::vector<RecoParticle*> getJets() { return v_jets; }
-  std::vector<RecoParticle*> getLJets() { return v_ljets; }
-  std::vector<RecoParticle*> getBJets() { return v_bjets; }
-  std::vector<RecoParticle*> getMu() { return v_mu; }
-  std::vector<RecoParticle*> getEl() { return v_el; }
-  std::vector<RecoParticle*> getLep() { return v_lep; }
+  const std::vector<RecoParticle*>& getAll() { return v_all; }
+  const std::vector<RecoParticle*>& getJets() { return v_jets; }
+  const std::vector<RecoParticle*>& getLJets() { return v_ljets; }
+  const std::vector<RecoParticle*>& getBJets() { return v_bjets; }
+  const std::vector<RecoParticle*>& getMu() { return v_mu; }
+  const std::vector<RecoParticle*>& getEl() { return v_el; }
+  const std::vector<RecoParticle*>& getLep() { return v_lep; }
 
   RecoParticle* getParticle( std::size_t i ) { return v_all[i]; }
   RecoParticle* getJet( std::size_t i ) { return v_jets[i]; }
@@ -165,27 +182,88 @@ public:
   //
   Bool_t processRecoRecord() {
 
-    // Load event number "iev" in the tree
-    //ex->ReadEntry( iev ); This is handled in DelphesTtbar.cpp
-    
-    // Make sure we clear vectors and reset indicators from previous event
-    cleanup();
+    // The entry is read (DelphesColumns::readEntry) by the caller
+    assert( cols );
 
     //
     // Loop over particles in the record and keep the ones that pass minimum energy/eta requirements
     //
 
-    // Jet selection
-    for( std::size_t i = 0 ; i < br_jet->GetEntriesFast() ; ++i ) {
+    // Jet selection. The selected jets are b-tagged all together.
+    const DelphesColumns::Jets &jet = cols->jet;
+    jetBatch.clear();
+    for( Int_t i = 0 ; i < jet.n ; ++i ) {
+
+      if( jet.pt[i] < 20 ) continue;
+      if( TMath::Abs(jet.eta[i]) > 2.5 ) continue;
+
+      jetBatch.add( jet.pt[i] , jet.flavor[i] , i );
+
+    }
+    bt->tag( jetBatch );
+    checkSize( "jets" , jetBatch.size() , SkimEvent::MAXJETS );
+    record.nJet = jetBatch.size();
+    for( std::size_t k = 0 ; k < jetBatch.size() ; k++ ) {
+      const Int_t i = jetBatch.index[k];
+      record.jetPt[k]     = jet.pt[i];
+      record.jetEta[k]    = jet.eta[i];
+      record.jetPhi[k]    = jet.phi[i];
+      record.jetM[k]      = jet.mass[i];
+      record.jetFlavor[k] = jet.flavor[i];
+      record.jetTag[k]    = jetBatch.level[k];
+    }
+
+    // Electron selection
+    const DelphesColumns::Leptons &el = cols->el;
+    record.nEl = 0;
+    for( Int_t i = 0 ; i < el.n ; ++i ) {
+
+      if( el.pt[i] < 20 ) continue;
+      if( TMath::Abs(el.eta[i]) > 2.5 ) continue;
+
+      checkSize( "electrons" , record.nEl+1 , SkimEvent::MAXLEPTONS );
+      record.elPt[record.nEl]  = el.pt[i];
+      record.elEta[record.nEl] = el.eta[i];
+      record.elPhi[record.nEl] = el.phi[i];
+      record.nEl++;
+
+    }
+
+    // Muon selection
+    const DelphesColumns::Leptons &mu = cols->mu;
+    record.nMu = 0;
+    for( Int_t i = 0 ; i < mu.n ; ++i ) {
+
+      if( mu.pt[i] < 20 ) continue;
+      if( TMath::Abs(mu.eta[i]) > 2.5 ) continue;
+
+      checkSize( "muons" , record.nMu+1 , SkimEvent::MAXLEPTONS );
+      record.muPt[record.nMu]  = mu.pt[i];
+      record.muEta[record.nMu] = mu.eta[i];
+      record.muPhi[record.nMu] = mu.phi[i];
+      record.nMu++;
+
+    }
+
+    // Load the MET
+    record.met    = cols->met.met[0];
+    record.metPhi = cols->met.phi[0];
+
+    return processRecoRecord( record );
+
+  }
+
+  // Same, from the selected objects of an entry (e.g. read back from a skim)
+  Bool_t processRecoRecord( const SkimEvent &ev ) {
 
-      Jet *jet = (Jet*) br_jet->At(i);
+    // Make sure we clear vectors and reset indicators from previous event
+    cleanup();
 
-      if( jet->PT < 20 ) continue;
-      if( TMath::Abs(jet->Eta) > 2.5 ) continue;
+    for( Int_t k = 0 ; k < ev.nJet ; k++ ) {
 
-      Int_t tagLevel = bt->getTagLevel( jet->PT , jet->Flavor );
+      Int_t tagLevel = ev.jetTag[k];
 
-      v_all.push_back( new RecoParticle( jet->PT , jet->Eta , jet->Phi , jet->Mass , RecoParticle::JET , tagLevel ) );
+      v_all.push_back( arena.make( ev.jetPt[k] , ev.jetEta[k] , ev.jetPhi[k] , ev.jetM[k] , RecoParticle::JET , tagLevel ) );
       v_jets.push_back( v_all.back() );
       if( tagLevel > 0 )
 	v_bjets.push_back( v_all.back() );
@@ -198,40 +276,22 @@ public:
     if( int(v_jets.size()) < minJets ) return kFALSE;
     if( int(v_jets.size()) > maxJets && maxJets > 0 ) return kFALSE;
     
-    // Electron selection
-    for( std::size_t i = 0 ; i < br_el->GetEntriesFast() ; ++i ) {
-
-      Electron *el = (Electron*) br_el->At(i);
-
-      if( el->PT < 20 ) continue;
-      if( TMath::Abs(el->Eta) > 2.5 ) continue;
-
-      v_all.push_back( new RecoParticle( el->PT , el->Eta , el->Phi , 0.0 , RecoParticle::EL ) );
+    for( Int_t i = 0 ; i < ev.nEl ; i++ ) {
+      v_all.push_back( arena.make( ev.elPt[i] , ev.elEta[i] , ev.elPhi[i] , 0.0 , RecoParticle::EL ) );
       v_el.push_back( v_all.back() );
       v_lep.push_back( v_all.back() );
-
     }
 
-    // Muon selection
-    for( std::size_t i = 0 ; i < br_mu->GetEntriesFast() ; ++i ) {
-
-      Muon *mu = (Muon*) br_mu->At(i);
-
-      if( mu->PT < 20 ) continue;
-      if( TMath::Abs(mu->Eta) > 2.5 ) continue;
-
-      v_all.push_back( new RecoParticle( mu->PT , mu->Eta , mu->Phi , 0.0 , RecoParticle::MU ) );
+    for( Int_t i = 0 ; i < ev.nMu ; i++ ) {
+      v_all.push_back( arena.make( ev.muPt[i] , ev.muEta[i] , ev.muPhi[i] , 0.0 , RecoParticle::MU ) );
       v_mu.push_back( v_all.back() );
       v_lep.push_back( v_all.back() );
-
     }
 
     // Cut on the number of leptons
     //if( v_lep.size() != 1 ) return kFALSE;
 
-    // Load the MET
-    MissingET *met = (MissingET*) br_met->At(0);
-    v_all.push_back( new RecoParticle( met->MET , 0.0 , met->Phi , 0.0 , RecoParticle::MET ) );
+    v_all.push_back( arena.make( ev.met , 0.0 , ev.metPhi , 0.0 , RecoParticle::MET ) );
     v_met.push_back( v_all.back() );
 
     // If this is a single lepton event, calculate the z momentum of the neutrino by fixing
@@ -274,8 +334,8 @@ public:
       Double_t eta1 = 0.5 * TMath::Log( (Ev1 + pvz1) / (Ev1 - pvz1) );
       Double_t eta2 = 0.5 * TMath::Log( (Ev2 + pvz2) / (Ev2 - pvz2) );
 
-      v_nu.push_back( new RecoParticle( v_met[0]->getPt() , eta1 , v_met[0]->getPhi() , 0.0 , RecoParticle::NU ) );
-      v_nu.push_back( new RecoParticle( v_met[0]->getPt() , eta2 , v_met[0]->getPhi() , 0.0 , RecoParticle::NU ) );
+      v_nu.push_back( arena.make( v_met[0]->getPt() , eta1 , v_met[0]->getPhi() , 0.0 , RecoParticle::NU ) );
+      v_nu.push_back( arena.make( v_met[0]->getPt() , eta2 , v_met[0]->getPhi() , 0.0 , RecoParticle::NU ) );
 
       //std::cout << std::endl;
       //report::debug( "mW = %g , El = %g , plx = %g , ply = %g , plz = %g , pvx = %g , pvy = %g  " , mW , El , plx , ply , plz , pvx , pvy );
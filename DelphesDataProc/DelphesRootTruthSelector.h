@@ -13,6 +13,7 @@
 
 #include "Report.h"
 #include "Particle.h"
+#include "TopEvent/ParticleArena.h"
 #include "TopDecay.h"
 
 class DelphesRootTruthSelector
@@ -21,6 +22,9 @@ class DelphesRootTruthSelector
 private:
   // variables
   
+  // Owns all of the particles of the current event
+  ParticleArena<TruthParticle> arena;
+
   // vectors for keeping track of classified truth particles
   std::vector<TruthParticle*> v_all;
   std::vector<TruthParticle*> v_jets;
@@ -54,7 +58,7 @@ private:
   void cleanup() {
 
     // Remove all truth particle currently in the record
-    for( std::size_t i = 0 ; i < v_all.size() ; i++ ) delete v_all[i];
+    arena.reset();
     v_all.clear();
     v_jets.clear();
     v_bjets.clear();
@@ -112,11 +116,11 @@ public:
   std::size_t getNmu() { return v_mu.size(); }
   std::size_t getNlep() { return v_el.size() + v_mu.size(); }
   
-  std::vector<TruthParticle*> getAll() { return v_all; }
-  std::vector<TruthParticle*> getJets() { return v_jets; }
-  std::vector<TruthParticle*> getBJets() { return v_bjets; }
-  std::vector<TruthParticle*> getMu() { return v_mu; }
-  std::vector<TruthParticle*> getEl() { return v_el; }
+  const std::vector<TruthParticle*>& getAll() { return v_all; }
+  const std::vector<TruthParticle*>& getJets() { return v_jets; }
+  const std::vector<TruthParticle*>& getBJets() { return v_bjets; }
+  const std::vector<TruthParticle*>& getMu() { return v_mu; }
+  const std::vector<TruthParticle*>& getEl() { return v_el; }
   
   //
   // Real nuts & bolts function used to process each event and
@@ -156,7 +160,7 @@ public:
       // prompt q from the t decay
       if( (pdg==5 || pdg==3 || pdg==1) && pdgm1==6 ) {
 	assert( decayt == topdecay::UNDEFINED );
-	v_all.push_back( new TruthParticle( pt , eta , phi , 0.0 , pdg , pdgm1 ) );
+	v_all.push_back( arena.make( pt , eta , phi , 0.0 , pdg , pdgm1 ) );
 	v_jets.push_back( v_all.back() );
 	if( pdg==5 ) v_bjets.push_back( v_all.back() );
 	decayt = pdg==5 ? topdecay::WB : topdecay::WLIGHT;
@@ -166,7 +170,7 @@ public:
       // prompt qbar from the tbar decay
       else if( (pdg==-5 || pdg==-3 || pdg==-1) && pdgm1==-6 ) {
 	assert( decaytbar == topdecay::UNDEFINED );
-	v_all.push_back( new TruthParticle( pt , eta , phi , 0.0 , pdg , pdgm1 ) );
+	v_all.push_back( arena.make( pt , eta , phi , 0.0 , pdg , pdgm1 ) );
 	v_jets.push_back( v_all.back() );
 	if( pdg==-5 ) v_bjets.push_back( v_all.back() );
 	decaytbar = pdg==-5 ? topdecay::WB : topdecay::WLIGHT;
@@ -183,7 +187,7 @@ public:
 	  else if( TMath::Abs(pdg) == 13 ) decayWp = topdecay::MUNU;
 	  else if( TMath::Abs(pdg) == 15 ) decayWp = topdecay::TAUNU;
 	  else assert( false );
-	  v_all.push_back( new TruthParticle( pt , eta , phi , 0.0 , pdg , pdgm1 ) );
+	  v_all.push_back( arena.make( pt , eta , phi , 0.0 , pdg , pdgm1 ) );
 	  if( decayWp == topdecay::JETS ) v_jets.push_back( v_all.back() );
 	  else if( decayWp == topdecay::ELNU ) v_el.push_back( v_all.back() );
 	  else if( decayWp == topdecay::MUNU ) v_mu.push_back( v_all.back() );
@@ -201,7 +205,7 @@ public:
 	  else if( TMath::Abs(pdg) == 13 ) decayWm = topdecay::MUNU;
 	  else if( TMath::Abs(pdg) == 15 ) decayWm = topdecay::TAUNU;
 	  else assert( false );
-	  v_all.push_back( new TruthParticle( pt , eta , phi , 0.0 , pdg , pdgm1 ) );
+	  v_all.push_back( arena.make( pt , eta , phi , 0.0 , pdg , pdgm1 ) );
 	  if( decayWm == topdecay::JETS ) v_jets.push_back( v_all.back() );
 	  else if( decayWm == topdecay::ELNU ) v_el.push_back( v_all.back() );
 	  else if( decayWm == topdecay::MUNU ) v_mu.push_back( v_all.back() );
@@ -0,0 +1,227 @@
+#ifndef _DELPHESSKIM_H_
+#define _DELPHESSKIM_H_
+
+#include <iostream>
+#include <assert.h>
+#include <mutex>
+
+#include "TFile.h"
+#include "TTree.h"
+#include "TNamed.h"
+#include "TString.h"
+#include "TSystem.h"
+
+#include "Report.h"
+#include "ParallelTools.h"
+#include "SkimEvent.h"
+#include "DelphesBtagger.h"
+#include "DelphesRecoSelector.h"
+#include "DelphesTruthSelector.h"
+#include "DelphesColumns.h"
+#include "DelphesPrefetcher.h"
+#include "SideFiles.h"
+
+
+class
+DelphesSkim
+{
+
+  //
+  // Compact copy of a Delphes file holding only what the reco and truth selectors take from
+  // it, one SkimEvent per Delphes entry (also the ones that fail any selection). Jobs that
+  // run from a skim skip decoding the Delphes branches, and read a small fraction of the
+  // bytes. A skim remembers the file it was made from (UUID and number of entries), the key
+  // of the b-tagger that tagged its jets, and the skim VERSION. isFresh() compares all of
+  // them, so stale skims get remade. The object cuts live in the selectors: bump VERSION
+  // when they change. Skims are written as side files (see SideFiles.h), so jobs can make
+  // and read them concurrently.
+  //
+
+public:
+
+  static const Int_t VERSION = 1;
+
+private:
+
+  TFile *file;
+  TTree *tree;
+  SkimEvent ev;
+
+  // Points the tree at ev, making the branches if the tree is being written
+  void setBranches( const Bool_t &write ) {
+    auto bind = [&]( const char *name , void *address , const char *leaflist ) {
+      if( write ) tree->Branch( name , address , leaflist );
+      else tree->SetBranchAddress( name , address );
+    };
+    bind( "entry"	   , &ev.entry		, "entry/L" );
+    bind( "nJet"	   , &ev.nJet		, "nJet/I" );
+    bind( "jetPt"	   , ev.jetPt		, "jetPt[nJet]/F" );
+    bind( "jetEta"	   , ev.jetEta		, "jetEta[nJet]/F" );
+    bind( "jetPhi"	   , ev.jetPhi		, "jetPhi[nJet]/F" );
+    bind( "jetM"	   , ev.jetM		, "jetM[nJet]/F" );
+    bind( "jetFlavor"	   , ev.jetFlavor	, "jetFlavor[nJet]/I" );
+    bind( "jetTag"	   , ev.jetTag		, "jetTag[nJet]/I" );
+    bind( "nEl"		   , &ev.nEl		, "nEl/I" );
+    bind( "elPt"	   , ev.elPt		, "elPt[nEl]/F" );
+    bind( "elEta"	   , ev.elEta		, "elEta[nEl]/F" );
+    bind( "elPhi"	   , ev.elPhi		, "elPhi[nEl]/F" );
+    bind( "nMu"		   , &ev.nMu		, "nMu/I" );
+    bind( "muPt"	   , ev.muPt		, "muPt[nMu]/F" );
+    bind( "muEta"	   , ev.muEta		, "muEta[nMu]/F" );
+    bind( "muPhi"	   , ev.muPhi		, "muPhi[nMu]/F" );
+    bind( "met"		   , &ev.met		, "met/F" );
+    bind( "metPhi"	   , &ev.metPhi		, "metPhi/F" );
+    bind( "decayT"	   , &ev.decayT		, "decayT/I" );
+    bind( "decayTbar"	   , &ev.decayTbar	, "decayTbar/I" );
+    bind( "decayWp"	   , &ev.decayWp	, "decayWp/I" );
+    bind( "decayWm"	   , &ev.decayWm	, "decayWm/I" );
+    bind( "nTruth"	   , &ev.nTruth		, "nTruth/I" );
+    bind( "truthPt"	   , ev.truthPt		, "truthPt[nTruth]/D" );
+    bind( "truthEta"	   , ev.truthEta	, "truthEta[nTruth]/F" );
+    bind( "truthPhi"	   , ev.truthPhi	, "truthPhi[nTruth]/F" );
+    bind( "truthPdg"	   , ev.truthPdg	, "truthPdg[nTruth]/I" );
+    bind( "truthParentPdg" , ev.truthParentPdg	, "truthParentPdg[nTruth]/I" );
+  }
+
+  static TTree* getDelphesTree( TFile *f , const TString &path ) {
+    TTree *t = ( f && ! f->IsZombie() ) ? (TTree*) f->Get( "Delphes" ) : 0;
+    if( ! t ) {
+      report::error( "DelphesSkim : no Delphes tree in %s" , path.Data() );
+      assert( false );
+    }
+    return t;
+  }
+
+  // What a skim of "source" made with "bt" has to remember
+  static TString getInfo( TFile *source , TTree *t , const DelphesBtagger &bt ) {
+    return TString::Format( "version=%i;uuid=%s;entries=%lld;btag=%s" , VERSION , source->GetUUID().AsString() ,
+			    t->GetEntries() , bt.getKeyString().Data() );
+  }
+
+  DelphesSkim( const DelphesSkim& );
+  DelphesSkim& operator=( const DelphesSkim& );
+
+public:
+
+  // Opens a skim for reading
+  DelphesSkim( const TString &path ) {
+    std::lock_guard<std::mutex> lock( ptools::rootMutex() );
+    file = TFile::Open( path );
+    tree = ( file && ! file->IsZombie() ) ? (TTree*) file->Get( "skim" ) : 0;
+    if( ! tree ) {
+      report::error( "DelphesSkim : could not read the skim %s" , path.Data() );
+      assert( false );
+    }
+    setBranches( kFALSE );
+  }
+
+  ~DelphesSkim() {
+    std::lock_guard<std::mutex> lock( ptools::rootMutex() );
+    delete file;
+  }
+
+  Long64_t getEntries() const { return tree->GetEntries(); }
+
+  const SkimEvent& getEntry( const Long64_t &i ) {
+    tree->GetEntry( i );
+    return ev;
+  }
+
+  // Where the skim of a Delphes file goes in directory "dir"
+  static TString getSkimPath( const TString &dir , const TString &sourcePath ) { return sidefile::getPath( dir , sourcePath , "skim" ); }
+
+  // True if the skim exists, is complete, and was made from this very source with this b-tagger
+  static Bool_t isFresh( const TString &skimPath , const TString &sourcePath , const DelphesBtagger &bt ) {
+    std::lock_guard<std::mutex> lock( ptools::rootMutex() );
+    if( gSystem->AccessPathName( skimPath ) ) return kFALSE;
+    TFile *f_skim = TFile::Open( skimPath );
+    TNamed *info = ( f_skim && ! f_skim->IsZombie() ) ? (TNamed*) f_skim->Get( "SkimInfo" ) : 0;
+    Bool_t fresh = kFALSE;
+    if( info ) {
+      TFile *f_src = TFile::Open( sourcePath );
+      fresh = getInfo( f_src , getDelphesTree( f_src , sourcePath ) , bt ) == TString( info->GetTitle() );
+      delete f_src;
+    }
+    delete f_skim;
+    return fresh;
+  }
+
+  // Runs the selectors over every entry of the Delphes file and writes what they took from it.
+  // It goes to a temporary file of this thread's, which only replaces skimPath once complete,
+  // and as nothing else touches that file the entries are filled without holding rootMutex.
+  // cacheBytes caps the TTreeCache of the source (see DelphesPrefetcher::configureCache).
+  static void make( const TString &sourcePath , const TString &skimPath , DelphesBtagger &bt ,
+		    const DelphesColumns::Mode &readMode = DelphesColumns::DIRECT , const Long64_t &cacheBytes = 0 ) {
+
+    const TString tmpPath = sidefile::getTempPath( skimPath );
+    TFile *f_src = 0 , *f_skim = 0;
+    TTree *t_src = 0;
+    DelphesColumns *cols = 0;
+    DelphesRecoSelector *rSel = 0;
+    DelphesTruthSelector *tSel = 0;
+    DelphesSkim *skim = 0;
+    {
+      std::lock_guard<std::mutex> lock( ptools::rootMutex() );
+      f_src = TFile::Open( sourcePath );
+      t_src = getDelphesTree( f_src , sourcePath );
+      DelphesLeaves leaves;
+      DelphesRecoSelector::requireLeaves( leaves );
+      DelphesTruthSelector::requireLeaves( leaves );
+      cols = new DelphesColumns( t_src , leaves , readMode );
+      DelphesPrefetcher::configureCache( t_src , cacheBytes );
+      rSel = new DelphesRecoSelector( cols , &bt );
+      tSel = new DelphesTruthSelector( cols );
+      f_skim = new TFile( tmpPath , "recreate" );
+      if( f_skim->IsZombie() ) {
+	report::error( "DelphesSkim : could not create %s" , tmpPath.Data() );
+	assert( false );
+      }
+      skim = new DelphesSkim();
+      skim->file = f_skim;
+      skim->tree = new TTree( "skim" , "skim" );
+      skim->tree->SetDirectory( f_skim );
+      skim->setBranches( kTRUE );
+    }
+    bt.beginInputFile( sourcePath );
+
+    SkimEvent &ev = skim->ev;
+    const Long64_t nev = t_src->GetEntries();
+    for( Long64_t iev = 0 ; iev < nev ; iev++ ) {
+      cols->readEntry( iev );
+      bt.beginEvent( iev );
+      rSel->processRecoRecord();
+      tSel->processTruthRecord();
+      ev = rSel->getRecord();
+      ev.setTruth( tSel->getRecord() );
+      ev.entry = iev;
+      skim->tree->Fill();
+    }
+
+    {
+      std::lock_guard<std::mutex> lock( ptools::rootMutex() );
+      f_skim->cd();
+      skim->tree->Write( "" , TObject::kOverwrite );
+      TNamed info( "SkimInfo" , getInfo( f_src , t_src , bt ) );
+      info.Write( "" , TObject::kOverwrite );
+      f_skim->Close();
+      delete f_skim;
+      skim->file = 0;
+      sidefile::commit( tmpPath , skimPath );
+      delete rSel;
+      delete tSel;
+      delete cols;
+      delete f_src;
+    }
+    delete skim;
+    report::info( "Skimmed %lld entries of %s into %s" , nev , sourcePath.Data() , skimPath.Data() );
+
+  }
+
+private:
+
+  DelphesSkim() : file( 0 ) , tree( 0 ) {}
+
+};
+
+
+#endif
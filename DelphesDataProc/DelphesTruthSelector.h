@@ -5,6 +5,7 @@
 #include <string>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <assert.h>
 #include <vector>
 
 #include <TTree.h>
@@ -13,11 +14,11 @@
 
 #include "Report.h"
 #include "Particle.h"
+#include "TopEvent/ParticleArena.h"
 #include "TopDecay.h"
-
-// Delphes includes
-#include "classes/DelphesClasses.h"
-#include "external/ExRootAnalysis/ExRootTreeReader.h"
+#include "SkimEvent.h"
+#include "DelphesLeaves.h"
+#include "DelphesColumns.h"
 
 class DelphesTruthSelector
 {
@@ -25,6 +26,9 @@ class DelphesTruthSelector
 private:
   // variables
   
+  // Owns all of the particles of the current event
+  ParticleArena<TruthParticle> arena;
+
   // vectors for keeping track of classified truth particles
   std::vector<TruthParticle*> v_all;
   std::vector<TruthParticle*> v_jets;
@@ -32,9 +36,8 @@ private:
   std::vector<TruthParticle*> v_el;
   std::vector<TruthParticle*> v_mu;
 
-  // Readers for the Delphes trees
-  ExRootTreeReader *ex;
-  TClonesArray *br_part;
+  // The Delphes collections of the current entry
+  const DelphesColumns *cols;
 
   // Variables to keep track of the most recent event looks in
   // terms of the decay chain
@@ -42,6 +45,9 @@ private:
   int decaytbar;
   int decayWp;
   int decayWm;
+
+  // The partons and decay codes of the current Delphes entry
+  SkimEvent record;
   
 private:
   // functions
@@ -49,7 +55,7 @@ private:
   void cleanup() {
 
     // Remove all truth particle currently in the record
-    for( std::size_t i = 0 ; i < v_all.size() ; i++ ) delete v_all[i];
+    arena.reset();
     v_all.clear();
     v_jets.clear();
     v_bjets.clear();
@@ -64,17 +70,31 @@ private:
 
   }
 
+  void addParton( const Double_t &pt , const Int_t &ipart , const int &pdgm1 ) {
+    assert( record.nTruth < SkimEvent::MAXTRUTH );
+    record.truthPt[record.nTruth]	 = pt;
+    record.truthEta[record.nTruth]	 = cols->part.eta[ipart];
+    record.truthPhi[record.nTruth]	 = cols->part.phi[ipart];
+    record.truthPdg[record.nTruth]	 = cols->part.pid[ipart];
+    record.truthParentPdg[record.nTruth] = pdgm1;
+    record.nTruth++;
+  }
+
 public:
 
-  DelphesTruthSelector( ExRootTreeReader* _ex )
-    : ex( _ex )
-  {
-    // Set up the Delphes reader branches
-    br_part = ex->UseBranch( "Particle" );
-  }
+  // The columns have to hold the members of requireLeaves(). Without them, the events can
+  // only come from processTruthRecord( const SkimEvent& ).
+  DelphesTruthSelector( const DelphesColumns* _cols )
+    : cols( _cols )
+  {}
 
   ~DelphesTruthSelector() { cleanup(); }
 
+  // The members of the Delphes branches that processTruthRecord() reads
+  static void requireLeaves( DelphesLeaves &l ) {
+    l.add( "Particle" , { "Status" , "M1" , "M2" , "PID" , "Px" , "Py" , "Eta" , "Phi" } );
+  }
+
   
   //
   // Basic return functions
@@ -84,6 +104,9 @@ public:
   int getDecayWp() { return decayWp; }
   int getDecayWm() { return decayWm; }
 
+  // The partons and decay codes of the last entry read by processTruthRecord(), e.g. for a skim
+  const SkimEvent& getRecord() const { return record; }
+
   std::size_t getN() { return v_all.size(); }
   std::size_t getNjets() { return v_jets.size(); }
   std::size_t getNbjets() { return v_bjets.size(); }
@@ -91,11 +114,11 @@ public:
   std::size_t getNmu() { return v_mu.size(); }
   std::size_t getNlep() { return v_el.size() + v_mu.size(); }
   
-  std::vector<TruthParticle*> getAll() { return v_all; }
-  std::vector<TruthParticle*> getJets() { return v_jets; }
-  std::vector<TruthParticle*> getBJets() { return v_bjets; }
-  std::vector<TruthParticle*> getMu() { return v_mu; }
-  std::vector<TruthParticle*> getEl() { return v_el; }
+  const std::vector<TruthParticle*>& getAll() { return v_all; }
+  const std::vector<TruthParticle*>& getJets() { return v_jets; }
+  const std::vector<TruthParticle*>& getBJets() { return v_bjets; }
+  const std::vector<TruthParticle*>& getMu() { return v_mu; }
+  const std::vector<TruthParticle*>& getEl() { return v_el; }
   
   //
   // Real nuts & bolts function used to process each event and
@@ -104,37 +127,36 @@ public:
   //
   Bool_t processTruthRecord() {
 
-    // ex->ReadEntry(iev) is already called in DelphesTtbar.cpp
+    // The entry is read (DelphesColumns::readEntry) by the caller
+    assert( cols );
+    const DelphesColumns::Particles &part = cols->part;
     
     // Make sure we clear vectors and reset indicators from previous event
     cleanup();
 
     // Loop over particles in the truth record that is in the input tree
-    for( std::size_t ipart = 0 ; ipart < br_part->GetEntriesFast() ; ipart++ ) {
+    record.nTruth = 0;
+    for( Int_t ipart = 0 ; ipart < part.n ; ipart++ ) {
 
-      GenParticle *p = (GenParticle*) br_part->At(ipart);
-      
       // Only look at particles with status indicating that they are prior to parton shower / hadronization
-      if( p->Status != 3 ) break;
+      if( part.status[ipart] != 3 ) break;
 
       // Only look at single mother particles, i.e. the top and W decay products
-      if( p->M1 <  0 ) continue;
-      if( p->M2 >= 0 ) continue;
+      if( part.m1[ipart] <  0 ) continue;
+      if( part.m2[ipart] >= 0 ) continue;
 
-      GenParticle *pm1 = (GenParticle*) br_part->At(p->M1);
+      const Int_t m1 = part.m1[ipart];
       
       // Variables for some useful information in the record
-      Double_t pt  = TMath::Sqrt( (p->Px*p->Px) + (p->Py*p->Py) );
-      int pdg	   = p->PID;
-      int pdgm1	   = pm1->PID;
+      Double_t pt  = TMath::Sqrt( (part.px[ipart]*part.px[ipart]) + (part.py[ipart]*part.py[ipart]) );
+      int pdg	   = part.pid[ipart];
+      int pdgm1	   = part.pid[m1];
 
       // Check if this is the...
       // prompt q from the t decay
       if( (pdg==5 || pdg==3 || pdg==1) && pdgm1==6 ) {
 	assert( decayt == topdecay::UNDEFINED );
-	v_all.push_back( new TruthParticle( pt , p->Eta , p->Phi , 0.0 , pdg , pdgm1 ) );
-	v_jets.push_back( v_all.back() );
-	if( pdg==5 ) v_bjets.push_back( v_all.back() );
+	addParton( pt , ipart , pdgm1 );
 	decayt = pdg==5 ? topdecay::WB : topdecay::WLIGHT;
       }
       
@@ -142,17 +164,14 @@ public:
       // prompt qbar from the tbar decay
       else if( (pdg==-5 || pdg==-3 || pdg==-1) && pdgm1==-6 ) {
 	assert( decaytbar == topdecay::UNDEFINED );
-	v_all.push_back( new TruthParticle( pt , p->Eta , p->Phi , 0.0 , pdg , pdgm1 ) );
-	v_jets.push_back( v_all.back() );
-	if( pdg==-5 ) v_bjets.push_back( v_all.back() );
+	addParton( pt , ipart , pdgm1 );
 	decaytbar = pdg==-5 ? topdecay::WB : topdecay::WLIGHT;
       }
 
       // Check if this is the...
       // lepton or jet coming from t-->W+
-      else if( pdgm1 == 24 && pm1->M1 >= 0 && pm1->M2 < 0 ) {
-	GenParticle *pm1m1 = (GenParticle*) br_part->At(pm1->M1);
-	if( pm1m1->PID == 6 ) {
+      else if( pdgm1 == 24 && part.m1[m1] >= 0 && part.m2[m1] < 0 ) {
+	if( part.pid[part.m1[m1]] == 6 ) {
 	  if( TMath::Abs(pdg) <= 6 ) decayWp = topdecay::JETS;
 	  // don't bother saving neutrinos
 	  else if( TMath::Abs(pdg) % 2 == 0 ) continue;
@@ -160,18 +179,14 @@ public:
 	  else if( TMath::Abs(pdg) == 13 ) decayWp = topdecay::MUNU;
 	  else if( TMath::Abs(pdg) == 15 ) decayWp = topdecay::TAUNU;
 	  else assert( false );
-	  v_all.push_back( new TruthParticle( pt , p->Eta , p->Phi , 0.0 , pdg , pdgm1 ) );
-	  if( decayWp == topdecay::JETS ) v_jets.push_back( v_all.back() );
-	  else if( decayWp == topdecay::ELNU ) v_el.push_back( v_all.back() );
-	  else if( decayWp == topdecay::MUNU ) v_mu.push_back( v_all.back() );
+	  addParton( pt , ipart , pdgm1 );
 	}
       }
 
       // Check if this is the....
       // lepton or jet coming from tbar-->W-
-      else if( pdgm1 == -24 && pm1->M1 >= 0 && pm1->M2 < 0 ) {
-	GenParticle *pm1m1 = (GenParticle*) br_part->At(pm1->M1);
-	if( pm1m1->PID == -6 ) {
+      else if( pdgm1 == -24 && part.m1[m1] >= 0 && part.m2[m1] < 0 ) {
+	if( part.pid[part.m1[m1]] == -6 ) {
 	  if( TMath::Abs(pdg) <= 6 ) decayWm = topdecay::JETS;
 	  // don't bother saving neutrinos
 	  else if( TMath::Abs(pdg) % 2 == 0 ) continue;
@@ -179,10 +194,7 @@ public:
 	  else if( TMath::Abs(pdg) == 13 ) decayWm = topdecay::MUNU;
 	  else if( TMath::Abs(pdg) == 15 ) decayWm = topdecay::TAUNU;
 	  else assert( false );
-	  v_all.push_back( new TruthParticle( pt , p->Eta , p->Phi , 0.0 , pdg , pdgm1 ) );
-	  if( decayWm == topdecay::JETS ) v_jets.push_back( v_all.back() );
-	  else if( decayWm == topdecay::ELNU ) v_el.push_back( v_all.back() );
-	  else if( decayWm == topdecay::MUNU ) v_mu.push_back( v_all.back() );
+	  addParton( pt , ipart , pdgm1 );
 	}
       }
 
@@ -198,13 +210,44 @@ public:
     if( decaytbar == topdecay::UNDEFINED ) { report::error( "Missing qbar from tbar decay" ); }
     assert( decayWp != topdecay::UNDEFINED );
     assert( decayWm != topdecay::UNDEFINED );
+
+    record.decayT    = decayt;
+    record.decayTbar = decaytbar;
+    record.decayWp   = decayWp;
+    record.decayWm   = decayWm;
+    return processTruthRecord( record );
+    
+  }
+
+  // Same, from the partons and decay codes of an entry (e.g. read back from a skim)
+  Bool_t processTruthRecord( const SkimEvent &ev ) {
+
+    cleanup();
+    decayt    = ev.decayT;
+    decaytbar = ev.decayTbar;
+    decayWp   = ev.decayWp;
+    decayWm   = ev.decayWm;
+
+    // The prompt quarks of the top decays are jets, and the W decay products jets, electrons
+    // or muons (or taus, kept in v_all only)
+    for( Int_t i = 0 ; i < ev.nTruth ; i++ ) {
+      const Int_t pdg = ev.truthPdg[i] , pdgm1 = ev.truthParentPdg[i];
+      v_all.push_back( arena.make( ev.truthPt[i] , ev.truthEta[i] , ev.truthPhi[i] , 0.0 , pdg , pdgm1 ) );
+      if( TMath::Abs(pdgm1) == 6 ) {
+	v_jets.push_back( v_all.back() );
+	if( TMath::Abs(pdg) == 5 ) v_bjets.push_back( v_all.back() );
+      }
+      else if( TMath::Abs(pdg) <= 6 ) v_jets.push_back( v_all.back() );
+      else if( TMath::Abs(pdg) == 11 ) v_el.push_back( v_all.back() );
+      else if( TMath::Abs(pdg) == 13 ) v_mu.push_back( v_all.back() );
+    }
     assert( v_el.size() <= 2 );
     assert( v_mu.size() <= 2 );
     assert( v_all.size() <= 6 );
 
     // Success!
     return kTRUE;
-    
+
   }
 
   
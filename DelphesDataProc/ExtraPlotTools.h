@@ -10,6 +10,7 @@
 #include <TList.h>
 #include <TKey.h>
 #include <TLegend.h>
+#include <TStopwatch.h>
 
 #include "Report.h"
 #include "HistTools.h"
@@ -18,6 +19,7 @@
 #include "TreeReader.h"
 #include "PhysicsProcess.h"
 #include "Config.h"
+#include "ParallelTools.h"
 
 
 namespace
@@ -69,9 +71,176 @@ plot
   static bool TH1DIntegralCompareGT( TH1D* lhs , TH1D *rhs ) { return lhs->Integral() > rhs->Integral(); }
 
 
+  // Extra per-event weights (on top of the xsec weight)
+  static Double_t getEventWeight( TreeReader *tr , const Bool_t &mcweights ) {
+    Double_t event_weight = 1.0;
+    if( mcweights ) {
+      event_weight *= (*tr)["weight_mc"] * (*tr)["weight_leptonSF"] * (*tr)["weight_bTagSF_77"];
+      if( config::UsePileupWeights )
+	event_weight *= (*tr)["weight_pileup"];
+    }
+    return event_weight;
+  }
+
+  // Leading lepton pT in GeV, squeezed into the range of the h_passing histograms
+  static Double_t getPassingPt( TreeReader *tr ) {
+    Double_t leadingLeptonPt = tr->leadingLeptonPt() * tth::GeV;
+    leadingLeptonPt = TMath::Min( 29.999 , leadingLeptonPt );
+    leadingLeptonPt = TMath::Max( 20.001 , leadingLeptonPt );
+    return leadingLeptonPt;
+  }
+
+
   //
-  // 
-  static std::map<TString,TH1D*> getTH1Dmap( const PhysicsProcess &proc , InputConfig *in , TreeReader *tr , std::vector<HistConfig1D> hconfigs , Bool_t mcweights ) {
+  // Everything a worker thread produces for one input file in fillFromFilesParallel
+  //
+  struct FileFills {
+    Long64_t nev;
+    Long64_t pev;
+    Double_t nevents; // generated events the file's entry range stands for
+    std::vector< std::pair<Double_t,Double_t> > passing; // (leading lepton pT, event weight)
+    std::vector< std::vector< std::pair<Double_t,Double_t> > > hists; // (x,w) fills for each hconfig
+    TreeReader::OutputChunk *chunk;
+    FileFills( const std::size_t &nhists ) : nev( 0 ) , pev( 0 ) , nevents( 0 ) , hists( nhists ) , chunk( 0 ) {}
+  };
+
+  //
+  // Multi-threaded version of the loop over input files in getTH1Dmap. The files are handed
+  // out to worker threads, each with its own clone of the TreeReader. Workers only record what
+  // they would have filled; the master replays the records file by file in the original
+  // order, so histograms, cutflow and output trees come out identical to the serial loop.
+  // Returns false (having done nothing) if the TreeReader can't be cloned.
+  //
+  static Bool_t fillFromFilesParallel( const PhysicsProcess &proc , TreeReader *tr , std::vector<HistConfig1D> &hconfigs , std::map<TString,TH1D*> &hmap ,
+				       TH1D *h_total , TH1D *h_passing , TH1D *h_passing_weighted , const Bool_t &mcweights , const UInt_t &nthreads ,
+				       Long64_t &nev_total , Long64_t &pev_total ) {
+
+    // Clone the readers up front, on this thread
+    std::vector<TreeReader*> workers;
+    for( UInt_t ithread = 0 ; ithread < nthreads ; ++ithread ) {
+      TreeReader *wtr = tr->clone();
+      if( !wtr ) break;
+      wtr->initCutflow();
+      workers.push_back( wtr );
+    }
+    if( workers.size() < nthreads ) {
+      report::warn( "TreeReader doesn't support clone(), falling back to the serial event loop" );
+      for( TreeReader *wtr : workers ) delete wtr;
+      return kFALSE;
+    }
+
+    // The workers only read the binning of these (for the _INCL histograms), which the master
+    // never changes while replaying fills, so they can be shared.
+    std::vector<TH1D*> hists;
+    std::vector<Bool_t> isWeight;
+    for( HistConfig1D hconfig : hconfigs ) {
+      hists.push_back( hmap[hconfig.xname] );
+      isWeight.push_back( hconfig.xname.Contains("weight_") );
+    }
+
+    ptools::OrderedResults<FileFills> results( proc.numSamples() , 2*nthreads );
+    
+    auto work = [&]( UInt_t ithread ) {
+      TreeReader *wtr = workers[ithread];
+      std::size_t ifile;
+      while( results.next(ifile) ) {
+
+	FileFills *res = new FileFills( hconfigs.size() );
+
+	TFile *f = 0;
+	TTree *tree_tmp = 0;
+	{
+	  std::lock_guard<std::mutex> lock( ptools::rootMutex() );
+	  tree_tmp = proc.openSampleTree( ifile , f );
+	  wtr->setTree( tree_tmp );
+	  wtr->beginOutputChunk( proc.getName() );
+	}
+	wtr->beginInputFile( ifile );
+
+	std::vector<TreeReader::VarHandle> vars;
+	for( HistConfig1D hconfig : hconfigs ) vars.push_back( wtr->getVarHandle(hconfig.xname) );
+
+	Double_t xsec_weight = proc.getSampleWeight(ifile);
+	const Long64_t first = proc.getSampleFirstEntry(ifile);
+	const Long64_t last  = proc.getSampleEntryEnd( ifile , tree_tmp->GetEntries() );
+	res->nev = TMath::Max( last - first , Long64_t(0) );
+	res->nevents = proc.getSampleNeventsInRange( ifile , tree_tmp->GetEntries() );
+	for( Long64_t iev = first ; iev < last ; iev++ ) {
+
+	  if( ! wtr->getEntry(iev) ) continue;
+	  if( ! wtr->passesSelection() ) continue;
+
+	  res->pev++;
+
+	  Double_t event_weight = getEventWeight( wtr , mcweights );
+	  res->passing.push_back( std::make_pair(getPassingPt(wtr),event_weight) );
+
+	  wtr->fillOutputTree( ifile , iev , xsec_weight * event_weight );
+
+	  for( std::size_t ih = 0 ; ih < hconfigs.size() ; ih++ ) {
+	    if( !mcweights && isWeight[ih] ) continue;
+	    wtr->fillHist( hists[ih] , vars[ih] , hconfigs[ih].xunits , isWeight[ih] ? xsec_weight : xsec_weight * event_weight , &res->hists[ih] );
+	  }
+
+	}
+	wtr->endInputFile();
+
+	{
+	  std::lock_guard<std::mutex> lock( ptools::rootMutex() );
+	  res->chunk = wtr->endOutputChunk();
+	  delete f;
+	}
+	results.put( ifile , res );
+      }
+    };
+
+    auto merge = [&]() {
+      report::startProgressBar( proc.getName() );
+      for( std::size_t ifile = 0 ; ifile < results.size() ; ifile++ ) {
+
+	FileFills *res = results.take( ifile );
+
+	h_total->SetBinContent( 1 , h_total->GetBinContent(1) + res->nevents );
+
+	Double_t xsec_weight = proc.getSampleWeight(ifile);
+	for( std::pair<Double_t,Double_t> &fill : res->passing ) {
+	  h_passing->Fill( fill.first , fill.second );
+	  h_passing_weighted->Fill( fill.first , fill.second * xsec_weight );
+	}
+	for( std::size_t ih = 0 ; ih < hists.size() ; ih++ ) {
+	  for( std::pair<Double_t,Double_t> &fill : res->hists[ih] ) hists[ih]->Fill( fill.first , fill.second );
+	}
+
+	{
+	  std::lock_guard<std::mutex> lock( ptools::rootMutex() );
+	  tr->appendOutputChunk( res->chunk );
+	}
+	
+	nev_total += res->nev;
+	pev_total += res->pev;
+	delete res;
+
+	report::updateProgressBar( Double_t(ifile+1) , Double_t(results.size()) , TString::Format(" ε=%0.3f",Double_t(pev_total)/Double_t(nev_total)) );
+      }
+    };
+
+    report::info( "Running event loop on %u threads" , nthreads );
+    ptools::run( nthreads , work , merge );
+
+    for( TreeReader *wtr : workers ) {
+      tr->mergeCutflow( wtr );
+      delete wtr;
+    }
+
+    return kTRUE;
+  }
+
+
+  //
+  // Fill the histograms in "hconfigs" for PhysicsProcess "proc". With nthreads != 1 the input
+  // files are processed in parallel (0 means one thread per core), see fillFromFilesParallel.
+  //
+  static std::map<TString,TH1D*> getTH1Dmap( const PhysicsProcess &proc , InputConfig *in , TreeReader *tr , std::vector<HistConfig1D> hconfigs , Bool_t mcweights , UInt_t nthreads = 1 ) {
 
     report::info( "Filling histograms for process %s" , proc.getName().Data() );
     
@@ -93,25 +262,48 @@ plot
     
     Long64_t nev_total = 0;
     Long64_t pev_total = 0;
+
+    std::vector<TH1D*> hists;
+    std::vector<Bool_t> isWeight;
+    for( HistConfig1D hconfig : hconfigs ) {
+      hists.push_back( hmap[hconfig.xname] );
+      isWeight.push_back( hconfig.xname.Contains("weight_") );
+    }
+
+    // Measures the processing cost of an entry of this process, for JobSplitter
+    TStopwatch sw;
+    sw.Start();
+
+    nthreads = ptools::numThreads( nthreads );
+    nthreads = TMath::Min( nthreads , UInt_t(proc.numSamples()) );
+    Bool_t doneParallel = nthreads > 1 && fillFromFilesParallel( proc , tr , hconfigs , hmap , h_total , h_passing , h_passing_weighted , mcweights , nthreads , nev_total , pev_total );
     
     // Loop over the input ROOT files corresponding to this process
-    for( size_t ifile = 0 ; ifile < proc.numSamples() ; ifile++ ) {
+    for( size_t ifile = 0 ; !doneParallel && ifile < proc.numSamples() ; ifile++ ) {
       
       // load Tree for this sample
       TTree *tree_tmp = proc.getSampleTree(ifile);
       tr->setTree( tree_tmp );
+      tr->beginInputFile( ifile );
+
+      // Resolve the histogram variables once per file rather than by name in every event
+      std::vector<TreeReader::VarHandle> vars;
+      for( HistConfig1D hconfig : hconfigs ) vars.push_back( tr->getVarHandle(hconfig.xname) );
 
-      h_total->SetBinContent( 1 , h_total->GetBinContent(1) + proc.getSampleNevents(ifile) );
+      // Only the share of the file's events that this job reads
+      h_total->SetBinContent( 1 , h_total->GetBinContent(1) + proc.getSampleNeventsInRange( ifile , tree_tmp->GetEntries() ) );
 
       Double_t sumw_file = 0.;
       
-      // Loop over events in tree
-      Long64_t nev = tree_tmp->GetEntries();
+      // Loop over the events of the tree that belong to this sample
+      const Long64_t first = proc.getSampleFirstEntry(ifile);
+      const Long64_t last  = proc.getSampleEntryEnd( ifile , tree_tmp->GetEntries() );
+      Long64_t nev = TMath::Max( last - first , Long64_t(0) );
       Long64_t pev = 0;
       report::startProgressBar( proc.getSampleTag(ifile).Length() < 20 ? proc.getSampleTag(ifile) : "" );
-      for( Long64_t iev = 0 ; iev < nev ; iev++ ) {
+      for( Long64_t iev = first ; iev < last ; iev++ ) {
 
-	report::updateProgressBar( Double_t(iev+1) , Double_t(nev) , TString::Format(" SumW=%0.1f ε=%0.3f",sumw_file,Double_t(pev)/Double_t(iev)) );
+	report::updateProgressBar( Double_t(iev-first+1) , Double_t(nev) , TString::Format(" SumW=%0.1f ε=%0.3f",sumw_file,Double_t(pev)/Double_t(iev-first)) );
 	
 	if( ! tr->getEntry(iev) ) continue;
 	
@@ -126,29 +318,23 @@ plot
 	xsec_weight = proc.getSampleWeight(ifile);
 
 	// extra per-event weights
-	event_weight = 1.0;
-	if( mcweights ) {
-	  event_weight *= (*tr)["weight_mc"] * (*tr)["weight_leptonSF"] * (*tr)["weight_bTagSF_77"];
-	  if( config::UsePileupWeights )
-	    event_weight *= (*tr)["weight_pileup"];
-	}
+	event_weight = getEventWeight( tr , mcweights );
 
 	sumw_file += event_weight * xsec_weight;
 	
-	Double_t leadingLeptonPt = tr->leadingLeptonPt() * tth::GeV;
-	leadingLeptonPt = TMath::Min( 29.999 , leadingLeptonPt );
-	leadingLeptonPt = TMath::Max( 20.001 , leadingLeptonPt );
+	Double_t leadingLeptonPt = getPassingPt( tr );
 	h_passing->Fill( leadingLeptonPt , event_weight );
 	h_passing_weighted->Fill( leadingLeptonPt , event_weight * xsec_weight );
 
 	tr->fillOutputTree( ifile , iev , xsec_weight * event_weight );
 
-	for( HistConfig1D hconfig : hconfigs ) {
-	  if( !mcweights && hconfig.xname.Contains("weight_") ) continue;
-	  tr->fillHist( hmap[hconfig.xname] , hconfig.xname , hconfig.xunits , hconfig.xname.Contains("weight_") ? xsec_weight : xsec_weight * event_weight );
+	for( std::size_t ih = 0 ; ih < hconfigs.size() ; ih++ ) {
+	  if( !mcweights && isWeight[ih] ) continue;
+	  tr->fillHist( hists[ih] , vars[ih] , hconfigs[ih].xunits , isWeight[ih] ? xsec_weight : xsec_weight * event_weight );
 	}
 	
       } // end loop over tree entries
+      tr->endInputFile();
       delete tree_tmp;
 
       nev_total += nev;
@@ -173,7 +359,9 @@ plot
     hmap["passing_weighted"] = h_passing_weighted;
     hmap["total"]	     = h_total;
 
+    sw.Stop();
     report::info( "Total Efficiency = %li / %li = %g" , pev_total , nev_total , Double_t(pev_total) / Double_t(nev_total) );
+    if( nev_total > 0 ) report::info( "CPU time per entry of %s = %.3g ms (its cost in the dataset catalog, relative to the other processes)" , proc.getName().Data() , 1000.0 * sw.CpuTime() / nev_total );
 
     tr->printCutflow();
     
@@ -184,10 +372,10 @@ plot
   //
   // Fill histogram corresponding to PhysicsProcss "proc"
   //
-  static TH1D* getTH1D( const PhysicsProcess &proc , InputConfig *in , TreeReader *tr , HistConfig1D hconfig , Bool_t mcweights ) {
+  static TH1D* getTH1D( const PhysicsProcess &proc , InputConfig *in , TreeReader *tr , HistConfig1D hconfig , Bool_t mcweights , UInt_t nthreads = 1 ) {
     std::vector<HistConfig1D> hconfigVec;
     hconfigVec.push_back( hconfig );
-    return getTH1Dmap(proc,in,tr,hconfigVec,mcweights)[hconfig.xname];
+    return getTH1Dmap(proc,in,tr,hconfigVec,mcweights,nthreads)[hconfig.xname];
   }
   
   
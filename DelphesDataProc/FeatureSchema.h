@@ -0,0 +1,123 @@
+#ifndef _FEATURESCHEMA_H_
+#define _FEATURESCHEMA_H_
+
+#include <iostream>
+#include <assert.h>
+#include <map>
+#include <vector>
+
+#include "TString.h"
+
+#include "Report.h"
+#include "CsvWriter.h"
+#include "FeatureSelection.h"
+
+
+class
+FeatureSchema
+{
+
+  //
+  // Ordered list of the features (CSV columns) written by a feature extractor. Each feature
+  // owns one slot in a flat array of values, so the extractors look up slot numbers by name
+  // once when they are built and then fill and write rows by index. Values that an extractor
+  // computes but doesn't write out go to an extra "sink" slot past the last column.
+  //
+  // select() drops the columns that aren't in a FeatureSelection, so they become sink slots
+  // too and the extractor can tell from their slots which features it may skip.
+  //
+
+public:
+
+  // Storage type of a column in the binary output formats (the CSV doesn't care)
+  enum ColumnType { FLOAT32 , INT32 , INT8 };
+
+private:
+
+  std::vector<TString> v_names;
+  std::vector<ColumnType> v_types;
+  std::vector<Bool_t> v_keep;
+  std::map<TString,Int_t> m_slots;
+
+public:
+
+  FeatureSchema() {}
+  ~FeatureSchema() {}
+
+  // Columns added with keep set (bookkeeping, training targets) survive any selection
+  Int_t add( const TString &name , const ColumnType &type = FLOAT32 , const Bool_t &keep = kFALSE ) {
+    if( m_slots.find(name) != m_slots.end() ) {
+      report::error( "FeatureSchema : feature %s was added twice" , name.Data() );
+      assert( false );
+    }
+    m_slots[name] = Int_t(v_names.size());
+    v_names.push_back( name );
+    v_types.push_back( type );
+    v_keep.push_back( keep );
+    return m_slots[name];
+  }
+
+  void select( FeatureSelection &sel ) {
+    if( sel.isEmpty() ) return;
+    std::vector<TString> names;
+    std::vector<ColumnType> types;
+    std::vector<Bool_t> keep;
+    m_slots.clear();
+    for( std::size_t i = 0 ; i < v_names.size() ; i++ ) {
+      if( ! sel.use(v_names[i]) && ! v_keep[i] ) continue;
+      m_slots[v_names[i]] = Int_t(names.size());
+      names.push_back( v_names[i] );
+      types.push_back( v_types[i] );
+      keep.push_back( v_keep[i] );
+    }
+    v_names.swap( names );
+    v_types.swap( types );
+    v_keep.swap( keep );
+  }
+
+  std::size_t size() const { return v_names.size(); }
+  const TString& getName( const std::size_t &i ) const { return v_names[i]; }
+  const ColumnType& getType( const std::size_t &i ) const { return v_types[i]; }
+  Int_t getSink() const { return Int_t(v_names.size()); }
+  Bool_t isSink( const Int_t &slot ) const { return slot == getSink(); }
+
+  // Slot for the named feature, or the sink if it isn't one of the output columns.
+  // Only meant to be called after all of the features have been added.
+  Int_t getSlot( const TString &name ) const {
+    std::map<TString,Int_t>::const_iterator it = m_slots.find( name );
+    return it == m_slots.end() ? getSink() : it->second;
+  }
+
+  // Zeroed array of values with room for every column plus the sink
+  std::vector<Double_t> makeRow() const { return std::vector<Double_t>( v_names.size()+1 , 0.0 ); }
+
+  void writeHeader( CsvWriter &csv ) const {
+    for( std::size_t i = 0 ; i < v_names.size() ; i++ ) {
+      if( i ) csv.putSeparator();
+      csv.putString( v_names[i] );
+    }
+    csv.endRow();
+  }
+
+  void writeRow( CsvWriter &csv , const std::vector<Double_t> &values ) const {
+    for( std::size_t i = 0 ; i < v_names.size() ; i++ ) {
+      if( i ) csv.putSeparator();
+      const Double_t &v = values[i];
+      if( v_types[i]!=FLOAT32 && v==Double_t(Long64_t(v)) ) csv.putInt( Long64_t(v) );
+      else csv.putFloat( v );
+    }
+    csv.endRow();
+  }
+
+  void dump( const std::vector<Double_t> &values ) const {
+    std::cout << std::endl;
+    for( std::size_t i = 0 ; i < v_names.size() ; i++ ) {
+      std::cout << TString::Format("%25s",v_names[i].Data()) << " = " << values[i] << std::endl;
+    }
+    std::cout << std::endl;
+  }
+
+};
+
+
+#endif
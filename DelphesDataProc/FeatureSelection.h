@@ -0,0 +1,108 @@
+#ifndef _FEATURESELECTION_H_
+#define _FEATURESELECTION_H_
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <assert.h>
+#include <vector>
+
+#include "TString.h"
+
+#include "Report.h"
+
+
+class
+FeatureSelection
+{
+
+  //
+  // The features that a job should compute and write out, read from a text file with one
+  // feature name per line. Names may contain '*' wildcards (e.g. "dr_hadTop_*"), and
+  // anything after a '#' is a comment. An empty selection selects everything.
+  //
+  // The extractors turn the selection into a plan of what to calculate for every event, so
+  // that features (and intermediate objects) nobody asked for cost nothing.
+  //
+
+private:
+
+  std::vector<TString> v_patterns;
+  std::vector<Int_t> v_nMatched;
+
+  static Bool_t matches( const char *p , const char *s ) {
+    for( ; *p ; p++ , s++ ) {
+      if( *p == '*' ) {
+	for( ; ; s++ ) {
+	  if( matches( p+1 , s ) ) return kTRUE;
+	  if( ! *s ) return kFALSE;
+	}
+      }
+      if( *p != *s ) return kFALSE;
+    }
+    return *s == 0;
+  }
+
+public:
+
+  FeatureSelection() {}
+  ~FeatureSelection() {}
+
+  void add( const TString &pattern ) {
+    v_patterns.push_back( pattern );
+    v_nMatched.push_back( 0 );
+  }
+
+  void load( const TString &fname ) {
+    std::ifstream in( fname.Data() );
+    if( ! in ) {
+      report::error( "FeatureSelection : could not open %s" , fname.Data() );
+      assert( false );
+    }
+    std::string line;
+    while( std::getline( in , line ) ) {
+      TString s( line.c_str() );
+      if( s.Index("#") >= 0 ) s.Remove( s.Index("#") );
+      s.ReplaceAll( "\t" , " " );
+      s = s.Strip( TString::kBoth );
+      if( s.Length() ) add( s );
+    }
+    report::info( "Read %i feature names from %s" , Int_t(v_patterns.size()) , fname.Data() );
+  }
+
+  Bool_t isEmpty() const { return v_patterns.empty(); }
+
+  Bool_t selects( const TString &name ) const {
+    if( isEmpty() ) return kTRUE;
+    for( const TString &p : v_patterns ) if( matches( p.Data() , name.Data() ) ) return kTRUE;
+    return kFALSE;
+  }
+
+  // Same as selects(), but also records which names were matched for checkAllMatched(). Meant
+  // for setting up, once for every feature that a job knows about.
+  Bool_t use( const TString &name ) {
+    if( isEmpty() ) return kTRUE;
+    Bool_t res = kFALSE;
+    for( std::size_t i = 0 ; i < v_patterns.size() ; i++ ) {
+      if( ! matches( v_patterns[i].Data() , name.Data() ) ) continue;
+      v_nMatched[i]++;
+      res = kTRUE;
+    }
+    return res;
+  }
+
+  // Names that no extractor knows about are most likely typos
+  void checkAllMatched() const {
+    Bool_t ok = kTRUE;
+    for( std::size_t i = 0 ; i < v_patterns.size() ; i++ ) {
+      if( v_nMatched[i] ) continue;
+      report::error( "FeatureSelection : %s doesn't match any feature" , v_patterns[i].Data() );
+      ok = kFALSE;
+    }
+    assert( ok );
+  }
+
+};
+
+
+#endif
@@ -0,0 +1,246 @@
+#ifndef _FEATUREWRITER_H_
+#define _FEATUREWRITER_H_
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <assert.h>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include "TFile.h"
+#include "TTree.h"
+#include "TBranch.h"
+#include "TString.h"
+
+#include "Report.h"
+#include "FeatureSchema.h"
+#include "CsvWriter.h"
+#include "CompressedFile.h"
+#include "ParallelTools.h"
+
+
+class
+FeatureWriter
+{
+
+  //
+  // Output sink for the rows of a feature extractor. CSV is the original text format. COLUMNAR
+  // writes a flat ROOT tree ("features") with one typed branch per column, stored column by
+  // column in compressed clusters of rowGroupSize rows. Columnar readers (uproot, RDataFrame,
+  // pandas via uproot) load whole columns straight into arrays, with no text to parse.
+  // The CSV can be compressed while it's written (bzip2 or zstd).
+  //
+
+public:
+
+  enum Format { CSV , COLUMNAR };
+
+  static Format getFormat( const TString &name ) {
+    if( name==TString("csv") ) return CSV;
+    if( name==TString("root") || name==TString("columnar") ) return COLUMNAR;
+    report::error( "FeatureWriter : unknown output format %s (expected csv or root)" , name.Data() );
+    assert( false );
+    return CSV;
+  }
+
+  static TString getExtension( const Format &f , const CompressedFile::Codec &codec = CompressedFile::NONE ) {
+    return f==CSV ? ".csv" + CompressedFile::getExtension(codec) : ".root";
+  }
+
+private:
+
+  const FeatureSchema *schema;
+  Format format;
+  TString path;
+
+  // CSV
+  CsvWriter *csv;
+  CompressedFile::Codec csvCodec;
+  Int_t csvLevel;
+  Int_t csvThreads;
+
+  // COLUMNAR
+  TFile *file;
+  TTree *tree;
+  Long64_t rowGroupSize;
+  Int_t compression;
+  std::map<TString,Int_t> m_columnCompression;
+  std::vector<Float_t> v_float;
+  std::vector<Int_t> v_int;
+  std::vector<Char_t> v_char;
+  // (schema column, buffer index) for each of the typed buffers
+  std::vector< std::pair<Int_t,Int_t> > v_floatCols , v_intCols , v_charCols;
+
+  void setupBuffers() {
+    v_floatCols.clear();
+    v_intCols.clear();
+    v_charCols.clear();
+    for( std::size_t i = 0 ; i < schema->size() ; i++ ) {
+      switch( schema->getType(i) ) {
+      case FeatureSchema::FLOAT32 : v_floatCols.push_back( std::make_pair( Int_t(i) , Int_t(v_floatCols.size()) ) ); break;
+      case FeatureSchema::INT32   : v_intCols.push_back( std::make_pair( Int_t(i) , Int_t(v_intCols.size()) ) ); break;
+      case FeatureSchema::INT8    : v_charCols.push_back( std::make_pair( Int_t(i) , Int_t(v_charCols.size()) ) ); break;
+      }
+    }
+    // Sized once, so the addresses given to the branches stay put
+    v_float.assign( v_floatCols.size() , 0 );
+    v_int.assign( v_intCols.size() , 0 );
+    v_char.assign( v_charCols.size() , 0 );
+  }
+
+  void* getAddress( const std::size_t &icol ) {
+    for( std::pair<Int_t,Int_t> &c : v_floatCols ) if( c.first==Int_t(icol) ) return &v_float[c.second];
+    for( std::pair<Int_t,Int_t> &c : v_intCols ) if( c.first==Int_t(icol) ) return &v_int[c.second];
+    for( std::pair<Int_t,Int_t> &c : v_charCols ) if( c.first==Int_t(icol) ) return &v_char[c.second];
+    assert( false );
+    return 0;
+  }
+
+  static TString getLeafType( const FeatureSchema::ColumnType &type ) {
+    if( type==FeatureSchema::INT32 ) return "I";
+    if( type==FeatureSchema::INT8 ) return "B";
+    return "F";
+  }
+
+  void openFile( const TString &fname ) {
+    std::lock_guard<std::mutex> lock( ptools::rootMutex() );
+    file = new TFile( fname , "recreate" );
+    if( file->IsZombie() ) {
+      report::error( "FeatureWriter : could not create %s" , fname.Data() );
+      assert( false );
+    }
+    file->SetCompressionSettings( compression );
+    tree = new TTree( "features" , "features" );
+    tree->SetDirectory( file );
+    tree->SetAutoFlush( rowGroupSize );
+    for( std::size_t i = 0 ; i < schema->size() ; i++ ) {
+      const TString &name = schema->getName(i);
+      TBranch *b = tree->Branch( name , getAddress(i) , name+"/"+getLeafType(schema->getType(i)) );
+      std::map<TString,Int_t>::const_iterator it = m_columnCompression.find( name );
+      if( it != m_columnCompression.end() ) b->SetCompressionSettings( it->second );
+    }
+  }
+
+  void closeFile() {
+    std::lock_guard<std::mutex> lock( ptools::rootMutex() );
+    file->cd();
+    tree->Write( "" , TObject::kOverwrite );
+    file->Close();
+    delete file;
+    file = 0;
+    tree = 0;
+  }
+
+public:
+
+  FeatureWriter()
+    : schema( 0 )
+    , format( CSV )
+    , csv( 0 )
+    , csvCodec( CompressedFile::NONE )
+    , csvLevel( 0 )
+    , csvThreads( 1 )
+    , file( 0 )
+    , tree( 0 )
+    , rowGroupSize( 100000 )
+    , compression( 105 ) // zlib, level 5
+  {}
+
+  ~FeatureWriter() {
+    delete csv;
+  }
+
+  // Settings for the COLUMNAR format. They take effect at the next open()/openPart().
+  // Compression settings are ROOT's 100*algorithm+level (1xx = zlib, 2xx = lzma).
+  void setRowGroupSize( const Long64_t &n ) { rowGroupSize = n; }
+  void setCompression( const Int_t &settings ) { compression = settings; }
+  void setColumnCompression( const TString &name , const Int_t &settings ) { m_columnCompression[name] = settings; }
+
+  // Compression of the CSV format (level 0 = the codec's default). nthreads is for zstd, and
+  // only applies to the full outputs.
+  void setCsvCompression( const CompressedFile::Codec &codec , const Int_t &level = 0 , const Int_t &nthreads = 1 ) {
+    csvCodec   = codec;
+    csvLevel   = level;
+    csvThreads = nthreads;
+  }
+
+  Format getFormat() const { return format; }
+  const TString& getPath() const { return path; }
+
+  // The full CSV outputs are written to disk by a background thread. Part files aren't, since
+  // they're only used when there is already a worker per core.
+  void open( const TString &fname , const FeatureSchema *_schema , const Format &_format ) {
+    openPart( fname , _schema , _format , kTRUE );
+    if( format==CSV ) schema->writeHeader( *csv );
+  }
+
+  //
+  // Part files hold the rows of a single input file (and no CSV header). Worker threads write
+  // them and the master appends them to the real output in file order with appendPart().
+  // CSV parts are compressed like the real output, and are appended without decompressing.
+  //
+  void openPart( const TString &fname , const FeatureSchema *_schema , const Format &_format , const Bool_t &writerThread = kFALSE ) {
+    schema = _schema;
+    format = _format;
+    path   = fname;
+    if( format==CSV ) {
+      if( ! csv ) csv = new CsvWriter();
+      csv->open( fname , writerThread , csvCodec , csvLevel , writerThread ? csvThreads : 1 );
+    } else {
+      setupBuffers();
+      openFile( fname );
+    }
+  }
+
+  void close() {
+    if( format==CSV ) {
+      if( ! csv ) return;
+      csv->close();
+    } else {
+      if( ! file ) return;
+      closeFile();
+    }
+  }
+
+  void appendPart( const TString &fname ) {
+
+    if( format==CSV ) {
+      csv->appendFile( fname , kTRUE );
+      return;
+    }
+
+    // Read the part back through our own column buffers and refill our tree from them
+    std::lock_guard<std::mutex> lock( ptools::rootMutex() );
+    TFile *fpart = TFile::Open( fname );
+    if( ! fpart || fpart->IsZombie() ) {
+      report::error( "FeatureWriter : could not open part file %s" , fname.Data() );
+      assert( false );
+    }
+    TTree *tpart = (TTree*) fpart->Get( "features" );
+    for( std::size_t i = 0 ; i < schema->size() ; i++ ) tpart->SetBranchAddress( schema->getName(i) , getAddress(i) );
+    for( Long64_t ientry = 0 ; ientry < tpart->GetEntries() ; ++ientry ) {
+      tpart->GetEntry( ientry );
+      tree->Fill();
+    }
+    fpart->Close();
+    delete fpart;
+    std::remove( fname.Data() );
+  }
+
+  void writeRow( const std::vector<Double_t> &values ) {
+    if( format==CSV ) {
+      schema->writeRow( *csv , values );
+      return;
+    }
+    for( const std::pair<Int_t,Int_t> &c : v_floatCols ) v_float[c.second] = Float_t( values[c.first] );
+    for( const std::pair<Int_t,Int_t> &c : v_intCols ) v_int[c.second] = Int_t( values[c.first] );
+    for( const std::pair<Int_t,Int_t> &c : v_charCols ) v_char[c.second] = Char_t( values[c.first] );
+    tree->Fill();
+  }
+
+};
+
+
+#endif
@@ -0,0 +1,100 @@
+#ifndef _FOURVECTOR_H_
+#define _FOURVECTOR_H_
+
+#include <cmath>
+#include <algorithm>
+
+#include "TMath.h"
+#include "TLorentzVector.h"
+
+
+struct
+FourVector
+{
+
+  //
+  // Plain four-vector that keeps both the Cartesian (px, py, pz, E) and the collider
+  // (pt, eta, phi, m) coordinates, plus |p|. Everything is worked out once when the vector is
+  // made, so the accessors are plain loads. The conventions follow TLorentzVector (phi in
+  // [-pi,pi), eta = +-1e11 along the beam axis, negative masses for space-like vectors).
+  // It's a POD, so make one with the static functions rather than a constructor, and only
+  // convert to a TLorentzVector where an external interface wants one.
+  //
+
+  Double_t px , py , pz , e;
+  Double_t pt , eta , phi , m;
+  Double_t p;
+
+  static Double_t phiMPiPi( Double_t x ) {
+    while( x >= TMath::Pi() ) x -= TMath::TwoPi();
+    while( x < -TMath::Pi() ) x += TMath::TwoPi();
+    return x;
+  }
+
+  // Same as TLorentzVector::SetPtEtaPhiM
+  static FourVector fromPtEtaPhiM( Double_t _pt , const Double_t &_eta , const Double_t &_phi , const Double_t &_m ) {
+    _pt = std::fabs( _pt );
+    FourVector v;
+    v.px  = _pt * std::cos( _phi );
+    v.py  = _pt * std::sin( _phi );
+    v.pz  = _pt * std::sinh( _eta );
+    v.p   = std::sqrt( v.px*v.px + v.py*v.py + v.pz*v.pz );
+    v.e   = _m >= 0 ? std::sqrt( v.p*v.p + _m*_m ) : std::sqrt( std::max( v.p*v.p - _m*_m , 0.0 ) );
+    v.pt  = _pt;
+    v.eta = _pt > 0 ? _eta : getEta( v.pz , v.p );
+    v.phi = _pt > 0 ? phiMPiPi( _phi ) : 0.0;
+    v.m   = _m;
+    return v;
+  }
+
+  static FourVector fromPxPyPzE( const Double_t &_px , const Double_t &_py , const Double_t &_pz , const Double_t &_e ) {
+    FourVector v;
+    v.px  = _px;
+    v.py  = _py;
+    v.pz  = _pz;
+    v.e   = _e;
+    v.p   = std::sqrt( _px*_px + _py*_py + _pz*_pz );
+    v.pt  = std::sqrt( _px*_px + _py*_py );
+    v.eta = getEta( _pz , v.p );
+    v.phi = ( _px == 0 && _py == 0 ) ? 0.0 : std::atan2( _py , _px );
+    const Double_t m2 = _e*_e - v.p*v.p;
+    v.m   = m2 < 0 ? -std::sqrt( -m2 ) : std::sqrt( m2 );
+    return v;
+  }
+
+  static FourVector fromTLorentzVector( const TLorentzVector &l ) { return fromPxPyPzE( l.Px() , l.Py() , l.Pz() , l.E() ); }
+  TLorentzVector toTLorentzVector() const { return TLorentzVector( px , py , pz , e ); }
+
+  // Pseudorapidity the way TVector3 does it
+  static Double_t getEta( const Double_t &_pz , const Double_t &_p ) {
+    const Double_t cosTheta = _p == 0 ? 1.0 : _pz/_p;
+    if( cosTheta*cosTheta < 1 ) return -0.5 * std::log( (1.0-cosTheta)/(1.0+cosTheta) );
+    if( _pz == 0 ) return 0;
+    return _pz > 0 ? 10e10 : -10e10;
+  }
+
+  FourVector operator+( const FourVector &o ) const { return fromPxPyPzE( px+o.px , py+o.py , pz+o.pz , e+o.e ); }
+  FourVector& operator+=( const FourVector &o ) { return *this = *this + o; }
+
+  Double_t deltaPhi( const FourVector &o ) const { return phiMPiPi( phi - o.phi ); }
+  Double_t deltaEta( const FourVector &o ) const { return eta - o.eta; }
+  Double_t deltaR( const FourVector &o ) const {
+    const Double_t dphi = deltaPhi( o ) , deta = eta - o.eta;
+    return std::sqrt( deta*deta + dphi*dphi );
+  }
+
+  // Transverse energy and mass
+  Double_t et() const {
+    const Double_t pt2 = pt*pt;
+    const Double_t et2 = pt2 == 0 ? 0.0 : e*e * pt2/( pt2 + pz*pz );
+    return e < 0 ? -std::sqrt( et2 ) : std::sqrt( et2 );
+  }
+  Double_t mt() const {
+    const Double_t _et = et();
+    return std::sqrt( _et*_et - px*px - py*py );
+  }
+
+};
+
+
+#endif
@@ -15,6 +15,7 @@
 #include "Report.h"
 #include "HistTools.h"
 #include "PhysicsProcess.h"
+#include "DatasetCatalog.h"
 #include "Config.h"
 
 
@@ -116,13 +117,20 @@ public:
   
   //
   // Fancy load function for tth analysis
-  // Looks for directories with the correct tag containing "output.root" files
+  // Looks for directories with the correct tag containing "output.root" files,
+  // taking the directories from the dataset catalog of the base path if there is one
   //
   void load() {
 
     // get list of data directories in this base path
     std::vector<TString> datadirs;
-    {
+    if( DatasetCatalog::exists( DatasetCatalog::getDefaultPath(databasedir) ) ) {
+      DatasetCatalog catalog;
+      catalog.load( DatasetCatalog::getDefaultPath(databasedir) );
+      for( const TString &dir : catalog.getDirectoryNames() ) {
+	if( dir.Contains("user.") ) datadirs.push_back( dir );
+      }
+    } else {
       void* dirp = gSystem->OpenDirectory(databasedir);
       
       const char* entry;
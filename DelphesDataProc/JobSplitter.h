@@ -0,0 +1,104 @@
+#ifndef _JOBSPLITTER_H_
+#define _JOBSPLITTER_H_
+
+#include <iostream>
+#include <assert.h>
+#include <vector>
+
+#include "TMath.h"
+
+#include "Report.h"
+
+
+class
+JobSplitter
+{
+
+  //
+  // Divides the input files of a job between its splits. splitByEntries() gives every split
+  // the same share of the total cost, where an entry of file i costs cost[i] (e.g. the
+  // measured time per event of its sample), cutting files into entry ranges where needed.
+  // Each split reads one contiguous range of the concatenated entries, so a file is spread
+  // over any number of consecutive splits (many of them when a file costs more than a
+  // split's share). The cuts only depend on the entry counts and costs, so every split of a
+  // job agrees on them and the splits together read each entry exactly once.
+  //
+
+public:
+
+  // Entries [first,last) of file "file"; a last of -1 means to the end of the file
+  struct Chunk {
+    std::size_t file;
+    Long64_t first;
+    Long64_t last;
+    Chunk( const std::size_t &_file , const Long64_t &_first , const Long64_t &_last ) : file( _file ) , first( _first ) , last( _last ) {}
+    Long64_t getEnd( const Long64_t &entries ) const { return last < 0 ? entries : TMath::Min( last , entries ); }
+  };
+
+  // Whole files, the same number to every split (give or take one)
+  static std::vector<Chunk> splitByFiles( const std::size_t &nfiles , const UInt_t &totalSplits , const UInt_t &splitId ) {
+    check( totalSplits , splitId );
+    std::vector<Chunk> chunks;
+    const Int_t i = TMath::FloorNint( Double_t(splitId) * Double_t(nfiles) / Double_t(totalSplits) );
+    const Int_t f = TMath::FloorNint( Double_t(splitId+1) * Double_t(nfiles) / Double_t(totalSplits) );
+    for( Int_t ifile = i ; ifile < f ; ifile++ ) chunks.push_back( Chunk( ifile , 0 , -1 ) );
+    return chunks;
+  }
+
+  // Entry ranges with the same total cost in every split. cost may be empty (all 1).
+  static std::vector<Chunk> splitByEntries( const std::vector<Long64_t> &entries , const std::vector<Double_t> &cost ,
+					    const UInt_t &totalSplits , const UInt_t &splitId ) {
+    check( totalSplits , splitId );
+    assert( cost.empty() || cost.size() == entries.size() );
+    auto costOf = [&]( const std::size_t &i ) { return cost.empty() ? 1.0 : cost[i]; };
+
+    Double_t total = 0;
+    for( std::size_t i = 0 ; i < entries.size() ; i++ ) {
+      if( costOf(i) <= 0 ) {
+	report::error( "JobSplitter : the entries of file %i need a positive cost" , Int_t(i) );
+	assert( false );
+      }
+      total += entries[i] * costOf(i);
+    }
+    const Double_t lo = total * splitId / totalSplits;
+    const Double_t hi = total * (splitId+1) / totalSplits;
+
+    // The entry of file i at which the cumulative cost reaches x. Splits meeting at x both use
+    // this, so no entry is skipped or read twice.
+    auto cut = [&]( const Double_t &x , const Double_t &start , const std::size_t &i ) {
+      const Long64_t n = TMath::Nint( (x - start) / costOf(i) );
+      return TMath::Max( Long64_t(0) , TMath::Min( n , entries[i] ) );
+    };
+
+    std::vector<Chunk> chunks;
+    Double_t start = 0;
+    for( std::size_t i = 0 ; i < entries.size() ; i++ ) {
+      const Long64_t first = cut( lo , start , i );
+      const Long64_t last  = splitId+1 == totalSplits ? entries[i] : cut( hi , start , i );
+      if( last > first ) chunks.push_back( Chunk( i , first , last ) );
+      start += entries[i] * costOf(i);
+    }
+    return chunks;
+  }
+
+  static Long64_t countEntries( const std::vector<Chunk> &chunks ) {
+    Long64_t n = 0;
+    for( const Chunk &c : chunks ) {
+      assert( c.last >= 0 );
+      n += c.last - c.first;
+    }
+    return n;
+  }
+
+private:
+
+  static void check( const UInt_t &totalSplits , const UInt_t &splitId ) {
+    if( totalSplits > 0 && splitId < totalSplits ) return;
+    report::error( "JobSplitter : split %u of %u doesn't exist" , splitId , totalSplits );
+    assert( false );
+  }
+
+};
+
+
+#endif
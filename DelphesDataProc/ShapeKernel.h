@@ -0,0 +1,166 @@
+#ifndef _SHAPEKERNEL_H_
+#define _SHAPEKERNEL_H_
+
+#include <iostream>
+#include <assert.h>
+#include <vector>
+
+#include "Report.h"
+#include "Particle.h"
+#include "RecoParticleCollection.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+
+class
+ShapeKernel
+{
+
+  //
+  // Shape variables of many particle collections at once. The collections of an event are
+  // queued with add() and run() works them all out in one go. The particle momenta are kept
+  // as structure of arrays (px[particle][collection], ...), zero-padded to MAXPARTICLES, so
+  // the momentum tensors of four collections are summed up together in the AVX2 registers
+  // when the code is compiled with -mavx2 (see SIMDFLAGS in the Makefile), and one at a time
+  // otherwise. The eigenvalues and shapes then come from the closed-form solvers of
+  // RecoParticleCollection, collection by collection, as they branch on degenerate cases.
+  //
+
+public:
+
+  enum { MAXPARTICLES = 6 , NTENSOR = 6 };
+
+private:
+
+  std::size_t n;
+  std::size_t nmax; // most particles in any collection
+  std::vector<Double_t> v_px[MAXPARTICLES] , v_py[MAXPARTICLES] , v_pz[MAXPARTICLES];
+  // Upper triangles of the normalised momentum tensors, plain and 1/|p| weighted
+  std::vector<Double_t> v_S[NTENSOR] , v_O[NTENSOR];
+  std::vector<Double_t> v_shapes;
+
+  void tensors( const std::size_t &i ) {
+    Double_t S[NTENSOR] = { 0 } , O[NTENSOR] = { 0 } , normal = 0 , Onormal = 0;
+    for( std::size_t k = 0 ; k < nmax ; k++ ) {
+      const Double_t px = v_px[k][i] , py = v_py[k][i] , pz = v_pz[k][i];
+      const Double_t p2 = px*px + py*py + pz*pz;
+      const Double_t pp = TMath::Sqrt( p2 );
+      const Double_t invp = pp > 0 ? 1.0/pp : 0.0; // padding
+      const Double_t t[NTENSOR] = { px*px , px*py , px*pz , py*py , py*pz , pz*pz };
+      for( Int_t j = 0 ; j < NTENSOR ; j++ ) {
+	S[j] += t[j];
+	O[j] += t[j]*invp;
+      }
+      normal  += p2;
+      Onormal += pp;
+    }
+    for( Int_t j = 0 ; j < NTENSOR ; j++ ) {
+      v_S[j][i] = S[j]/normal;
+      v_O[j][i] = O[j]/Onormal;
+    }
+  }
+
+#if defined(__AVX2__)
+  // Same as tensors() for collections i..i+3
+  void tensors4( const std::size_t &i ) {
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d one  = _mm256_set1_pd( 1.0 );
+    __m256d S[NTENSOR] , O[NTENSOR] , normal = zero , Onormal = zero;
+    for( Int_t j = 0 ; j < NTENSOR ; j++ ) S[j] = O[j] = zero;
+    for( std::size_t k = 0 ; k < nmax ; k++ ) {
+      const __m256d px = _mm256_loadu_pd( &v_px[k][i] );
+      const __m256d py = _mm256_loadu_pd( &v_py[k][i] );
+      const __m256d pz = _mm256_loadu_pd( &v_pz[k][i] );
+      const __m256d p2 = _mm256_add_pd( _mm256_add_pd( _mm256_mul_pd(px,px) , _mm256_mul_pd(py,py) ) , _mm256_mul_pd(pz,pz) );
+      const __m256d pp = _mm256_sqrt_pd( p2 );
+      const __m256d invp = _mm256_and_pd( _mm256_cmp_pd( pp , zero , _CMP_GT_OQ ) , _mm256_div_pd( one , pp ) );
+      const __m256d t[NTENSOR] = { _mm256_mul_pd(px,px) , _mm256_mul_pd(px,py) , _mm256_mul_pd(px,pz) ,
+				   _mm256_mul_pd(py,py) , _mm256_mul_pd(py,pz) , _mm256_mul_pd(pz,pz) };
+      for( Int_t j = 0 ; j < NTENSOR ; j++ ) {
+	S[j] = _mm256_add_pd( S[j] , t[j] );
+	O[j] = _mm256_add_pd( O[j] , _mm256_mul_pd( t[j] , invp ) );
+      }
+      normal  = _mm256_add_pd( normal , p2 );
+      Onormal = _mm256_add_pd( Onormal , pp );
+    }
+    for( Int_t j = 0 ; j < NTENSOR ; j++ ) {
+      _mm256_storeu_pd( &v_S[j][i] , _mm256_div_pd( S[j] , normal ) );
+      _mm256_storeu_pd( &v_O[j][i] , _mm256_div_pd( O[j] , Onormal ) );
+    }
+  }
+#endif
+
+public:
+
+  ShapeKernel() : n( 0 ) , nmax( 0 ) {}
+  ~ShapeKernel() {}
+
+  void clear() {
+    n    = 0;
+    nmax = 0;
+  }
+
+  std::size_t size() const { return n; }
+
+  // Queues a collection and returns its index
+  std::size_t add( const std::vector<RecoParticle*> &v ) {
+    if( v.size() > MAXPARTICLES ) {
+      report::error( "ShapeKernel : collections can have at most %i particles" , Int_t(MAXPARTICLES) );
+      assert( false );
+    }
+    // Room for a whole vector of collections past the last one
+    if( v_px[0].size() < n+4 ) {
+      const std::size_t size = 2*(n+4);
+      for( Int_t k = 0 ; k < MAXPARTICLES ; k++ ) {
+	v_px[k].resize( size , 0 );
+	v_py[k].resize( size , 0 );
+	v_pz[k].resize( size , 0 );
+      }
+      for( Int_t j = 0 ; j < NTENSOR ; j++ ) {
+	v_S[j].resize( size , 0 );
+	v_O[j].resize( size , 0 );
+      }
+    }
+    for( std::size_t k = 0 ; k < MAXPARTICLES ; k++ ) {
+      if( k < v.size() ) {
+	const FourVector &l = v[k]->getP4();
+	v_px[k][n] = l.px;
+	v_py[k][n] = l.py;
+	v_pz[k][n] = l.pz;
+      } else {
+	v_px[k][n] = v_py[k][n] = v_pz[k][n] = 0;
+      }
+    }
+    if( v.size() > nmax ) nmax = v.size();
+    return n++;
+  }
+
+  void run() {
+    std::size_t i = 0;
+#if defined(__AVX2__)
+    for( ; i+4 <= n ; i += 4 ) tensors4( i );
+#endif
+    for( ; i < n ; i++ ) tensors( i );
+
+    v_shapes.resize( n*RecoParticleCollection::NSHAPES );
+    for( i = 0 ; i < n ; i++ ) {
+      const Double_t S[NTENSOR] = { v_S[0][i] , v_S[1][i] , v_S[2][i] , v_S[3][i] , v_S[4][i] , v_S[5][i] };
+      const Double_t O[NTENSOR] = { v_O[0][i] , v_O[1][i] , v_O[2][i] , v_O[3][i] , v_O[4][i] , v_O[5][i] };
+      Double_t e[3] , eT[2] , eO[3];
+      RecoParticleCollection::solveSym3( S , e );
+      RecoParticleCollection::solveSym2( S[0] , S[1] , S[3] , eT );
+      RecoParticleCollection::solveSym3( O , eO );
+      Double_t *shapes = &v_shapes[i*RecoParticleCollection::NSHAPES];
+      for( Int_t j = 0 ; j < RecoParticleCollection::NSHAPES ; j++ ) shapes[j] = RecoParticleCollection::getShape( j , e , eT , eO );
+    }
+  }
+
+  // All NSHAPES shape values of collection i, in the order of RecoParticleCollection::Shape
+  const Double_t* getShapes( const std::size_t &i ) const { return &v_shapes[i*RecoParticleCollection::NSHAPES]; }
+
+};
+
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef _SIDEFILES_H_
+#define _SIDEFILES_H_
+
+#include <iostream>
+#include <cstdio>
+#include <assert.h>
+#include <atomic>
+
+#include "TString.h"
+#include "TSystem.h"
+
+#include "Report.h"
+#include "Philox.h"
+
+namespace
+sidefile
+{
+
+  //
+  // Files made from a Delphes file and kept in a directory of their own for later jobs to
+  // reuse (skims, event indices). Many jobs, and several threads of a job, can be making the
+  // one for the same source at once, while others read it. Each is therefore written to a
+  // temporary file of its own and renamed into place once complete: readers see either the
+  // old file or the new one, and the last writer wins with a file as good as the others'.
+  //
+
+  //
+  // Where the side file of sourcePath goes in "dir". The files of a sample usually all have
+  // the same name, one per job directory, so the name is made of the directory and file names
+  // and a hash of the full path (to tell apart data directories sharing "dir").
+  //
+  static TString getPath( const TString &dir , const TString &sourcePath , const TString &suffix ) {
+    TString name = gSystem->BaseName( sourcePath );
+    if( name.EndsWith( ".root" ) ) name.Remove( name.Length()-5 );
+    const TString parent = gSystem->BaseName( gSystem->DirName( sourcePath ) );
+    return TString::Format( "%s/%s_%s_%08x.%s.root" , dir.Data() , parent.Data() , name.Data() ,
+			    Philox::hash( sourcePath.Data() ) , suffix.Data() );
+  }
+
+  // A path next to "path" that no other job or thread writes to
+  static TString getTempPath( const TString &path ) {
+    static std::atomic<UInt_t> count( 0 );
+    return TString::Format( "%s.tmp%i_%u" , path.Data() , gSystem->GetPid() , count++ );
+  }
+
+  // Moves the finished temporary file into place
+  static void commit( const TString &tmpPath , const TString &path ) {
+    if( std::rename( tmpPath.Data() , path.Data() ) != 0 ) {
+      report::error( "Could not rename %s to %s" , tmpPath.Data() , path.Data() );
+      assert( false );
+    }
+  }
+
+}
+
+
+#endif
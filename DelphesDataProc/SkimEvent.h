@@ -0,0 +1,61 @@
+#ifndef _SKIMEVENT_H_
+#define _SKIMEVENT_H_
+
+#include "Rtypes.h"
+
+
+struct
+SkimEvent
+{
+
+  //
+  // What the selectors take from one Delphes entry: the selected jets with their b-tags, the
+  // selected leptons, the MET, and the partons of the top decays with the decay codes. The
+  // selectors fill it from the Delphes branches and then make their particles from it, or
+  // make them straight from one read back from a skim (DelphesSkim.h). The values are kept
+  // exactly as Delphes has them, so both ways give the same particles. Fixed-size arrays,
+  // so that the branches of the skim tree can point at them.
+  //
+
+  enum { MAXJETS = 32 , MAXLEPTONS = 8 , MAXTRUTH = 6 };
+
+  Long64_t entry; // in the Delphes file
+
+  Int_t nJet;
+  Float_t jetPt[MAXJETS] , jetEta[MAXJETS] , jetPhi[MAXJETS] , jetM[MAXJETS];
+  Int_t jetFlavor[MAXJETS] , jetTag[MAXJETS];
+
+  Int_t nEl;
+  Float_t elPt[MAXLEPTONS] , elEta[MAXLEPTONS] , elPhi[MAXLEPTONS];
+
+  Int_t nMu;
+  Float_t muPt[MAXLEPTONS] , muEta[MAXLEPTONS] , muPhi[MAXLEPTONS];
+
+  Float_t met , metPhi;
+
+  Int_t decayT , decayTbar , decayWp , decayWm;
+  Int_t nTruth;
+  Double_t truthPt[MAXTRUTH]; // worked out from px and py
+  Float_t truthEta[MAXTRUTH] , truthPhi[MAXTRUTH];
+  Int_t truthPdg[MAXTRUTH] , truthParentPdg[MAXTRUTH];
+
+  // Takes the truth part from another event
+  void setTruth( const SkimEvent &o ) {
+    decayT    = o.decayT;
+    decayTbar = o.decayTbar;
+    decayWp   = o.decayWp;
+    decayWm   = o.decayWm;
+    nTruth    = o.nTruth;
+    for( Int_t i = 0 ; i < nTruth ; i++ ) {
+      truthPt[i]	= o.truthPt[i];
+      truthEta[i]	= o.truthEta[i];
+      truthPhi[i]	= o.truthPhi[i];
+      truthPdg[i]	= o.truthPdg[i];
+      truthParentPdg[i] = o.truthParentPdg[i];
+    }
+  }
+
+};
+
+
+#endif
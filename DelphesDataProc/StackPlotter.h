@@ -29,6 +29,7 @@ private:
   InputConfig *in;
   Plotter *p;
   TreeReader *tr;
+  UInt_t nThreads; // threads used for the event loop, 0 = one per core
 
   std::vector<plot::HistConfig1D> queue1D;
   //std::vetcor<plot::HistConfig2D> queue2D;
@@ -39,10 +40,13 @@ public:
     in = _in;
     p  = _p;
     tr = _tr;
+    nThreads = 1;
   }
   
   ~StackPlotter() {}
 
+  void setNumThreads( UInt_t n ) { nThreads = n; }
+
   void addToQueue( TString xname , TString xtitle , Int_t xbins , Double_t xmin , Double_t xmax , Double_t xunits = 1.0 ) { queue1D.push_back( plot::HistConfig1D(xname,xtitle,xbins,xmin,xmax,xunits) ); }
 
   void drawDataMC( const Bool_t &use_event_weights = kTRUE ) {
@@ -188,7 +192,7 @@ private:
   std::vector< std::map<TString,TH1D*> > getFilledDataHistograms1D() {
     std::vector< std::map<TString,TH1D*> > res;
     for( std::size_t i = 0 ; i < in->numData() ; ++i )
-      res.push_back( plot::getTH1Dmap( in->getData(i) , in , tr , queue1D , kFALSE ) );
+      res.push_back( plot::getTH1Dmap( in->getData(i) , in , tr , queue1D , kFALSE , nThreads ) );
     return res;
   }
 
@@ -204,7 +208,7 @@ private:
     TH1D *h_passing_weighted = (TH1D*)0;
 
     for( std::size_t i = 0 ; i < in->numSignals() ; ++i ) {
-      res.push_back( plot::getTH1Dmap( in->getSignal(i) , in , tr , queue1D , use_event_weights ) );
+      res.push_back( plot::getTH1Dmap( in->getSignal(i) , in , tr , queue1D , use_event_weights , nThreads ) );
       if( res.back()["passing"] ) {
 	htools::safe_add( h_passing , res.back()["passing"] , "h_passing_sig" );
 	htools::safe_add( h_passing_weighted , res.back()["passing_weighted"] , "h_passing_weighted_sig" );
@@ -240,7 +244,7 @@ private:
     TH1D *h_passing_weighted = (TH1D*)0;
     
     for( std::size_t i = 0 ; i < in->numBackgrounds() ; ++i ) {
-      res.push_back( plot::getTH1Dmap( in->getBackground(i) , in , tr , queue1D , use_event_weights ) );
+      res.push_back( plot::getTH1Dmap( in->getBackground(i) , in , tr , queue1D , use_event_weights , nThreads ) );
       if( res.back()["passing"] ) {
 	htools::safe_add( h_passing , res.back()["passing"] , "h_passing_bkg" );
 	htools::safe_add( h_passing_weighted , res.back()["passing_weighted"] , "h_passing_weighted_bkg" );
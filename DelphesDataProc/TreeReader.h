@@ -7,6 +7,7 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <map>
+#include <deque>
 #include <vector>
 
 #include "TString.h"
@@ -57,15 +58,53 @@ protected:
 
   std::map< TString , BranchType > types;
 
-  std::map< TString , UInt_t > map_uint;
-  std::map< TString , Int_t > map_int;
-  std::map< TString , Long64_t > map_long64;
-  std::map< TString , Float_t > map_float;
-  std::map< TString , Char_t > map_char;
-  std::map< TString , std::vector<float>* > map_vector_float;
-  std::map< TString , std::vector<char>* > map_vector_char;
-  std::map< TString , std::vector<int>* > map_vector_int;
-  std::map< TString , std::vector<uint>* > map_vector_uint;
+  //
+  // Typed slot returned when a variable is registered. Reading and writing through a handle
+  // is a plain index into the store, with no string building or map lookup.
+  //
+  template< typename T >
+  struct Handle {
+    Int_t slot;
+    Handle( const Int_t &_slot = -1 ) : slot( _slot ) {}
+  };
+
+  //
+  // Values for all of the variables of one type. Variables are registered by name once and
+  // get a slot in a deque, which grows in fixed-size blocks and never moves what it already
+  // holds, so the addresses given to SetBranchAddress/Branch stay valid. Indexing by name
+  // still works (and creates the variable if needed) for ad-hoc access.
+  //
+  template< typename T >
+  class BranchStore {
+  private:
+    std::deque<T> values;
+    std::map<TString,Int_t> slots;
+  public:
+    Handle<T> add( const TString &name ) {
+      std::map<TString,Int_t>::const_iterator it = slots.find( name );
+      if( it != slots.end() ) return Handle<T>( it->second );
+      values.push_back( T() );
+      slots[name] = Int_t(values.size()) - 1;
+      return Handle<T>( Int_t(values.size()) - 1 );
+    }
+    Int_t find( const TString &name ) const {
+      std::map<TString,Int_t>::const_iterator it = slots.find( name );
+      return it == slots.end() ? -1 : it->second;
+    }
+    T& at( const Int_t &slot ) { return values[slot]; }
+    T& operator[]( const Handle<T> &h ) { return values[h.slot]; }
+    T& operator[]( const TString &name ) { return values[add(name).slot]; }
+  };
+
+  BranchStore< UInt_t > map_uint;
+  BranchStore< Int_t > map_int;
+  BranchStore< Long64_t > map_long64;
+  BranchStore< Float_t > map_float;
+  BranchStore< Char_t > map_char;
+  BranchStore< std::vector<float>* > map_vector_float;
+  BranchStore< std::vector<char>* > map_vector_char;
+  BranchStore< std::vector<int>* > map_vector_int;
+  BranchStore< std::vector<uint>* > map_vector_uint;
 
   std::map< TString , Int_t > cutflow;
   
@@ -93,84 +132,102 @@ protected:
   };
 
 
-  void setBranch_uint( TString branchname , Bool_t intree = kTRUE ) {
+  Handle<UInt_t> setBranch_uint( TString branchname , Bool_t intree = kTRUE ) {
+    Handle<UInt_t> h = map_uint.add( branchname );
     if( intree ) {
       tree->SetBranchStatus( branchname , 1 );
-      tree->SetBranchAddress( branchname , &map_uint[branchname] );
+      tree->SetBranchAddress( branchname , &map_uint[h] );
     }
     types[branchname] = UINT;
+    return h;
   }
 
-  void setBranch_int( TString branchname , Bool_t intree = kTRUE ) {
+  Handle<Int_t> setBranch_int( TString branchname , Bool_t intree = kTRUE ) {
+    Handle<Int_t> h = map_int.add( branchname );
     if( intree ) {
       tree->SetBranchStatus( branchname , 1 );
-      tree->SetBranchAddress( branchname , &map_int[branchname] );
+      tree->SetBranchAddress( branchname , &map_int[h] );
     }
     types[branchname] = INT;
+    return h;
   }
 
-  void setBranch_long64( TString branchname , Bool_t intree = kTRUE ) {
+  Handle<Long64_t> setBranch_long64( TString branchname , Bool_t intree = kTRUE ) {
+    Handle<Long64_t> h = map_long64.add( branchname );
     if( intree ) {
       tree->SetBranchStatus( branchname , 1 );
-      tree->SetBranchAddress( branchname , &map_long64[branchname] );
+      tree->SetBranchAddress( branchname , &map_long64[h] );
     }
     types[branchname] = LONG64;
+    return h;
   }
   
-  void setBranch_float( TString branchname , Bool_t intree = kTRUE ) {
+  Handle<Float_t> setBranch_float( TString branchname , Bool_t intree = kTRUE ) {
+    Handle<Float_t> h = map_float.add( branchname );
     if( intree ) {
       tree->SetBranchStatus( branchname , 1 );
-      tree->SetBranchAddress( branchname , &map_float[branchname] );
+      tree->SetBranchAddress( branchname , &map_float[h] );
     }
     types[branchname] = FLOAT;
+    return h;
   }
 
-  void setBranch_char( TString branchname , Bool_t intree = kTRUE ) {
+  Handle<Char_t> setBranch_char( TString branchname , Bool_t intree = kTRUE ) {
+    Handle<Char_t> h = map_char.add( branchname );
     if( intree ) {
       tree->SetBranchStatus( branchname , 1 );
-      tree->SetBranchAddress( branchname , &map_char[branchname] );
+      tree->SetBranchAddress( branchname , &map_char[h] );
     }
     types[branchname] = CHAR;
+    return h;
   }
 
-  void setBranch_vector_float( TString branchname , Bool_t intree = kTRUE ) {
+  Handle< std::vector<float>* > setBranch_vector_float( TString branchname , Bool_t intree = kTRUE ) {
+    Handle< std::vector<float>* > h = map_vector_float.add( branchname );
     if( intree ) {
       tree->SetBranchStatus( branchname , 1 );
-      tree->SetBranchAddress( branchname , &map_vector_float[branchname] );
-    } else if( ! map_vector_float[branchname] ) {
-      map_vector_float[branchname] = new std::vector<float>();
+      tree->SetBranchAddress( branchname , &map_vector_float[h] );
+    } else if( ! map_vector_float[h] ) {
+      map_vector_float[h] = new std::vector<float>();
     }
     for( TString vtag : vectortags ) types[branchname+vtag] = VECTOR_FLOAT;
+    return h;
   }
 
-  void setBranch_vector_char( TString branchname , Bool_t intree = kTRUE ) {
+  Handle< std::vector<char>* > setBranch_vector_char( TString branchname , Bool_t intree = kTRUE ) {
+    Handle< std::vector<char>* > h = map_vector_char.add( branchname );
     if( intree ) {
       tree->SetBranchStatus( branchname , 1 );
-      tree->SetBranchAddress( branchname , &map_vector_char[branchname] );
-    } else if( ! map_vector_char[branchname] ) {
-      map_vector_char[branchname] = new std::vector<char>();
+      tree->SetBranchAddress( branchname , &map_vector_char[h] );
+    } else if( ! map_vector_char[h] ) {
+      map_vector_char[h] = new std::vector<char>();
     }
     for( TString vtag : vectortags ) types[branchname+vtag] = VECTOR_CHAR;
+    return h;
   }
 
-  void setBranch_vector_int( TString branchname , Bool_t intree = kTRUE ) {
+  Handle< std::vector<int>* > setBranch_vector_int( TString branchname , Bool_t intree = kTRUE ) {
+    Handle< std::vector<int>* > h = map_vector_int.add( branchname );
     if( intree ) {
       tree->SetBranchStatus( branchname , 1 );
-      tree->SetBranchAddress( branchname , &map_vector_int[branchname] );
-    } else if( ! map_vector_int[branchname] ) {
-      map_vector_int[branchname] = new std::vector<int>();
+      tree->SetBranchAddress( branchname , &map_vector_int[h] );
+    } else if( ! map_vector_int[h] ) {
+      map_vector_int[h] = new std::vector<int>();
     }
     for( TString vtag : vectortags ) types[branchname+vtag] = VECTOR_INT;
+    return h;
   }
 
-  void setBranch_vector_uint( TString branchname , Bool_t intree = kTRUE ) {
+  Handle< std::vector<uint>* > setBranch_vector_uint( TString branchname , Bool_t intree = kTRUE ) {
+    Handle< std::vector<uint>* > h = map_vector_uint.add( branchname );
     if( intree ) {
       tree->SetBranchStatus( branchname , 1 );
-      tree->SetBranchAddress( branchname , &map_vector_uint[branchname] );
-    } else if( ! map_vector_uint[branchname] ) {
-      map_vector_uint[branchname] = new std::vector<uint>();
+      tree->SetBranchAddress( branchname , &map_vector_uint[h] );
+    } else if( ! map_vector_uint[h] ) {
+      map_vector_uint[h] = new std::vector<uint>();
     }
     for( TString vtag : vectortags ) types[branchname+vtag] = VECTOR_UINT;
+    return h;
   }
   
   Double_t vectorElement( const TString &branchname , const std::size_t &i ) {
@@ -191,6 +248,38 @@ protected:
     assert( false );
   }
 
+  // Same as above, for a variable that has already been resolved to its slot
+  Double_t vectorElement( const BranchType &type , const Int_t &slot , const std::size_t &i ) {
+    if( type==VECTOR_FLOAT ) { std::vector<float> *v = map_vector_float.at(slot); return v->size() > i ? Double_t(v->at(i)) : -1; }
+    if( type==VECTOR_INT ) { std::vector<int> *v = map_vector_int.at(slot); return v->size() > i ? Double_t(v->at(i)) : -1; }
+    if( type==VECTOR_UINT ) { std::vector<uint> *v = map_vector_uint.at(slot); return v->size() > i ? Double_t(v->at(i)) : -1; }
+    if( type==VECTOR_CHAR ) { std::vector<char> *v = map_vector_char.at(slot); return v->size() > i ? Double_t(v->at(i)) : -1; }
+    assert( false );
+    return -1;
+  }
+
+  std::size_t vectorSize( const BranchType &type , const Int_t &slot ) {
+    if( type==VECTOR_FLOAT ) return map_vector_float.at(slot)->size();
+    if( type==VECTOR_INT ) return map_vector_int.at(slot)->size();
+    if( type==VECTOR_UINT ) return map_vector_uint.at(slot)->size();
+    if( type==VECTOR_CHAR ) return map_vector_char.at(slot)->size();
+    assert( false );
+    return 0;
+  }
+
+  Int_t findSlot( const BranchType &type , const TString &branchname ) const {
+    if( type==UINT ) return map_uint.find( branchname );
+    if( type==INT ) return map_int.find( branchname );
+    if( type==LONG64 ) return map_long64.find( branchname );
+    if( type==FLOAT ) return map_float.find( branchname );
+    if( type==CHAR ) return map_char.find( branchname );
+    if( type==VECTOR_FLOAT ) return map_vector_float.find( branchname );
+    if( type==VECTOR_INT ) return map_vector_int.find( branchname );
+    if( type==VECTOR_UINT ) return map_vector_uint.find( branchname );
+    if( type==VECTOR_CHAR ) return map_vector_char.find( branchname );
+    return -1;
+  }
+
   Double_t read( const TString &branchname ) {
     Double_t result;
     fill( branchname , result );
@@ -269,7 +358,7 @@ public:
 
  
   TreeReader() {}
-  ~TreeReader() {}
+  virtual ~TreeReader() {}
 
   Double_t operator[]( const TString &branchname ) { return read(branchname); }
 
@@ -296,30 +385,163 @@ public:
     assert( false );
   }
 
+
+  //
+  // A variable as fill() and fillHist() understand it (a plain branch, or the _SIZE, _ENTRYn,
+  // _ALL or _INCL view of one), resolved from its name once so the event loop doesn't have
+  // to parse the name and look it up in every event. Names that can't be resolved are
+  // passed on to the string-based functions, which complain about them as before.
+  //
+  enum { VIEW_VALUE=-1 , VIEW_SIZE=-2 , VIEW_ALL=-3 , VIEW_INVALID=-4 };
+  struct VarHandle {
+    TString name;
+    BranchType type;
+    Int_t slot;
+    Int_t entry; // index of a vector element, or one of the VIEW_ codes
+    Bool_t inclusive;
+  };
+
+  VarHandle getVarHandle( const TString &branchname ) const {
+    VarHandle v;
+    v.name      = branchname;
+    v.type      = UNDEFINED;
+    v.slot      = -1;
+    v.entry     = VIEW_INVALID;
+    v.inclusive = branchname.EndsWith("_INCL");
+    TString origname( branchname );
+    if( branchname.EndsWith("_ALL") ) {
+      v.entry = VIEW_ALL;
+      origname.ReplaceAll( "_ALL" , "" );
+    } else {
+      origname.ReplaceAll( "_INCL" , "" );
+      std::map<TString,BranchType>::const_iterator it = types.find( origname );
+      if( it == types.end() ) return v;
+      if( it->second==UINT || it->second==INT || it->second==LONG64 || it->second==FLOAT || it->second==CHAR ) {
+	v.entry = VIEW_VALUE;
+      } else if( it->second==VECTOR_FLOAT || it->second==VECTOR_INT || it->second==VECTOR_CHAR ) {
+	if( origname.EndsWith("_SIZE") ) v.entry = VIEW_SIZE;
+	for( Int_t i = 0 ; i < 4 ; i++ ) {
+	  if( origname.EndsWith(TString::Format("_ENTRY%i",i)) ) v.entry = i;
+	}
+	if( v.entry == VIEW_INVALID ) return v;
+	origname.ReplaceAll( "_SIZE" , "" );
+	for( Int_t i = 0 ; i < 4 ; i++ ) origname.ReplaceAll( TString::Format("_ENTRY%i",i) , "" );
+      } else {
+	return v;
+      }
+    }
+    std::map<TString,BranchType>::const_iterator it = types.find( origname );
+    if( it != types.end() ) {
+      v.type = it->second;
+      v.slot = findSlot( v.type , origname );
+    }
+    if( v.slot < 0 || (v.entry==VIEW_ALL && v.type<VECTOR_FLOAT) ) {
+      v.type  = UNDEFINED;
+      v.entry = VIEW_INVALID;
+    }
+    return v;
+  }
+
+  Bool_t fill( const VarHandle &v , Double_t &val ) {
+    if( v.entry == VIEW_INVALID || v.entry == VIEW_ALL ) return fill( v.name , val );
+    if( v.type==UINT ) { val = Double_t(map_uint.at(v.slot)); return kTRUE; }
+    if( v.type==INT ) { val = Double_t(map_int.at(v.slot)); return kTRUE; }
+    if( v.type==LONG64 ) { val = Double_t(map_long64.at(v.slot)); return kTRUE; }
+    if( v.type==FLOAT ) { val = Double_t(map_float.at(v.slot)); return kTRUE; }
+    if( v.type==CHAR ) { val = Double_t(map_char.at(v.slot)); return kTRUE; }
+    if( v.entry == VIEW_SIZE ) { val = Double_t( vectorSize(v.type,v.slot) ); return kTRUE; }
+    val = vectorElement( v.type , v.slot , v.entry );
+    return vectorSize( v.type , v.slot ) > std::size_t(v.entry);
+  }
+
+  void fillHist( TH1* h , const VarHandle &var , const Double_t &units , const Double_t &w , std::vector< std::pair<Double_t,Double_t> > *fills = 0 ) {
+    if( var.entry == VIEW_INVALID ) {
+      fillHist( h , var.name , units , w , fills );
+    } else if( var.entry == VIEW_ALL ) {
+      for( size_t i = 0 ; i < vectorSize(var.type,var.slot) ; ++i ) {
+	fillOrRecord( h , vectorElement(var.type,var.slot,i) * units , w , fills );
+      }
+    } else {
+      Double_t val;
+      if( fill( var , val ) ) {
+	if( var.inclusive ) {
+	  for( Int_t ibin = 1 ; ibin <= h->GetNbinsX() ; ++ibin ) {
+	    if( h->GetBinLowEdge(ibin) <= (val * units) ) {
+	      fillOrRecord( h , h->GetBinCenter(ibin) , w , fills );
+	    }
+	  }
+	} else {
+	  fillOrRecord( h , val * units , w , fills );
+	}
+      }
+    }
+  }
   
   void fillHist( TH1* h , const TString &branchname , const Double_t &units , const Double_t &w ) {
+    fillHist( h , branchname , units , w , 0 );
+  }
+
+  // If "fills" is given, the (x,w) pairs are appended to it instead of being filled into h,
+  // and h is only used for its binning. The multi-threaded event loop uses this to replay the
+  // fills in a fixed order on the master thread.
+  void fillHist( TH1* h , const TString &branchname , const Double_t &units , const Double_t &w , std::vector< std::pair<Double_t,Double_t> > *fills ) {
     Double_t val;
     TString origname( branchname );
     if( branchname.EndsWith("_ALL") ) {
       origname.ReplaceAll( "_ALL" , "" );
       for( size_t i = 0 ; i < vectorSize(origname) ; ++i ) {
-	h->Fill( vectorElement(origname,i) * units , w );
+	fillOrRecord( h , vectorElement(origname,i) * units , w , fills );
       }
     } else {
       if( fill( origname.ReplaceAll("_INCL","") , val ) ) {
 	if( branchname.EndsWith("_INCL") ) {
 	  for( Int_t ibin = 1 ; ibin <= h->GetNbinsX() ; ++ibin ) {
 	    if( h->GetBinLowEdge(ibin) <= (val * units) ) {
-	      h->Fill( h->GetBinCenter(ibin) , w );
+	      fillOrRecord( h , h->GetBinCenter(ibin) , w , fills );
 	    }
 	  }
 	} else {
-	  h->Fill( val * units , w );
+	  fillOrRecord( h , val * units , w , fills );
 	}
       }
     }
   }
 
+  static void fillOrRecord( TH1* h , const Double_t &x , const Double_t &w , std::vector< std::pair<Double_t,Double_t> > *fills ) {
+    if( fills ) fills->push_back( std::make_pair(x,w) );
+    else h->Fill( x , w );
+  }
+
+  //
+  // Hooks for the multi-threaded event loop in ExtraPlotTools.h. A reader that can be cloned
+  // is run with one clone per worker thread. Each worker writes the output for one input file
+  // into an OutputChunk, and the master appends the chunks to its own output in file order.
+  //
+  struct OutputChunk {
+    TTree *tree;
+    std::string csv;
+    OutputChunk() : tree( 0 ) {}
+  };
+
+  // Return a new reader with the same configuration, or 0 if this reader can only run serially
+  virtual TreeReader* clone() const { return 0; }
+
+  // Called before the first entry of every input file, in serial and parallel mode alike
+  virtual void beginInputFile( const std::size_t & ) {}
+
+  // Called after the last entry of every input file, while its tree still exists, so that
+  // readers can let go of anything pointing into the tree
+  virtual void endInputFile() {}
+
+  virtual void beginOutputChunk( const TString & ) {}
+  virtual OutputChunk* endOutputChunk() { return 0; }
+  virtual void appendOutputChunk( OutputChunk *chunk ) { delete chunk; }
+
+  void mergeCutflow( const TreeReader *other ) {
+    for( auto itr = other->cutflow.begin() ; itr != other->cutflow.end() ; ++itr )
+      cutflow[itr->first] += itr->second;
+  }
+
   virtual void setupOutputTree( const TString & ) {}
   virtual void fillOutputTree( const std::size_t& , const Long64_t& , const Double_t& ) {}
   virtual void saveOutputTrees( const TString & ) {}
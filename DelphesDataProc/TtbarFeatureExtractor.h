@@ -19,6 +19,9 @@
 #include "Report.h"
 #include "Particle.h"
 #include "RecoParticleCollection.h"
+#include "FeatureSchema.h"
+#include "FeatureSelection.h"
+#include "FeatureWriter.h"
 #include "DelphesRecoSelector.h"
 #include "DelphesTruthSelector.h"
 #include "DelphesRootTruthSelector.h"
@@ -38,16 +41,70 @@ private:
   DelphesTruthSelector *tSel;
   DelphesRootTruthSelector *tSelRoot;
   
-  std::map<TString,Double_t> m_features;
-  std::vector<TString> v_featureNames;
-
   std::vector<TString> v_collectionNames;
   std::vector< std::pair<TString,TString> > v_pairNames;
+
+  // Output columns and the values for the row being built
+  FeatureSchema schema;
+  std::vector<Double_t> v_values;
+
+  // Slots in v_values for each feature, looked up once in the constructor
+  enum Kinematic { PT , ETA , PHI , M , WP , NKINEMATICS };
+  Int_t s_eventId , s_combId , s_tag;
+  Int_t s_nJets , s_nJetsPtAbove[3] , s_nBtags[5];
+  Int_t s_ptMet , s_phiMet;
+  Int_t s_ptLep[4] , s_etaLep[4] , s_phiLep[4] , s_isMuonLep[4];
+  Int_t s_jet[6][NKINEMATICS] , s_bjet[3][NKINEMATICS];
+  Int_t s_htAll , s_htHad;
+  Int_t s_decayT , s_decayTbar , s_decayWp , s_decayWm;
   
-  TString outputPath;
-  std::ofstream *outputCsv;
+  FeatureWriter writer;
+
+  void addFeature( TString s , FeatureSchema::ColumnType type = FeatureSchema::FLOAT32 , Bool_t keep = kFALSE ) { schema.add( s , type , keep ); }
+
+  void setKinematicSlots( Int_t *slots , const TString &suffix ) {
+    slots[PT]  = schema.getSlot( "pt_"+suffix );
+    slots[ETA] = schema.getSlot( "eta_"+suffix );
+    slots[PHI] = schema.getSlot( "phi_"+suffix );
+    slots[M]   = schema.getSlot( "m_"+suffix );
+    slots[WP]  = schema.getSlot( "wp_"+suffix );
+  }
 
-  void addFeature( TString s ) { v_featureNames.push_back(s); }
+  void resolveSlots() {
+    s_eventId = schema.getSlot( "EventId" );
+    s_combId  = schema.getSlot( "CombId" );
+    s_tag     = schema.getSlot( "Tag" );
+    s_nJets   = schema.getSlot( "nJets" );
+    for( int i = 0 ; i < 3 ; i++ ) s_nJetsPtAbove[i] = schema.getSlot( TString::Format("nJetsPtAbove%i",30+10*i) );
+    for( int i = 1 ; i <= 5 ; i++ ) s_nBtags[i-1] = schema.getSlot( TString::Format("nBtags%i",i) );
+    s_ptMet  = schema.getSlot( "pt_met" );
+    s_phiMet = schema.getSlot( "phi_met" );
+    for( int i = 1 ; i <= 4 ; i++ ) {
+      s_ptLep[i-1]     = schema.getSlot( TString::Format("pt_lep%i",i) );
+      s_etaLep[i-1]    = schema.getSlot( TString::Format("eta_lep%i",i) );
+      s_phiLep[i-1]    = schema.getSlot( TString::Format("phi_lep%i",i) );
+      s_isMuonLep[i-1] = schema.getSlot( TString::Format("isMuon_lep%i",i) );
+    }
+    for( int i = 1 ; i <= 6 ; i++ ) setKinematicSlots( s_jet[i-1] , TString::Format("jet%i",i) );
+    for( int i = 1 ; i <= 3 ; i++ ) setKinematicSlots( s_bjet[i-1] , TString::Format("bjet%i",i) );
+    s_htAll     = schema.getSlot( "HT_all" );
+    s_htHad     = schema.getSlot( "HT_had" );
+    s_decayT    = schema.getSlot( "decayT" );
+    s_decayTbar = schema.getSlot( "decayTbar" );
+    s_decayWp   = schema.getSlot( "decayWp" );
+    s_decayWm   = schema.getSlot( "decayWm" );
+  }
+
+  void setKinematics( const Int_t *slots , RecoParticle *p ) {
+    v_values[slots[PT]]  = p->getPt();
+    v_values[slots[ETA]] = p->getEta();
+    v_values[slots[PHI]] = p->getPhi();
+    v_values[slots[M]]   = p->getM();
+    v_values[slots[WP]]  = p->getTagLevel();
+  }
+  void setKinematics( const Int_t *slots , const Double_t &val ) {
+    for( Int_t k = 0 ; k < NKINEMATICS ; k++ ) v_values[slots[k]] = val;
+  }
 
 public:
 
@@ -58,44 +115,46 @@ public:
   {
 
     // Bookkeeping features
-    addFeature( "EventId" );
-    addFeature( "CombId" );
-    addFeature( "Tag" );
+    addFeature( "EventId" , FeatureSchema::INT32 , kTRUE );
+    addFeature( "CombId" , FeatureSchema::INT32 , kTRUE );
+    addFeature( "Tag" , FeatureSchema::INT32 , kTRUE );
 
     // Event-wide features
-    addFeature( "nJets" );
-    for( double pt : { 30 , 40 , 50 } ) addFeature( TString::Format("nJetsPtAbove%i",int(pt)) );
-    for( int i = 1 ; i <= 5 ; i++ ) addFeature( TString::Format("nBtags%i",i) );
+    addFeature( "nJets" , FeatureSchema::INT32 );
+    for( double pt : { 30 , 40 , 50 } ) addFeature( TString::Format("nJetsPtAbove%i",int(pt)) , FeatureSchema::INT32 );
+    for( int i = 1 ; i <= 5 ; i++ ) addFeature( TString::Format("nBtags%i",i) , FeatureSchema::INT32 );
     addFeature( "pt_met" );
     addFeature( "phi_met" );
     for( int i = 1 ; i <= 4 ; i++ ) {
       addFeature( TString::Format("pt_lep%i",i) );
       addFeature( TString::Format("eta_lep%i",i) );
       addFeature( TString::Format("phi_lep%i",i) );
-      addFeature( TString::Format("isMuon_lep%i",i) );
+      addFeature( TString::Format("isMuon_lep%i",i) , FeatureSchema::INT8 );
     }
     for( int i = 1 ; i <= 6 ; i++ ) {
       addFeature( TString::Format("pt_jet%i",i) );
       addFeature( TString::Format("eta_jet%i",i) );
       addFeature( TString::Format("phi_jet%i",i) );
       addFeature( TString::Format("m_jet%i",i) );
-      addFeature( TString::Format("wp_jet%i",i) );
+      addFeature( TString::Format("wp_jet%i",i) , FeatureSchema::INT8 );
     }
     for( int i = 1 ; i <= 3 ; i++ ) {
       addFeature( TString::Format("pt_bjet%i",i) );
       addFeature( TString::Format("eta_bjet%i",i) );
       addFeature( TString::Format("phi_bjet%i",i) );
       addFeature( TString::Format("m_bjet%i",i) );
-      addFeature( TString::Format("wp_bjet%i",i) );
+      addFeature( TString::Format("wp_bjet%i",i) , FeatureSchema::INT8 );
     }
     addFeature( "HT_all" );
     addFeature( "HT_had" );
 
-    addFeature( "decayT" );
-    addFeature( "decayTbar" );
-    addFeature( "decayWp" );
-    addFeature( "decayWm" );
+    addFeature( "decayT" , FeatureSchema::INT32 );
+    addFeature( "decayTbar" , FeatureSchema::INT32 );
+    addFeature( "decayWp" , FeatureSchema::INT32 );
+    addFeature( "decayWm" , FeatureSchema::INT32 );
 
+    v_values = schema.makeRow();
+    resolveSlots();
   }
 
   ~TtbarFeatureExtractor() {}
@@ -108,33 +167,33 @@ public:
   void setTruthSelector( DelphesTruthSelector *s ) { tSel = s; }
   void setTruthSelector( DelphesRootTruthSelector *s ) { tSelRoot = s; }
 
+  // Only write the selected features (everything here is cheap, so they're still all computed).
+  // Has to be called before the output is opened.
+  void selectFeatures( FeatureSelection &sel ) {
+    schema.select( sel );
+    v_values = schema.makeRow();
+    resolveSlots();
+  }
+
 
   //
-  // Functions for building CSV file
+  // Functions for writing the output file
   //
 
-  void openCsv( TString fname ) {
-    outputPath = fname;
-    outputCsv  = new std::ofstream( fname.Data() );
-    (*outputCsv) << v_featureNames[0];
-    for( std::size_t i = 1 ; i < v_featureNames.size() ; i++ ) {
-      (*outputCsv) << "," << v_featureNames[i];
-    }
-    (*outputCsv) << std::endl;
-  }
-  void closeCsv() { outputCsv->close(); }
+  void openOutput( TString fname , FeatureWriter::Format format = FeatureWriter::CSV ) { writer.open( fname , &schema , format ); }
+  void closeOutput() { writer.close(); }
+  void setOutputCompression( CompressedFile::Codec codec , Int_t level = 0 , Int_t nthreads = 1 ) { writer.setCsvCompression( codec , level , nthreads ); }
 
-  void closeAndZipCsv() {
-    outputCsv->close();
-    report::info( "Bzipping %s" , outputPath.Data() );
-    std::system( TString::Format( "bzip2 %s" , outputPath.Data() ).Data() );
-  }
+  // Part files for the multi-threaded loop (see FeatureWriter::openPart)
+  void openOutputPart( TString fname , FeatureWriter::Format format = FeatureWriter::CSV ) { writer.openPart( fname , &schema , format ); }
+  void closeOutputPart() { writer.close(); }
+  void appendOutputPart( TString fname ) { writer.appendPart( fname ); }
   
   void fill( Int_t eventId , Int_t combId , Int_t tag ) {
 
-    m_features["EventId"] = eventId;
-    m_features["CombId"]  = combId;
-    m_features["Tag"]     = tag;
+    v_values[s_eventId] = eventId;
+    v_values[s_combId]  = combId;
+    v_values[s_tag]     = tag;
 
     if( combId <= 0 ) {
 
@@ -142,89 +201,55 @@ public:
       // so we should reset all the event-wide variables that are fixed for all
       // combinations in a given event, e.g. Njets, Nbtags...
       
-      m_features["nJets"] = rSel->getNjets();
-      for( double pt : { 30 , 40 , 50 } ) m_features[TString::Format("nJetsPtAbove%i",int(pt))] = rSel->getNjetsPtAbove(pt);
-      for( int i = 1 ; i <= 5 ; i++ ) m_features[TString::Format("nBtags%i",i)] = rSel->getNbjets(i);
+      v_values[s_nJets] = rSel->getNjets();
+      for( int i = 0 ; i < 3 ; i++ ) v_values[s_nJetsPtAbove[i]] = rSel->getNjetsPtAbove(30+10*i);
+      for( int i = 1 ; i <= 5 ; i++ ) v_values[s_nBtags[i-1]] = rSel->getNbjets(i);
 
-      m_features["pt_met"]  = rSel->getMet()->getPt();
-      m_features["phi_met"] = rSel->getMet()->getPhi();
+      v_values[s_ptMet]  = rSel->getMet()->getPt();
+      v_values[s_phiMet] = rSel->getMet()->getPhi();
       for( int i = 1 ; i <= 4 ; i++ ) {
 	if( rSel->getNlep() < i ) {
-	  m_features[TString::Format("pt_lep%i",i)]     = -10;
-	  m_features[TString::Format("eta_lep%i",i)]    = -10;
-	  m_features[TString::Format("phi_lep%i",i)]    = -10;
-	  m_features[TString::Format("isMuon_lep%i",i)] = -10;
+	  v_values[s_ptLep[i-1]]     = -10;
+	  v_values[s_etaLep[i-1]]    = -10;
+	  v_values[s_phiLep[i-1]]    = -10;
+	  v_values[s_isMuonLep[i-1]] = -10;
 	} else {
-	  m_features[TString::Format("pt_lep%i",i)]     = rSel->getLep(i-1)->getPt();
-	  m_features[TString::Format("eta_lep%i",i)]    = rSel->getLep(i-1)->getEta();
-	  m_features[TString::Format("phi_lep%i",i)]    = rSel->getLep(i-1)->getPhi();
-	  m_features[TString::Format("isMuon_lep%i",i)] = ( rSel->getLep(i-1)->getType()==RecoParticle::MU ? 1 : 0 );
+	  v_values[s_ptLep[i-1]]     = rSel->getLep(i-1)->getPt();
+	  v_values[s_etaLep[i-1]]    = rSel->getLep(i-1)->getEta();
+	  v_values[s_phiLep[i-1]]    = rSel->getLep(i-1)->getPhi();
+	  v_values[s_isMuonLep[i-1]] = ( rSel->getLep(i-1)->getType()==RecoParticle::MU ? 1 : 0 );
 	}
       }
       for( int i = 1 ; i <= 6 ; i++ ) {
-        if( rSel->getNjets() < i ) {
-          m_features[TString::Format("pt_jet%i",i)]  = -10;
-          m_features[TString::Format("eta_jet%i",i)] = -10;
-          m_features[TString::Format("phi_jet%i",i)] = -10;
-          m_features[TString::Format("m_jet%i",i)]   = -10;
-          m_features[TString::Format("wp_jet%i",i)]  = -10;
-        } else {
-          m_features[TString::Format("pt_jet%i",i)]  = rSel->getJet(i-1)->getPt();
-          m_features[TString::Format("eta_jet%i",i)] = rSel->getJet(i-1)->getEta();
-          m_features[TString::Format("phi_jet%i",i)] = rSel->getJet(i-1)->getPhi();
-          m_features[TString::Format("m_jet%i",i)]   = rSel->getJet(i-1)->getM();
-          m_features[TString::Format("wp_jet%i",i)]  = rSel->getJet(i-1)->getTagLevel();
-        }
+        if( rSel->getNjets() < i ) setKinematics( s_jet[i-1] , -10 );
+        else setKinematics( s_jet[i-1] , rSel->getJet(i-1) );
       }
       for( int i = 1 ; i <= 3 ; i++ ) {
-        if( rSel->getNbjets() < i ) {
-          m_features[TString::Format("pt_bjet%i",i)]  = -10;
-          m_features[TString::Format("eta_bjet%i",i)] = -10;
-          m_features[TString::Format("phi_bjet%i",i)] = -10;
-          m_features[TString::Format("m_bjet%i",i)]   = -10;
-          m_features[TString::Format("wp_bjet%i",i)]  = -10;
-        } else {
-          m_features[TString::Format("pt_bjet%i",i)]  = rSel->getBJet(i-1)->getPt();
-          m_features[TString::Format("eta_bjet%i",i)] = rSel->getBJet(i-1)->getEta();
-          m_features[TString::Format("phi_bjet%i",i)] = rSel->getBJet(i-1)->getPhi();
-          m_features[TString::Format("m_bjet%i",i)]   = rSel->getBJet(i-1)->getM();
-          m_features[TString::Format("wp_bjet%i",i)]  = rSel->getBJet(i-1)->getTagLevel();
-        }
+        if( rSel->getNbjets() < i ) setKinematics( s_bjet[i-1] , -10 );
+        else setKinematics( s_bjet[i-1] , rSel->getBJet(i-1) );
       }
-      m_features["HT_all"] = rSel->getHtAll();
-      m_features["HT_had"] = rSel->getHtHad();
+      v_values[s_htAll] = rSel->getHtAll();
+      v_values[s_htHad] = rSel->getHtHad();
 
       if( tSel ) {
-	m_features["decayT"]    = tSel->getDecayT();
-	m_features["decayTbar"] = tSel->getDecayTbar();
-	m_features["decayWp"]   = tSel->getDecayWp();
-	m_features["decayWm"]   = tSel->getDecayWm();
+	v_values[s_decayT]    = tSel->getDecayT();
+	v_values[s_decayTbar] = tSel->getDecayTbar();
+	v_values[s_decayWp]   = tSel->getDecayWp();
+	v_values[s_decayWm]   = tSel->getDecayWm();
       } else {
-	m_features["decayT"]    = tSelRoot->getDecayT();
-	m_features["decayTbar"] = tSelRoot->getDecayTbar();
-	m_features["decayWp"]   = tSelRoot->getDecayWp();
-	m_features["decayWm"]   = tSelRoot->getDecayWm();
+	v_values[s_decayT]    = tSelRoot->getDecayT();
+	v_values[s_decayTbar] = tSelRoot->getDecayTbar();
+	v_values[s_decayWp]   = tSelRoot->getDecayWp();
+	v_values[s_decayWm]   = tSelRoot->getDecayWm();
       }	
       
     }
 
   }
 
-  void save() {
-    (*outputCsv) << m_features[v_featureNames[0]];
-    for( std::size_t i = 1 ; i < v_featureNames.size() ; i++ ) {
-      (*outputCsv) << "," << m_features[v_featureNames[i]];
-    }
-    (*outputCsv) << std::endl;
-  }
+  void save() { writer.writeRow( v_values ); }
 
-  void dump() {
-    std::cout << std::endl;
-    for( std::size_t i = 0 ; i < v_featureNames.size() ; i++ ) {
-      std::cout << TString::Format("%25s",v_featureNames[i].Data()) << " = " << m_features[v_featureNames[i]] << std::endl;
-    }
-    std::cout << std::endl;
-  }
+  void dump() { schema.dump( v_values ); }
 
 
 
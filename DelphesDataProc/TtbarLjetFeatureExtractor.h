@@ -19,6 +19,10 @@
 #include "Report.h"
 #include "Particle.h"
 #include "RecoParticleCollection.h"
+#include "ShapeKernel.h"
+#include "FeatureSchema.h"
+#include "FeatureSelection.h"
+#include "FeatureWriter.h"
 #include "DelphesRecoSelector.h"
 
 
@@ -41,24 +45,287 @@ private:
   RecoParticle *nuSol1;
   RecoParticle *nuSol2;
 
-  std::map<TString,Double_t> m_features;
-  std::vector<TString> v_featureNames;
-
   std::vector<TString> v_eventCollectionNames;
   std::vector<TString> v_extendedCollectionNames;
   std::vector<TString> v_shapeNames;
   std::vector< std::pair<TString,TString> > v_pairNames;
 
-  TString outputPath;
-  std::ofstream *outputCsv;
+  // Output columns and the values for the row being built
+  FeatureSchema schema;
+  std::vector<Double_t> v_values;
+
+  //
+  // Single particles and multi-particle systems that the features are built from. The
+  // names used above are turned into these indices (and the feature names into slots in
+  // v_values) once in the constructor, so fill() doesn't have to deal with strings.
+  //
+  enum Object { LEPTOPJET , HADTOPJET , HADWJET1 , HADWJET2 , LEP , NUSOL1 , NUSOL2 ,
+		HADW , LEPWSOL1 , LEPWSOL2 , HADTOP , LEPTOPSOL1 , LEPTOPSOL2 , TTBARSOL1 , TTBARSOL2 , NOBJECTS };
+  enum Kinematic { PT , ETA , PHI , M , WP , NKINEMATICS };
+
+  RecoParticleCollection *m_collections[NOBJECTS]; // only the multi-particle systems are used
+  FourVector m_allV4[NOBJECTS];
+
+  //
+  // Per-event cache of the multi-particle systems, keyed by the set of jets in them (a bit
+  // per jet of the event). Most systems are shared by many combinations, e.g. hadW only
+  // depends on the two W jets, lepTopSol1/2 only on lepTopJet, and ttbarSol1/2 only on which
+  // four jets are used, so each of them is built (and diagonalised) once per event.
+  //
+  std::vector<RecoParticle*> v_eventJets;
+  std::map<UInt_t,RecoParticleCollection> m_cache[NOBJECTS];
+  Bool_t newEvent; // the event-wide features still have to be set
+
+  // Systems added with addCombination() whose shapes are worked out together by
+  // computeShapes(), and their index in the kernel
+  ShapeKernel kernel;
+  std::vector< std::pair<RecoParticleCollection*,std::size_t> > v_queued;
+
+  UInt_t getJetBit( RecoParticle *j ) const {
+    for( std::size_t i = 0 ; i < v_eventJets.size() ; i++ ) if( v_eventJets[i] == j ) return 1u << i;
+    report::error( "TtbarLjetFeatureExtractor : jet isn't one of the jets of the event (missing beginEvent?)" );
+    assert( false );
+    return 0;
+  }
+
+  UInt_t getJetMask( const Int_t &object , const UInt_t *bits ) const {
+    switch( object ) {
+    case HADW:       return bits[HADWJET1] | bits[HADWJET2];
+    case LEPWSOL1:   return 0;
+    case LEPWSOL2:   return 0;
+    case HADTOP:     return bits[HADTOPJET] | bits[HADWJET1] | bits[HADWJET2];
+    case LEPTOPSOL1: return bits[LEPTOPJET];
+    case LEPTOPSOL2: return bits[LEPTOPJET];
+    case TTBARSOL1:  return bits[HADTOPJET] | bits[HADWJET1] | bits[HADWJET2] | bits[LEPTOPJET];
+    case TTBARSOL2:  return bits[HADTOPJET] | bits[HADWJET1] | bits[HADWJET2] | bits[LEPTOPJET];
+    }
+    assert( false );
+    return 0;
+  }
+
+  // How much of each multi-particle system the selected features need. The shapes (three
+  // eigen-decompositions per system) are by far the most expensive part of fill().
+  enum Need { NEED_NONE , NEED_V4 , NEED_SHAPES };
+  Int_t m_need[NOBJECTS];
+
+  struct CollectionSlots {
+    Int_t object;
+    Int_t eta , m , pt , phi , mt , wpsum , ptsum;
+    Int_t shapes[RecoParticleCollection::NSHAPES];
+  };
+  struct PairSlots {
+    Int_t first , second;
+    Int_t dphi , deta , dr;
+  };
+  std::vector<CollectionSlots> v_eventCollectionSlots;
+  std::vector<CollectionSlots> v_extendedCollectionSlots;
+  std::vector<PairSlots> v_pairSlots;
+
+  Int_t s_eventId , s_combId;
+  Int_t s_nJets , s_nJetsPtAbove[3] , s_nBtags[5];
+  Int_t s_leptonIsMuon , s_nuMomentumSolved;
+  Int_t s_ptLep , s_etaLep , s_phiLep;
+  Int_t s_ptNuSol1 , s_etaNuSol1 , s_etaNuSol2 , s_phiNuSol1;
+  Int_t s_jet[6][NKINEMATICS] , s_bjet[3][NKINEMATICS];
+  Int_t s_htAll , s_htHad;
+  Int_t s_nBtagsTtbar[6] , s_nBtagsTtbarDecay[6];
+  Int_t s_combJet[4][NKINEMATICS]; // lepTopJet, hadTopJet, hadWJet1, hadWJet2
+  Int_t s_signal;
+
+  FeatureWriter writer;
+
+  void addFeature( TString s , FeatureSchema::ColumnType type = FeatureSchema::FLOAT32 , Bool_t keep = kFALSE ) { schema.add( s , type , keep ); }
+
+  static Int_t getObjectIndex( const TString &n ) {
+    static const char* names[NOBJECTS] = { "lepTopJet" , "hadTopJet" , "hadWJet1" , "hadWJet2" , "lep" , "nuSol1" , "nuSol2" ,
+					   "hadW" , "lepWSol1" , "lepWSol2" , "hadTop" , "lepTopSol1" , "lepTopSol2" , "ttbarSol1" , "ttbarSol2" };
+    for( Int_t i = 0 ; i < NOBJECTS ; i++ ) {
+      if( n==TString(names[i]) ) return i;
+    }
+    report::error( "TtbarLjetFeatureExtractor : unknown object %s" , n.Data() );
+    assert( false );
+    return NOBJECTS;
+  }
+
+  void setKinematicSlots( Int_t *slots , const TString &suffix ) {
+    slots[PT]  = schema.getSlot( "pt_"+suffix );
+    slots[ETA] = schema.getSlot( "eta_"+suffix );
+    slots[PHI] = schema.getSlot( "phi_"+suffix );
+    slots[M]   = schema.getSlot( "m_"+suffix );
+    slots[WP]  = schema.getSlot( "wp_"+suffix );
+  }
+
+  CollectionSlots getCollectionSlots( const TString &n ) {
+    CollectionSlots c;
+    c.object = getObjectIndex( n );
+    c.eta    = schema.getSlot( "eta_"+n );
+    c.m      = schema.getSlot( "m_"+n );
+    c.pt     = schema.getSlot( "pt_"+n );
+    c.phi    = schema.getSlot( "phi_"+n );
+    c.mt     = schema.getSlot( "mt_"+n );
+    c.wpsum  = schema.getSlot( "wpsum_"+n );
+    c.ptsum  = schema.getSlot( "ptsum_"+n );
+    for( Int_t i = 0 ; i < RecoParticleCollection::NSHAPES ; i++ ) c.shapes[i] = schema.getSink();
+    for( TString s : v_shapeNames ) c.shapes[RecoParticleCollection::getShapeIndex(s)] = schema.getSlot( s+"_"+n );
+    return c;
+  }
+
+  Bool_t usesShapes( const CollectionSlots &c ) const {
+    for( Int_t i = 0 ; i < RecoParticleCollection::NSHAPES ; i++ ) if( ! schema.isSink(c.shapes[i]) ) return kTRUE;
+    return kFALSE;
+  }
+  Bool_t usesAny( const CollectionSlots &c ) const {
+    for( Int_t slot : { c.eta , c.m , c.pt , c.phi , c.mt , c.wpsum , c.ptsum } ) if( ! schema.isSink(slot) ) return kTRUE;
+    return usesShapes( c );
+  }
+
+  void require( const Int_t &object , const Int_t &need ) {
+    if( object >= HADW && need > m_need[object] ) m_need[object] = need;
+  }
+
+  // Drops the collections and pairs without any selected features and works out what fill()
+  // has to build for the rest
+  void planCalculations() {
+    for( Int_t i = 0 ; i < NOBJECTS ; i++ ) m_need[i] = NEED_NONE;
+    for( std::vector<CollectionSlots> *v : { &v_eventCollectionSlots , &v_extendedCollectionSlots } ) {
+      std::vector<CollectionSlots> used;
+      for( const CollectionSlots &c : *v ) {
+	if( ! usesAny(c) ) continue;
+	require( c.object , usesShapes(c) ? NEED_SHAPES : NEED_V4 );
+	used.push_back( c );
+      }
+      v->swap( used );
+    }
+    std::vector<PairSlots> used;
+    for( const PairSlots &p : v_pairSlots ) {
+      if( schema.isSink(p.dphi) && schema.isSink(p.deta) && schema.isSink(p.dr) ) continue;
+      require( p.first , NEED_V4 );
+      require( p.second , NEED_V4 );
+      used.push_back( p );
+    }
+    v_pairSlots.swap( used );
+  }
+
+  void setCombination( RecoParticle *_lepTopJet , RecoParticle *_hadTopJet , RecoParticle *_hadWJet1 , RecoParticle *_hadWJet2 , UInt_t *bits ) {
+    lepTopJet = _lepTopJet;
+    hadTopJet = _hadTopJet;
+    hadWJet1  = _hadWJet1;
+    hadWJet2  = _hadWJet2;
+    lep       = rSel->getLep(0);
+    nuSol1    = rSel->getNu(0);
+    nuSol2    = rSel->getNu(1);
+    bits[LEPTOPJET] = getJetBit( lepTopJet );
+    bits[HADTOPJET] = getJetBit( hadTopJet );
+    bits[HADWJET1]  = getJetBit( hadWJet1 );
+    bits[HADWJET2]  = getJetBit( hadWJet2 );
+  }
+
+  // Finds (or builds) the multi-particle system of the current combination. Queued systems
+  // get their shapes from the kernel, others calculate them as they're asked for.
+  RecoParticleCollection* getCollection( const Int_t &object , const UInt_t *bits , const Bool_t &queue = kFALSE ) {
+    const UInt_t key = getJetMask( object , bits );
+    std::map<UInt_t,RecoParticleCollection>::iterator it = m_cache[object].find( key );
+    if( it != m_cache[object].end() ) return &it->second;
+    const Bool_t shapes = m_need[object] == NEED_SHAPES;
+    const std::vector<RecoParticle*> v = getParticles( object );
+    it = m_cache[object].insert( std::make_pair( key , RecoParticleCollection( v , shapes && ! queue ) ) ).first;
+    if( shapes && queue ) v_queued.push_back( std::make_pair( &it->second , kernel.add( v ) ) );
+    return &it->second;
+  }
+
+  std::vector<RecoParticle*> getParticles( const Int_t &object ) {
+    switch( object ) {
+    case HADW:       return { hadWJet1 , hadWJet2 };
+    case LEPWSOL1:   return { lep , nuSol1 };
+    case LEPWSOL2:   return { lep , nuSol2 };
+    case HADTOP:     return { hadTopJet , hadWJet1 , hadWJet2 };
+    case LEPTOPSOL1: return { lepTopJet , lep , nuSol1 };
+    case LEPTOPSOL2: return { lepTopJet , lep , nuSol2 };
+    case TTBARSOL1:  return { hadTopJet , hadWJet1 , hadWJet2 , lepTopJet , lep , nuSol1 };
+    case TTBARSOL2:  return { hadTopJet , hadWJet1 , hadWJet2 , lepTopJet , lep , nuSol2 };
+    }
+    assert( false );
+    return {};
+  }
+
+  // Look up where every feature that fill() sets lives in v_values. Features that fill()
+  // calculates but that aren't output columns all share the sink slot.
+  void resolveSlots() {
+    v_eventCollectionSlots.clear();
+    v_extendedCollectionSlots.clear();
+    v_pairSlots.clear();
+    s_eventId = schema.getSlot( "EventId" );
+    s_combId  = schema.getSlot( "CombId" );
+    s_nJets   = schema.getSlot( "nJets" );
+    for( int i = 0 ; i < 3 ; i++ ) s_nJetsPtAbove[i] = schema.getSlot( TString::Format("nJetsPtAbove%i",30+10*i) );
+    for( int i = 1 ; i <= 5 ; i++ ) s_nBtags[i-1] = schema.getSlot( TString::Format("nBtags%i",i) );
+    s_leptonIsMuon     = schema.getSlot( "leptonIsMuon" );
+    s_nuMomentumSolved = schema.getSlot( "nuMomentumSolved" );
+    s_ptLep      = schema.getSlot( "pt_lep" );
+    s_etaLep     = schema.getSlot( "eta_lep" );
+    s_phiLep     = schema.getSlot( "phi_lep" );
+    s_ptNuSol1   = schema.getSlot( "pt_nuSol1" );
+    s_etaNuSol1  = schema.getSlot( "eta_nuSol1" );
+    s_etaNuSol2  = schema.getSlot( "eta_nuSol2" );
+    s_phiNuSol1  = schema.getSlot( "phi_nuSol1" );
+    for( int i = 1 ; i <= 6 ; i++ ) setKinematicSlots( s_jet[i-1] , TString::Format("jet%i",i) );
+    for( int i = 1 ; i <= 3 ; i++ ) setKinematicSlots( s_bjet[i-1] , TString::Format("bjet%i",i) );
+    s_htAll = schema.getSlot( "HT_all" );
+    s_htHad = schema.getSlot( "HT_had" );
+    for( TString n : v_eventCollectionNames ) v_eventCollectionSlots.push_back( getCollectionSlots(n) );
+    for( int i = 0 ; i <= 5 ; i++ ) s_nBtagsTtbar[i] = schema.getSlot( TString::Format("nBtags%i_ttbar",i) );
+    for( int i = 0 ; i <= 5 ; i++ ) s_nBtagsTtbarDecay[i] = schema.getSlot( TString::Format("nBtags%i_ttbarDecay",i) );
+    setKinematicSlots( s_combJet[0] , "lepTopJet" );
+    setKinematicSlots( s_combJet[1] , "hadTopJet" );
+    setKinematicSlots( s_combJet[2] , "hadWJet1" );
+    setKinematicSlots( s_combJet[3] , "hadWJet2" );
+    for( TString n : v_extendedCollectionNames ) v_extendedCollectionSlots.push_back( getCollectionSlots(n) );
+    for( std::pair<TString,TString> p : v_pairNames ) {
+      PairSlots ps;
+      ps.first  = getObjectIndex( p.first );
+      ps.second = getObjectIndex( p.second );
+      ps.dphi   = schema.getSlot( "dphi_"+p.first+"_"+p.second );
+      ps.deta   = schema.getSlot( "deta_"+p.first+"_"+p.second );
+      ps.dr     = schema.getSlot( "dr_"+p.first+"_"+p.second );
+      v_pairSlots.push_back( ps );
+    }
+    s_signal = schema.getSlot( "signal" );
+    planCalculations();
+  }
 
-  void addFeature( TString s ) { v_featureNames.push_back(s); }
+  void setKinematics( const Int_t *slots , RecoParticle *p ) {
+    v_values[slots[PT]]  = p->getPt();
+    v_values[slots[ETA]] = p->getEta();
+    v_values[slots[PHI]] = p->getPhi();
+    v_values[slots[M]]   = p->getM();
+    v_values[slots[WP]]  = p->getTagLevel();
+  }
+  void setKinematics( const Int_t *slots , const Double_t &val ) {
+    for( Int_t k = 0 ; k < NKINEMATICS ; k++ ) v_values[slots[k]] = val;
+  }
+
+  void setCollectionFeatures( const CollectionSlots &c ) {
+    RecoParticleCollection &coll = *m_collections[c.object];
+    v_values[c.eta]   = coll.getEta();
+    v_values[c.m]     = coll.getM();
+    v_values[c.pt]    = coll.getPt();
+    v_values[c.phi]   = coll.getPhi();
+    v_values[c.mt]    = coll.getMt();
+    v_values[c.wpsum] = coll.getWpsum();
+    v_values[c.ptsum] = coll.getPtsum();
+    // The eigenvalues behind the shapes are only solved for if a selected shape needs them
+    for( Int_t i = 0 ; i < RecoParticleCollection::NSHAPES ; i++ )
+      if( ! schema.isSink(c.shapes[i]) ) v_values[c.shapes[i]] = coll.getShape( i );
+  }
 
 
 public:
 
   TtbarLjetFeatureExtractor() {
 
+    for( Int_t i = 0 ; i < NOBJECTS ; i++ ) m_collections[i] = 0;
+    newEvent = kTRUE;
+
     // Multi-particle systems to use when building event features
     v_eventCollectionNames =  {
       "lepWSol1" ,
@@ -180,15 +447,15 @@ public:
     };
     
     // Bookkeeping features
-    addFeature( "EventId" );
-    addFeature( "CombId" );
+    addFeature( "EventId" , FeatureSchema::INT32 , kTRUE );
+    addFeature( "CombId" , FeatureSchema::INT32 , kTRUE );
 
     // Event-wide features
-    addFeature( "nJets" );
-    for( double pt : { 30 , 40 , 50 } ) addFeature( TString::Format("nJetsPtAbove%i",int(pt)) );
-    for( int i = 1 ; i <= 5 ; i++ ) addFeature( TString::Format("nBtags%i",i) );
-    addFeature( "leptonIsMuon" );
-    addFeature( "nuMomentumSolved" );
+    addFeature( "nJets" , FeatureSchema::INT32 );
+    for( double pt : { 30 , 40 , 50 } ) addFeature( TString::Format("nJetsPtAbove%i",int(pt)) , FeatureSchema::INT32 );
+    for( int i = 1 ; i <= 5 ; i++ ) addFeature( TString::Format("nBtags%i",i) , FeatureSchema::INT32 );
+    addFeature( "leptonIsMuon" , FeatureSchema::INT8 );
+    addFeature( "nuMomentumSolved" , FeatureSchema::INT8 );
     addFeature( "pt_lep" );
     addFeature( "eta_lep" );
     addFeature( "phi_lep" );
@@ -201,14 +468,14 @@ public:
       addFeature( TString::Format("eta_jet%i",i) );
       addFeature( TString::Format("phi_jet%i",i) );
       addFeature( TString::Format("m_jet%i",i) );
-      addFeature( TString::Format("wp_jet%i",i) );
+      addFeature( TString::Format("wp_jet%i",i) , FeatureSchema::INT8 );
     }
     for( int i = 1 ; i <= 3 ; i++ ) {
       addFeature( TString::Format("pt_bjet%i",i) );
       addFeature( TString::Format("eta_bjet%i",i) );
       addFeature( TString::Format("phi_bjet%i",i) );
       addFeature( TString::Format("m_bjet%i",i) );
-      addFeature( TString::Format("wp_bjet%i",i) );
+      addFeature( TString::Format("wp_bjet%i",i) , FeatureSchema::INT8 );
     }
     addFeature( "HT_all" );
     addFeature( "HT_had" );
@@ -238,28 +505,28 @@ public:
     }
 
     // Combination-specific basic features
-    for( int i = 1 ; i <= 5 ; i++ ) addFeature( TString::Format("nBtags%i_ttbar",i) );
-    for( int i = 1 ; i <= 5 ; i++ ) addFeature( TString::Format("nBtags%i_ttbarDecay",i) );
+    for( int i = 1 ; i <= 5 ; i++ ) addFeature( TString::Format("nBtags%i_ttbar",i) , FeatureSchema::INT32 );
+    for( int i = 1 ; i <= 5 ; i++ ) addFeature( TString::Format("nBtags%i_ttbarDecay",i) , FeatureSchema::INT32 );
     addFeature( "pt_lepTopJet" );
     addFeature( "eta_lepTopJet" );
     addFeature( "phi_lepTopJet" );
     addFeature( "m_lepTopJet" );
-    addFeature( "wp_lepTopJet" );
+    addFeature( "wp_lepTopJet" , FeatureSchema::INT8 );
     addFeature( "pt_hadTopJet" );
     addFeature( "eta_hadTopJet" );
     addFeature( "phi_hadTopJet" );
     addFeature( "m_hadTopJet" );
-    addFeature( "wp_hadTopJet" );
+    addFeature( "wp_hadTopJet" , FeatureSchema::INT8 );
     addFeature( "pt_hadWJet1" );
     addFeature( "eta_hadWJet1" );
     addFeature( "phi_hadWJet1" );
     addFeature( "m_hadWJet1" );
-    addFeature( "wp_hadWJet1" );
+    addFeature( "wp_hadWJet1" , FeatureSchema::INT8 );
     addFeature( "pt_hadWJet2" );
     addFeature( "eta_hadWJet2" );
     addFeature( "phi_hadWJet2" );
     addFeature( "m_hadWJet2" );
-    addFeature( "wp_hadWJet2" );
+    addFeature( "wp_hadWJet2" , FeatureSchema::INT8 );
 
 
     // Combination-specific extended features
@@ -272,7 +539,7 @@ public:
 	addFeature( "ptsum_"+n );
       }
       if( n.Contains("had") || (n.Contains("ttbar") && !n.Contains("Sol2")) ) {
-	addFeature( "wpsum_"+n );
+	addFeature( "wpsum_"+n , FeatureSchema::INT32 );
       }
       for( TString s : v_shapeNames ) {
 	// For 2 object systems (i.e. reconstructed W candidates) some of the shape
@@ -300,7 +567,10 @@ public:
     }
     
     // Training output
-    addFeature( "signal" );
+    addFeature( "signal" , FeatureSchema::INT8 , kTRUE );
+
+    v_values = schema.makeRow();
+    resolveSlots();
   }
 
   ~TtbarLjetFeatureExtractor() {}
@@ -310,6 +580,42 @@ public:
   //
 
   void setRecoSelector( DelphesRecoSelector *_rSel ) { rSel = _rSel; }
+
+  // Has to be called before the combinations of each event are filled
+  void beginEvent() {
+    v_eventJets.clear();
+    for( std::size_t i = 0 ; i < rSel->getNjets() ; i++ ) v_eventJets.push_back( rSel->getJet(i) );
+    if( v_eventJets.size() > 32 ) v_eventJets.resize( 32 );
+    for( Int_t i = 0 ; i < NOBJECTS ; i++ ) m_cache[i].clear();
+    kernel.clear();
+    v_queued.clear();
+    newEvent = kTRUE;
+  }
+
+  //
+  // Optional batching of the shape calculations: after beginEvent(), add every combination
+  // that will be filled, then call computeShapes() once before the fill()s. This builds the
+  // multi-particle systems of all of them and works out their shapes in one ShapeKernel call.
+  //
+  void addCombination( RecoParticle *_lepTopJet , RecoParticle *_hadTopJet , RecoParticle *_hadWJet1 , RecoParticle *_hadWJet2 ) {
+    UInt_t bits[HADW];
+    setCombination( _lepTopJet , _hadTopJet , _hadWJet1 , _hadWJet2 , bits );
+    for( Int_t i = HADW ; i < NOBJECTS ; i++ ) if( m_need[i] != NEED_NONE ) getCollection( i , bits , kTRUE );
+  }
+
+  void computeShapes() {
+    kernel.run();
+    for( std::pair<RecoParticleCollection*,std::size_t> &q : v_queued ) q.first->setShapes( kernel.getShapes( q.second ) );
+    kernel.clear();
+    v_queued.clear();
+  }
+
+  // Only compute and write the selected features. Has to be called before the output is opened.
+  void selectFeatures( FeatureSelection &sel ) {
+    schema.select( sel );
+    v_values = schema.makeRow();
+    resolveSlots();
+  }
   Int_t getNbtagsTtbarDecay( int wp ) {
     Int_t res = 0;
     if( lepTopJet->getTagLevel() >= wp ) res++;
@@ -334,198 +640,104 @@ public:
 
 
   //
-  // Functions for building CSV file
+  // Functions for writing the output file
   //
 
-  void openCsv( TString fname ) {
-    outputPath = fname;
-    outputCsv  = new std::ofstream( fname.Data() );
-    (*outputCsv) << v_featureNames[0];
-    for( std::size_t i = 1 ; i < v_featureNames.size() ; i++ ) {
-      (*outputCsv) << "," << v_featureNames[i];
-    }
-    (*outputCsv) << std::endl;
-  }
-  void closeCsv() { outputCsv->close(); }
+  void openOutput( TString fname , FeatureWriter::Format format = FeatureWriter::CSV ) { writer.open( fname , &schema , format ); }
+  void closeOutput() { writer.close(); }
+  void setOutputCompression( CompressedFile::Codec codec , Int_t level = 0 , Int_t nthreads = 1 ) { writer.setCsvCompression( codec , level , nthreads ); }
 
-  void closeAndZipCsv() {
-    outputCsv->close();
-    report::info( "Bzipping %s" , outputPath.Data() );
-    std::system( TString::Format( "bzip2 %s" , outputPath.Data() ).Data() );
-  }
+  // Part files for the multi-threaded loop (see FeatureWriter::openPart)
+  void openOutputPart( TString fname , FeatureWriter::Format format = FeatureWriter::CSV ) { writer.openPart( fname , &schema , format ); }
+  void closeOutputPart() { writer.close(); }
+  void appendOutputPart( TString fname ) { writer.appendPart( fname ); }
 
   void fill( Int_t eventId , Int_t combId , RecoParticle *_lepTopJet , RecoParticle *_hadTopJet , RecoParticle *_hadWJet1 , RecoParticle *_hadWJet2 ) {
 
-    lepTopJet = _lepTopJet;
-    hadTopJet = _hadTopJet;
-    hadWJet1  = _hadWJet1;
-    hadWJet2  = _hadWJet2;
-    lep       = rSel->getLep(0);
-    nuSol1    = rSel->getNu(0);
-    nuSol2    = rSel->getNu(1);
-
-    // Build some collections for extended shape features
-    std::map<TString,RecoParticleCollection> m_collections;
-    m_collections["hadW"]       = RecoParticleCollection( { hadWJet1 , hadWJet2 } );
-    m_collections["lepWTrans"]  = RecoParticleCollection( { lep , rSel->getMet() } );
-    m_collections["lepWSol1"]   = RecoParticleCollection( { lep , nuSol1 } );
-    m_collections["lepWSol2"]   = RecoParticleCollection( { lep , nuSol2 } );
-    m_collections["hadTop"]     = RecoParticleCollection( { hadTopJet , hadWJet1 , hadWJet2 } );
-    m_collections["lepTopSol1"] = RecoParticleCollection( { lepTopJet , lep , nuSol1 } );
-    m_collections["lepTopSol2"] = RecoParticleCollection( { lepTopJet , lep , nuSol2 } );
-    m_collections["ttbarSol1"]  = RecoParticleCollection( { hadTopJet , hadWJet1 , hadWJet2 , lepTopJet , lep , nuSol1 } );
-    m_collections["ttbarSol2"]  = RecoParticleCollection( { hadTopJet , hadWJet1 , hadWJet2 , lepTopJet , lep , nuSol2 } );
+    // Find (or build) the collections for extended shape features, as far as the selected
+    // features need them
+    UInt_t bits[HADW];
+    setCombination( _lepTopJet , _hadTopJet , _hadWJet1 , _hadWJet2 , bits );
+    for( Int_t i = HADW ; i < NOBJECTS ; i++ ) {
+      if( m_need[i] == NEED_NONE ) continue;
+      m_collections[i] = getCollection( i , bits );
+      m_allV4[i] = m_collections[i]->getP4();
+    }
     
-    std::map<TString,TLorentzVector> m_allV4;
-    m_allV4["lepTopJet"]  = lepTopJet->getV4();
-    m_allV4["hadTopJet"]  = hadTopJet->getV4();
-    m_allV4["hadWJet1"]	  = hadWJet1->getV4();
-    m_allV4["hadWJet2"]	  = hadWJet2->getV4();
-    m_allV4["lep"]	  = lep->getV4();
-    m_allV4["nuSol1"]	  = nuSol1->getV4();
-    m_allV4["nuSol2"]	  = nuSol2->getV4();
-    m_allV4["hadW"]	  = m_collections["hadW"].getV4();
-    m_allV4["lepWSol1"]	  = m_collections["lepWSol1"].getV4();
-    m_allV4["lepWSol2"]	  = m_collections["lepWSol2"].getV4();
-    m_allV4["hadTop"]	  = m_collections["hadTop"].getV4();
-    m_allV4["lepTopSol1"] = m_collections["lepTopSol1"].getV4();
-    m_allV4["lepTopSol2"] = m_collections["lepTopSol2"].getV4();
-    m_allV4["ttbarSol1"]  = m_collections["ttbarSol1"].getV4();
-    m_allV4["ttbarSol2"]  = m_collections["ttbarSol2"].getV4();
+    m_allV4[LEPTOPJET] = lepTopJet->getP4();
+    m_allV4[HADTOPJET] = hadTopJet->getP4();
+    m_allV4[HADWJET1]  = hadWJet1->getP4();
+    m_allV4[HADWJET2]  = hadWJet2->getP4();
+    m_allV4[LEP]       = lep->getP4();
+    m_allV4[NUSOL1]    = nuSol1->getP4();
+    m_allV4[NUSOL2]    = nuSol2->getP4();
     
-    m_features["EventId"] = eventId;
-    m_features["CombId"]  = combId;
-
-    if( combId == 0 ) {
-
-      // This is the first fill of a new event
-      // so we should reset all the event-wide variables that are fixed for all
-      // combinations in a given event, e.g. Njets, Nbtags...
-
-      m_features["nJets"] = rSel->getNjets();
-      for( double pt : { 30 , 40 , 50 } ) m_features[TString::Format("nJetsPtAbove%i",int(pt))] = rSel->getNjetsPtAbove(pt);
-      for( int i = 1 ; i <= 5 ; i++ ) m_features[TString::Format("nBtags%i",i)] = rSel->getNbjets(i);
-
-      m_features["leptonIsMuon"] = ( lep->getType()==RecoParticle::MU ? 1 : 0 );
-      m_features["nuMomentumSolved"] = ( rSel->getNuMomentumSolved() ? 1 : 0 );
-      m_features["pt_lep"]  = lep->getPt();
-      m_features["eta_lep"] = lep->getEta();
-      m_features["phi_lep"] = lep->getPhi();
-      m_features["pt_nuSol1"]  = nuSol1->getPt();
-      m_features["eta_nuSol1"] = nuSol1->getEta();
-      m_features["eta_nuSol2"] = nuSol2->getEta();
-      m_features["phi_nuSol1"] = nuSol1->getPhi();
+    v_values[s_eventId] = eventId;
+    v_values[s_combId]  = combId;
+
+    if( newEvent ) {
+
+      // This is the first fill of a new event (which isn't necessarily combination 0, if
+      // combinations are filtered) so we should reset all the event-wide variables that are
+      // fixed for all combinations in a given event, e.g. Njets, Nbtags...
+      newEvent = kFALSE;
+
+      v_values[s_nJets] = rSel->getNjets();
+      for( int i = 0 ; i < 3 ; i++ ) v_values[s_nJetsPtAbove[i]] = rSel->getNjetsPtAbove(30+10*i);
+      for( int i = 1 ; i <= 5 ; i++ ) v_values[s_nBtags[i-1]] = rSel->getNbjets(i);
+
+      v_values[s_leptonIsMuon] = ( lep->getType()==RecoParticle::MU ? 1 : 0 );
+      v_values[s_nuMomentumSolved] = ( rSel->getNuMomentumSolved() ? 1 : 0 );
+      v_values[s_ptLep]  = lep->getPt();
+      v_values[s_etaLep] = lep->getEta();
+      v_values[s_phiLep] = lep->getPhi();
+      v_values[s_ptNuSol1]  = nuSol1->getPt();
+      v_values[s_etaNuSol1] = nuSol1->getEta();
+      v_values[s_etaNuSol2] = nuSol2->getEta();
+      v_values[s_phiNuSol1] = nuSol1->getPhi();
       for( int i = 1 ; i <= 6 ; i++ ) {
-        if( rSel->getNjets() < i ) {
-          m_features[TString::Format("pt_jet%i",i)]  = -10;
-          m_features[TString::Format("eta_jet%i",i)] = -10;
-          m_features[TString::Format("phi_jet%i",i)] = -10;
-          m_features[TString::Format("m_jet%i",i)]   = -10;
-          m_features[TString::Format("wp_jet%i",i)]  = -10;
-        } else {
-          m_features[TString::Format("pt_jet%i",i)]  = rSel->getJet(i-1)->getPt();
-          m_features[TString::Format("eta_jet%i",i)] = rSel->getJet(i-1)->getEta();
-          m_features[TString::Format("phi_jet%i",i)] = rSel->getJet(i-1)->getPhi();
-          m_features[TString::Format("m_jet%i",i)]   = rSel->getJet(i-1)->getM();
-          m_features[TString::Format("wp_jet%i",i)]  = rSel->getJet(i-1)->getTagLevel();
-        }
+        if( rSel->getNjets() < i ) setKinematics( s_jet[i-1] , -10 );
+        else setKinematics( s_jet[i-1] , rSel->getJet(i-1) );
       }
       for( int i = 1 ; i <= 3 ; i++ ) {
-        if( rSel->getNbjets() < i ) {
-          m_features[TString::Format("pt_bjet%i",i)]  = -10;
-          m_features[TString::Format("eta_bjet%i",i)] = -10;
-          m_features[TString::Format("phi_bjet%i",i)] = -10;
-          m_features[TString::Format("m_bjet%i",i)]   = -10;
-          m_features[TString::Format("wp_bjet%i",i)]  = -10;
-        } else {
-          m_features[TString::Format("pt_bjet%i",i)]  = rSel->getBJet(i-1)->getPt();
-          m_features[TString::Format("eta_bjet%i",i)] = rSel->getBJet(i-1)->getEta();
-          m_features[TString::Format("phi_bjet%i",i)] = rSel->getBJet(i-1)->getPhi();
-          m_features[TString::Format("m_bjet%i",i)]   = rSel->getBJet(i-1)->getM();
-          m_features[TString::Format("wp_bjet%i",i)]  = rSel->getBJet(i-1)->getTagLevel();
-        }
-      }
-      m_features["HT_all"]     = rSel->getHtAll();
-      m_features["HT_had"]     = rSel->getHtHad();
-
-      for( TString n : v_eventCollectionNames ) {
-	m_features["eta_"+n]   = m_collections[n].getEta();
-	m_features["m_"+n]     = m_collections[n].getM();
-	m_features["pt_"+n]    = m_collections[n].getPt();
-	m_features["phi_"+n]   = m_collections[n].getPhi();
-	m_features["mt_"+n]    = m_collections[n].getMt();
-	m_features["ptsum_"+n] = m_collections[n].getPtsum();
-	for( TString s : v_shapeNames )
-	  m_features[s+"_"+n]  = m_collections[n].getShape(s);
+        if( rSel->getNbjets() < i ) setKinematics( s_bjet[i-1] , -10 );
+        else setKinematics( s_bjet[i-1] , rSel->getBJet(i-1) );
       }
+      v_values[s_htAll] = rSel->getHtAll();
+      v_values[s_htHad] = rSel->getHtHad();
+
+      for( const CollectionSlots &c : v_eventCollectionSlots ) setCollectionFeatures( c );
 
     }
 
     // basic features
-    for( int i = 0 ; i <= 5 ; i++ ) m_features[TString::Format("nBtags%i_ttbar",i)] = Double_t(getNbtagsTtbarSystem(i));
-    for( int i = 0 ; i <= 5 ; i++ ) m_features[TString::Format("nBtags%i_ttbarDecay",i)] = Double_t(getNbtagsTtbarDecay(i));
-    m_features["pt_lepTopJet"]  = lepTopJet->getPt();
-    m_features["eta_lepTopJet"] = lepTopJet->getEta();
-    m_features["phi_lepTopJet"] = lepTopJet->getPhi();
-    m_features["m_lepTopJet"]   = lepTopJet->getM();
-    m_features["wp_lepTopJet"]  = lepTopJet->getTagLevel();
-    m_features["pt_hadTopJet"]  = hadTopJet->getPt();
-    m_features["eta_hadTopJet"] = hadTopJet->getEta();
-    m_features["phi_hadTopJet"] = hadTopJet->getPhi();
-    m_features["m_hadTopJet"]   = hadTopJet->getM();
-    m_features["wp_hadTopJet"]  = hadTopJet->getTagLevel();
-    m_features["pt_hadWJet1"]   = hadWJet1->getPt();
-    m_features["eta_hadWJet1"]  = hadWJet1->getEta();
-    m_features["phi_hadWJet1"]  = hadWJet1->getPhi();
-    m_features["m_hadWJet1"]    = hadWJet1->getM();
-    m_features["wp_hadWJet1"]   = hadWJet1->getTagLevel();
-    m_features["pt_hadWJet2"]   = hadWJet2->getPt();
-    m_features["eta_hadWJet2"]  = hadWJet2->getEta();
-    m_features["phi_hadWJet2"]  = hadWJet2->getPhi();
-    m_features["m_hadWJet2"]    = hadWJet2->getM();
-    m_features["wp_hadWJet2"]   = hadWJet2->getTagLevel();
+    for( int i = 0 ; i <= 5 ; i++ ) v_values[s_nBtagsTtbar[i]] = Double_t(getNbtagsTtbarSystem(i));
+    for( int i = 0 ; i <= 5 ; i++ ) v_values[s_nBtagsTtbarDecay[i]] = Double_t(getNbtagsTtbarDecay(i));
+    setKinematics( s_combJet[0] , lepTopJet );
+    setKinematics( s_combJet[1] , hadTopJet );
+    setKinematics( s_combJet[2] , hadWJet1 );
+    setKinematics( s_combJet[3] , hadWJet2 );
 
     // extended features
-    for( TString n : v_extendedCollectionNames ) {
-      m_features["eta_"+n]   = m_collections[n].getEta();
-      m_features["m_"+n]     = m_collections[n].getM();
-      m_features["pt_"+n]    = m_collections[n].getPt();
-      m_features["phi_"+n]   = m_collections[n].getPhi();
-      m_features["wpsum_"+n] = m_collections[n].getWpsum();
-      m_features["ptsum_"+n] = m_collections[n].getPtsum();
-      for( TString s : v_shapeNames )
-	m_features[s+"_"+n]  = m_collections[n].getShape(s);
-    }
+    for( const CollectionSlots &c : v_extendedCollectionSlots ) setCollectionFeatures( c );
     
     // further extended features
-    for( std::pair<TString,TString> p : v_pairNames ) {
-      m_features["dphi_"+p.first+"_"+p.second] = m_allV4[p.first].DeltaPhi( m_allV4[p.second] );
-      m_features["deta_"+p.first+"_"+p.second] = m_allV4[p.first].Eta() - m_allV4[p.second].Eta();
-      m_features["dr_"+p.first+"_"+p.second]   = m_allV4[p.first].DeltaR( m_allV4[p.second] );;
+    for( const PairSlots &p : v_pairSlots ) {
+      v_values[p.dphi] = m_allV4[p.first].deltaPhi( m_allV4[p.second] );
+      v_values[p.deta] = m_allV4[p.first].deltaEta( m_allV4[p.second] );
+      v_values[p.dr]   = m_allV4[p.first].deltaR( m_allV4[p.second] );
     }
 
     // check if the combination is properly matched to a ttbar decay
     Bool_t hadTopMatched = hadTopJet->fromCommonWofSameTop( hadWJet1 , hadWJet2 );
     Bool_t lepTopMatched = lepTopJet->fromCommonTop( lep );
-    m_features["signal"] = hadTopMatched && lepTopMatched ? 1 : 0;
+    v_values[s_signal] = hadTopMatched && lepTopMatched ? 1 : 0;
 
   }
 
-  void save() {
-    (*outputCsv) << m_features[v_featureNames[0]];
-    for( std::size_t i = 1 ; i < v_featureNames.size() ; i++ ) {
-      (*outputCsv) << "," << m_features[v_featureNames[i]];
-    }
-    (*outputCsv) << std::endl;
-  }
+  void save() { writer.writeRow( v_values ); }
 
-  void dump() {
-    std::cout << std::endl;
-    for( std::size_t i = 0 ; i < v_featureNames.size() ; i++ ) {
-      std::cout << TString::Format("%25s",v_featureNames[i].Data()) << " = " << m_features[v_featureNames[i]] << std::endl;
-    }
-    std::cout << std::endl;
-  }
+  void dump() { schema.dump( v_values ); }
 
 
 
@@ -16,6 +16,8 @@
 
 #include <TLorentzVector.h>
 
+#include "ParticleArena.h"
+
 namespace xAOD {
 
   class IParticle {
@@ -77,21 +79,21 @@ namespace xAOD {
       BTagging( const double &_mv2c20 = -10 ) : mv2c20(_mv2c20) {}
       bool MVx_discriminant( const std::string &algo , double &mv2 ) { mv2 = mv2c20; return true; }
     };
-    BTagging *btag;
+    mutable BTagging btag;
     Int_t bTagLevel;
   public:
     Jet()
       : IParticle()
-      , btag(new BTagging())
+      , btag()
       , bTagLevel(-1)
     {}
     Jet( const TLorentzVector &v , const double &mv2c20 , const Int_t &taglevel = -1 )
       : IParticle( v )
-      , btag( new BTagging(mv2c20) )
+      , btag( mv2c20 )
       , bTagLevel( taglevel )
     {}
-    ~Jet() { delete btag; }
-    BTagging* btagging() const { return btag; }
+    ~Jet() {}
+    BTagging* btagging() const { return &btag; }
     Int_t getBTagLevel() const { return bTagLevel; }
   };
 
@@ -126,13 +128,47 @@ namespace xAOD {
 
 namespace top {
 
+  //
+  // The particles are made in the event's own pools with addJet(), addElectron() and
+  // addMuon(), and clear() recycles them, so refilling the event for every entry of a file
+  // doesn't allocate once the pools are big enough. A copy gets its own copies of the
+  // particles, made in its own pools.
+  //
   class Event {
+  private:
+    ParticleArena<xAOD::Jet> m_jetPool;
+    ParticleArena<xAOD::Electron> m_electronPool;
+    ParticleArena<xAOD::Muon> m_muonPool;
+
+    void copyParticles( const Event &other ) {
+      for( const xAOD::Jet *j : other.m_jets ) m_jets.push_back( m_jetPool.make( *j ) );
+      for( const xAOD::Electron *el : other.m_electrons ) m_electrons.push_back( m_electronPool.make( *el ) );
+      for( const xAOD::Muon *mu : other.m_muons ) m_muons.push_back( m_muonPool.make( *mu ) );
+      m_trackJets = other.m_trackJets; // not owned by the event
+    }
+
   public:
 
     Event()
       : m_met( new xAOD::MissingET() )
     {}
 
+    Event( const Event &other )
+      : m_met( other.m_met ? new xAOD::MissingET( *other.m_met ) : 0 )
+    {
+      copyParticles( other );
+    }
+
+    Event& operator=( const Event &other ) {
+      if( this == &other ) return *this;
+      clear();
+      m_trackJets.clear();
+      delete m_met;
+      m_met = other.m_met ? new xAOD::MissingET( *other.m_met ) : 0;
+      copyParticles( other );
+      return *this;
+    }
+
     ~Event() {
       if( m_met ) delete m_met;
       clear();
@@ -144,13 +180,17 @@ namespace top {
     xAOD::ElectronContainer m_electrons;
     xAOD::MuonContainer m_muons;
 
+    void addJet( const TLorentzVector &v , const double &mv2c20 , const Int_t &taglevel = -1 ) { m_jets.push_back( m_jetPool.make( v , mv2c20 , taglevel ) ); }
+    void addElectron( const TLorentzVector &v ) { m_electrons.push_back( m_electronPool.make( v ) ); }
+    void addMuon( const TLorentzVector &v ) { m_muons.push_back( m_muonPool.make( v ) ); }
+
     void clear() {
-      for( std::size_t i = 0 ; i < m_jets.size() ; i++ ) delete m_jets[i];
-      for( std::size_t i = 0 ; i < m_electrons.size() ; i++ ) delete m_electrons[i];
-      for( std::size_t i = 0 ; i < m_muons.size() ; i++ ) delete m_muons[i];
       m_jets.clear();
       m_electrons.clear();
       m_muons.clear();
+      m_jetPool.reset();
+      m_electronPool.reset();
+      m_muonPool.reset();
     }
     
   };
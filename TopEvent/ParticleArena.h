@@ -0,0 +1,63 @@
+#ifndef _PARTICLEARENA_H_
+#define _PARTICLEARENA_H_
+
+#include <iostream>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include "Rtypes.h"
+
+
+template<typename T>
+class
+ParticleArena
+{
+
+  //
+  // Owner of the particle objects of one event. make() constructs them one after the other in
+  // blocks of raw memory, and reset() destroys them all and starts again from the beginning of
+  // the first block. The blocks are kept, so once the arena has grown to the largest event no
+  // more memory is allocated. Pointers stay valid until the next reset().
+  //
+
+private:
+
+  static const std::size_t BLOCKSIZE = 64;
+
+  std::vector<T*> v_blocks;
+  std::size_t n; // objects in use
+
+  ParticleArena( const ParticleArena& );
+  ParticleArena& operator=( const ParticleArena& );
+
+public:
+
+  ParticleArena() : n( 0 ) {}
+
+  ~ParticleArena() {
+    reset();
+    for( std::size_t i = 0 ; i < v_blocks.size() ; i++ ) ::operator delete( v_blocks[i] );
+  }
+
+  template<typename... Args>
+  T* make( Args&&... args ) {
+    const std::size_t iblock = n / BLOCKSIZE;
+    if( iblock == v_blocks.size() ) v_blocks.push_back( static_cast<T*>( ::operator new( BLOCKSIZE*sizeof(T) ) ) );
+    T *p = new( v_blocks[iblock] + n % BLOCKSIZE ) T( std::forward<Args>(args)... );
+    n++;
+    return p;
+  }
+
+  void reset() {
+    for( std::size_t i = 0 ; i < n ; i++ ) v_blocks[i/BLOCKSIZE][i%BLOCKSIZE].~T();
+    n = 0;
+  }
+
+  std::size_t size() const { return n; }
+  std::size_t capacity() const { return v_blocks.size() * BLOCKSIZE; }
+
+};
+
+
+#endif
@@ -0,0 +1,126 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <TString.h>
+#include <TRegexp.h>
+#include <TSystem.h>
+
+#include "Report.h"
+#include "ArgParser.h"
+#include "DatasetCatalog.h"
+
+using namespace std;
+
+
+//
+// One sample to look for in the data directory. Every entry of the directory whose name
+// matches "pattern" ('*' wildcards) holds one file of the sample: the entry itself if
+// "file" is '-', otherwise the file of that name inside it.
+//
+struct
+SampleSpec
+{
+  TString name;
+  TString pattern;
+  TString file;
+  TString tree;
+  Double_t xsec;
+  Double_t nevents;
+  Double_t cost;
+};
+
+// Lines of "name pattern file tree xsec nevents [cost]", '#' starting a comment
+vector<SampleSpec>
+readSpecs( const TString &fname )
+{
+  ifstream in( fname.Data() );
+  if( ! in ) {
+    report::error( "Could not open %s" , fname.Data() );
+    assert( false );
+  }
+  vector<SampleSpec> specs;
+  string line;
+  for( Int_t iline = 1 ; getline( in , line ) ; iline++ ) {
+    if( line.find('#') != string::npos ) line.erase( line.find('#') );
+    istringstream ss( line );
+    string name , pattern , file , tree;
+    SampleSpec s;
+    if( ! (ss >> name) ) continue;
+    if( ! (ss >> pattern >> file >> tree >> s.xsec >> s.nevents) ) {
+      report::error( "Can't read line %i of %s" , iline , fname.Data() );
+      assert( false );
+    }
+    if( ! (ss >> s.cost) ) s.cost = 1;
+    s.name    = name.c_str();
+    s.pattern = pattern.c_str();
+    s.file    = file.c_str();
+    s.tree    = tree.c_str();
+    specs.push_back( s );
+  }
+  return specs;
+}
+
+
+int
+main( int argc , char* argv[] )
+{
+
+  ArgParser ap( "BuildDatasetCatalog" , "Lists the input files of each sample in a data directory, for the jobs to read instead of the directory" );
+  ap.addArg( "datadir" , "Data directory to list" , "path" );
+  ap.addArg( "samples" , "Text file of samples, one per line: name pattern file tree xsec nevents [cost]" , "path" );
+  ap.addOptionalArg( "output" , "Where to write the catalog (auto = dataset_catalog.txt in datadir)" , "auto" );
+  ap.addOptionalArg( "md5" , "Also record the MD5 sum of every file, reading all of them (0 or 1)" , "0" );
+  ap.parse( argc , argv );
+
+  TString datadir = ap["datadir"];
+  gSystem->ExpandPathName( datadir );
+  const TString output = ap["output"]==TString("auto") ? DatasetCatalog::getDefaultPath( datadir ) : ap["output"];
+  const Bool_t md5 = ap.getAtoi("md5") != 0;
+
+  // The directory is listed once, sorted so that the catalog (and job splits) don't depend
+  // on the order the file system returns the entries in
+  vector<TString> entries;
+  {
+    void *dirp = gSystem->OpenDirectory( datadir );
+    if( ! dirp ) {
+      report::error( "Could not list %s" , datadir.Data() );
+      assert( false );
+    }
+    const char *entry;
+    while( (entry = gSystem->GetDirEntry(dirp)) ) {
+      TString name( entry );
+      if( name != "." && name != ".." ) entries.push_back( name );
+    }
+    gSystem->FreeDirectory( dirp );
+  }
+  sort( entries.begin() , entries.end() );
+  report::info( "Found %i entries in %s" , Int_t(entries.size()) , datadir.Data() );
+
+  DatasetCatalog catalog;
+  for( const SampleSpec &s : readSpecs( ap["samples"] ) ) {
+    catalog.addSample( s.name , s.tree , s.xsec , s.nevents , s.cost );
+    TRegexp re( s.pattern , kTRUE );
+    Int_t nfiles = 0;
+    for( const TString &entry : entries ) {
+      if( entry.Index( re ) != 0 ) continue;
+      const TString path = s.file==TString("-") ? datadir + "/" + entry : datadir + "/" + entry + "/" + s.file;
+      if( ! DatasetCatalog::exists( path ) ) {
+	report::warn( "No %s in %s, skipping it" , s.file.Data() , entry.Data() );
+	continue;
+      }
+      catalog.addFile( s.name , DatasetCatalog::describe( path , s.tree , md5 ) );
+      nfiles++;
+    }
+    report::info( "Sample %-20s : %5i files, %lld entries" , s.name.Data() , nfiles , catalog.getSample( s.name ).getEntries() );
+  }
+
+  catalog.save( output , "Made by BuildDatasetCatalog from " + datadir );
+  report::info( "Wrote %s" , output.Data() );
+
+  return 0;
+
+}
@@ -1,6 +1,8 @@
 #include <iostream>
 #include <fstream>
 #include <vector>
+#include <map>
+#include <mutex>
 
 #include <TFile.h>
 #include <TTree.h>
@@ -8,8 +10,10 @@
 #include <TKey.h>
 #include <TSystem.h>
 #include <TClonesArray.h>
+#include <TRegexp.h>
 
 #include "Report.h"
+#include "ParallelTools.h"
 #include "ArgParser.h"
 #include "HistTools.h"
 #include "Plotter.h"
@@ -20,10 +24,16 @@
 #include "DelphesRecoSelector.h"
 #include "TtbarFeatureExtractor.h"
 #include "TtbarLjetFeatureExtractor.h"
+#include "CombinationFilter.h"
+#include "DelphesSkim.h"
+#include "DelphesLeaves.h"
+#include "DelphesColumns.h"
+#include "DelphesPrefetcher.h"
+#include "DatasetCatalog.h"
+#include "JobSplitter.h"
 
 // Delphes Includes
 #include "classes/DelphesClasses.h"
-#include "external/ExRootAnalysis/ExRootTreeReader.h"
 
 using namespace std;
 
@@ -33,6 +43,327 @@ const Double_t GeV = 1.0;
 const Double_t MeV = 1000.0;
 
 
+//
+// Objects owned by one thread while it works through input files. Each thread needs its own
+// b-tagger (current file and event) and extractors (feature buffers and output stream). The
+// combination filter is only read, and is shared, as is the prefetcher of the Delphes files.
+//
+struct
+FileWorker
+{
+  DelphesBtagger *bt;
+  TtbarLjetFeatureExtractor *fe;
+  TtbarLjetFeatureExtractor *fe_sandbox;
+  TtbarFeatureExtractor *fe_base;
+  const CombinationFilter *filter;
+  DelphesPrefetcher *prefetch;
+};
+
+//
+// Counters and histogram fills for one input file, added to the job totals in file order
+//
+struct
+FileSummary
+{
+  Int_t nTotal;
+  Int_t nPassed;
+  Int_t nSolved;
+  Int_t nComb;
+  CombinationFilter::Stats filterStats;
+  Long64_t bytesRead; // from the Delphes file, compressed
+  Double_t bytesUnzipped; // estimated from the sizes of the active branches
+  map< TString , vector<Double_t> > h1fills;
+  map< TString , vector< pair<Double_t,Double_t> > > h2fills;
+  FileSummary() : nTotal( 0 ) , nPassed( 0 ) , nSolved( 0 ) , nComb( 0 ) , bytesRead( 0 ) , bytesUnzipped( 0 ) {}
+};
+
+
+// The members of the Delphes files that the selectors read
+DelphesLeaves
+getInputLeaves()
+{
+  DelphesLeaves leaves;
+  DelphesRecoSelector::requireLeaves( leaves );
+  DelphesTruthSelector::requireLeaves( leaves );
+  return leaves;
+}
+
+
+//
+// Run the event loop over the entries of one input file of "sample" in "chunk" (task "itask"
+// of the job), writing CSV rows through the worker's extractors and recording everything
+// else in "fs". A per-event progress bar is only shown if the running job totals are given
+// (i.e. in the serial loop). Unless skimDir is "none", the selected objects are read from
+// the file's skim in skimDir, which is made first if it is missing or stale.
+//
+void
+processFile( const TString &path , const TString &sample , const JobSplitter::Chunk &chunk , const std::size_t &itask , FileWorker &w , const TString &skimDir , const DelphesColumns::Mode &readMode ,
+	     const TString &recosel , const TString &truthsel , const Int_t &minjets , const Int_t &maxjets ,
+	     FileSummary *fs , const FileSummary *totals = 0 , const Double_t &evweight = 0.0 )
+{
+
+  // The b-tags (also those stored in skims) are keyed by the sample
+  w.bt->setSample( sample );
+
+  DelphesSkim *skim = 0;
+  if( skimDir != TString("none") ) {
+    const TString skimPath = DelphesSkim::getSkimPath( skimDir , path );
+    if( ! DelphesSkim::isFresh( skimPath , path , *w.bt ) ) DelphesSkim::make( path , skimPath , *w.bt , readMode , w.prefetch->getCacheBytes() );
+    skim = new DelphesSkim( skimPath );
+  }
+
+  // The prefetcher opens the file with only what the selectors use active
+  TFile *f_reco = 0;
+  TTree *t_reco = 0;
+  if( ! skim ) f_reco = w.prefetch->take( itask , t_reco );
+
+  DelphesColumns *cols = 0;
+  DelphesRecoSelector *rSel = 0;
+  DelphesTruthSelector *tSel = 0;
+  {
+    std::lock_guard<std::mutex> lock( ptools::rootMutex() );
+    if( ! skim ) cols = new DelphesColumns( t_reco , getInputLeaves() , readMode );
+    rSel = new DelphesRecoSelector( cols , w.bt , minjets , maxjets );
+    tSel = new DelphesTruthSelector( cols );
+  }
+  w.bt->beginInputFile( path );
+
+  w.fe->setRecoSelector( rSel );
+  w.fe_sandbox->setRecoSelector( rSel );
+  w.fe_base->setRecoSelector( rSel );
+  w.fe_base->setTruthSelector( tSel );
+    
+  const Long64_t first = chunk.first;
+  const Long64_t last  = chunk.getEnd( skim ? skim->getEntries() : t_reco->GetEntries() );
+  const Long64_t nev   = TMath::Max( last - first , Long64_t(0) );
+
+  if( totals ) report::startProgressBar( TString::Format( "File %4i" , Int_t(chunk.file) ) );
+  for( Long64_t iev = first ; iev < last ; iev++ ) {
+
+    if( totals ) {
+      Int_t nPassed = totals->nPassed + fs->nPassed;
+      report::updateProgressBar( Double_t(iev-first+1) , Double_t(nev) ,
+				 TString::Format(" SumW=%0.1f ε=%0.3f nuMomentumSolved=%0.4f",nPassed*evweight,
+						 Double_t(nPassed)/Double_t(totals->nTotal+fs->nTotal),Double_t(totals->nSolved+fs->nSolved)/Double_t(nPassed)) );
+    }
+
+    fs->nTotal++;
+
+    // Process the truth and reconstruction records
+    // RecoSelector returns false here if there's not at least one lepton and 2 jets
+    // TruthSelector always returns true here
+    if( skim ) {
+      const SkimEvent &ev = skim->getEntry( iev );
+      if( ! rSel->processRecoRecord( ev ) ) continue;
+      if( ! tSel->processTruthRecord( ev ) ) continue;
+    } else {
+      cols->readEntry( iev );
+      w.bt->beginEvent( iev );
+      if( ! rSel->processRecoRecord() ) continue;
+      if( ! tSel->processTruthRecord() ) continue;
+    }
+
+    // Ensure that the event passes user-defined event selection (cleaning data).
+    // Otherwise drop the event.
+    if( ! rSel->passesSelection(recosel) ) continue;
+    if( ! tSel->passesSelection(truthsel) ) continue;
+
+    // Fill the truth decay chain information into histograms
+    fs->h2fills["topDecayMatrix"].push_back( std::make_pair( tSel->getDecayT() , tSel->getDecayTbar() ) );
+    fs->h2fills["WDecayMatrix"].push_back( std::make_pair( tSel->getDecayWp() , tSel->getDecayWm() ) );
+    
+    // Match the reco particles to truth particles using
+    // delta-R matching. Each reconstructed particle is matched
+    // to the nearest truth particle of the same type, as long
+    // as it is within dR < 0.4.
+    RecoParticle::truthMatch( rSel->getAll() , tSel->getAll() );
+
+    // Calculate some diagnostic information that we can
+    // save to histograms for validation / debugging
+    int nMatched_all	 = 0;
+    int nMatched_jets	 = 0;
+    int nMatched_ljets = 0;
+    int nMatched_bjets = 0;
+    int nMatched_el	 = 0;
+    int nMatched_mu	 = 0;
+    for( size_t ip = 0 ; ip < rSel->getN() ; ip++ ) {
+      RecoParticle *p = rSel->getParticle(ip);
+      if( p->isTruthMatched() ) {
+	nMatched_all++;
+	if( p->getType()==RecoParticle::JET ) {
+	  nMatched_jets++;
+	  if( p->getTagLevel()>0 )
+	    nMatched_bjets++;
+	  else
+	    nMatched_ljets++;
+	}
+	else if( p->getType()==RecoParticle::EL ) nMatched_el++;
+	else if( p->getType()==RecoParticle::MU ) nMatched_mu++;
+	else assert( false );
+      }
+    }
+
+    // Calculate the reconstructed mass of the particles matched to hadronic t decay
+    if( tSel->getDecayWp() == topdecay::JETS ) {
+      vector<Particle*> hadtop;
+      for( size_t ij = 0 ; ij < rSel->getNjets() ; ij++ ) {
+	RecoParticle *j = rSel->getJet(ij);
+	if( j->isTruthMatched() ) {
+	  if( j->getTruthParticle()->isFromWp() || j->getTruthParticle()->isFromTp() ) {
+	    hadtop.push_back( j );
+	  }
+	}
+      }
+      assert( hadtop.size() <= 3 );
+      if( hadtop.size()==3 ) {
+	// All of the true top jets are matched
+	fs->h1fills["hadTopMass"].push_back( Particle::getMergedMass(hadtop) );
+      } else {
+	fs->h1fills["hadTopMass"].push_back( 0 );
+      }
+    }
+
+    // Calculate the reconstructed mass of particles matched to hadronic tbar decay
+    if( tSel->getDecayWm() == topdecay::JETS ) {
+      vector<Particle*> hadtop;
+      for( size_t ij = 0 ; ij < rSel->getNjets() ; ij++ ) {
+	RecoParticle *j = rSel->getJet(ij);
+	if( j->isTruthMatched() ) {
+	  if( j->getTruthParticle()->isFromWm() || j->getTruthParticle()->isFromTm() ) {
+	    hadtop.push_back( j );
+	  }
+	}
+      }
+      assert( hadtop.size() <= 3 );
+      if( hadtop.size()==3 ) {
+	// All of the true top jets are matched
+	fs->h1fills["hadTopMass"].push_back( Particle::getMergedMass(hadtop) );
+      } else {
+	fs->h1fills["hadTopMass"].push_back( 0 );
+      }
+    }
+
+    // Fill additional histograms
+    fs->h1fills["nJets"].push_back( int(rSel->getNjets()) );
+    fs->h1fills["nJetsMatched"].push_back( nMatched_jets );
+    fs->h1fills["nLJets"].push_back( int(rSel->getNljets()) );
+    fs->h1fills["nLJetsMatched"].push_back( nMatched_ljets );
+    fs->h1fills["nBJets"].push_back( int(rSel->getNbjets()) );
+    fs->h1fills["nBJetsMatched"].push_back( nMatched_bjets );
+    fs->h1fills["nEl"].push_back( int(rSel->getNel()) );
+    fs->h1fills["nElMatched"].push_back( nMatched_el );
+    fs->h1fills["nMu"].push_back( int(rSel->getNmu()) );
+    fs->h1fills["nMuMatched"].push_back( nMatched_mu );
+    fs->h1fills["nLep"].push_back( int(rSel->getNlep()) );
+    fs->h1fills["nLepMatched"].push_back( nMatched_el + nMatched_mu );
+
+    w.fe_base->fill( iev , -1 , 1 );
+    w.fe_base->save();
+    
+    //
+    // Now the very important bit...
+    //
+    // Loop over all top reconstruction combinations and calculate a bunch of
+    // features for each combination.
+    //
+    // WARNING: I assume here that we are targetting the semi-leptonic decay. The
+    //          dilepton logic would look quite a bit different.
+    //
+    int icombo = 0;
+    vector< pair<int,CombinationFilter::Combination> > v_passed;
+    size_t nj = size_t( TMath::Min( int(rSel->getNjets()) , 6 ) );
+    w.fe->beginEvent();
+    w.fe_sandbox->beginEvent();
+
+    // The first thing I do is loop over all possible jets that could come from
+    // the leptonic top decay to W *b*.
+    //      t --> W *b* --> l v *b* 
+    // Note that more often then not this jet
+    // should be b-tagged, but I don't explicitly require it to be b-tagged.
+    for( size_t lepTopJet = 0 ; lepTopJet < nj ; ++lepTopJet ) {
+      
+      // Next, loop over the remaining jets that could come from the hadronic top
+      // decay to W *b*. Again, this should be b-tagged, but I don't explicitly
+      // require it.
+      for( size_t hadTopJet = 0 ; hadTopJet < nj ; ++hadTopJet ) {
+	if( hadTopJet == lepTopJet ) continue;
+
+	// Now loop over the remaining pairs of jets that could come from the
+	// hadronic W decay.
+	//    t --> W b --> *j* *j* b
+	// More often then not these should be light jets, but it is not explicitly required here.
+	// The order doesn't matter now since the 2 jets come from the same W, hence the ranges
+	// in the following 2 for loops.
+	for( size_t hadWJet1 = 0 ; hadWJet1 < nj-1 ; ++hadWJet1 ) {
+	  if( hadWJet1 == lepTopJet ) continue;
+	  if( hadWJet1 == hadTopJet ) continue;
+	  for(  size_t hadWJet2 = hadWJet1+1 ; hadWJet2 < nj ; ++hadWJet2 ) {
+	    if( hadWJet2 == lepTopJet ) continue;
+	    if( hadWJet2 == hadTopJet ) continue;
+
+	    // Check if this combination is correctly truth-matched
+	    //Bool_t hadTopMatched = rSel->getJet(hadTopJet)->fromCommonWofSameTop( rSel->getJet(hadWJet1) , rSel->getJet(hadWJet2) );
+	    //Bool_t lepTopMatched = rSel->getJet(lepTopJet)->fromCommonTop( rSel->getLep(0) );
+	    //int signal	   = hadTopMatched && lepTopMatched ? 1 : 0;
+	    //report::debug( "combo=%i : lepTopJet=%i, hadTopJet=%i, hadWJet1=%i, hadWJet2=%i : hadTopMatched=%i, leptTopMatched=%i, signal=%i" ,
+	    //	     icombo , int(lepTopJet) , int(hadTopJet) , int(hadWJet1) , int(hadWJet2) , int(hadTopMatched) , int(lepTopMatched) , signal );
+
+	    // Drop the combinations that fail the cheap pre-selection before computing any
+	    // features (CombId still counts all of the combinations)
+	    const CombinationFilter::Combination c = { rSel->getJet(lepTopJet) , rSel->getJet(hadTopJet) , rSel->getJet(hadWJet1) , rSel->getJet(hadWJet2) , rSel->getLep(0) };
+	    if( w.filter->pass( c , w.filter->size() ? c.isSignal() : kFALSE , fs->filterStats ) ) {
+	      w.fe->addCombination( c.lepTopJet , c.hadTopJet , c.hadWJet1 , c.hadWJet2 );
+	      v_passed.push_back( make_pair( icombo , c ) );
+	    }
+	    
+	    fs->nComb++;
+	    icombo++;
+	  }
+	}
+      }
+    }
+
+    // The shapes of all the multi-particle systems of the event are worked out in one batch,
+    // and then the features are filled combination by combination
+    w.fe->computeShapes();
+    for( size_t i = 0 ; i < v_passed.size() ; i++ ) {
+      const CombinationFilter::Combination &c = v_passed[i].second;
+
+      w.fe->fill( iev , v_passed[i].first , c.lepTopJet , c.hadTopJet , c.hadWJet1 , c.hadWJet2 );
+      //w.fe->dump(); assert( false );
+      w.fe->save();
+
+      if( i==0 ) {
+	w.fe_sandbox->fill( iev , v_passed[i].first , c.lepTopJet , c.hadTopJet , c.hadWJet1 , c.hadWJet2 );
+	w.fe_sandbox->save();
+      }
+    }
+
+    
+    fs->nPassed++;
+    if( rSel->getNuMomentumSolved() ) fs->nSolved++;
+
+  }
+
+  {
+    std::lock_guard<std::mutex> lock( ptools::rootMutex() );
+    delete cols;
+    delete rSel;
+    delete tSel;
+    if( t_reco ) {
+      Double_t active , all;
+      DelphesLeaves::getBytesPerEntry( t_reco , active , all );
+      fs->bytesUnzipped = active * nev;
+      fs->bytesRead = f_reco->GetBytesRead();
+    }
+    delete t_reco;
+    if( f_reco ) f_reco->Close();
+  }
+  delete skim;
+
+}
+
+
 int
 main( int argc , char* argv[] )
 {
@@ -45,6 +376,18 @@ main( int argc , char* argv[] )
   ap.addOptionalArg( "maxjets" , "Maximum number of reco jets required" , "4" );
   ap.addOptionalArg( "totalSplits" , "Number of splits for dividing job" , "1000" );
   ap.addOptionalArg( "splitId" , "The split to run in this job" , "0" );
+  ap.addOptionalArg( "nThreads" , "Threads for the event loop (0 = one per core)" , "1" );
+  ap.addOptionalArg( "format" , "Output format for the features (csv or root)" , "csv" );
+  ap.addOptionalArg( "compression" , "Compression of the csv output (none, bzip2 or zstd)" , "bzip2" );
+  ap.addOptionalArg( "compressionLevel" , "Compression level (0 = default for the codec)" , "0" );
+  ap.addOptionalArg( "features" , "File listing the features to calculate and write (all = every feature)" , "all" );
+  ap.addOptionalArg( "combFilter" , "Cuts on the jet combinations, e.g. mW:50:110,mTop:100:250,bTop:1,bW:1,dRW:3 (none = keep all)" , "none" );
+  ap.addOptionalArg( "skimDir" , "Directory for skims of the input files, made when missing or stale (none = read the Delphes files)" , "none" );
+  ap.addOptionalArg( "readMode" , "How the Delphes branches are read (direct: straight into arrays, objects: through the Delphes classes)" , "direct" );
+  ap.addOptionalArg( "cacheMB" , "Largest TTreeCache for the branches read from each Delphes file, in MB (0 = no cache)" , "32" );
+  ap.addOptionalArg( "prefetch" , "Delphes files opened and read ahead of the event loop, per thread (0 = open them when reached)" , "1" );
+  ap.addOptionalArg( "catalog" , "Dataset catalog listing the input files (auto = the one in the data directory if there is one, none = list the directory)" , "auto" );
+  ap.addOptionalArg( "imtThreads" , "Threads for ROOT's implicit multi-threading, e.g. decompressing baskets (0 = off)" , "0" );
   ap.parse( argc , argv );
 
   // Initialize a plotting object that we can use to save histograms, etc.
@@ -60,10 +403,26 @@ main( int argc , char* argv[] )
   TString datadir ( "/cnfs/data1/users/jwebster/ttbar_01p/massdep" );
   gSystem->ExpandPathName( datadir );
 
-  // Look at the input data directory and find all of the Delphes
-  // ROOT files that contain relevent data
+  // Take the Delphes ROOT files that contain relevent data from the
+  // catalog of the data directory (samples ttbar_01p_mass<masspoint>,
+  // see BuildDatasetCatalog), or failing that look at the directory
   vector<TString> v_inputFilePaths;
-  {
+  vector<TString> v_inputFileSamples; // ttbar_01p_mass<masspoint>
+  vector<Long64_t> v_inputFileEntries; // known only from the catalog
+  const TString catalogPath = ap["catalog"]==TString("auto") ? DatasetCatalog::getDefaultPath( datadir ) : ap["catalog"];
+  if( catalogPath!=TString("none") && DatasetCatalog::exists( catalogPath ) ) {
+    DatasetCatalog catalog;
+    catalog.load( catalogPath );
+    const TString pattern = ap["masspoint"]==TString("0") ? TString("ttbar_01p_mass*") : "ttbar_01p_mass"+ap["masspoint"];
+    for( const TString &sample : catalog.getSampleNames( pattern ) ) {
+      for( const TString &path : catalog.getPaths( sample ) ) {
+	v_inputFilePaths.push_back( path );
+	v_inputFileSamples.push_back( sample );
+      }
+      for( Long64_t n : catalog.getEntries( sample ) ) v_inputFileEntries.push_back( n );
+    }
+  } else {
+    if( ap["catalog"]!=TString("none") ) report::warn( "No dataset catalog %s, listing %s instead" , catalogPath.Data() , datadir.Data() );
     void *dirp = gSystem->OpenDirectory(datadir);
     const char *entry;
     Int_t n = 0;
@@ -74,6 +433,7 @@ main( int argc , char* argv[] )
       if( tmpdir.BeginsWith("ttbar_01p_singlecore_") &&
 	  ( tmpdir.Contains("mass"+ap["masspoint"]) || ap["masspoint"]==TString("0") ) ) {
 	v_inputFilePaths.push_back( datadir + "/" + tmpdir + "/delphes_output.root" );
+	v_inputFileSamples.push_back( "ttbar_01p_" + TString( tmpdir( TRegexp("mass[0-9]+") ) ) );
       }
     }
     delete entry;
@@ -83,21 +443,31 @@ main( int argc , char* argv[] )
   //assert( false );
 
   
-  // Determine which files to analyze in this particular job
-  Double_t totalSplits = ap.getAtof("totalSplits");
-  Double_t splitId     = ap.getAtof("splitId");
-  Int_t iFile = TMath::FloorNint( splitId * Double_t(v_inputFilePaths.size()) / totalSplits );
-  Int_t fFile = TMath::FloorNint( (splitId+1.0) * Double_t(v_inputFilePaths.size()) / totalSplits );
-  report::info( "Processing files with IDs in range [ %i , %i )" , iFile , fFile );
+  // Determine which files to analyze in this particular job. With the entry counts from the
+  // catalog every job gets the same number of entries, the files at the edges of its share
+  // being cut, otherwise the same number of whole files.
+  const UInt_t totalSplits = ap.getAtoi("totalSplits");
+  const UInt_t splitId     = ap.getAtoi("splitId");
+  vector<JobSplitter::Chunk> chunks;
+  if( v_inputFileEntries.size() == v_inputFilePaths.size() ) {
+    chunks = JobSplitter::splitByEntries( v_inputFileEntries , vector<Double_t>() , totalSplits , splitId );
+    report::info( "Processing %lld entries from %i files" , JobSplitter::countEntries( chunks ) , Int_t(chunks.size()) );
+  } else {
+    chunks = JobSplitter::splitByFiles( v_inputFilePaths.size() , totalSplits , splitId );
+    report::info( "Processing %i files" , Int_t(chunks.size()) );
+  }
+  vector<TString> v_chunkPaths , v_chunkSamples;
+  vector<Long64_t> v_chunkFirst , v_chunkLast;
+  for( const JobSplitter::Chunk &c : chunks ) {
+    v_chunkPaths.push_back( v_inputFilePaths[c.file] );
+    v_chunkSamples.push_back( v_inputFileSamples[c.file] );
+    v_chunkFirst.push_back( c.first );
+    v_chunkLast.push_back( c.last );
+  }
 
   // Some book-keeping variables
   Double_t xsec	   = 336.354802117;
   Double_t totalev = 22300922.0;
-  Double_t sumw    = 0.0;
-  Int_t    nPassed = 0;
-  Int_t    nTotal  = 0;
-  Int_t    nSolved = 0;
-  Int_t    nComb   = 0;
 
   //
   // Initialize the histograms that we want to fill and then save
@@ -125,238 +495,159 @@ main( int argc , char* argv[] )
   // Initialize an object to handle Delphes B-Tagging
   DelphesBtagger *bt = new DelphesBtagger();
 
+  const TString recosel  = ap["recosel"];
+  const TString truthsel = ap["truthsel"];
+  const Int_t   minjets  = ap.getAtoi("minjets");
+  const Int_t   maxjets  = ap.getAtoi("maxjets");
+  const UInt_t  nThreads = ptools::numThreads( ap.getAtoi("nThreads") );
+  const TString skimDir  = ap["skimDir"];
+  const DelphesColumns::Mode readMode = DelphesColumns::getMode( ap["readMode"] );
+  if( skimDir != TString("none") ) gSystem->mkdir( skimDir , kTRUE );
+  ptools::enableImplicitMT( ap.getAtoi("imtThreads") );
+
+  // Opens the Delphes files of this split ahead of the workers (not needed when reading skims)
+  const std::size_t prefetchDepth = skimDir != TString("none") ? 0 : std::size_t( ap.getAtoi("prefetch") ) * nThreads;
+  DelphesPrefetcher prefetch( v_chunkPaths , 0 , v_chunkPaths.size() , getInputLeaves() ,
+			      Long64_t( ap.getAtof("cacheMB") * 1024 * 1024 ) , prefetchDepth , v_chunkFirst , v_chunkLast );
+
   // Initialize an object for constructing all features
+  // The csv is compressed as it's written, zstd using as many threads as the event loop
+  const FeatureWriter::Format format = FeatureWriter::getFormat( ap["format"] );
+  const CompressedFile::Codec codec = CompressedFile::getCodec( ap["compression"] );
+  const Int_t level = ap.getAtoi("compressionLevel");
+  const TString ext = FeatureWriter::getExtension( format , codec );
+
+  // Features to calculate, shared by all of the extractors (the bookkeeping columns are always written)
+  FeatureSelection features;
+  if( ap["features"]!=TString("all") ) features.load( ap["features"] );
+
+  TString outpath = TString::Format("output/%s%s",ap.getTag().Data(),ext.Data());
   TtbarLjetFeatureExtractor *fe = new TtbarLjetFeatureExtractor();
-  fe->openCsv( TString::Format("output/%s.csv",ap.getTag().Data()) );
+  fe->setOutputCompression( codec , level , nThreads );
+  fe->selectFeatures( features );
+  fe->openOutput( outpath , format );
 
+  TString outpath_sandbox = TString::Format("output/%s_sandbox%s",ap.getTag().Data(),ext.Data());
   TtbarLjetFeatureExtractor *fe_sandbox = new TtbarLjetFeatureExtractor();
-  fe_sandbox->openCsv( TString::Format("output/%s_sandbox.csv",ap.getTag().Data()) );
+  fe_sandbox->setOutputCompression( codec , level , nThreads );
+  fe_sandbox->selectFeatures( features );
+  fe_sandbox->openOutput( outpath_sandbox , format );
 
+  TString outpath_base = TString::Format("output/%s_base%s",ap.getTag().Data(),ext.Data());
   TtbarFeatureExtractor *fe_base = new TtbarFeatureExtractor();
-  fe_base->openCsv( TString::Format("output/%s_base.csv",ap.getTag().Data()) );
-  
+  fe_base->setOutputCompression( codec , level , nThreads );
+  fe_base->selectFeatures( features );
+  fe_base->openOutput( outpath_base , format );
+  features.checkAllMatched();
+
+  // Pre-selection of the jet combinations
+  CombinationFilter filter;
+  filter.configure( ap["combFilter"] );
+
+  // Add one file's counters and histogram fills to the job totals
+  FileSummary totals;
+  auto addSummary = [&]( FileSummary *fs ) {
+    totals.nTotal  += fs->nTotal;
+    totals.nPassed += fs->nPassed;
+    totals.nSolved += fs->nSolved;
+    totals.nComb   += fs->nComb;
+    totals.bytesRead     += fs->bytesRead;
+    totals.bytesUnzipped += fs->bytesUnzipped;
+    totals.filterStats.add( fs->filterStats );
+    for( map< TString , vector<Double_t> >::iterator ibeg = fs->h1fills.begin() , iend = fs->h1fills.end() ; ibeg != iend ; ++ibeg ) {
+      for( Double_t &x : ibeg->second ) h1map[ibeg->first]->Fill( x );
+    }
+    for( map< TString , vector< pair<Double_t,Double_t> > >::iterator ibeg = fs->h2fills.begin() , iend = fs->h2fills.end() ; ibeg != iend ; ++ibeg ) {
+      for( pair<Double_t,Double_t> &xy : ibeg->second ) h2map[ibeg->first]->Fill( xy.first , xy.second );
+    }
+  };
 
   //
   // Loop over the files
   //
-  for( ; iFile < fFile ; ++iFile ) {
-
-    TFile *f_reco  = TFile::Open( v_inputFilePaths[iFile] );
-    //TFile *f_reco  = TFile::Open( v_inputFilePaths[iFile].first );
-    //TFile *f_truth = TFile::Open( v_inputFilePaths[iFile].second );
-
-    TTree *t_reco  = htools::quiet_assert_load<TTree>( f_reco , "Delphes" );
-    //TTree *t_truth = htools::quiet_assert_load<TTree>( f_truth , "TruthTree" );
-
-    ExRootTreeReader *ex = new ExRootTreeReader( t_reco );
-    
-    DelphesRecoSelector *rSel  = new DelphesRecoSelector( ex , bt , ap.getAtoi("minjets") , ap.getAtoi("maxjets") );
-    DelphesTruthSelector *tSel = new DelphesTruthSelector( ex );
+  if( nThreads == 1 ) {
 
-    fe->setRecoSelector( rSel );
-    fe_sandbox->setRecoSelector( rSel );
-    fe_base->setRecoSelector( rSel );
-    fe_base->setTruthSelector( tSel );
-    
-    Long64_t nev = t_reco->GetEntries();
-    //assert( nev == t_truth->GetEntries() );
-
-    report::startProgressBar( TString::Format( "File %4i" , iFile ) );
-    for( Int_t iev = 0 ; iev < nev ; iev++ ) {
-
-      report::updateProgressBar( Double_t(iev+1) , Double_t(nev) ,
-				 TString::Format(" SumW=%0.1f ε=%0.3f nuMomentumSolved=%0.4f",sumw,Double_t(nPassed)/Double_t(nTotal),Double_t(nSolved)/Double_t(nPassed)) );
-
-      nTotal++;
-
-      ex->ReadEntry( iev );
-      
-      // Process the truth and reconstruction records
-      // RecoSelector returns false here if there's not at least one lepton and 2 jets
-      // TruthSelector always returns true here
-      if( ! rSel->processRecoRecord() ) continue;
-      if( ! tSel->processTruthRecord() ) continue;
+    FileWorker w = { bt , fe , fe_sandbox , fe_base , &filter , &prefetch };
+    for( std::size_t itask = 0 ; itask < chunks.size() ; ++itask ) {
+      FileSummary fs;
+      processFile( v_chunkPaths[itask] , v_chunkSamples[itask] , chunks[itask] , itask , w , skimDir , readMode , recosel , truthsel , minjets , maxjets , &fs , &totals , xsec / totalev );
+      addSummary( &fs );
+    }
 
-      // Ensure that the event passes user-defined event selection (cleaning data).
-      // Otherwise drop the event.
-      if( ! rSel->passesSelection(ap["recosel"]) ) continue;
-      if( ! tSel->passesSelection(ap["truthsel"]) ) continue;
+  } else {
+
+    //
+    // Each thread writes the rows of the file it is working on to part files next to the real
+    // outputs. The master appends the parts to the real outputs in file order, so the output
+    // is the same as the serial loop's whatever the thread count.
+    //
+    auto partPath = [&]( const TString &path , const Int_t &ifile ) { return TString::Format( "%s.part%i" , path.Data() , ifile ); };
+
+    vector<FileWorker> workers;
+    for( UInt_t ithread = 0 ; ithread < nThreads ; ++ithread ) {
+      FileWorker w = { new DelphesBtagger() , new TtbarLjetFeatureExtractor() , new TtbarLjetFeatureExtractor() , new TtbarFeatureExtractor() , &filter , &prefetch };
+      w.fe->setOutputCompression( codec , level );
+      w.fe_sandbox->setOutputCompression( codec , level );
+      w.fe_base->setOutputCompression( codec , level );
+      w.fe->selectFeatures( features );
+      w.fe_sandbox->selectFeatures( features );
+      w.fe_base->selectFeatures( features );
+      workers.push_back( w );
+    }
 
-      // Fill the truth decay chain information into histograms
-      h2map["topDecayMatrix"]->Fill( tSel->getDecayT() , tSel->getDecayTbar() );
-      h2map["WDecayMatrix"]->Fill( tSel->getDecayWp() , tSel->getDecayWm() );
-      
-      // Match the reco particles to truth particles using
-      // delta-R matching. Each reconstructed particle is matched
-      // to the nearest truth particle of the same type, as long
-      // as it is within dR < 0.4.
-      RecoParticle::truthMatch( rSel->getAll() , tSel->getAll() );
-
-      // Calculate some diagnostic information that we can
-      // save to histograms for validation / debugging
-      int nMatched_all	 = 0;
-      int nMatched_jets	 = 0;
-      int nMatched_ljets = 0;
-      int nMatched_bjets = 0;
-      int nMatched_el	 = 0;
-      int nMatched_mu	 = 0;
-      for( size_t ip = 0 ; ip < rSel->getN() ; ip++ ) {
-	RecoParticle *p = rSel->getParticle(ip);
-	if( p->isTruthMatched() ) {
-	  nMatched_all++;
-	  if( p->getType()==RecoParticle::JET ) {
-	    nMatched_jets++;
-	    if( p->getTagLevel()>0 )
-	      nMatched_bjets++;
-	    else
-	      nMatched_ljets++;
-	  }
-	  else if( p->getType()==RecoParticle::EL ) nMatched_el++;
-	  else if( p->getType()==RecoParticle::MU ) nMatched_mu++;
-	  else assert( false );
-	}
+    ptools::OrderedResults<FileSummary> results( chunks.size() , 2*nThreads );
+
+    auto work = [&]( UInt_t ithread ) {
+      FileWorker &w = workers[ithread];
+      std::size_t itask;
+      while( results.next(itask) ) {
+	Int_t ifile = chunks[itask].file;
+	FileSummary *fs = new FileSummary();
+	w.fe->openOutputPart( partPath(outpath,ifile) , format );
+	w.fe_sandbox->openOutputPart( partPath(outpath_sandbox,ifile) , format );
+	w.fe_base->openOutputPart( partPath(outpath_base,ifile) , format );
+	processFile( v_chunkPaths[itask] , v_chunkSamples[itask] , chunks[itask] , itask , w , skimDir , readMode , recosel , truthsel , minjets , maxjets , fs );
+	w.fe->closeOutputPart();
+	w.fe_sandbox->closeOutputPart();
+	w.fe_base->closeOutputPart();
+	results.put( itask , fs );
       }
-
-      // Calculate the reconstructed mass of the particles matched to hadronic t decay
-      if( tSel->getDecayWp() == topdecay::JETS ) {
-	vector<Particle*> hadtop;
-	for( size_t ij = 0 ; ij < rSel->getNjets() ; ij++ ) {
-	  RecoParticle *j = rSel->getJet(ij);
-	  if( j->isTruthMatched() ) {
-	    if( j->getTruthParticle()->isFromWp() || j->getTruthParticle()->isFromTp() ) {
-	      hadtop.push_back( j );
-	    }
-	  }
-	}
-	assert( hadtop.size() <= 3 );
-	if( hadtop.size()==3 ) {
-	  // All of the true top jets are matched
-	  h1map["hadTopMass"]->Fill( Particle::getMergedMass(hadtop) );
-	} else {
-	  h1map["hadTopMass"]->Fill( 0 );
-	}
+    };
+
+    auto merge = [&]() {
+      report::startProgressBar( "Files" );
+      for( std::size_t itask = 0 ; itask < results.size() ; itask++ ) {
+	Int_t ifile = chunks[itask].file;
+	FileSummary *fs = results.take( itask );
+	fe->appendOutputPart( partPath(outpath,ifile) );
+	fe_sandbox->appendOutputPart( partPath(outpath_sandbox,ifile) );
+	fe_base->appendOutputPart( partPath(outpath_base,ifile) );
+	addSummary( fs );
+	delete fs;
+	report::updateProgressBar( Double_t(itask+1) , Double_t(results.size()) ,
+				   TString::Format(" SumW=%0.1f ε=%0.3f nuMomentumSolved=%0.4f",totals.nPassed*xsec/totalev,
+						   Double_t(totals.nPassed)/Double_t(totals.nTotal),Double_t(totals.nSolved)/Double_t(totals.nPassed)) );
       }
+    };
 
-      // Calculate the reconstructed mass of particles matched to hadronic tbar decay
-      if( tSel->getDecayWm() == topdecay::JETS ) {
-	vector<Particle*> hadtop;
-	for( size_t ij = 0 ; ij < rSel->getNjets() ; ij++ ) {
-	  RecoParticle *j = rSel->getJet(ij);
-	  if( j->isTruthMatched() ) {
-	    if( j->getTruthParticle()->isFromWm() || j->getTruthParticle()->isFromTm() ) {
-	      hadtop.push_back( j );
-	    }
-	  }
-	}
-	assert( hadtop.size() <= 3 );
-	if( hadtop.size()==3 ) {
-	  // All of the true top jets are matched
-	  h1map["hadTopMass"]->Fill( Particle::getMergedMass(hadtop) );
-	} else {
-	  h1map["hadTopMass"]->Fill( 0 );
-	}
-      }
-
-      // Fill additional histograms
-      h1map["nJets"]->Fill( int(rSel->getNjets()) );
-      h1map["nJetsMatched"]->Fill( nMatched_jets );
-      h1map["nLJets"]->Fill( int(rSel->getNljets()) );
-      h1map["nLJetsMatched"]->Fill( nMatched_ljets );
-      h1map["nBJets"]->Fill( int(rSel->getNbjets()) );
-      h1map["nBJetsMatched"]->Fill( nMatched_bjets );
-      h1map["nEl"]->Fill( int(rSel->getNel()) );
-      h1map["nElMatched"]->Fill( nMatched_el );
-      h1map["nMu"]->Fill( int(rSel->getNmu()) );
-      h1map["nMuMatched"]->Fill( nMatched_mu );
-      h1map["nLep"]->Fill( int(rSel->getNlep()) );
-      h1map["nLepMatched"]->Fill( nMatched_el + nMatched_mu );
-
-      fe_base->fill( iev , -1 , 1 );
-      fe_base->save();
-      
-      //
-      // Now the very important bit...
-      //
-      // Loop over all top reconstruction combinations and calculate a bunch of
-      // features for each combination.
-      //
-      // WARNING: I assume here that we are targetting the semi-leptonic decay. The
-      //          dilepton logic would look quite a bit different.
-      //
-      int icombo = 0;
-      size_t nj = size_t( TMath::Min( int(rSel->getNjets()) , 6 ) );
-
-      // The first thing I do is loop over all possible jets that could come from
-      // the leptonic top decay to W *b*.
-      //      t --> W *b* --> l v *b* 
-      // Note that more often then not this jet
-      // should be b-tagged, but I don't explicitly require it to be b-tagged.
-      for( size_t lepTopJet = 0 ; lepTopJet < nj ; ++lepTopJet ) {
-	
-	// Next, loop over the remaining jets that could come from the hadronic top
-	// decay to W *b*. Again, this should be b-tagged, but I don't explicitly
-	// require it.
-	for( size_t hadTopJet = 0 ; hadTopJet < nj ; ++hadTopJet ) {
-	  if( hadTopJet == lepTopJet ) continue;
-
-	  // Now loop over the remaining pairs of jets that could come from the
-	  // hadronic W decay.
-	  //    t --> W b --> *j* *j* b
-	  // More often then not these should be light jets, but it is not explicitly required here.
-	  // The order doesn't matter now since the 2 jets come from the same W, hence the ranges
-	  // in the following 2 for loops.
-	  for( size_t hadWJet1 = 0 ; hadWJet1 < nj-1 ; ++hadWJet1 ) {
-	    if( hadWJet1 == lepTopJet ) continue;
-	    if( hadWJet1 == hadTopJet ) continue;
-	    for(  size_t hadWJet2 = hadWJet1+1 ; hadWJet2 < nj ; ++hadWJet2 ) {
-	      if( hadWJet2 == lepTopJet ) continue;
-	      if( hadWJet2 == hadTopJet ) continue;
-
-	      // Check if this combination is correctly truth-matched
-	      //Bool_t hadTopMatched = rSel->getJet(hadTopJet)->fromCommonWofSameTop( rSel->getJet(hadWJet1) , rSel->getJet(hadWJet2) );
-	      //Bool_t lepTopMatched = rSel->getJet(lepTopJet)->fromCommonTop( rSel->getLep(0) );
-	      //int signal	   = hadTopMatched && lepTopMatched ? 1 : 0;
-	      //report::debug( "combo=%i : lepTopJet=%i, hadTopJet=%i, hadWJet1=%i, hadWJet2=%i : hadTopMatched=%i, leptTopMatched=%i, signal=%i" ,
-	      //	     icombo , int(lepTopJet) , int(hadTopJet) , int(hadWJet1) , int(hadWJet2) , int(hadTopMatched) , int(lepTopMatched) , signal );
-
-	      if( true ) {
-	      
-		fe->fill( iev , icombo , rSel->getJet(lepTopJet) , rSel->getJet(hadTopJet) , rSel->getJet(hadWJet1) , rSel->getJet(hadWJet2) );
-		//fe->dump(); assert( false );
-		fe->save();
-
-		if( icombo==0 ) {
-		  fe_sandbox->fill( iev , icombo , rSel->getJet(lepTopJet) , rSel->getJet(hadTopJet) , rSel->getJet(hadWJet1) , rSel->getJet(hadWJet2) );
-		  fe_sandbox->save();
-		}
-
-	      }
-	      
-	      nComb++;
-	      icombo++;
-	    }
-	  }
-	}
-      }
-
-      
-      nPassed++;
-      if( rSel->getNuMomentumSolved() ) nSolved++;
-      sumw += xsec / totalev;
+    report::info( "Running event loop on %u threads" , nThreads );
+    ptools::run( nThreads , work , merge );
 
+    for( FileWorker &w : workers ) {
+      delete w.bt;
+      delete w.fe;
+      delete w.fe_sandbox;
+      delete w.fe_base;
     }
 
-    delete ex;
-    delete rSel;
-    delete tSel;
-    delete t_reco;
-    //delete t_truth;
-    f_reco->Close();
-    //f_truth->Close();
-    
   }
 
-  report::debug( "Total events = %i, Passing = %i, Solved = %i, Combinations = %i" , nTotal , nPassed , nSolved , nComb );
+  report::debug( "Total events = %i, Passing = %i, Solved = %i, Combinations = %i" , totals.nTotal , totals.nPassed , totals.nSolved , totals.nComb );
+  filter.print( totals.filterStats );
+  if( totals.bytesRead > 0 ) {
+    report::info( "Read %.1f kB per entry from the Delphes files (%.1f kB uncompressed)" ,
+		  totals.bytesRead/1024.0/totals.nTotal , totals.bytesUnzipped/1024.0/totals.nTotal );
+  }
   
   //
   // Save the 2-dim histograms
@@ -386,9 +677,9 @@ main( int argc , char* argv[] )
   }
 
   // Close output files and exit
-  fe->closeAndZipCsv();
-  fe_sandbox->closeAndZipCsv();
-  fe_base->closeAndZipCsv();
+  fe->closeOutput();
+  fe_sandbox->closeOutput();
+  fe_base->closeOutput();
   p.closePs();
   
   report::info( "done." );
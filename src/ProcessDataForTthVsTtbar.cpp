@@ -14,6 +14,8 @@
 #include "TreeReader.h"
 #include "DelphesReader.h"
 #include "StackPlotter.h"
+#include "DatasetCatalog.h"
+#include "JobSplitter.h"
 
 using namespace std;
 
@@ -29,6 +31,14 @@ main( int argc , char* argv[] )
   ap.addArg( "minNbtags" , "N-btag cut" , "0, 1, 2, ..." );
   ap.addArg( "totalSplits" , "Number of splits for dividing job" , "1, 2, ..." );
   ap.addArg( "splitId" , "The split to run in this job" , "0, ..., splits-1" );
+  ap.addOptionalArg( "nThreads" , "Threads for the event loop (0 = one per core)" , "1" );
+  ap.addOptionalArg( "format" , "Output format (csv: trees plus a csv copy, root: trees only)" , "csv" );
+  ap.addOptionalArg( "features" , "File listing the output branches to calculate and write (all = every branch)" , "all" );
+  ap.addOptionalArg( "indexDir" , "Directory for event indices of the input files, made when missing or stale (none = read every entry)" , "none" );
+  ap.addOptionalArg( "readMode" , "How the Delphes branches are read (direct: straight into arrays, objects: through the Delphes classes)" , "direct" );
+  ap.addOptionalArg( "cacheMB" , "Largest TTreeCache for the branches read from each Delphes file, in MB (0 = no cache)" , "32" );
+  ap.addOptionalArg( "catalog" , "Dataset catalog listing the input files (auto = the one in the data directory if there is one, none = list the directory)" , "auto" );
+  ap.addOptionalArg( "imtThreads" , "Threads for ROOT's implicit multi-threading, e.g. decompressing baskets (0 = off)" , "0" );
   ap.parse( argc , argv );
 
   Plotter p( ap );
@@ -43,7 +53,16 @@ main( int argc , char* argv[] )
   vector<TString> vec_ttbar123_files;
   vector<TString> vec_tth_files;
   vector<TString> vec_tth_old_files;
-  {
+  DatasetCatalog catalog;
+  const TString catalogPath = ap["catalog"]==TString("auto") ? DatasetCatalog::getDefaultPath( datadir ) : ap["catalog"];
+  if( catalogPath!=TString("none") && DatasetCatalog::exists( catalogPath ) ) {
+    catalog.load( catalogPath );
+    vec_ttbar_files    = catalog.getPaths( "ttbar" );
+    vec_ttbar123_files = catalog.getPaths( "ttbar123" );
+    vec_tth_old_files  = catalog.getPaths( "tth_old" );
+    vec_tth_files      = catalog.getPaths( "tth" );
+  } else {
+    if( ap["catalog"]!=TString("none") ) report::warn( "No dataset catalog %s, listing %s instead" , catalogPath.Data() , datadir.Data() );
     void *dirp = gSystem->OpenDirectory(datadir);
     const char *entry;
     Int_t n = 0;
@@ -61,34 +80,55 @@ main( int argc , char* argv[] )
   report::info( "Found %i ttbar123 files" , Int_t(vec_ttbar123_files.size()) );
   report::info( "Found %i tth files" , Int_t(vec_tth_files.size()) );
 
-  Double_t totalSplits = ap.getAtof("totalSplits");
-  Double_t splitId     = ap.getAtof("splitId");
-
-  Int_t i , f;
-  Double_t xsec , nev;
-
   // http://atlaswww.hep.anl.gov/hepsim/info.php?item=200
   PhysicsProcess proc_ttbar123( "ttbar123" , "t#bar{t} Np#neq0" , "$t\\bar{t} Np\\neq=0$" , 100+kGreen , "Delphes" );
-  i    = TMath::FloorNint( splitId * Double_t(vec_ttbar123_files.size()) / totalSplits );
-  f    = TMath::FloorNint( (splitId+1.0) * Double_t(vec_ttbar123_files.size()) / totalSplits );
-  xsec = 336.354802117; // 13 TeV
-  nev  = 22300922.0;
-  report::info( "Loading ttbar123 files with IDs in range [ %i , %i )" , i , f );
-  for( ; i < f ; ++i )
-    proc_ttbar123.addSample( vec_ttbar123_files[i] , xsec , 1.0 , nev );
+  Double_t xsec_ttbar123 = 336.354802117; // 13 TeV
+  Double_t nev_ttbar123  = 22300922.0;
+  if( catalog.hasSample( "ttbar123" ) ) { xsec_ttbar123 = catalog.getSample( "ttbar123" ).xsec; nev_ttbar123 = catalog.getSample( "ttbar123" ).nevents; }
 
   // http://atlaswww.hep.anl.gov/hepsim/info.php?item=203
   PhysicsProcess proc_tth( "tth" , "t#bar{t}H" , "$t\\bar{t}H$" , 100+kRed , "Delphes" );
-  i    = TMath::FloorNint( splitId * Double_t(vec_tth_files.size()) / totalSplits );
-  f    = TMath::FloorNint( (splitId+1.0) * Double_t(vec_tth_files.size()) / totalSplits );
-  xsec = 1.0 / 2.69745; // 13 TeV, extrapolating from the int lumi reported on hepsim page
-  nev  = 10000000.0;
-  report::info( "Loading tth files with IDs in range [ %i , %i )" , i , f );
-  for( ; i < f ; ++i )
-    proc_tth.addSample( vec_tth_files[i] , xsec , 1.0 , nev );
+  Double_t xsec_tth = 1.0 / 2.69745; // 13 TeV, extrapolating from the int lumi reported on hepsim page
+  Double_t nev_tth  = 10000000.0;
+  if( catalog.hasSample( "tth" ) ) { xsec_tth = catalog.getSample( "tth" ).xsec; nev_tth = catalog.getSample( "tth" ).nevents; }
+
+  if( catalog.hasSample( "ttbar123" ) && catalog.hasSample( "tth" ) ) {
+
+    // Split the entries of both samples together, weighted by their cost per entry, so every
+    // split has the same amount of work. Files at the split boundaries are shared.
+    vector<Long64_t> entries = catalog.getEntries( "ttbar123" );
+    vector<Double_t> cost( entries.size() , catalog.getSample( "ttbar123" ).cost );
+    for( Long64_t n : catalog.getEntries( "tth" ) ) {
+      entries.push_back( n );
+      cost.push_back( catalog.getSample( "tth" ).cost );
+    }
+    vector<JobSplitter::Chunk> chunks = JobSplitter::splitByEntries( entries , cost , ap.getAtoi("totalSplits") , ap.getAtoi("splitId") );
+    for( const JobSplitter::Chunk &c : chunks ) {
+      if( c.file < vec_ttbar123_files.size() ) proc_ttbar123.addSample( vec_ttbar123_files[c.file] , xsec_ttbar123 , 1.0 , nev_ttbar123 , c.first , c.last );
+      else proc_tth.addSample( vec_tth_files[c.file-vec_ttbar123_files.size()] , xsec_tth , 1.0 , nev_tth , c.first , c.last );
+    }
+    report::info( "Loading %lld entries of ttbar123 and tth from %i files" , JobSplitter::countEntries( chunks ) , Int_t(chunks.size()) );
+
+  } else {
+
+    // Without entry counts, each sample's files are split separately by number
+    for( const JobSplitter::Chunk &c : JobSplitter::splitByFiles( vec_ttbar123_files.size() , ap.getAtoi("totalSplits") , ap.getAtoi("splitId") ) )
+      proc_ttbar123.addSample( vec_ttbar123_files[c.file] , xsec_ttbar123 , 1.0 , nev_ttbar123 );
+    report::info( "Loading %i ttbar123 files" , Int_t(proc_ttbar123.numSamples()) );
+    for( const JobSplitter::Chunk &c : JobSplitter::splitByFiles( vec_tth_files.size() , ap.getAtoi("totalSplits") , ap.getAtoi("splitId") ) )
+      proc_tth.addSample( vec_tth_files[c.file] , xsec_tth , 1.0 , nev_tth );
+    report::info( "Loading %i tth files" , Int_t(proc_tth.numSamples()) );
+
+  }
   
   // http://atlaswww.hep.anl.gov/hepsim/info.php?item=141
   /*
+  Double_t totalSplits = ap.getAtof("totalSplits");
+  Double_t splitId     = ap.getAtof("splitId");
+
+  Int_t i , f;
+  Double_t xsec , nev;
+
   PhysicsProcess proc_tth( "tth" , "t#bar{t}H" , "$t\\bar{t}H$" , 100+kRed , "Delphes" );
   i    = TMath::FloorNint( splitId * Double_t(vec_tth_files.size()) / totalSplits );
   f    = TMath::FloorNint( (splitId+1.0) * Double_t(vec_tth_files.size()) / totalSplits );
@@ -156,6 +196,18 @@ main( int argc , char* argv[] )
   tr.setMinNbtags( ap.getAtoi("minNbtags") );
   tr.setTotalSplits( ap.getAtoi("totalSplits") );
   tr.setSplitId( ap.getAtoi("splitId") );
+  tr.setOutputFormat( FeatureWriter::getFormat(ap["format"]) );
+  tr.setIndexDir( ap["indexDir"] );
+  tr.setReadMode( DelphesColumns::getMode( ap["readMode"] ) );
+  tr.setCacheBytes( Long64_t( ap.getAtof("cacheMB") * 1024 * 1024 ) );
+  ptools::enableImplicitMT( ap.getAtoi("imtThreads") );
+  if( ap["indexDir"]!=TString("none") ) gSystem->mkdir( ap["indexDir"] , kTRUE );
+  if( ap["features"]!=TString("all") ) {
+    FeatureSelection features;
+    features.load( ap["features"] );
+    tr.selectFeatures( features );
+    features.checkAllMatched();
+  }
 
   p.openRoot();
 
@@ -164,6 +216,7 @@ main( int argc , char* argv[] )
   p.write( h_lumi , "h_lumi" );
 
   StackPlotter sp( &input , &p , &tr );
+  sp.setNumThreads( ap.getAtoi("nThreads") );
   //sp.addToQueue( "isTagged_ALL" , "isTagged" , 15 , -5 , 10 );
   //sp.addToQueue( "good_jet_flavor_ALL" , "Jet Flavor" , 20 , -10 , 10 );
   //sp.addToQueue( "good_njets" , "nJets" , 20 , 0 , 20 );